@@ -3,234 +3,565 @@ Cy Dixon
 Matrix Calculation App
 2025
 
-Uses GTK for UI elements
-Compile using: gcc $(pkg-config --cflags gtk4) -o mat matrix-app.c $(pkg-config --libs gtk4)
+Uses GTK for UI elements; the engine lives in matrix.c (libmatrix)
+Build using: cmake -S . -B build && cmake --build build
 */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
 #include <math.h>
+#include <float.h>
+#include <limits.h>
+#include <errno.h>
+#include <locale.h>
+#include <time.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "matrix.h"
+#include "matrix-internal.h"
+
+#ifdef MATRIX_GUI
 #include <gtk/gtk.h>
 
 static void on_calculate_clicked(GtkWidget *widget, gpointer data);
 
-typedef struct Matrix {
-    unsigned M;
-    unsigned N;
-    int *data;
-    char name[10]; // For storing matrix name (A, B, C, etc.)
-} Matrix;
-
-// Matrix storage - global storage for saved matrices
-#define MAX_SAVED_MATRICES 10
-Matrix *saved_matrices[MAX_SAVED_MATRICES] = {NULL};
-int num_saved_matrices = 0;
-
-// Function prototypes
-Matrix *create_matrix(unsigned M, unsigned N);
-void set_element(Matrix *matrix, unsigned i, unsigned j, int value);
-double determinant(Matrix *matrix);
-Matrix *copy_matrix(Matrix *source);
-void save_matrix(Matrix *matrix, const char *name);
-Matrix *load_matrix(const char *name);
-void save_matrices_to_file(const char *filename);
-void load_matrices_from_file(const char *filename);
+// Cells edited in the view but not yet written to the matrix: an
+// open-addressing map from element index to value
+typedef struct {
+    size_t *keys;               // element index + 1, 0 for an empty slot
+    MatrixValue *values;
+    size_t count, slots;
+} CellEdits;
 
 typedef struct {
-    unsigned rows;
-    unsigned cols;
-    GtkWidget **entries;
+    GtkWidget *grid_area;       // Virtualized view of matrix
+    GtkAdjustment *grid_hadj;   // First visible column
+    GtkAdjustment *grid_vadj;   // First visible row
+    GtkWidget *cell_editor;     // The one entry, placed over the cell being edited
+    gboolean editing;
+    unsigned edit_row, edit_col;
+    MatrixValue edit_original;  // Value of the edited cell when editing began
+    CellEdits edits;
+    LuCache *det_cache;         // Factorization behind the last determinant
+    struct DeterminantJob *det_job; // Determinant running in the background, if any
+    struct FileJob *file_job;   // File load or save running in the background, if any
+    struct HeatmapView *heatmap; // Heatmap window of Display Matrix, if open
     GtkWidget *result_label;
     GtkWindow *input_window;
     Matrix *matrix;
     GtkWidget *rows_entry;
     GtkWidget *cols_entry;
+    GtkWidget *type_combo;      // Element type of new matrices, in MatrixType order
     GtkWidget *display_btn;
     GtkWidget *determinant_btn;
+    GtkWidget *cancel_btn;
+    GtkWidget *exact_check;
     GtkWidget *matrix_container;
     GtkWidget *matrix_name_entry;
     GtkWidget *save_btn;
     GtkWidget *load_combo;
+    GtkWidget *multiply_left_combo;   // These two share load_combo's model
+    GtkWidget *multiply_right_combo;
+    GtkWidget *multiply_name_entry;
+    GtkWidget *expression_entry;
+    GtkWidget *solve_combo;     // Right-hand side, sharing load_combo's model
+    GtkWidget *cache_label;
+    GtkWidget *file_save_btn;
+    GtkWidget *file_load_btn;
+    GtkWidget *file_cancel_btn;
+    GtkWidget *file_progress;   // Progress of file_job
+    GtkWidget *last_op_label;   // Timing of the last engine operation
+    MatrixOpTiming last_op;     // What last_op_label shows
 } MatrixInputData;
 
-Matrix *create_matrix(unsigned M, unsigned N) {
-    Matrix *matrix = malloc(sizeof(Matrix));
-    if (!matrix) return NULL;
+static void show_matrix(MatrixInputData *input_data, Matrix *matrix);
 
-    matrix->M = M;
-    matrix->N = N;
-    matrix->data = malloc(M * N * sizeof(int));
-    matrix->name[0] = '\0'; // Initialize name as empty
+// Virtualized matrix view
+//
+// The elements are drawn straight from the Matrix into one GtkDrawingArea,
+// visible cells only, so the cost of the view depends on the window size and
+// not on the matrix. The scroll adjustments count cells, not pixels. A click
+// places the one GtkEntry over a cell; it writes back through set_element.
+#define GRID_CELL_WIDTH 96
+#define GRID_CELL_HEIGHT 28
+#define GRID_HEADER_WIDTH 64
+#define GRID_HEADER_HEIGHT 24
 
-    if (!matrix->data) {
-        free(matrix);
-        return NULL;
-    }
-    return matrix;
+// First visible row and column, and the pixel position of that cell
+static void grid_origin(MatrixInputData *input_data, unsigned *row0, unsigned *col0,
+                        double *x0, double *y0) {
+    double top = gtk_adjustment_get_value(input_data->grid_vadj);
+    double left = gtk_adjustment_get_value(input_data->grid_hadj);
+    *row0 = (unsigned)top;
+    *col0 = (unsigned)left;
+    *y0 = GRID_HEADER_HEIGHT - (top - *row0) * GRID_CELL_HEIGHT;
+    *x0 = GRID_HEADER_WIDTH - (left - *col0) * GRID_CELL_WIDTH;
 }
 
-void set_element(Matrix *matrix, unsigned i, unsigned j, int value) {
-    matrix->data[i * matrix->N + j] = value;
-}
+static int cell_edits_put(CellEdits *edits, size_t index, MatrixValue value);
 
-Matrix *copy_matrix(Matrix *source) {
-    if (!source) return NULL;
-    
-    Matrix *copy = create_matrix(source->M, source->N);
-    if (!copy) return NULL;
-    
-    // Copy data
-    memcpy(copy->data, source->data, source->M * source->N * sizeof(int));
-    // Copy name
-    strncpy(copy->name, source->name, sizeof(copy->name));
-    
-    return copy;
+// Double the table. Returns -1 if memory runs out, keeping the old table.
+static int cell_edits_grow(CellEdits *edits) {
+    CellEdits old = *edits;
+    size_t slots = old.slots ? old.slots * 2 : 64;
+    size_t *keys = calloc(slots, sizeof(size_t));
+    MatrixValue *values = malloc(slots * sizeof(MatrixValue));
+    if (!keys || !values) {
+        free(keys);
+        free(values);
+        return -1;
+    }
+    edits->slots = slots;
+    edits->keys = keys;
+    edits->values = values;
+    edits->count = 0;
+    for (size_t i = 0; i < old.slots; i++)
+        if (old.keys[i]) cell_edits_put(edits, old.keys[i] - 1, old.values[i]);
+    free(old.keys);
+    free(old.values);
+    return 0;
 }
 
-// Save matrix to global storage
-void save_matrix(Matrix *matrix, const char *name) {
-    if (!matrix || !name) return;
-    
-    // Check if matrix with this name already exists
-    for (int i = 0; i < num_saved_matrices; i++) {
-        if (saved_matrices[i] && strcmp(saved_matrices[i]->name, name) == 0) {
-            // Replace existing matrix
-            free(saved_matrices[i]->data);
-            free(saved_matrices[i]);
-            
-            saved_matrices[i] = copy_matrix(matrix);
-            strncpy(saved_matrices[i]->name, name, sizeof(saved_matrices[i]->name) - 1);
-            return;
-        }
-    }
-    
-    // Add new matrix if we have space
-    if (num_saved_matrices < MAX_SAVED_MATRICES) {
-        saved_matrices[num_saved_matrices] = copy_matrix(matrix);
-        strncpy(saved_matrices[num_saved_matrices]->name, name, sizeof(saved_matrices[num_saved_matrices]->name) - 1);
-        num_saved_matrices++;
+// Set the pending edit of a cell. Returns -1 if memory runs out; the edit is
+// then not recorded and the others are kept.
+static int cell_edits_put(CellEdits *edits, size_t index, MatrixValue value) {
+    if (2 * (edits->count + 1) > edits->slots && cell_edits_grow(edits) != 0) return -1;
+    size_t mask = edits->slots - 1;
+    size_t slot = (index * 0x9E3779B97F4A7C15ULL >> 20) & mask;
+    while (edits->keys[slot] && edits->keys[slot] != index + 1) slot = (slot + 1) & mask;
+    if (!edits->keys[slot]) {
+        edits->keys[slot] = index + 1;
+        edits->count++;
     }
+    edits->values[slot] = value;
+    return 0;
 }
 
-// Load matrix from global storage
-Matrix *load_matrix(const char *name) {
-    if (!name) return NULL;
-    
-    for (int i = 0; i < num_saved_matrices; i++) {
-        if (saved_matrices[i] && strcmp(saved_matrices[i]->name, name) == 0) {
-            return copy_matrix(saved_matrices[i]);
+static int cell_edits_get(const CellEdits *edits, size_t index, MatrixValue *value) {
+    if (!edits->count) return 0;
+    size_t mask = edits->slots - 1;
+    for (size_t slot = (index * 0x9E3779B97F4A7C15ULL >> 20) & mask; edits->keys[slot];
+         slot = (slot + 1) & mask) {
+        if (edits->keys[slot] == index + 1) {
+            *value = edits->values[slot];
+            return 1;
         }
     }
-    
-    return NULL;
+    return 0;
 }
 
-// Save all matrices to a file
-void save_matrices_to_file(const char *filename) {
-    FILE *file = fopen(filename, "w");
-    if (!file) return;
-    
-    fprintf(file, "%d\n", num_saved_matrices);
-    
-    for (int i = 0; i < num_saved_matrices; i++) {
-        Matrix *matrix = saved_matrices[i];
-        fprintf(file, "%s %u %u\n", matrix->name, matrix->M, matrix->N);
-        
-        for (unsigned row = 0; row < matrix->M; row++) {
-            for (unsigned col = 0; col < matrix->N; col++) {
-                fprintf(file, "%d ", matrix->data[row * matrix->N + col]);
-            }
-            fprintf(file, "\n");
+static void cell_edits_clear(CellEdits *edits) {
+    if (edits->count) memset(edits->keys, 0, edits->slots * sizeof(size_t));
+    edits->count = 0;
+}
+
+// Value of a cell as the view shows it, pending edits included
+static MatrixValue grid_cell_value(MatrixInputData *input_data, size_t index) {
+    MatrixValue value;
+    if (cell_edits_get(&input_data->edits, index, &value)) return value;
+    return matrix_get_value(input_data->matrix, index / input_data->matrix->N, index % input_data->matrix->N);
+}
+
+// Text of a cell, pending edits included. int64 values keep all their
+// digits; short gives floating point values in few enough digits to fit a
+// cell.
+static void grid_cell_text(MatrixInputData *input_data, size_t index, int short_form,
+                           char *out, size_t size) {
+    Matrix *matrix = input_data->matrix;
+    MatrixValue value;
+    if (!matrix_type_is_integer(matrix->type) && short_form)
+        snprintf(out, size, "%.6g", grid_cell_value(input_data, index).f);
+    else if (!cell_edits_get(&input_data->edits, index, &value))
+        matrix_format_element(matrix, index / matrix->N, index % matrix->N, out, size);
+    else if (matrix_type_is_integer(matrix->type))
+        snprintf(out, size, "%" PRId64, value.i);
+    else
+        snprintf(out, size, matrix->type == MATRIX_FLOAT32 ? "%.9g" : "%.17g", value.f);
+}
+
+typedef struct {
+    size_t index;
+    MatrixValue value;
+    double delta;
+} CellEdit;
+
+static int compare_cell_edits(const void *a, const void *b) {
+    size_t x = ((const CellEdit *)a)->index, y = ((const CellEdit *)b)->index;
+    return (x > y) - (x < y);
+}
+
+// Write the pending edits into the matrix. Every action calls this first, so
+// its cost depends on the number of edited cells, not the matrix size. The
+// changed cells reach the determinant cache as one rank-k update, with one
+// term per row (u = e_row, v = the row's change) or one per column (u = the
+// column's change, v = e_col), whichever takes fewer; past what the cache can
+// hold, the next determinant refactors.
+static int grid_sync(MatrixInputData *input_data) {
+    CellEdits *edits = &input_data->edits;
+    Matrix *matrix = input_data->matrix;
+    if (!edits->count) return 0;
+
+    MatrixTraceScope scope = matrix_trace_begin("ui.sync");
+    unsigned n = matrix->N;
+    int integer = matrix_type_is_integer(matrix->type);
+    CellEdit *list = malloc(edits->count * sizeof(CellEdit));
+    int status = list ? 0 : -1;
+
+    // Unchanged cells are dropped, so looking at a cell writes nothing
+    size_t count = 0;
+    for (size_t i = 0; list && i < edits->slots; i++) {
+        if (!edits->keys[i]) continue;
+        size_t index = edits->keys[i] - 1;
+        MatrixValue old = matrix_get_value(matrix, index / n, index % n), value = edits->values[i];
+        if (integer ? value.i == old.i : value.f == old.f) continue;
+        double delta = integer ? (double)value.i - (double)old.i : value.f - old.f;
+        list[count++] = (CellEdit){ index, value, delta };
+    }
+    if (list) qsort(list, count, sizeof(CellEdit), compare_cell_edits);
+
+    // Terms by row follow the sorted order; column_term numbers the columns
+    unsigned *column_term = matrix->M == matrix->N && count ? calloc(n, sizeof(unsigned)) : NULL;
+    unsigned rows = 0, cols = 0;
+    for (size_t i = 0; column_term && i < count; i++) {
+        rows += i == 0 || list[i].index / n != list[i - 1].index / n;
+        if (!column_term[list[i].index % n]) column_term[list[i].index % n] = ++cols;
+    }
+    int by_column = cols < rows;
+    unsigned k = by_column ? cols : rows;
+    int update = column_term && k <= LU_CACHE_UPDATES;
+    double *u = update ? calloc((size_t)k * n, sizeof(double)) : NULL;
+    double *v = update ? calloc((size_t)k * n, sizeof(double)) : NULL;
+    update = u && v;
+
+    uint64_t version = matrix->version;
+    size_t row_term = 0;
+    for (size_t i = 0; status == 0 && i < count; i++) {
+        unsigned row = list[i].index / n, col = list[i].index % n;
+        if (matrix_set_value(matrix, row, col, list[i].value) != 0) status = -1;
+        row_term += i == 0 || row != list[i - 1].index / n;
+        if (!update) continue;
+        if (by_column) {
+            size_t t = column_term[col] - 1;
+            u[t * n + row] = list[i].delta;
+            v[t * n + col] = 1.0;
+        } else {
+            u[(row_term - 1) * n + row] = 1.0;
+            v[(row_term - 1) * n + col] = list[i].delta;
         }
     }
-    
-    fclose(file);
+    if (status == 0 && update) lu_cache_update_rank(input_data->det_cache, matrix, version, k, u, v);
+    free(list);
+    free(column_term);
+    free(u);
+    free(v);
+
+    matrix_trace_end(scope, count * sizeof(CellEdit), 0.0);
+    cell_edits_clear(edits);
+    if (status != 0)
+        gtk_label_set_text(GTK_LABEL(input_data->result_label), "Out of memory, edits lost");
+    return status;
 }
 
-// Load all matrices from a file
-void load_matrices_from_file(const char *filename) {
-    FILE *file = fopen(filename, "r");
-    if (!file) return;
-    
-    // Clear existing matrices
-    for (int i = 0; i < num_saved_matrices; i++) {
-        if (saved_matrices[i]) {
-            free(saved_matrices[i]->data);
-            free(saved_matrices[i]);
-            saved_matrices[i] = NULL;
+static void grid_draw(GtkDrawingArea *area, cairo_t *cr, int width, int height, gpointer data) {
+    MatrixInputData *input_data = data;
+    Matrix *matrix = input_data->matrix;
+    cairo_set_source_rgb(cr, 1, 1, 1);
+    cairo_paint(cr);
+    if (!matrix) return;
+
+    MatrixTraceScope scope = matrix_trace_begin("ui.draw");
+    unsigned row0, col0, rows = 0, cols = 0;
+    double x0, y0;
+    grid_origin(input_data, &row0, &col0, &x0, &y0);
+    while (row0 + rows < matrix->M && y0 + rows * GRID_CELL_HEIGHT < height) rows++;
+    while (col0 + cols < matrix->N && x0 + cols * GRID_CELL_WIDTH < width) cols++;
+
+    cairo_select_font_face(cr, "monospace", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
+    cairo_set_font_size(cr, 13);
+    cairo_text_extents_t extents;
+    char text[32];
+
+    // Cells, right-aligned, clipped to the area beside the headers
+    cairo_save(cr);
+    cairo_rectangle(cr, GRID_HEADER_WIDTH, GRID_HEADER_HEIGHT, width, height);
+    cairo_clip(cr);
+    cairo_set_source_rgb(cr, 0, 0, 0);
+    for (unsigned i = 0; i < rows; i++) {
+        size_t row = (size_t)(row0 + i) * matrix->N + col0;
+        double y = y0 + i * GRID_CELL_HEIGHT + GRID_CELL_HEIGHT / 2 + 5;
+        for (unsigned j = 0; j < cols; j++) {
+            grid_cell_text(input_data, row + j, 1, text, sizeof(text));
+            cairo_text_extents(cr, text, &extents);
+            cairo_move_to(cr, x0 + (j + 1) * GRID_CELL_WIDTH - 6 - extents.x_advance, y);
+            cairo_show_text(cr, text);
         }
     }
-    
-    fscanf(file, "%d", &num_saved_matrices);
-    
-    for (int i = 0; i < num_saved_matrices; i++) {
-        char name[10];
-        unsigned M, N;
-        fscanf(file, "%s %u %u", name, &M, &N);
-        
-        Matrix *matrix = create_matrix(M, N);
-        strncpy(matrix->name, name, sizeof(matrix->name) - 1);
-        
-        for (unsigned row = 0; row < M; row++) {
-            for (unsigned col = 0; col < N; col++) {
-                int value;
-                fscanf(file, "%d", &value);
-                set_element(matrix, row, col, value);
-            }
-        }
-        
-        saved_matrices[i] = matrix;
+    cairo_set_source_rgb(cr, 0.8, 0.8, 0.8);
+    cairo_set_line_width(cr, 1);
+    double right = x0 + cols * GRID_CELL_WIDTH, bottom = y0 + rows * GRID_CELL_HEIGHT;
+    for (unsigned i = 0; i <= rows; i++) {
+        cairo_move_to(cr, x0, y0 + i * GRID_CELL_HEIGHT + 0.5);
+        cairo_line_to(cr, right, y0 + i * GRID_CELL_HEIGHT + 0.5);
     }
-    
-    fclose(file);
+    for (unsigned j = 0; j <= cols; j++) {
+        cairo_move_to(cr, x0 + j * GRID_CELL_WIDTH + 0.5, y0);
+        cairo_line_to(cr, x0 + j * GRID_CELL_WIDTH + 0.5, bottom);
+    }
+    cairo_stroke(cr);
+    cairo_restore(cr);
+
+    // Row and column numbers, counting from 1
+    cairo_set_source_rgb(cr, 0xD9 / 255.0, 0xD7 / 255.0, 0xCC / 255.0);
+    cairo_rectangle(cr, 0, 0, width, GRID_HEADER_HEIGHT);
+    cairo_rectangle(cr, 0, 0, GRID_HEADER_WIDTH, height);
+    cairo_fill(cr);
+    cairo_set_source_rgb(cr, 0.2, 0.2, 0.2);
+    cairo_save(cr);
+    cairo_rectangle(cr, GRID_HEADER_WIDTH, 0, width, GRID_HEADER_HEIGHT);
+    cairo_clip(cr);
+    for (unsigned j = 0; j < cols; j++) {
+        snprintf(text, sizeof(text), "%u", col0 + j + 1);
+        cairo_text_extents(cr, text, &extents);
+        cairo_move_to(cr, x0 + (j + 0.5) * GRID_CELL_WIDTH - extents.x_advance / 2,
+                      GRID_HEADER_HEIGHT / 2 + 5);
+        cairo_show_text(cr, text);
+    }
+    cairo_restore(cr);
+    cairo_save(cr);
+    cairo_rectangle(cr, 0, GRID_HEADER_HEIGHT, GRID_HEADER_WIDTH, height);
+    cairo_clip(cr);
+    for (unsigned i = 0; i < rows; i++) {
+        snprintf(text, sizeof(text), "%u", row0 + i + 1);
+        cairo_text_extents(cr, text, &extents);
+        cairo_move_to(cr, GRID_HEADER_WIDTH - 6 - extents.x_advance,
+                      y0 + i * GRID_CELL_HEIGHT + GRID_CELL_HEIGHT / 2 + 5);
+        cairo_show_text(cr, text);
+    }
+    cairo_restore(cr);
+    matrix_trace_end(scope, (uint64_t)rows * cols * matrix_types[matrix->type].size, 0.0);
 }
 
-double determinant(Matrix *matrix) {
-    if (matrix->M != matrix->N) return 0.0;
-    unsigned n = matrix->M;
-    double *data = malloc(n * n * sizeof(double));
-    if (!data) return 0.0;
+// Fit the scroll ranges to the matrix and a view of width x height pixels
+static void grid_update_range(MatrixInputData *input_data, int width, int height) {
+    Matrix *matrix = input_data->matrix;
+    double rows = (height - GRID_HEADER_HEIGHT) / (double)GRID_CELL_HEIGHT;
+    double cols = (width - GRID_HEADER_WIDTH) / (double)GRID_CELL_WIDTH;
+    if (rows < 1) rows = 1;
+    if (cols < 1) cols = 1;
+    GtkAdjustment *v = input_data->grid_vadj, *h = input_data->grid_hadj;
+    gtk_adjustment_configure(v, gtk_adjustment_get_value(v), 0, matrix ? matrix->M : 0,
+                             1, rows, rows);
+    gtk_adjustment_configure(h, gtk_adjustment_get_value(h), 0, matrix ? matrix->N : 0,
+                             1, cols, cols);
+}
 
-    for (unsigned i = 0; i < n * n; i++)
-        data[i] = matrix->data[i];
+// Parse cell editor text; 0 if it is not a value of the matrix's type
+static int grid_parse_cell(MatrixInputData *input_data, const char *text, MatrixValue *out) {
+    return matrix_parse_value(input_data->matrix->type, text, out) == 0;
+}
 
-    int sign = 1;
-    for (unsigned k = 0; k < n; k++) {
-        unsigned max_row = k;
-        for (unsigned i = k + 1; i < n; i++)
-            if (fabs(data[i*n +k]) > fabs(data[max_row*n +k]))
-                max_row = i;
+// Close the cell editor. Its value is already in the pending edits; text
+// that does not parse as the element type puts the cell back as it was. That
+// put needs no check: if the table cannot grow, the cell has no pending edit
+// and already shows its original value.
+static void grid_commit_edit(MatrixInputData *input_data) {
+    if (!input_data->editing) return;
+    input_data->editing = FALSE;
 
-        if (max_row != k) {
-            for (unsigned j = 0; j < n; j++) {
-                double tmp = data[k*n +j];
-                data[k*n +j] = data[max_row*n +j];
-                data[max_row*n +j] = tmp;
-            }
-            sign *= -1;
-        }
+    MatrixValue value;
+    const char *text = gtk_editable_get_text(GTK_EDITABLE(input_data->cell_editor));
+    if (!grid_parse_cell(input_data, text, &value)) {
+        char message[64];
+        snprintf(message, sizeof(message), "Not a valid %s value, cell unchanged",
+                 matrix_type_name(input_data->matrix->type));
+        gtk_label_set_text(GTK_LABEL(input_data->result_label), message);
+        cell_edits_put(&input_data->edits,
+                       (size_t)input_data->edit_row * input_data->matrix->N + input_data->edit_col,
+                       input_data->edit_original);
+    }
 
-        if (data[k*n +k] == 0.0) {
-            free(data);
-            return 0.0;
-        }
+    gtk_widget_set_visible(input_data->cell_editor, FALSE);
+    gtk_widget_queue_draw(input_data->grid_area);
+}
 
-        for (unsigned i = k + 1; i < n; i++) {
-            double factor = data[i*n +k] / data[k*n +k];
-            data[i*n +k] = factor;
-            for (unsigned j = k + 1; j < n; j++)
-                data[i*n +j] -= factor * data[k*n +j];
-        }
+// Scroll cell (row, col) into view and open the editor over it
+static void grid_begin_edit(MatrixInputData *input_data, unsigned row, unsigned col) {
+    grid_commit_edit(input_data);
+    Matrix *matrix = input_data->matrix;
+    GtkAdjustment *v = input_data->grid_vadj, *h = input_data->grid_hadj;
+    if (row < gtk_adjustment_get_value(v))
+        gtk_adjustment_set_value(v, row);
+    else if (row + 1 > gtk_adjustment_get_value(v) + gtk_adjustment_get_page_size(v))
+        gtk_adjustment_set_value(v, row + 1 - gtk_adjustment_get_page_size(v));
+    if (col < gtk_adjustment_get_value(h))
+        gtk_adjustment_set_value(h, col);
+    else if (col + 1 > gtk_adjustment_get_value(h) + gtk_adjustment_get_page_size(h))
+        gtk_adjustment_set_value(h, col + 1 - gtk_adjustment_get_page_size(h));
+
+    unsigned row0, col0;
+    double x0, y0;
+    grid_origin(input_data, &row0, &col0, &x0, &y0);
+    // Set the text before editing starts, so it is not recorded as an edit
+    char text[32];
+    input_data->edit_original = grid_cell_value(input_data, (size_t)row * matrix->N + col);
+    grid_cell_text(input_data, (size_t)row * matrix->N + col, 0, text, sizeof(text));
+    gtk_editable_set_text(GTK_EDITABLE(input_data->cell_editor), text);
+    gtk_widget_set_margin_start(input_data->cell_editor, (int)(x0 + (double)(col - col0) * GRID_CELL_WIDTH));
+    gtk_widget_set_margin_top(input_data->cell_editor, (int)(y0 + (double)(row - row0) * GRID_CELL_HEIGHT));
+
+    input_data->editing = TRUE;
+    input_data->edit_row = row;
+    input_data->edit_col = col;
+    gtk_widget_set_visible(input_data->cell_editor, TRUE);
+    gtk_widget_grab_focus(input_data->cell_editor);
+}
+
+static void on_grid_resize(GtkDrawingArea *area, int width, int height, gpointer data) {
+    grid_update_range(data, width, height);
+}
+
+static void on_grid_scrolled(GtkAdjustment *adjustment, gpointer data) {
+    MatrixInputData *input_data = data;
+    grid_commit_edit(input_data);
+    gtk_widget_queue_draw(input_data->grid_area);
+}
+
+static gboolean on_grid_scroll(GtkEventControllerScroll *controller, double dx, double dy, gpointer data) {
+    MatrixInputData *input_data = data;
+    // Wheels scroll three cells a notch, touchpads report pixels
+    if (gtk_event_controller_scroll_get_unit(controller) == GDK_SCROLL_UNIT_SURFACE) {
+        dx /= GRID_CELL_WIDTH;
+        dy /= GRID_CELL_HEIGHT;
+    } else {
+        dx *= 3;
+        dy *= 3;
     }
+    GtkAdjustment *v = input_data->grid_vadj, *h = input_data->grid_hadj;
+    gtk_adjustment_set_value(h, gtk_adjustment_get_value(h) + dx);
+    gtk_adjustment_set_value(v, gtk_adjustment_get_value(v) + dy);
+    return TRUE;
+}
 
-    double det = 1.0;
-    for (unsigned k = 0; k < n; k++)
-        det *= data[k*n +k];
-    det *= sign;
+static void on_grid_pressed(GtkGestureClick *gesture, int n_press, double x, double y, gpointer data) {
+    MatrixInputData *input_data = data;
+    Matrix *matrix = input_data->matrix;
+    grid_commit_edit(input_data);
+    if (!matrix || x < GRID_HEADER_WIDTH || y < GRID_HEADER_HEIGHT) return;
 
-    free(data);
-    return det;
+    unsigned row0, col0;
+    double x0, y0;
+    grid_origin(input_data, &row0, &col0, &x0, &y0);
+    unsigned row = row0 + (unsigned)((y - y0) / GRID_CELL_HEIGHT);
+    unsigned col = col0 + (unsigned)((x - x0) / GRID_CELL_WIDTH);
+    if (row < matrix->M && col < matrix->N) grid_begin_edit(input_data, row, col);
+}
+
+// Enter moves the editor down a row, Tab and Shift+Tab along the row, Escape
+// drops the edit
+static void on_cell_editor_activate(GtkEntry *entry, gpointer data) {
+    MatrixInputData *input_data = data;
+    if (!input_data->editing) return;
+    unsigned row = input_data->edit_row, col = input_data->edit_col;
+    grid_commit_edit(input_data);
+    if (row + 1 < input_data->matrix->M) grid_begin_edit(input_data, row + 1, col);
+}
+
+static gboolean on_cell_editor_key(GtkEventControllerKey *controller, guint keyval, guint keycode,
+                                   GdkModifierType state, gpointer data) {
+    MatrixInputData *input_data = data;
+    if (!input_data->editing) return FALSE;
+    unsigned row = input_data->edit_row, col = input_data->edit_col;
+    switch (keyval) {
+    case GDK_KEY_Escape:
+        input_data->editing = FALSE;
+        cell_edits_put(&input_data->edits, (size_t)row * input_data->matrix->N + col,
+                       input_data->edit_original);
+        gtk_widget_set_visible(input_data->cell_editor, FALSE);
+        gtk_widget_queue_draw(input_data->grid_area);
+        return TRUE;
+    case GDK_KEY_Tab:
+        if (col + 1 < input_data->matrix->N) grid_begin_edit(input_data, row, col + 1);
+        else grid_commit_edit(input_data);
+        return TRUE;
+    case GDK_KEY_ISO_Left_Tab:
+        if (col > 0) grid_begin_edit(input_data, row, col - 1);
+        else grid_commit_edit(input_data);
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+
+// Each change of the editor text updates the pending edit of its cell
+static void on_cell_editor_changed(GtkEditable *editable, gpointer data) {
+    MatrixInputData *input_data = data;
+    MatrixValue value;
+    if (!input_data->editing || !grid_parse_cell(input_data, gtk_editable_get_text(editable), &value))
+        return;
+    if (cell_edits_put(&input_data->edits,
+                       (size_t)input_data->edit_row * input_data->matrix->N + input_data->edit_col,
+                       value) != 0)
+        gtk_label_set_text(GTK_LABEL(input_data->result_label), "Out of memory, edit not kept");
+}
+
+static void on_cell_editor_leave(GtkEventControllerFocus *controller, gpointer data) {
+    grid_commit_edit(data);
+}
+
+// The view widget for input_data->matrix: the drawing area with the cell
+// editor over it, and scrollbars
+static GtkWidget *grid_view_new(MatrixInputData *input_data) {
+    input_data->grid_vadj = gtk_adjustment_new(0, 0, 0, 1, 1, 1);
+    input_data->grid_hadj = gtk_adjustment_new(0, 0, 0, 1, 1, 1);
+    g_signal_connect(input_data->grid_vadj, "value-changed", G_CALLBACK(on_grid_scrolled), input_data);
+    g_signal_connect(input_data->grid_hadj, "value-changed", G_CALLBACK(on_grid_scrolled), input_data);
+
+    GtkWidget *area = gtk_drawing_area_new();
+    gtk_widget_set_hexpand(area, TRUE);
+    gtk_widget_set_vexpand(area, TRUE);
+    gtk_widget_set_size_request(area, GRID_HEADER_WIDTH + 2 * GRID_CELL_WIDTH,
+                                GRID_HEADER_HEIGHT + 4 * GRID_CELL_HEIGHT);
+    gtk_drawing_area_set_draw_func(GTK_DRAWING_AREA(area), grid_draw, input_data, NULL);
+    g_signal_connect(area, "resize", G_CALLBACK(on_grid_resize), input_data);
+    input_data->grid_area = area;
+
+    GtkEventController *scroll = gtk_event_controller_scroll_new(GTK_EVENT_CONTROLLER_SCROLL_BOTH_AXES);
+    g_signal_connect(scroll, "scroll", G_CALLBACK(on_grid_scroll), input_data);
+    gtk_widget_add_controller(area, scroll);
+    GtkGesture *click = gtk_gesture_click_new();
+    g_signal_connect(click, "pressed", G_CALLBACK(on_grid_pressed), input_data);
+    gtk_widget_add_controller(area, GTK_EVENT_CONTROLLER(click));
+
+    GtkWidget *editor = gtk_entry_new();
+    gtk_editable_set_width_chars(GTK_EDITABLE(editor), 8);
+    gtk_widget_set_halign(editor, GTK_ALIGN_START);
+    gtk_widget_set_valign(editor, GTK_ALIGN_START);
+    gtk_widget_set_visible(editor, FALSE);
+    g_signal_connect(editor, "activate", G_CALLBACK(on_cell_editor_activate), input_data);
+    g_signal_connect(editor, "changed", G_CALLBACK(on_cell_editor_changed), input_data);
+    GtkEventController *keys = gtk_event_controller_key_new();
+    g_signal_connect(keys, "key-pressed", G_CALLBACK(on_cell_editor_key), input_data);
+    gtk_widget_add_controller(editor, keys);
+    GtkEventController *focus = gtk_event_controller_focus_new();
+    g_signal_connect(focus, "leave", G_CALLBACK(on_cell_editor_leave), input_data);
+    gtk_widget_add_controller(editor, focus);
+    input_data->cell_editor = editor;
+
+    GtkWidget *overlay = gtk_overlay_new();
+    gtk_overlay_set_child(GTK_OVERLAY(overlay), area);
+    gtk_overlay_add_overlay(GTK_OVERLAY(overlay), editor);
+
+    GtkWidget *grid = gtk_grid_new();
+    gtk_grid_attach(GTK_GRID(grid), overlay, 0, 0, 1, 1);
+    gtk_grid_attach(GTK_GRID(grid), gtk_scrollbar_new(GTK_ORIENTATION_VERTICAL, input_data->grid_vadj), 1, 0, 1, 1);
+    gtk_grid_attach(GTK_GRID(grid), gtk_scrollbar_new(GTK_ORIENTATION_HORIZONTAL, input_data->grid_hadj), 0, 1, 1, 1);
+    grid_update_range(input_data, 0, 0);
+    return grid;
 }
 
 static void update_saved_matrices_combo(GtkDropDown *combo) {
@@ -265,18 +596,14 @@ static void on_save_matrix_clicked(GtkWidget *widget, gpointer data) {
         return;
     }
     
-    // Recalculate matrix values from current entries to ensure it's up to date
-    for (unsigned i = 0; i < input_data->rows; i++) {
-        for (unsigned j = 0; j < input_data->cols; j++) {
-            GtkEntry *entry = GTK_ENTRY(input_data->entries[i * input_data->cols + j]);
-            const char *text = gtk_editable_get_text(GTK_EDITABLE(entry));
-            int value = atoi(text);
-            set_element(input_data->matrix, i, j, value);
-        }
-    }
-    
+    // Apply the edited cells; the rest of the matrix is already current
+    if (grid_sync(input_data) != 0) return;
+
     // Save the matrix
-    save_matrix(input_data->matrix, name);
+    if (save_matrix(input_data->matrix, name) != 0) {
+        gtk_label_set_text(GTK_LABEL(input_data->result_label), "Failed to save matrix");
+        return;
+    }
     
     // Update the combo box
     update_saved_matrices_combo(GTK_DROP_DOWN(input_data->load_combo));
@@ -307,32 +634,16 @@ static void on_load_matrix_clicked(GtkWidget *widget, gpointer data) {
         return;
     }
     
-    // Free the old matrix if it exists
-    if (input_data->matrix) {
-        free(input_data->matrix->data);
-        free(input_data->matrix);
-    }
-    
-    input_data->matrix = loaded_matrix;
-    
     // Update rows and cols entries
-    char rows_str[10], cols_str[10];
+    char rows_str[16], cols_str[16];
     sprintf(rows_str, "%u", loaded_matrix->M);
     sprintf(cols_str, "%u", loaded_matrix->N);
     gtk_editable_set_text(GTK_EDITABLE(input_data->rows_entry), rows_str);
     gtk_editable_set_text(GTK_EDITABLE(input_data->cols_entry), cols_str);
+    gtk_drop_down_set_selected(GTK_DROP_DOWN(input_data->type_combo), loaded_matrix->type);
     
-    // Regenerate the matrix UI
-    on_calculate_clicked(NULL, input_data);
-    
-    // Update the matrix entries with the loaded values
-    for (unsigned i = 0; i < loaded_matrix->M; i++) {
-        for (unsigned j = 0; j < loaded_matrix->N; j++) {
-            char value_str[20];
-            sprintf(value_str, "%d", loaded_matrix->data[i * loaded_matrix->N + j]);
-            gtk_editable_set_text(GTK_EDITABLE(input_data->entries[i * loaded_matrix->N + j]), value_str);
-        }
-    }
+    // Edit the loaded matrix; its elements stay shared until they change
+    show_matrix(input_data, loaded_matrix);
     
     // Update the name entry
     gtk_editable_set_text(GTK_EDITABLE(input_data->matrix_name_entry), name);
@@ -343,39 +654,244 @@ static void on_load_matrix_clicked(GtkWidget *widget, gpointer data) {
     gtk_label_set_text(GTK_LABEL(input_data->result_label), "Matrix loaded successfully");
 }
 
+static void on_delete_matrix_clicked(GtkWidget *widget, gpointer data) {
+    MatrixInputData *input_data = data;
+    GtkDropDown *combo = GTK_DROP_DOWN(input_data->load_combo);
+    guint pos = gtk_drop_down_get_selected(combo);
+
+    if (pos == GTK_INVALID_LIST_POSITION) {
+        gtk_label_set_text(GTK_LABEL(input_data->result_label), "Please select a matrix");
+        return;
+    }
+
+    GtkStringObject *item = GTK_STRING_OBJECT(g_list_model_get_item(
+        gtk_drop_down_get_model(combo), pos));
+    int status = delete_matrix(gtk_string_object_get_string(item));
+    g_object_unref(item);
+    if (status != 0) {
+        const char *error = matrix_last_error();
+        gtk_label_set_text(GTK_LABEL(input_data->result_label),
+                           error[0] ? error : "Failed to delete matrix");
+        return;
+    }
+
+    update_saved_matrices_combo(combo);
+    gtk_label_set_text(GTK_LABEL(input_data->result_label), "Matrix deleted");
+}
+
+// File load or save on a worker thread, one at a time. A save writes
+// handles on the saved matrices taken when it starts. A load hands the
+// matrices it reads to registry_put_deferred() a batch at a time, so their
+// journal records are written and synced on the worker; the GTK thread,
+// which owns the registry, only applies them and updates the dropdowns on
+// every progress tick, and matrices appear while the rest of the file is
+// still being read.
+#define FILE_JOB_BATCH_US 100000
+
+typedef struct FileJob {
+    MatrixInputData *input_data;
+    char *filename;
+    int save;
+    Matrix **matrices;          // save: what is written
+    int count;
+    GPtrArray *batch;           // load: read but not yet recorded, worker only
+    gint64 batch_start;
+    gboolean cleared;           // load: registry replaced (a CSV only adds to it), worker only
+    atomic_uint loaded;
+    gboolean out_of_memory;     // load: a recorded matrix did not fit in the registry
+    int status;
+    char error[512];
+    MatrixProgress progress;
+    guint progress_source;
+} FileJob;
+
+static void file_buttons_update(MatrixInputData *input_data) {
+    gboolean busy = input_data->file_job != NULL;
+    gtk_widget_set_sensitive(input_data->file_save_btn, !busy);
+    gtk_widget_set_sensitive(input_data->file_load_btn, !busy);
+    gtk_widget_set_sensitive(input_data->file_cancel_btn, busy);
+    gtk_widget_set_visible(input_data->file_progress, busy);
+}
+
+static void file_job_free(FileJob *job) {
+    for (int i = 0; i < job->count; i++)
+        free_matrix(job->matrices[i]);
+    free(job->matrices);
+    for (guint i = 0; job->batch && i < job->batch->len; i++)
+        free_matrix(g_ptr_array_index(job->batch, i));
+    if (job->batch) g_ptr_array_free(job->batch, TRUE);
+    g_free(job->filename);
+    free(job);
+}
+
+// Record the batch for the registry, replacing it with the first one.
+// Returns 0, or -1 with the reason in matrix_last_error().
+static int file_job_flush(FileJob *job) {
+    job->batch_start = g_get_monotonic_time();
+    if (job->batch->len == 0) return 0;
+    guint count = job->batch->len;
+    int status = registry_put_deferred((Matrix **)job->batch->pdata, (int)count, !job->cleared);
+    g_ptr_array_set_size(job->batch, 0);
+    if (status != 0) return -1;
+    job->cleared = TRUE;
+    atomic_fetch_add(&job->loaded, count);
+    return 0;
+}
+
+static int file_job_queue(Matrix *matrix, void *data) {
+    FileJob *job = data;
+    g_ptr_array_add(job->batch, matrix);
+    if (g_get_monotonic_time() - job->batch_start < FILE_JOB_BATCH_US) return 0;
+    return file_job_flush(job);
+}
+
+static void file_job_run(GTask *task, gpointer source, gpointer data, GCancellable *cancellable) {
+    FileJob *job = data;
+    if (job->save) {
+        job->status = matrix_file_write(job->filename, job->matrices, job->count, &job->progress);
+    } else {
+        job->batch_start = g_get_monotonic_time();
+        job->status = matrix_file_read(job->filename, file_job_queue, job, &job->progress);
+        // What was read before a failure or cancel is kept, as it was shown
+        if (file_job_flush(job) != 0 && job->status == 0) job->status = -1;
+    }
+    if (job->status != 0) snprintf(job->error, sizeof(job->error), "%s", matrix_last_error());
+    g_task_return_boolean(task, TRUE);
+}
+
+// Apply the matrices recorded so far to the registry and the dropdowns
+static void file_job_drain(FileJob *job) {
+    GtkDropDown *combo = GTK_DROP_DOWN(job->input_data->load_combo);
+    int before = num_saved_matrices, cleared;
+    if (registry_apply_deferred(&cleared) != 0) job->out_of_memory = TRUE;
+    if (cleared) {
+        update_saved_matrices_combo(combo);
+        return;
+    }
+    if (num_saved_matrices <= before) return;
+    // Names go into the list in one splice, so a batch is one model change
+    GtkStringList *list = GTK_STRING_LIST(gtk_drop_down_get_model(combo));
+    const char **names = g_new0(const char *, num_saved_matrices - before + 1);
+    for (int i = before; i < num_saved_matrices; i++) names[i - before] = saved_matrices[i]->name;
+    gtk_string_list_splice(list, g_list_model_get_n_items(G_LIST_MODEL(list)), 0, names);
+    g_free(names);
+}
+
+static gboolean on_file_progress(gpointer data) {
+    FileJob *job = data;
+    if (!job->save) file_job_drain(job);
+    unsigned done = atomic_load(&job->progress.done), total = atomic_load(&job->progress.total);
+    double fraction = total ? (double)done / total : 0.0;
+    char *text = job->save ? g_strdup_printf("Saving... %.0f%%", fraction * 100)
+                           : g_strdup_printf("Loading... %.0f%%, %u matrices", fraction * 100,
+                                             atomic_load(&job->loaded));
+    GtkProgressBar *bar = GTK_PROGRESS_BAR(job->input_data->file_progress);
+    gtk_progress_bar_set_fraction(bar, fraction > 1.0 ? 1.0 : fraction);
+    gtk_progress_bar_set_text(bar, text);
+    g_free(text);
+    return G_SOURCE_CONTINUE;
+}
+
+static void on_file_job_done(GObject *source, GAsyncResult *result, gpointer data) {
+    FileJob *job = data;
+    MatrixInputData *input_data = job->input_data;
+    g_source_remove(job->progress_source);
+    if (!job->save) {
+        file_job_drain(job);
+        if (job->out_of_memory && job->status == 0) {
+            job->status = -1;
+            snprintf(job->error, sizeof(job->error), "out of memory");
+        }
+        // An empty file replaces the registry too; a failed read leaves it
+        if (job->status == 0 && !job->cleared) {
+            clear_saved_matrices();
+            update_saved_matrices_combo(GTK_DROP_DOWN(input_data->load_combo));
+        }
+    }
+    input_data->file_job = NULL;
+    file_buttons_update(input_data);
+
+    char *message;
+    int cancelled = atomic_load(&job->progress.cancel);
+    if (job->save)
+        message = cancelled ? g_strdup("Save cancelled, file left unchanged") :
+                  job->status == 0 ? g_strdup_printf("Saved %d matrices to file", job->count) :
+                  g_strdup_printf("Save failed: %s", job->error);
+    else
+        message = cancelled ? g_strdup_printf("Load cancelled after %u matrices", atomic_load(&job->loaded)) :
+                  job->status == 0 ? g_strdup_printf("Loaded %u matrices from file", atomic_load(&job->loaded)) :
+                  g_strdup_printf("Load failed: %s", job->error);
+    gtk_label_set_text(GTK_LABEL(input_data->result_label), message);
+    g_free(message);
+    file_job_free(job);
+}
+
+static void file_job_start(MatrixInputData *input_data, GFile *file, int save) {
+    FileJob *job = calloc(1, sizeof(FileJob));
+    if (!job) {
+        gtk_label_set_text(GTK_LABEL(input_data->result_label), "Out of memory");
+        return;
+    }
+    job->input_data = input_data;
+    job->filename = g_file_get_path(file);
+    job->save = save;
+    if (save) {
+        // Handles share the elements, so edits made meanwhile copy them
+        job->matrices = calloc(num_saved_matrices ? num_saved_matrices : 1, sizeof(Matrix *));
+        for (int i = 0; job->matrices && i < num_saved_matrices; i++) {
+            job->matrices[i] = copy_matrix(saved_matrices[i]);
+            if (!job->matrices[i]) break;
+            job->count++;
+        }
+        if (!job->matrices || job->count != num_saved_matrices) {
+            file_job_free(job);
+            gtk_label_set_text(GTK_LABEL(input_data->result_label), "Out of memory");
+            return;
+        }
+    } else {
+        job->batch = g_ptr_array_new();
+        job->cleared = job->filename && g_str_has_suffix(job->filename, ".csv");
+    }
+    if (!job->filename) {
+        file_job_free(job);
+        gtk_label_set_text(GTK_LABEL(input_data->result_label), "Only local files are supported");
+        return;
+    }
+
+    input_data->file_job = job;
+    file_buttons_update(input_data);
+    on_file_progress(job);
+    job->progress_source = g_timeout_add(100, on_file_progress, job);
+
+    GTask *task = g_task_new(NULL, NULL, on_file_job_done, job);
+    g_task_set_task_data(task, job, NULL);
+    g_task_run_in_thread(task, file_job_run);
+    g_object_unref(task);
+}
+
 static void on_file_save_response(GtkFileDialog *dialog, GAsyncResult *result, gpointer user_data) {
     GFile *file = gtk_file_dialog_save_finish(dialog, result, NULL);
     if (file) {
-        char *filename = g_file_get_path(file);
-        save_matrices_to_file(filename);
-        g_free(filename);
+        file_job_start(user_data, file, 1);
         g_object_unref(file);
     }
     g_object_unref(dialog);
 }
 
 static void on_file_save_clicked(GtkWidget *widget, gpointer data) {
-    GtkWindow *window = GTK_WINDOW(data);
+    MatrixInputData *input_data = data;
+    if (input_data->file_job) return;
     GtkFileDialog *dialog = gtk_file_dialog_new();
     gtk_file_dialog_set_initial_name(dialog, "matrices.dat");
     
-    gtk_file_dialog_save(dialog, window, NULL, 
-                       (GAsyncReadyCallback)on_file_save_response, NULL);
+    gtk_file_dialog_save(dialog, input_data->input_window, NULL, 
+                       (GAsyncReadyCallback)on_file_save_response, input_data);
 }
 
 static void on_file_load_response(GtkFileDialog *dialog, GAsyncResult *result, gpointer user_data) {
-    MatrixInputData *input_data = user_data;
     GFile *file = gtk_file_dialog_open_finish(dialog, result, NULL);
-    
     if (file) {
-        char *filename = g_file_get_path(file);
-        load_matrices_from_file(filename);
-        
-        // Update the combo box
-        update_saved_matrices_combo(GTK_DROP_DOWN(input_data->load_combo));
-        
-        gtk_label_set_text(GTK_LABEL(input_data->result_label), "Matrices loaded from file");
-        g_free(filename);
+        file_job_start(user_data, file, 0);
         g_object_unref(file);
     }
     g_object_unref(dialog);
@@ -383,6 +899,7 @@ static void on_file_load_response(GtkFileDialog *dialog, GAsyncResult *result, g
 
 static void on_file_load_clicked(GtkWidget *widget, gpointer data) {
     MatrixInputData *input_data = data;
+    if (input_data->file_job) return;
     GtkWindow *window = input_data->input_window;
     
     GtkFileDialog *dialog = gtk_file_dialog_new();
@@ -390,6 +907,325 @@ static void on_file_load_clicked(GtkWidget *widget, gpointer data) {
                        (GAsyncReadyCallback)on_file_load_response, input_data);
 }
 
+// Stops a save at the next row and a load at the next matrix or buffer
+static void on_file_cancel_clicked(GtkWidget *widget, gpointer data) {
+    MatrixInputData *input_data = data;
+    if (input_data->file_job) atomic_store(&input_data->file_job->progress.cancel, 1);
+}
+
+
+// Counters of the factorization cache, refreshed after every job that uses it
+static void factor_cache_label_update(MatrixInputData *input_data) {
+    FactorCacheStats stats;
+    factor_cache_get_stats(&stats);
+    char message[160];
+    snprintf(message, sizeof(message),
+             "Factorization cache: %llu hits, %llu misses, %u entries, %.1f of %.0f MB",
+             (unsigned long long)stats.hits, (unsigned long long)stats.misses, stats.entries,
+             stats.bytes / 1048576.0, stats.limit / 1048576.0);
+    gtk_label_set_text(GTK_LABEL(input_data->cache_label), message);
+}
+
+// Polled while the window is open, so the readout follows work done on job
+// threads without every job having to report back
+static gboolean on_last_op_tick(gpointer data) {
+    MatrixInputData *input_data = data;
+    MatrixOpTiming op;
+    matrix_last_op(&op);
+    if (!op.name || (op.name == input_data->last_op.name && op.seconds == input_data->last_op.seconds))
+        return G_SOURCE_CONTINUE;
+    input_data->last_op = op;
+
+    char message[160];
+    int len = snprintf(message, sizeof(message), "Last op: %s %.2f ms", op.name, op.seconds * 1e3);
+    if (op.flops > 0 && op.seconds > 0)
+        snprintf(message + len, sizeof(message) - len, ", %.2f GFLOP/s", op.flops / op.seconds * 1e-9);
+    else if (op.bytes > 0 && op.seconds > 0)
+        snprintf(message + len, sizeof(message) - len, ", %.1f MB/s", op.bytes / op.seconds * 1e-6);
+    gtk_label_set_text(GTK_LABEL(input_data->last_op_label), message);
+    return G_SOURCE_CONTINUE;
+}
+
+// Product of two saved matrices, computed on a worker thread from handles
+// on their elements and added to the registry when done
+typedef struct {
+    MatrixInputData *input_data;
+    Matrix *left, *right;
+    Matrix *product;
+    char *name;
+    char error[512];
+} MultiplyJob;
+
+static void multiply_job_run(GTask *task, gpointer source, gpointer data, GCancellable *cancellable) {
+    MultiplyJob *job = data;
+    job->product = matrix_multiply(job->left, job->right);
+    if (!job->product) snprintf(job->error, sizeof(job->error), "%s", matrix_last_error());
+    g_task_return_boolean(task, TRUE);
+}
+
+static void on_multiply_done(GObject *source, GAsyncResult *result, gpointer data) {
+    MultiplyJob *job = data;
+    MatrixInputData *input_data = job->input_data;
+    GtkLabel *label = GTK_LABEL(input_data->result_label);
+
+    char *message;
+    if (!job->product) {
+        message = g_strdup_printf("Multiply failed: %s", job->error);
+    } else {
+        unsigned rows = job->product->M, cols = job->product->N;
+        if (matrix_set_name(job->product, job->name) != 0 || registry_put(job->product) != 0) {
+            message = g_strdup("Failed to save the product");
+        } else {
+            update_saved_matrices_combo(GTK_DROP_DOWN(input_data->load_combo));
+            message = g_strdup_printf("Saved %s x %s as %s (%u x %u)", job->left->name,
+                                      job->right->name, job->name, rows, cols);
+        }
+    }
+    gtk_label_set_text(label, message);
+    g_free(message);
+
+    free_matrix(job->left);
+    free_matrix(job->right);
+    free(job->name);
+    free(job);
+}
+
+static Matrix *selected_saved_matrix(GtkWidget *combo) {
+    guint pos = gtk_drop_down_get_selected(GTK_DROP_DOWN(combo));
+    if (pos == GTK_INVALID_LIST_POSITION) return NULL;
+    GtkStringObject *item = GTK_STRING_OBJECT(g_list_model_get_item(
+        gtk_drop_down_get_model(GTK_DROP_DOWN(combo)), pos));
+    Matrix *matrix = load_matrix(gtk_string_object_get_string(item));
+    g_object_unref(item);
+    return matrix;
+}
+
+static void on_multiply_clicked(GtkWidget *widget, gpointer data) {
+    MatrixInputData *input_data = data;
+    GtkLabel *label = GTK_LABEL(input_data->result_label);
+
+    const char *name = gtk_editable_get_text(GTK_EDITABLE(input_data->multiply_name_entry));
+    if (!name || strlen(name) == 0) {
+        gtk_label_set_text(label, "Please enter a name for the product");
+        return;
+    }
+    MultiplyJob *job = calloc(1, sizeof(MultiplyJob));
+    if (!job) {
+        gtk_label_set_text(label, "Out of memory");
+        return;
+    }
+    job->input_data = input_data;
+    job->left = selected_saved_matrix(input_data->multiply_left_combo);
+    job->right = selected_saved_matrix(input_data->multiply_right_combo);
+    job->name = strdup(name);
+    if (!job->left || !job->right || !job->name) {
+        gtk_label_set_text(label, "Please select two saved matrices");
+        if (job->left) free_matrix(job->left);
+        if (job->right) free_matrix(job->right);
+        free(job->name);
+        free(job);
+        return;
+    }
+    if (job->left->N != job->right->M) {
+        char *message = g_strdup_printf("Cannot multiply %u x %u by %u x %u", job->left->M,
+                                        job->left->N, job->right->M, job->right->N);
+        gtk_label_set_text(label, message);
+        g_free(message);
+        free_matrix(job->left);
+        free_matrix(job->right);
+        free(job->name);
+        free(job);
+        return;
+    }
+
+    gtk_label_set_text(label, "Multiplying...");
+    GTask *task = g_task_new(NULL, NULL, on_multiply_done, job);
+    g_task_set_task_data(task, job, NULL);
+    g_task_run_in_thread(task, multiply_job_run);
+    g_object_unref(task);
+}
+
+// An expression statement, parsed on the GTK thread, where the saved
+// matrices live, and evaluated on a worker thread
+typedef struct {
+    MatrixInputData *input_data;
+    Expr *expr;
+    int status;
+    ExprResult result;
+    char error[512];
+} ExpressionJob;
+
+static void expression_job_run(GTask *task, gpointer source, gpointer data, GCancellable *cancellable) {
+    ExpressionJob *job = data;
+    job->status = expr_eval(job->expr, 1, &job->result, NULL);
+    if (job->status != 0) snprintf(job->error, sizeof(job->error), "%s", matrix_last_error());
+    g_task_return_boolean(task, TRUE);
+}
+
+static void on_expression_done(GObject *source, GAsyncResult *result, gpointer data) {
+    ExpressionJob *job = data;
+    MatrixInputData *input_data = job->input_data;
+    GtkLabel *label = GTK_LABEL(input_data->result_label);
+    Matrix *matrix = job->result.matrix;
+    const char *target = expr_target(job->expr);
+
+    char *message = NULL;
+    if (job->status != 0) {
+        message = g_strdup_printf("Expression failed: %s", job->error);
+    } else if (!matrix) {
+        message = g_strdup_printf("Result: %.2f", job->result.scalar);
+    } else if (target) {
+        unsigned rows = matrix->M, cols = matrix->N;
+        if (matrix_set_name(matrix, target) != 0 || registry_put(matrix) != 0) {
+            message = g_strdup("Failed to save the result");
+        } else {
+            update_saved_matrices_combo(GTK_DROP_DOWN(input_data->load_combo));
+            message = g_strdup_printf("Saved %s (%u x %u)", target, rows, cols);
+        }
+    } else {
+        // An unnamed result goes to the editor, like a new matrix
+        char rows_str[16], cols_str[16];
+        snprintf(rows_str, sizeof(rows_str), "%u", matrix->M);
+        snprintf(cols_str, sizeof(cols_str), "%u", matrix->N);
+        gtk_editable_set_text(GTK_EDITABLE(input_data->rows_entry), rows_str);
+        gtk_editable_set_text(GTK_EDITABLE(input_data->cols_entry), cols_str);
+        show_matrix(input_data, matrix);
+        message = g_strdup("Result shown below");
+    }
+    gtk_label_set_text(label, message);
+    g_free(message);
+    factor_cache_label_update(input_data);
+    expr_free(job->expr);
+    free(job);
+}
+
+static void on_evaluate_clicked(GtkWidget *widget, gpointer data) {
+    MatrixInputData *input_data = data;
+    GtkLabel *label = GTK_LABEL(input_data->result_label);
+
+    Expr *expr = expr_parse(gtk_editable_get_text(GTK_EDITABLE(input_data->expression_entry)));
+    if (!expr) {
+        char *message = g_strdup_printf("Expression error: %s", matrix_last_error());
+        gtk_label_set_text(label, message);
+        g_free(message);
+        return;
+    }
+    ExpressionJob *job = calloc(1, sizeof(ExpressionJob));
+    if (!job) {
+        expr_free(expr);
+        gtk_label_set_text(label, "Out of memory");
+        return;
+    }
+    job->input_data = input_data;
+    job->expr = expr;
+
+    gtk_label_set_text(label, "Evaluating...");
+    GTask *task = g_task_new(NULL, NULL, on_expression_done, job);
+    g_task_set_task_data(task, job, NULL);
+    g_task_run_in_thread(task, expression_job_run);
+    g_object_unref(task);
+}
+
+// Determinant computed on a worker thread. The job keeps its own handle on
+// the elements, so edits made meanwhile copy them instead of racing with the
+// elimination, and its own LuCache, which replaces the editor's only if the
+// matrix is still at the version the job started from. A sparse matrix is
+// factored sparse instead, through the factorization cache.
+typedef struct DeterminantJob {
+    MatrixInputData *input_data;
+    Matrix *matrix;
+    int exact;
+    LuCache *cache;
+    double sparse_det;
+    int status;
+    char *exact_result;
+    MatrixProgress progress;
+    guint progress_source;
+} DeterminantJob;
+
+static void determinant_buttons_update(MatrixInputData *input_data) {
+    if (input_data->determinant_btn)
+        gtk_widget_set_sensitive(input_data->determinant_btn, input_data->det_job == NULL);
+    if (input_data->cancel_btn)
+        gtk_widget_set_sensitive(input_data->cancel_btn, input_data->det_job != NULL);
+}
+
+static void determinant_job_free(DeterminantJob *job) {
+    free_matrix(job->matrix);
+    lu_cache_free(job->cache);
+    free(job->exact_result);
+    free(job);
+}
+
+static void determinant_job_run(GTask *task, gpointer source, gpointer data, GCancellable *cancellable) {
+    DeterminantJob *job = data;
+    if (job->exact) {
+        job->exact_result = determinant_exact_progress(job->matrix, NULL, &job->progress);
+        job->status = job->exact_result ? 0 : -1;
+    } else if (job->matrix->csr) {
+        Factorization *f = matrix_sparse_lu(job->matrix, &job->progress);
+        job->status = f ? 0 : -1;
+        if (f) job->sparse_det = factorization_determinant(f);
+        factorization_unref(f);
+    } else {
+        job->status = lu_cache_refresh(job->cache, job->matrix, &job->progress);
+    }
+    g_task_return_boolean(task, TRUE);
+}
+
+// Polled rather than pushed from the worker, so the label is redrawn a few
+// times a second however fast the elimination moves
+static gboolean on_determinant_progress(gpointer data) {
+    DeterminantJob *job = data;
+    if (job->input_data->det_job != job) return G_SOURCE_CONTINUE;
+    unsigned done = atomic_load(&job->progress.done), total = atomic_load(&job->progress.total);
+    char message[64];
+    snprintf(message, sizeof(message), "Calculating determinant... %u%%",
+             total ? (unsigned)((uint64_t)done * 100 / total) : 0);
+    gtk_label_set_text(GTK_LABEL(job->input_data->result_label), message);
+    return G_SOURCE_CONTINUE;
+}
+
+static void on_determinant_done(GObject *source, GAsyncResult *result, gpointer data) {
+    DeterminantJob *job = data;
+    MatrixInputData *input_data = job->input_data;
+    g_source_remove(job->progress_source);
+
+    // A job the editor has moved on from (another matrix was shown) ends quietly
+    if (input_data->det_job != job) {
+        determinant_job_free(job);
+        return;
+    }
+    input_data->det_job = NULL;
+    determinant_buttons_update(input_data);
+
+    GtkLabel *label = GTK_LABEL(input_data->result_label);
+    if (atomic_load(&job->progress.cancel)) {
+        gtk_label_set_text(label, "Determinant cancelled");
+    } else if (job->status != 0) {
+        gtk_label_set_text(label, "Failed to compute determinant");
+    } else if (!input_data->matrix || input_data->matrix->version != job->matrix->version) {
+        gtk_label_set_text(label, "Matrix changed during the calculation, determinant discarded");
+    } else if (job->exact) {
+        char *message = g_strdup_printf("Determinant: %s", job->exact_result);
+        gtk_label_set_text(label, message);
+        g_free(message);
+    } else if (job->matrix->csr) {
+        char message[100];
+        snprintf(message, sizeof(message), "Determinant: %.2f", job->sparse_det);
+        gtk_label_set_text(label, message);
+    } else {
+        LuCache *old = input_data->det_cache;
+        input_data->det_cache = job->cache;
+        job->cache = old;
+        char message[100];
+        snprintf(message, sizeof(message), "Determinant: %.2f",
+                 lu_cache_determinant(input_data->det_cache, input_data->matrix));
+        gtk_label_set_text(label, message);
+    }
+    factor_cache_label_update(input_data);
+    determinant_job_free(job);
+}
 
 static void on_determinant_clicked(GtkWidget *widget, gpointer data) {
     MatrixInputData *input_data = data;
@@ -398,16 +1234,10 @@ static void on_determinant_clicked(GtkWidget *widget, gpointer data) {
         g_print("Error: Invalid matrix or result label\n");
         return;
     }
+    if (input_data->det_job) return;
 
-    // Recalculate matrix values from current entries to ensure it's up to date
-    for (unsigned i = 0; i < input_data->rows; i++) {
-        for (unsigned j = 0; j < input_data->cols; j++) {
-            GtkEntry *entry = GTK_ENTRY(input_data->entries[i * input_data->cols + j]);
-            const char *text = gtk_editable_get_text(GTK_EDITABLE(entry));
-            int value = atoi(text);
-            set_element(input_data->matrix, i, j, value);
-        }
-    }
+    // Apply the edited cells; the rest of the matrix is already current
+    if (grid_sync(input_data) != 0) return;
 
     // Check if matrix is square for determinant calculation
     if (input_data->matrix->M != input_data->matrix->N) {
@@ -415,144 +1245,614 @@ static void on_determinant_clicked(GtkWidget *widget, gpointer data) {
         return;
     }
 
-    double det = determinant(input_data->matrix);
-    char message[100];
-    snprintf(message, sizeof(message), "Determinant: %.2f", det);
-    gtk_label_set_text(GTK_LABEL(input_data->result_label), message);
+    int exact = input_data->exact_check &&
+                gtk_check_button_get_active(GTK_CHECK_BUTTON(input_data->exact_check));
+
+    // Edits since the last determinant usually fold into the cached
+    // factorization, leaving nothing to run in the background
+    if (!exact && lu_cache_is_current(input_data->det_cache, input_data->matrix)) {
+        char message[100];
+        snprintf(message, sizeof(message), "Determinant: %.2f",
+                 lu_cache_determinant(input_data->det_cache, input_data->matrix));
+        gtk_label_set_text(GTK_LABEL(input_data->result_label), message);
+        return;
+    }
+
+    DeterminantJob *job = calloc(1, sizeof(DeterminantJob));
+    if (job) {
+        job->matrix = copy_matrix(input_data->matrix);
+        job->cache = exact ? NULL : lu_cache_new();
+    }
+    if (!job || !job->matrix || (!exact && !job->cache)) {
+        if (job) determinant_job_free(job);
+        gtk_label_set_text(GTK_LABEL(input_data->result_label), "Failed to compute determinant");
+        return;
+    }
+    job->input_data = input_data;
+    job->exact = exact;
+    input_data->det_job = job;
+    determinant_buttons_update(input_data);
+    gtk_label_set_text(GTK_LABEL(input_data->result_label), "Calculating determinant...");
+    job->progress_source = g_timeout_add(100, on_determinant_progress, job);
+
+    GTask *task = g_task_new(NULL, NULL, on_determinant_done, job);
+    g_task_set_task_data(task, job, NULL);
+    g_task_run_in_thread(task, determinant_job_run);
+    g_object_unref(task);
 }
 
-static void on_display_matrix_clicked(GtkWidget *widget, gpointer data) {
+// Stops the elimination at the next panel (or prime, for an exact result)
+static void on_cancel_clicked(GtkWidget *widget, gpointer data) {
     MatrixInputData *input_data = data;
-    
-    if (!input_data || !input_data->result_label || !GTK_IS_LABEL(input_data->result_label)) {
-        g_print("Error: Invalid result label or input data\n");
+    if (input_data->det_job) atomic_store(&input_data->det_job->progress.cancel, 1);
+}
+
+// Heatmap viewer
+//
+// Display Matrix opens the matrix as a heatmap in a window of its own,
+// drawn by matrix_heatmap_render() straight from the elements into an image
+// the size of the window, so showing a matrix costs the same whatever its
+// size. The viewer keeps its own handle on the elements shown, and Display
+// Matrix again brings it up to date. Until the min/max pyramid has been
+// built in the background, zoomed-out pixels show sampled elements. The
+// wheel zooms about the pointer and dragging pans; from HEATMAP_TEXT_SCALE
+// pixels per element on, the visible cells also show their values.
+#define HEATMAP_TEXT_SCALE 56.0     // pixels per element from which values are drawn
+#define HEATMAP_MAX_ZOOM 96.0       // most pixels per element
+
+typedef struct HeatmapView {
+    MatrixInputData *input_data;
+    Matrix *matrix;             // The elements shown
+    MatrixPyramid *pyramid;     // NULL until built for matrix
+    struct HeatmapJob *job;     // Pyramid being built, if any
+    GtkWidget *window;
+    GtkWidget *area;
+    GtkWidget *status_label;
+    cairo_surface_t *surface;   // The last frame, the size of area
+    double row, col, scale;     // Top-left corner and elements per pixel; scale 0 fits the matrix
+    double drag_row, drag_col;  // Top-left corner when the drag began
+    double pointer_x, pointer_y;
+    double range[2];            // Values the colours of the last frame span
+} HeatmapView;
+
+typedef struct HeatmapJob {
+    HeatmapView *view;          // NULL once the viewer has moved on
+    Matrix *matrix;
+    MatrixPyramid *pyramid;
+    MatrixProgress progress;
+} HeatmapJob;
+
+static void heatmap_job_run(GTask *task, gpointer source, gpointer data, GCancellable *cancellable) {
+    HeatmapJob *job = data;
+    job->pyramid = matrix_pyramid_build(job->matrix, &job->progress);
+    g_task_return_boolean(task, TRUE);
+}
+
+static void heatmap_job_detach(HeatmapView *view) {
+    if (!view->job) return;
+    view->job->view = NULL;
+    atomic_store(&view->job->progress.cancel, 1);
+    view->job = NULL;
+}
+
+static void heatmap_status_update(HeatmapView *view);
+
+static void on_heatmap_pyramid_done(GObject *source, GAsyncResult *result, gpointer data) {
+    HeatmapJob *job = data;
+    HeatmapView *view = job->view;
+    if (view && job->pyramid) {
+        view->job = NULL;
+        view->pyramid = job->pyramid;
+        job->pyramid = NULL;
+        gtk_widget_queue_draw(view->area);
+        heatmap_status_update(view);
+    } else if (view) {
+        view->job = NULL;
+    }
+    matrix_pyramid_free(job->pyramid);
+    free_matrix(job->matrix);
+    free(job);
+}
+
+// Build the pyramid of view->matrix in the background
+static void heatmap_start_pyramid(HeatmapView *view) {
+    HeatmapJob *job = calloc(1, sizeof(HeatmapJob));
+    if (job) job->matrix = copy_matrix(view->matrix);
+    if (!job || !job->matrix) {
+        free(job);
         return;
     }
-    
-    if (!input_data->matrix) {
-        gtk_label_set_text(GTK_LABEL(input_data->result_label), "No matrix to display");
+    job->view = view;
+    view->job = job;
+    GTask *task = g_task_new(NULL, NULL, on_heatmap_pyramid_done, job);
+    g_task_set_task_data(task, job, NULL);
+    g_task_run_in_thread(task, heatmap_job_run);
+    g_object_unref(task);
+}
+
+// Keep the zoom between fitting the whole matrix and HEATMAP_MAX_ZOOM, and
+// the matrix in view: centred along an axis it does not fill
+static void heatmap_clamp(HeatmapView *view, int width, int height) {
+    Matrix *matrix = view->matrix;
+    double fit = fmax((double)matrix->M / height, (double)matrix->N / width);
+    if (view->scale == 0) {
+        view->scale = fit;
+        view->row = view->col = 0;
+    }
+    view->scale = fmin(fmax(view->scale, 1 / HEATMAP_MAX_ZOOM), fmax(fit, 1 / HEATMAP_MAX_ZOOM));
+    double rows = height * view->scale, cols = width * view->scale;
+    view->row = rows >= matrix->M ? (matrix->M - rows) / 2 : fmin(fmax(view->row, 0), matrix->M - rows);
+    view->col = cols >= matrix->N ? (matrix->N - cols) / 2 : fmin(fmax(view->col, 0), matrix->N - cols);
+}
+
+static void heatmap_draw(GtkDrawingArea *area, cairo_t *cr, int width, int height, gpointer data) {
+    HeatmapView *view = data;
+    if (!view->matrix || width <= 0 || height <= 0) return;
+    if (!view->surface || cairo_image_surface_get_width(view->surface) != width ||
+        cairo_image_surface_get_height(view->surface) != height) {
+        if (view->surface) cairo_surface_destroy(view->surface);
+        view->surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, height);
+    }
+    heatmap_clamp(view, width, height);
+
+    MatrixTraceScope scope = matrix_trace_begin("ui.heatmap");
+    MatrixView frame = { view->row, view->col, view->scale, width, height };
+    cairo_surface_flush(view->surface);
+    uint32_t *pixels = (uint32_t *)cairo_image_surface_get_data(view->surface);
+    size_t stride = cairo_image_surface_get_stride(view->surface) / sizeof(uint32_t);
+    if (!pixels || matrix_heatmap_render(view->matrix, view->pyramid, &frame, pixels, stride,
+                                         view->range) != 0) {
+        matrix_trace_end(scope, 0, 0.0);
+        cairo_set_source_rgb(cr, 1, 1, 1);
+        cairo_paint(cr);
         return;
     }
+    cairo_surface_mark_dirty(view->surface);
+    cairo_set_source_surface(cr, view->surface, 0, 0);
+    cairo_paint(cr);
 
-    // UPDATE MATRIX VALUES FROM CURRENT ENTRIES
-    for (unsigned i = 0; i < input_data->rows; i++) {
-        for (unsigned j = 0; j < input_data->cols; j++) {
-            GtkEntry *entry = GTK_ENTRY(input_data->entries[i * input_data->cols + j]);
-            const char *text = gtk_editable_get_text(GTK_EDITABLE(entry));
-            int value = atoi(text);
-            set_element(input_data->matrix, i, j, value);
+    // Zoomed in far enough, the cells in view carry their values, in black
+    // or white whichever reads better on the cell
+    double cell = 1 / view->scale;
+    if (cell >= HEATMAP_TEXT_SCALE) {
+        Matrix *matrix = view->matrix;
+        cairo_select_font_face(cr, "monospace", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
+        cairo_set_font_size(cr, 12);
+        cairo_text_extents_t extents;
+        unsigned i0 = view->row > 0 ? (unsigned)view->row : 0;
+        unsigned j0 = view->col > 0 ? (unsigned)view->col : 0;
+        char text[32];
+        for (unsigned i = i0; i < matrix->M && (i - view->row) * cell < height; i++) {
+            double y = (i + 0.5 - view->row) * cell;
+            for (unsigned j = j0; j < matrix->N && (j - view->col) * cell < width; j++) {
+                double x = (j + 0.5 - view->col) * cell;
+                uint32_t p = pixels[(size_t)fmin(fmax(y, 0), height - 1) * stride +
+                                    (size_t)fmin(fmax(x, 0), width - 1)];
+                double luma = 0.299 * (p >> 16 & 0xff) + 0.587 * (p >> 8 & 0xff) + 0.114 * (p & 0xff);
+                matrix_format_element(matrix, i, j, text, sizeof(text));
+                cairo_text_extents(cr, text, &extents);
+                if (extents.x_advance > cell - 4) snprintf(text, sizeof(text), "%.4g", matrix_get(matrix, i, j));
+                cairo_text_extents(cr, text, &extents);
+                double gray = luma < 128 ? 1 : 0;
+                cairo_set_source_rgb(cr, gray, gray, gray);
+                cairo_move_to(cr, x - extents.x_advance / 2, y + 4);
+                cairo_show_text(cr, text);
+            }
         }
     }
+    matrix_trace_end(scope, (uint64_t)height * stride * sizeof(uint32_t), 0.0);
+    heatmap_status_update(view);
+}
 
-    GString *matrix_str = g_string_new("Matrix:\n");
-    for (unsigned i = 0; i < input_data->matrix->M; i++) {
-        for (unsigned j = 0; j < input_data->matrix->N; j++) {
-            g_string_append_printf(matrix_str, "%d ", input_data->matrix->data[i * input_data->matrix->N + j]);
-        }
-        g_string_append(matrix_str, "\n");
+// What is in view, the colour range and the element under the pointer
+static void heatmap_status_update(HeatmapView *view) {
+    Matrix *matrix = view->matrix;
+    if (!matrix || view->scale == 0) return;
+    int width = gtk_widget_get_width(view->area), height = gtk_widget_get_height(view->area);
+    double top = fmax(view->row, 0), left = fmax(view->col, 0);
+    double bottom = fmin(view->row + height * view->scale, matrix->M);
+    double right = fmin(view->col + width * view->scale, matrix->N);
+    GString *text = g_string_new(NULL);
+    g_string_printf(text, "Rows %u-%u of %u, columns %u-%u of %u, ",
+                    (unsigned)top + 1, (unsigned)ceil(bottom), matrix->M,
+                    (unsigned)left + 1, (unsigned)ceil(right), matrix->N);
+    if (view->scale >= 1) g_string_append_printf(text, "%.3g elements per pixel", view->scale);
+    else g_string_append_printf(text, "%.3g pixels per element", 1 / view->scale);
+    g_string_append_printf(text, "; colours span %.6g to %.6g", view->range[0], view->range[1]);
+    if (!view->pyramid)
+        g_string_append(text, view->job ? " in view, min/max pyramid in progress" : " in view");
+
+    double i = view->row + view->pointer_y * view->scale, j = view->col + view->pointer_x * view->scale;
+    if (i >= 0 && j >= 0 && i < matrix->M && j < matrix->N) {
+        char element[32];
+        matrix_format_element(matrix, (unsigned)i, (unsigned)j, element, sizeof(element));
+        g_string_append_printf(text, "\n(%u, %u) = %s", (unsigned)i + 1, (unsigned)j + 1, element);
     }
+    gtk_label_set_text(GTK_LABEL(view->status_label), text->str);
+    g_string_free(text, TRUE);
+}
 
-    gtk_label_set_text(GTK_LABEL(input_data->result_label), matrix_str->str);
-    g_string_free(matrix_str, TRUE);
+// Zoom about the pointer, a factor of 1.25 a wheel notch
+static gboolean on_heatmap_scroll(GtkEventControllerScroll *controller, double dx, double dy, gpointer data) {
+    HeatmapView *view = data;
+    if (view->scale == 0) return TRUE;
+    if (gtk_event_controller_scroll_get_unit(controller) == GDK_SCROLL_UNIT_SURFACE) dy /= 20;
+    double i = view->row + view->pointer_y * view->scale, j = view->col + view->pointer_x * view->scale;
+    view->scale *= pow(1.25, dy);
+    heatmap_clamp(view, gtk_widget_get_width(view->area), gtk_widget_get_height(view->area));
+    view->row = i - view->pointer_y * view->scale;
+    view->col = j - view->pointer_x * view->scale;
+    gtk_widget_queue_draw(view->area);
+    return TRUE;
 }
 
-static void on_calculate_clicked(GtkWidget *widget, gpointer data) {
+static void on_heatmap_motion(GtkEventControllerMotion *controller, double x, double y, gpointer data) {
+    HeatmapView *view = data;
+    view->pointer_x = x;
+    view->pointer_y = y;
+    heatmap_status_update(view);
+}
+
+static void on_heatmap_drag_begin(GtkGestureDrag *gesture, double x, double y, gpointer data) {
+    HeatmapView *view = data;
+    view->drag_row = view->row;
+    view->drag_col = view->col;
+}
+
+static void on_heatmap_drag_update(GtkGestureDrag *gesture, double dx, double dy, gpointer data) {
+    HeatmapView *view = data;
+    view->row = view->drag_row - dy * view->scale;
+    view->col = view->drag_col - dx * view->scale;
+    gtk_widget_queue_draw(view->area);
+}
+
+static void on_heatmap_destroy(GtkWidget *widget, gpointer data) {
+    HeatmapView *view = data;
+    heatmap_job_detach(view);
+    view->input_data->heatmap = NULL;
+    if (view->surface) cairo_surface_destroy(view->surface);
+    matrix_pyramid_free(view->pyramid);
+    free_matrix(view->matrix);
+    free(view);
+}
+
+static HeatmapView *heatmap_view_new(MatrixInputData *input_data) {
+    HeatmapView *view = calloc(1, sizeof(HeatmapView));
+    if (!view) return NULL;
+    view->input_data = input_data;
+
+    view->window = gtk_window_new();
+    gtk_window_set_default_size(GTK_WINDOW(view->window), 800, 600);
+    gtk_window_set_transient_for(GTK_WINDOW(view->window), input_data->input_window);
+    gtk_window_set_destroy_with_parent(GTK_WINDOW(view->window), TRUE);
+    g_signal_connect(view->window, "destroy", G_CALLBACK(on_heatmap_destroy), view);
+
+    GtkWidget *box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 5);
+    gtk_window_set_child(GTK_WINDOW(view->window), box);
+    view->area = gtk_drawing_area_new();
+    gtk_widget_set_hexpand(view->area, TRUE);
+    gtk_widget_set_vexpand(view->area, TRUE);
+    gtk_drawing_area_set_draw_func(GTK_DRAWING_AREA(view->area), heatmap_draw, view, NULL);
+    gtk_box_append(GTK_BOX(box), view->area);
+    view->status_label = gtk_label_new(NULL);
+    gtk_label_set_xalign(GTK_LABEL(view->status_label), 0);
+    gtk_box_append(GTK_BOX(box), view->status_label);
+
+    GtkEventController *scroll = gtk_event_controller_scroll_new(GTK_EVENT_CONTROLLER_SCROLL_VERTICAL);
+    g_signal_connect(scroll, "scroll", G_CALLBACK(on_heatmap_scroll), view);
+    gtk_widget_add_controller(view->area, scroll);
+    GtkEventController *motion = gtk_event_controller_motion_new();
+    g_signal_connect(motion, "motion", G_CALLBACK(on_heatmap_motion), view);
+    gtk_widget_add_controller(view->area, motion);
+    GtkGesture *drag = gtk_gesture_drag_new();
+    g_signal_connect(drag, "drag-begin", G_CALLBACK(on_heatmap_drag_begin), view);
+    g_signal_connect(drag, "drag-update", G_CALLBACK(on_heatmap_drag_update), view);
+    gtk_widget_add_controller(view->area, GTK_EVENT_CONTROLLER(drag));
+
+    input_data->heatmap = view;
+    return view;
+}
+
+// Show matrix in the viewer. Another shape starts over fitted to the window;
+// new elements of the same shape keep the zoom and position.
+static int heatmap_view_set_matrix(HeatmapView *view, Matrix *matrix) {
+    if (view->matrix && view->matrix->version == matrix->version &&
+        view->matrix->M == matrix->M && view->matrix->N == matrix->N)
+        return 0;
+    Matrix *handle = copy_matrix(matrix);
+    if (!handle) return -1;
+    if (!view->matrix || view->matrix->M != matrix->M || view->matrix->N != matrix->N)
+        view->scale = 0;
+    heatmap_job_detach(view);
+    matrix_pyramid_free(view->pyramid);
+    view->pyramid = NULL;
+    free_matrix(view->matrix);
+    view->matrix = handle;
+
+    char *title = g_strdup_printf("%s%s%u x %u %s", matrix->name, matrix->name[0] ? ": " : "",
+                                  matrix->M, matrix->N, matrix_type_name(matrix->type));
+    gtk_window_set_title(GTK_WINDOW(view->window), title);
+    g_free(title);
+    heatmap_start_pyramid(view);
+    gtk_widget_queue_draw(view->area);
+    return 0;
+}
+
+static void on_display_matrix_clicked(GtkWidget *widget, gpointer data) {
     MatrixInputData *input_data = data;
     
-    if (!GTK_IS_LABEL(input_data->result_label)) {
-        g_print("Error: Result label is invalid\n");
+    if (!input_data || !input_data->result_label || !GTK_IS_LABEL(input_data->result_label)) {
+        g_print("Error: Invalid result label or input data\n");
         return;
     }
     
-    const char *rows_text = gtk_editable_get_text(GTK_EDITABLE(input_data->rows_entry));
-    const char *cols_text = gtk_editable_get_text(GTK_EDITABLE(input_data->cols_entry));
-    
-    int rows = atoi(rows_text);
-    int cols = atoi(cols_text);
-    
-    if (rows <= 0 || cols <= 0) {
-        gtk_label_set_text(GTK_LABEL(input_data->result_label), "Invalid matrix dimensions");
+    if (!input_data->matrix) {
+        gtk_label_set_text(GTK_LABEL(input_data->result_label), "No matrix to display");
         return;
     }
 
-    if (input_data->entries) {
-        free(input_data->entries);
-        input_data->entries = NULL;
+    // Apply the edited cells; the rest of the matrix is already current
+    if (grid_sync(input_data) != 0) return;
+
+    HeatmapView *view = input_data->heatmap ? input_data->heatmap : heatmap_view_new(input_data);
+    if (!view || heatmap_view_set_matrix(view, input_data->matrix) != 0) {
+        if (view && !view->matrix) gtk_window_destroy(GTK_WINDOW(view->window));
+        gtk_label_set_text(GTK_LABEL(input_data->result_label), "Out of memory");
+        return;
     }
+    gtk_window_present(GTK_WINDOW(view->window));
+}
 
-    // Clear previous matrix container content
-    GtkWidget *child;
-    while ((child = gtk_widget_get_first_child(input_data->matrix_container))) {
-        gtk_box_remove(GTK_BOX(input_data->matrix_container), child);
+#define DISPLAY_MAX 20
+
+// Solve, inverse, rank and RREF of the edited matrix, computed on a worker
+// thread through the factorization cache
+enum { ANALYSIS_SOLVE, ANALYSIS_INVERSE, ANALYSIS_RANK, ANALYSIS_RREF };
+
+typedef struct {
+    MatrixInputData *input_data;
+    int op;
+    Matrix *matrix;
+    Matrix *rhs;            // ANALYSIS_SOLVE only
+    double *result;         // rows x cols, NULL for a rank
+    unsigned rows, cols;
+    int rank;
+    char error[512];
+} AnalysisJob;
+
+static void analysis_job_run(GTask *task, gpointer source, gpointer data, GCancellable *cancellable) {
+    AnalysisJob *job = data;
+    Matrix *matrix = job->matrix;
+    unsigned rank = 0;
+    switch (job->op) {
+    case ANALYSIS_SOLVE:
+        job->result = matrix_solve(matrix, job->rhs);
+        job->rows = matrix->N;
+        job->cols = job->rhs->N;
+        break;
+    case ANALYSIS_INVERSE:
+        job->result = matrix_inverse(matrix);
+        job->rows = job->cols = matrix->N;
+        break;
+    case ANALYSIS_RANK:
+        job->rank = matrix_rank(matrix);
+        break;
+    case ANALYSIS_RREF:
+        job->result = matrix_rref(matrix, &rank);
+        job->rank = job->result ? (int)rank : -1;
+        job->rows = matrix->M;
+        job->cols = matrix->N;
+        break;
     }
+    if (job->op == ANALYSIS_RANK ? job->rank < 0 : !job->result)
+        snprintf(job->error, sizeof(job->error), "%s", matrix_last_error());
+    g_task_return_boolean(task, TRUE);
+}
 
-    GtkWidget *grid = gtk_grid_new();
-    gtk_box_append(GTK_BOX(input_data->matrix_container), grid);
+static void analysis_job_free(AnalysisJob *job) {
+    free_matrix(job->matrix);
+    if (job->rhs) free_matrix(job->rhs);
+    free(job->result);
+    free(job);
+}
 
-    input_data->entries = malloc(rows * cols * sizeof(GtkWidget*));
-    input_data->rows = rows;
-    input_data->cols = cols;
+static void on_analysis_done(GObject *source, GAsyncResult *result, gpointer data) {
+    AnalysisJob *job = data;
+    MatrixInputData *input_data = job->input_data;
+    GtkLabel *label = GTK_LABEL(input_data->result_label);
+    static const char *titles[] = { "Solution", "Inverse", "Rank", "Reduced row echelon form" };
 
-    for (unsigned i = 0; i < rows; i++) {
-        for (unsigned j = 0; j < cols; j++) {
-            GtkWidget *entry = gtk_entry_new();
-            gtk_editable_set_text(GTK_EDITABLE(entry), "0");
-            gtk_grid_attach(GTK_GRID(grid), entry, j, i, 1, 1);
-            input_data->entries[i * cols + j] = entry;
+    GString *text = g_string_new(NULL);
+    if (job->error[0]) {
+        g_string_printf(text, "%s failed: %s", titles[job->op], job->error);
+    } else if (!input_data->matrix || input_data->matrix->version != job->matrix->version) {
+        g_string_assign(text, "Matrix changed during the calculation, result discarded");
+    } else if (job->op == ANALYSIS_RANK) {
+        g_string_printf(text, "Rank: %d", job->rank);
+    } else {
+        // Large results are shown by their top-left corner only
+        g_string_printf(text, "%s", titles[job->op]);
+        if (job->op == ANALYSIS_RREF) g_string_append_printf(text, " (rank %d)", job->rank);
+        g_string_append(text, ":\n");
+        unsigned rows = job->rows < DISPLAY_MAX ? job->rows : DISPLAY_MAX;
+        unsigned cols = job->cols < DISPLAY_MAX ? job->cols : DISPLAY_MAX;
+        for (unsigned i = 0; i < rows; i++) {
+            for (unsigned j = 0; j < cols; j++)
+                g_string_append_printf(text, "%.4g ", job->result[(size_t)i * job->cols + j]);
+            g_string_append(text, cols < job->cols ? "...\n" : "\n");
         }
+        if (rows < job->rows || cols < job->cols)
+            g_string_append_printf(text, "(first %u x %u of %u x %u)", rows, cols, job->rows, job->cols);
     }
+    gtk_label_set_text(label, text->str);
+    g_string_free(text, TRUE);
+    factor_cache_label_update(input_data);
+    analysis_job_free(job);
+}
+
+static void start_analysis(MatrixInputData *input_data, int op) {
+    GtkLabel *label = GTK_LABEL(input_data->result_label);
+    if (!input_data->matrix) return;
 
-    // Create a new matrix or use existing one with new dimensions
-    if (input_data->matrix) {
-        free(input_data->matrix->data);
-        free(input_data->matrix);
+    // Apply the edited cells; the rest of the matrix is already current
+    if (grid_sync(input_data) != 0) return;
+
+    AnalysisJob *job = calloc(1, sizeof(AnalysisJob));
+    if (job) job->matrix = copy_matrix(input_data->matrix);
+    if (!job || !job->matrix) {
+        free(job);
+        gtk_label_set_text(label, "Out of memory");
+        return;
     }
-    
-    Matrix *matrix = create_matrix(rows, cols);
-    
-    if (!matrix) {
-        gtk_label_set_text(GTK_LABEL(input_data->result_label), "Failed to create matrix");
+    job->input_data = input_data;
+    job->op = op;
+    if (op == ANALYSIS_SOLVE && !(job->rhs = selected_saved_matrix(input_data->solve_combo))) {
+        gtk_label_set_text(label, "Please select a saved right-hand side");
+        analysis_job_free(job);
         return;
     }
 
-    for (unsigned i = 0; i < rows; i++) {
-        for (unsigned j = 0; j < cols; j++) {
-            GtkEntry *entry = GTK_ENTRY(input_data->entries[i * cols + j]);
-            const char *text = gtk_editable_get_text(GTK_EDITABLE(entry));
-            int value = atoi(text);
-            set_element(matrix, i, j, value);
-        }
-    }
+    gtk_label_set_text(label, "Calculating...");
+    GTask *task = g_task_new(NULL, NULL, on_analysis_done, job);
+    g_task_set_task_data(task, job, NULL);
+    g_task_run_in_thread(task, analysis_job_run);
+    g_object_unref(task);
+}
+
+static void on_solve_clicked(GtkWidget *widget, gpointer data) {
+    start_analysis(data, ANALYSIS_SOLVE);
+}
+
+static void on_inverse_clicked(GtkWidget *widget, gpointer data) {
+    start_analysis(data, ANALYSIS_INVERSE);
+}
+
+static void on_rank_clicked(GtkWidget *widget, gpointer data) {
+    start_analysis(data, ANALYSIS_RANK);
+}
+
+static void on_rref_clicked(GtkWidget *widget, gpointer data) {
+    start_analysis(data, ANALYSIS_RREF);
+}
 
+// Replace the edited matrix, taking ownership of matrix, and rebuild the
+// editor and its buttons around it
+static void show_matrix(MatrixInputData *input_data, Matrix *matrix) {
+    MatrixTraceScope scope = matrix_trace_begin("ui.show");
+    if (input_data->det_job) {
+        atomic_store(&input_data->det_job->progress.cancel, 1);
+        input_data->det_job = NULL;
+    }
+    if (input_data->grid_area) grid_commit_edit(input_data);
+    cell_edits_clear(&input_data->edits);
+    if (input_data->matrix) free_matrix(input_data->matrix);
     input_data->matrix = matrix;
+    input_data->editing = FALSE;
+
+    // Clear previous matrix container content
+    GtkWidget *child;
+    while ((child = gtk_widget_get_first_child(input_data->matrix_container))) {
+        gtk_box_remove(GTK_BOX(input_data->matrix_container), child);
+    }
+
+    gtk_box_append(GTK_BOX(input_data->matrix_container), grid_view_new(input_data));
+
+    GtkWidget *button_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+    gtk_box_append(GTK_BOX(input_data->matrix_container), button_box);
 
     // Create Display Matrix button
     input_data->display_btn = gtk_button_new_with_label("Display Matrix");
-    gtk_grid_attach(GTK_GRID(grid), input_data->display_btn, 0, rows, cols/2, 1);
+    gtk_box_append(GTK_BOX(button_box), input_data->display_btn);
     g_signal_connect(input_data->display_btn, "clicked", G_CALLBACK(on_display_matrix_clicked), input_data);
 
     // Create Determinant button only for square matrices
-    if (rows == cols) {
+    input_data->determinant_btn = NULL;
+    input_data->cancel_btn = NULL;
+    input_data->exact_check = NULL;
+    if (matrix->M == matrix->N) {
         input_data->determinant_btn = gtk_button_new_with_label("Calculate Determinant");
-        gtk_grid_attach(GTK_GRID(grid), input_data->determinant_btn, cols/2, rows, cols/2, 1);
+        gtk_box_append(GTK_BOX(button_box), input_data->determinant_btn);
         g_signal_connect(input_data->determinant_btn, "clicked", G_CALLBACK(on_determinant_clicked), input_data);
+
+        // Exact integer result instead of the floating point one
+        input_data->exact_check = gtk_check_button_new_with_label("Exact");
+        gtk_box_append(GTK_BOX(button_box), input_data->exact_check);
+
+        input_data->cancel_btn = gtk_button_new_with_label("Cancel");
+        gtk_box_append(GTK_BOX(button_box), input_data->cancel_btn);
+        g_signal_connect(input_data->cancel_btn, "clicked", G_CALLBACK(on_cancel_clicked), input_data);
+        determinant_buttons_update(input_data);
+    }
+
+    // Factorization-based queries, second row
+    GtkWidget *analysis_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+    gtk_box_append(GTK_BOX(input_data->matrix_container), analysis_box);
+    GtkWidget *rank_btn = gtk_button_new_with_label("Rank");
+    g_signal_connect(rank_btn, "clicked", G_CALLBACK(on_rank_clicked), input_data);
+    gtk_box_append(GTK_BOX(analysis_box), rank_btn);
+    GtkWidget *rref_btn = gtk_button_new_with_label("RREF");
+    g_signal_connect(rref_btn, "clicked", G_CALLBACK(on_rref_clicked), input_data);
+    gtk_box_append(GTK_BOX(analysis_box), rref_btn);
+    input_data->solve_combo = NULL;
+    if (matrix->M == matrix->N) {
+        GtkWidget *inverse_btn = gtk_button_new_with_label("Inverse");
+        g_signal_connect(inverse_btn, "clicked", G_CALLBACK(on_inverse_clicked), input_data);
+        gtk_box_append(GTK_BOX(analysis_box), inverse_btn);
+
+        gtk_box_append(GTK_BOX(analysis_box), gtk_label_new("Solve for right-hand side:"));
+        GListModel *saved = gtk_drop_down_get_model(GTK_DROP_DOWN(input_data->load_combo));
+        input_data->solve_combo = gtk_drop_down_new(g_object_ref(saved), NULL);
+        gtk_box_append(GTK_BOX(analysis_box), input_data->solve_combo);
+        GtkWidget *solve_btn = gtk_button_new_with_label("Solve");
+        g_signal_connect(solve_btn, "clicked", G_CALLBACK(on_solve_clicked), input_data);
+        gtk_box_append(GTK_BOX(analysis_box), solve_btn);
     }
     
     // Add saving controls - second row below matrix
     GtkWidget *save_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
-    gtk_grid_attach(GTK_GRID(grid), save_box, 0, rows+1, cols, 1);
+    gtk_box_append(GTK_BOX(input_data->matrix_container), save_box);
     
     GtkWidget *name_label = gtk_label_new("Matrix Name:");
     gtk_box_append(GTK_BOX(save_box), name_label);
     
     input_data->matrix_name_entry = gtk_entry_new();
-    gtk_entry_set_max_length(GTK_ENTRY(input_data->matrix_name_entry), 9);
     gtk_entry_set_placeholder_text(GTK_ENTRY(input_data->matrix_name_entry), "A, B, C, etc.");
     gtk_box_append(GTK_BOX(save_box), input_data->matrix_name_entry);
     
     input_data->save_btn = gtk_button_new_with_label("Save Matrix");
     g_signal_connect(input_data->save_btn, "clicked", G_CALLBACK(on_save_matrix_clicked), input_data);
     gtk_box_append(GTK_BOX(save_box), input_data->save_btn);
+    matrix_trace_end(scope, 0, 0.0);
+}
+
+static void on_calculate_clicked(GtkWidget *widget, gpointer data) {
+    MatrixInputData *input_data = data;
+    
+    if (!GTK_IS_LABEL(input_data->result_label)) {
+        g_print("Error: Result label is invalid\n");
+        return;
+    }
+    
+    const char *rows_text = gtk_editable_get_text(GTK_EDITABLE(input_data->rows_entry));
+    const char *cols_text = gtk_editable_get_text(GTK_EDITABLE(input_data->cols_entry));
+    
+    int rows = atoi(rows_text);
+    int cols = atoi(cols_text);
+    
+    if (rows <= 0 || cols <= 0) {
+        gtk_label_set_text(GTK_LABEL(input_data->result_label), "Invalid matrix dimensions");
+        return;
+    }
+
+    // A new matrix starts out all zeros, so a large int32 one starts sparse
+    MatrixType type = (MatrixType)gtk_drop_down_get_selected(GTK_DROP_DOWN(input_data->type_combo));
+    Matrix *matrix = type == MATRIX_INT32 && prefers_sparse(rows, cols, 0) ?
+                     create_sparse_matrix(rows, cols) : create_matrix_typed(rows, cols, type);
+    if (!matrix) {
+        gtk_label_set_text(GTK_LABEL(input_data->result_label), "Failed to create matrix");
+        return;
+    }
+    show_matrix(input_data, matrix);
 }
 
 static void apply_css(GtkWidget *widget) {
@@ -588,14 +1888,26 @@ static void activate(GtkApplication *app, gpointer user_data) {
     MatrixInputData *input_data = malloc(sizeof(MatrixInputData));
     memset(input_data, 0, sizeof(MatrixInputData));
     input_data->input_window = GTK_WINDOW(window);
+    input_data->det_cache = lu_cache_new();
     
-    GtkWidget *file_save_btn = gtk_button_new_with_label("Save Matrices to File");
-    g_signal_connect(file_save_btn, "clicked", G_CALLBACK(on_file_save_clicked), window);
-    gtk_box_append(GTK_BOX(menu_bar), file_save_btn);
+    input_data->file_save_btn = gtk_button_new_with_label("Save Matrices to File");
+    g_signal_connect(input_data->file_save_btn, "clicked", G_CALLBACK(on_file_save_clicked), input_data);
+    gtk_box_append(GTK_BOX(menu_bar), input_data->file_save_btn);
     
-    GtkWidget *file_load_btn = gtk_button_new_with_label("Load Matrices from File");
-    g_signal_connect(file_load_btn, "clicked", G_CALLBACK(on_file_load_clicked), input_data);
-    gtk_box_append(GTK_BOX(menu_bar), file_load_btn);
+    input_data->file_load_btn = gtk_button_new_with_label("Load Matrices from File");
+    g_signal_connect(input_data->file_load_btn, "clicked", G_CALLBACK(on_file_load_clicked), input_data);
+    gtk_box_append(GTK_BOX(menu_bar), input_data->file_load_btn);
+
+    // Progress of a file load or save, shown while one runs
+    input_data->file_progress = gtk_progress_bar_new();
+    gtk_progress_bar_set_show_text(GTK_PROGRESS_BAR(input_data->file_progress), TRUE);
+    gtk_widget_set_hexpand(input_data->file_progress, TRUE);
+    gtk_widget_set_valign(input_data->file_progress, GTK_ALIGN_CENTER);
+    gtk_box_append(GTK_BOX(menu_bar), input_data->file_progress);
+    input_data->file_cancel_btn = gtk_button_new_with_label("Cancel");
+    g_signal_connect(input_data->file_cancel_btn, "clicked", G_CALLBACK(on_file_cancel_clicked), input_data);
+    gtk_box_append(GTK_BOX(menu_bar), input_data->file_cancel_btn);
+    file_buttons_update(input_data);
     
     // Matrix selection area
     GtkWidget *load_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
@@ -612,6 +1924,43 @@ static void activate(GtkApplication *app, gpointer user_data) {
     GtkWidget *load_btn = gtk_button_new_with_label("Load");
     g_signal_connect(load_btn, "clicked", G_CALLBACK(on_load_matrix_clicked), input_data);
     gtk_box_append(GTK_BOX(load_box), load_btn);
+
+    GtkWidget *delete_btn = gtk_button_new_with_label("Delete");
+    g_signal_connect(delete_btn, "clicked", G_CALLBACK(on_delete_matrix_clicked), input_data);
+    gtk_box_append(GTK_BOX(load_box), delete_btn);
+
+    // Matrices replayed from the journal at startup
+    update_saved_matrices_combo(GTK_DROP_DOWN(input_data->load_combo));
+
+    // Product of two saved matrices, saved under a new name
+    GtkWidget *multiply_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+    gtk_box_append(GTK_BOX(main_box), multiply_box);
+    gtk_box_append(GTK_BOX(multiply_box), gtk_label_new("Multiply:"));
+    input_data->multiply_left_combo = gtk_drop_down_new(G_LIST_MODEL(g_object_ref(list)), NULL);
+    gtk_box_append(GTK_BOX(multiply_box), input_data->multiply_left_combo);
+    gtk_box_append(GTK_BOX(multiply_box), gtk_label_new("x"));
+    input_data->multiply_right_combo = gtk_drop_down_new(G_LIST_MODEL(g_object_ref(list)), NULL);
+    gtk_box_append(GTK_BOX(multiply_box), input_data->multiply_right_combo);
+    gtk_box_append(GTK_BOX(multiply_box), gtk_label_new("="));
+    input_data->multiply_name_entry = gtk_entry_new();
+    gtk_entry_set_placeholder_text(GTK_ENTRY(input_data->multiply_name_entry), "Product name");
+    gtk_box_append(GTK_BOX(multiply_box), input_data->multiply_name_entry);
+    GtkWidget *multiply_btn = gtk_button_new_with_label("Multiply");
+    g_signal_connect(multiply_btn, "clicked", G_CALLBACK(on_multiply_clicked), input_data);
+    gtk_box_append(GTK_BOX(multiply_box), multiply_btn);
+
+    // Expressions over saved matrices, e.g. "D = A*B + 2*C^T" or "det(A - B)"
+    GtkWidget *expression_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+    gtk_box_append(GTK_BOX(main_box), expression_box);
+    gtk_box_append(GTK_BOX(expression_box), gtk_label_new("Expression:"));
+    input_data->expression_entry = gtk_entry_new();
+    gtk_entry_set_placeholder_text(GTK_ENTRY(input_data->expression_entry), "D = A*B + 2*C^T");
+    gtk_widget_set_hexpand(input_data->expression_entry, TRUE);
+    g_signal_connect(input_data->expression_entry, "activate", G_CALLBACK(on_evaluate_clicked), input_data);
+    gtk_box_append(GTK_BOX(expression_box), input_data->expression_entry);
+    GtkWidget *evaluate_btn = gtk_button_new_with_label("Evaluate");
+    g_signal_connect(evaluate_btn, "clicked", G_CALLBACK(on_evaluate_clicked), input_data);
+    gtk_box_append(GTK_BOX(expression_box), evaluate_btn);
     
     // Matrix input controls
     GtkWidget *input_box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 10);
@@ -633,6 +1982,14 @@ static void activate(GtkApplication *app, gpointer user_data) {
     gtk_box_append(GTK_BOX(cols_box), input_data->cols_entry);
     gtk_box_append(GTK_BOX(input_box), cols_box);
 
+    GtkWidget *type_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 10);
+    const char *type_names[MATRIX_TYPE_COUNT + 1] = { NULL };
+    for (int t = 0; t < MATRIX_TYPE_COUNT; t++) type_names[t] = matrix_type_name((MatrixType)t);
+    input_data->type_combo = gtk_drop_down_new_from_strings(type_names);
+    gtk_box_append(GTK_BOX(type_box), gtk_label_new("Elements:"));
+    gtk_box_append(GTK_BOX(type_box), input_data->type_combo);
+    gtk_box_append(GTK_BOX(input_box), type_box);
+
     GtkWidget *generate_btn = gtk_button_new_with_label("Generate Matrix Input");
     g_signal_connect(generate_btn, "clicked", G_CALLBACK(on_calculate_clicked), input_data);
     gtk_box_append(GTK_BOX(input_box), generate_btn);
@@ -641,23 +1998,299 @@ static void activate(GtkApplication *app, gpointer user_data) {
     gtk_box_append(GTK_BOX(main_box), result_label);
     input_data->result_label = result_label;
 
-    // Create a scrollable container for the matrix input grid
-    GtkWidget *scroll_window = gtk_scrolled_window_new();
-    gtk_scrolled_window_set_min_content_height(GTK_SCROLLED_WINDOW(scroll_window), 300);
-    gtk_box_append(GTK_BOX(main_box), scroll_window);
-    
-    // Create a container for the matrix input grid
+    input_data->cache_label = gtk_label_new(NULL);
+    gtk_box_append(GTK_BOX(main_box), input_data->cache_label);
+    factor_cache_label_update(input_data);
+
+    input_data->last_op_label = gtk_label_new("Last op: none yet");
+    gtk_box_append(GTK_BOX(main_box), input_data->last_op_label);
+    g_timeout_add(250, on_last_op_tick, input_data);
+
+    // Create a container for the matrix view, which scrolls by itself
     GtkWidget *matrix_container = gtk_box_new(GTK_ORIENTATION_VERTICAL, 5);
-    gtk_scrolled_window_set_child(GTK_SCROLLED_WINDOW(scroll_window), matrix_container);
+    gtk_widget_set_vexpand(matrix_container, TRUE);
+    gtk_widget_set_size_request(matrix_container, -1, 300);
+    gtk_box_append(GTK_BOX(main_box), matrix_container);
     input_data->matrix_container = matrix_container;
 
     gtk_window_present(GTK_WINDOW(window));
 }
 
+#endif
+
+// Headless batch mode
+//
+// mat --batch FILE [--op det|det-exact] [--threads N] streams every matrix
+// of a save_matrices_to_file file through one operation and prints one JSON
+// object per matrix to stdout. A .matbatch file of small matrices goes
+// through the batched kernels instead; with --out RESULTS its determinants
+// are written there as raw float64s and only a summary is printed. GTK is
+// never initialized on this path.
+static void json_write_string(FILE *out, const char *s) {
+    fputc('"', out);
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') fprintf(out, "\\%c", c);
+        else if (c < 0x20) fprintf(out, "\\u%04x", c);
+        else fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+static void json_write_double(FILE *out, double value) {
+    if (isfinite(value)) fprintf(out, "%.17g", value);
+    else fputs("null", out);
+}
+
+static void batch_usage(void) {
+    fprintf(stderr, "Usage: mat [--trace TRACE.json] --batch FILE [--op det|det-exact] [--threads N] [--out RESULTS]\n"
+                    "       mat --batch FILE.mattile [--memory MB] [--threads N]\n");
+}
+
+static void batch_process(int index, Matrix *matrix, const char *op, int exact) {
+    fprintf(stdout, "{\"index\":%d,\"name\":", index);
+    json_write_string(stdout, matrix->name);
+    fprintf(stdout, ",\"rows\":%u,\"cols\":%u,\"op\":\"%s\",", matrix->M, matrix->N, op);
+
+    if (matrix->M != matrix->N) {
+        fputs("\"error\":\"not square\"}\n", stdout);
+    } else if (exact) {
+        double t0 = now_seconds();
+        char *det = determinant_exact(matrix, NULL);
+        double ms = (now_seconds() - t0) * 1e3;
+        if (det) {
+            fprintf(stdout, "\"result\":\"%s\",\"ms\":%.3f}\n", det, ms);
+        } else {
+            fputs("\"error\":", stdout);
+            json_write_string(stdout, matrix_last_error());
+            fputs("}\n", stdout);
+        }
+        free(det);
+    } else {
+        double t0 = now_seconds();
+        double det = determinant(matrix);
+        double ms = (now_seconds() - t0) * 1e3;
+        fputs("\"result\":", stdout);
+        json_write_double(stdout, det);
+        fprintf(stdout, ",\"ms\":%.3f}\n", ms);
+    }
+    fflush(stdout);
+}
+
+// Determinants of every matrix in a .matbatch file
+static int run_batch_file(const char *path, const char *out_path) {
+    MatrixBatch batch;
+    if (matrix_batch_open(path, &batch) != 0) {
+        fprintf(stderr, "mat: %s\n", matrix_last_error());
+        return 1;
+    }
+    double *dets = malloc(batch.count * sizeof(double));
+    if (!dets && batch.count) {
+        fprintf(stderr, "mat: out of memory\n");
+        matrix_batch_close(&batch);
+        return 1;
+    }
+
+    double t0 = now_seconds();
+    matrix_det_batch(batch.n, batch.count, batch.elements, batch.stride, dets);
+    double ms = (now_seconds() - t0) * 1e3;
+
+    int status = 0;
+    if (out_path) {
+        FILE *out = fopen(out_path, "wb");
+        if (!out || fwrite(dets, sizeof(double), batch.count, out) != batch.count) status = 1;
+        if (out && fclose(out) != 0) status = 1;
+        if (status) {
+            fprintf(stderr, "mat: %s: cannot write results\n", out_path);
+        } else {
+            fprintf(stdout, "{\"rows\":%u,\"cols\":%u,\"count\":%zu,\"op\":\"det\",\"out\":",
+                    batch.n, batch.n, batch.count);
+            json_write_string(stdout, out_path);
+            fprintf(stdout, ",\"ms\":%.3f}\n", ms);
+        }
+    } else {
+        for (size_t k = 0; k < batch.count; k++) {
+            fprintf(stdout, "{\"index\":%zu,\"rows\":%u,\"cols\":%u,\"op\":\"det\",\"result\":",
+                    k, batch.n, batch.n);
+            json_write_double(stdout, dets[k]);
+            fputs("}\n", stdout);
+        }
+    }
+    fflush(stdout);
+    free(dets);
+    matrix_batch_close(&batch);
+    return status;
+}
+
+// Determinant of a .mattile file through the out-of-core LU, holding at
+// most memory_mb megabytes (0: half the physical memory)
+static int run_tiled_file(const char *path, unsigned memory_mb) {
+    MatrixTiled tiled;
+    if (matrix_tiled_open(path, &tiled) != 0) {
+        fprintf(stderr, "mat: %s\n", matrix_last_error());
+        return 1;
+    }
+    MatrixLogDet det;
+    double t0 = now_seconds();
+    int status = matrix_tiled_det(&tiled, (size_t)memory_mb << 20, NULL, &det);
+    double ms = (now_seconds() - t0) * 1e3;
+    if (status != 0) {
+        fprintf(stderr, "mat: %s\n", matrix_last_error());
+    } else {
+        fprintf(stdout, "{\"index\":0,\"rows\":%u,\"cols\":%u,\"op\":\"det\",\"result\":",
+                tiled.rows, tiled.cols);
+        json_write_double(stdout, det.sign * exp(det.log_abs));
+        fprintf(stdout, ",\"sign\":%d,\"log_abs\":", det.sign);
+        json_write_double(stdout, det.log_abs);
+        fprintf(stdout, ",\"ms\":%.3f}\n", ms);
+        fflush(stdout);
+    }
+    matrix_tiled_close(&tiled);
+    return status != 0;
+}
+
+static int run_batch(int argc, char **argv) {
+    const char *path = NULL, *op = "det", *out_path = NULL;
+    unsigned threads = 0, memory_mb = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            path = argv[++i];
+        } else if (strcmp(argv[i], "--op") == 0 && i + 1 < argc) {
+            op = argv[++i];
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = (unsigned)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+            out_path = argv[++i];
+        } else if (strcmp(argv[i], "--memory") == 0 && i + 1 < argc) {
+            memory_mb = (unsigned)atoi(argv[++i]);
+        } else {
+            batch_usage();
+            return 2;
+        }
+    }
+    int exact = strcmp(op, "det-exact") == 0;
+    if (!path || (!exact && strcmp(op, "det") != 0)) {
+        batch_usage();
+        return 2;
+    }
+
+    if (threads > 0) matrix_set_num_threads(threads);
+
+    if (is_matrix_batch_file(path)) {
+        if (exact) {
+            fprintf(stderr, "mat: %s: batch files support --op det only\n", path);
+            return 2;
+        }
+        return run_batch_file(path, out_path);
+    }
+    if (out_path) {
+        batch_usage();
+        return 2;
+    }
+    if (is_matrix_tiled_file(path)) {
+        if (exact) {
+            fprintf(stderr, "mat: %s: tiled matrices support --op det only\n", path);
+            return 2;
+        }
+        return run_tiled_file(path, memory_mb);
+    }
+
+    if (is_matrix_store_file(path)) {
+        MatrixStore store;
+        if (matrix_store_open(path, &store) != 0) {
+            fprintf(stderr, "mat: %s is not a valid matrix store\n", path);
+            return 1;
+        }
+        int status = 0;
+        for (uint64_t i = 0; i < store.count; i++) {
+            Matrix *matrix = matrix_store_get(&store, i);
+            if (!matrix) {
+                fprintf(stderr, "mat: %s: matrix %llu is corrupt\n", path, (unsigned long long)i + 1);
+                status = 1;
+                continue;
+            }
+            batch_process((int)i, matrix, op, exact);
+            free_matrix(matrix);
+        }
+        matrix_store_close(&store);
+        return status;
+    }
+
+    TextReader reader;
+    if (text_reader_open(&reader, path) != 0) {
+        fprintf(stderr, "mat: %s\n", matrix_last_error());
+        return 1;
+    }
+
+    int status = 0;
+    if (has_suffix(path, ".csv")) {
+        Matrix *matrix = text_read_csv(&reader);
+        if (matrix) batch_process(0, matrix, op, exact);
+        else status = 1;
+        free_matrix(matrix);
+    } else {
+        int count = 0;
+        status = text_read_count(&reader, &count) != 0;
+        for (int index = 0; !status && index < count; index++) {
+            Matrix *matrix = text_read_matrix(&reader);
+            if (!matrix) {
+                status = 1;
+                break;
+            }
+            batch_process(index, matrix, op, exact);
+            free_matrix(matrix);
+        }
+    }
+    text_reader_close(&reader);
+
+    if (status) fprintf(stderr, "mat: %s\n", matrix_last_error());
+    return status;
+}
+
+static void trace_stop_at_exit(void) {
+    matrix_trace_stop();
+}
+
 int main(int argc, char **argv) {
+    // --trace FILE (or MAT_TRACE=FILE) records timing scopes for the whole
+    // run; it is taken out before anything else sees the arguments
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            if (matrix_trace_start(argv[i + 1]) == 0) atexit(trace_stop_at_exit);
+            memmove(&argv[i], &argv[i + 2], (argc - i - 1) * sizeof(char *));
+            argc -= 2;
+            break;
+        }
+    }
+
+    for (int i = 1; i < argc; i++)
+        if (strcmp(argv[i], "--batch") == 0)
+            return run_batch(argc, argv);
+
+#ifdef MATRIX_GUI
+    // --journal FILE (or MAT_JOURNAL=FILE) keeps the saved matrices in a
+    // write-ahead journal, replayed here into the registry
+    const char *journal_path = getenv("MAT_JOURNAL");
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--journal") == 0 && i + 1 < argc) {
+            journal_path = argv[i + 1];
+            memmove(&argv[i], &argv[i + 2], (argc - i - 1) * sizeof(char *));
+            argc -= 2;
+            break;
+        }
+    }
+    if (journal_path && journal_path[0] && matrix_journal_open(journal_path) != 0)
+        fprintf(stderr, "mat: %s\n", matrix_last_error());
+
     GtkApplication *app = gtk_application_new("org.example.matrix", G_APPLICATION_DEFAULT_FLAGS);
     g_signal_connect(app, "activate", G_CALLBACK(activate), NULL);
     int status = g_application_run(G_APPLICATION(app), argc, argv);
     g_object_unref(app);
+    matrix_journal_close();
     return status;
-}
\ No newline at end of file
+#else
+    fprintf(stderr, "mat was built without GTK; only batch mode is available\n");
+    batch_usage();
+    return 2;
+#endif
+}
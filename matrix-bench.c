@@ -0,0 +1,1378 @@
+/*
+matrix-bench: benchmarks for libmatrix
+
+Run without a subcommand, it times the regression suite (determinant, text,
+binary and compressed save/load, registry and batched small determinant
+operations over several sizes and thread counts), prints one JSON object
+per result and, given --baseline, flags every result that got slower than
+the stored one. The subcommands run the detailed benchmarks of individual
+kernels and print tables.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "matrix.h"
+#include "matrix-internal.h"
+
+// The original row-by-row elimination, kept as the benchmark baseline
+static double determinant_reference(const double *src, unsigned n, double *data) {
+    memcpy(data, src, (size_t)n * n * sizeof(double));
+    int sign = 1;
+    for (unsigned k = 0; k < n; k++) {
+        unsigned max_row = k;
+        for (unsigned i = k + 1; i < n; i++)
+            if (fabs(data[(size_t)i*n +k]) > fabs(data[(size_t)max_row*n +k]))
+                max_row = i;
+        if (max_row != k) {
+            for (unsigned j = 0; j < n; j++) {
+                double tmp = data[(size_t)k*n +j];
+                data[(size_t)k*n +j] = data[(size_t)max_row*n +j];
+                data[(size_t)max_row*n +j] = tmp;
+            }
+            sign *= -1;
+        }
+        if (data[(size_t)k*n +k] == 0.0) return 0.0;
+        for (unsigned i = k + 1; i < n; i++) {
+            double factor = data[(size_t)i*n +k] / data[(size_t)k*n +k];
+            data[(size_t)i*n +k] = factor;
+            for (unsigned j = k + 1; j < n; j++)
+                data[(size_t)i*n +j] -= factor * data[(size_t)k*n +j];
+        }
+    }
+    double det = sign;
+    for (unsigned k = 0; k < n; k++)
+        det *= data[(size_t)k*n +k];
+    return det;
+}
+
+// matrix-bench det [max_n]: GFLOP/s of the reference loop vs the blocked LU,
+// and the workspace allocations of a repeated determinant() call, which
+// should be none once the scratch arena has grown
+static int run_determinant_benchmark(unsigned max_n) {
+    lu_select_kernel();
+    printf("LU update kernel: %s\n", lu_kernel_name);
+    printf("%6s %14s %14s %9s %8s\n", "n", "ref GFLOP/s", "LU GFLOP/s", "speedup", "allocs");
+
+    srand(42);
+    for (unsigned n = 64; n <= max_n; n *= 2) {
+        size_t count = (size_t)n * n;
+        double *src = malloc(count * sizeof(double));
+        double *work = malloc(count * sizeof(double));
+        if (!src || !work) {
+            free(src);
+            free(work);
+            fprintf(stderr, "Out of memory at n=%u\n", n);
+            return 1;
+        }
+        for (size_t i = 0; i < count; i++)
+            src[i] = rand() % 19 - 9;
+
+        double flops = 2.0 / 3.0 * n * (double)n * n;
+        double t_ref = 0.0, t_lu = 0.0;
+        unsigned reps = 0;
+        do {
+            double t0 = now_seconds();
+            determinant_reference(src, n, work);
+            t_ref += now_seconds() - t0;
+            reps++;
+        } while (t_ref < 0.2);
+        t_ref /= reps;
+
+        reps = 0;
+        do {
+            int sign;
+            memcpy(work, src, count * sizeof(double));
+            double t0 = now_seconds();
+            lu_factor(work, n, NULL, &sign);
+            t_lu += now_seconds() - t0;
+            reps++;
+        } while (t_lu < 0.2);
+        t_lu /= reps;
+
+        MatrixAllocStats before, after;
+        Matrix *matrix = create_matrix_typed(n, n, MATRIX_FLOAT64);
+        if (!matrix) {
+            free(src);
+            free(work);
+            fprintf(stderr, "Out of memory at n=%u\n", n);
+            return 1;
+        }
+        memcpy(matrix->data, src, count * sizeof(double));
+        determinant(matrix);
+        matrix_alloc_stats(&before);
+        determinant(matrix);
+        matrix_alloc_stats(&after);
+        free_matrix(matrix);
+
+        printf("%6u %14.2f %14.2f %8.1fx %8" PRIu64 "\n", n, flops / t_ref * 1e-9, flops / t_lu * 1e-9,
+               t_ref / t_lu, after.allocations - before.allocations);
+        fflush(stdout);
+        free(src);
+        free(work);
+    }
+    return 0;
+}
+
+// matrix-bench threads [n] [max_threads]: LU scaling from 1 to max_threads,
+// checking that every thread count produces the same factorization bits
+static int run_scaling_benchmark(unsigned n, unsigned max_threads) {
+    size_t count = (size_t)n * n;
+    double *src = malloc(count * sizeof(double));
+    double *first = malloc(count * sizeof(double));
+    double *work = malloc(count * sizeof(double));
+    if (!src || !first || !work) {
+        free(src);
+        free(first);
+        free(work);
+        fprintf(stderr, "Out of memory at n=%u\n", n);
+        return 1;
+    }
+    srand(42);
+    for (size_t i = 0; i < count; i++)
+        src[i] = rand() % 19 - 9;
+
+    lu_select_kernel();
+    double flops = 2.0 / 3.0 * n * (double)n * n;
+    double t_one = 0.0;
+    printf("n=%u, LU update kernel: %s\n", n, lu_kernel_name);
+    printf("%8s %10s %11s %9s %11s %s\n", "threads", "time (s)", "GFLOP/s", "speedup", "efficiency", "result");
+
+    for (unsigned t = 1; t <= max_threads; t = t < max_threads && t * 2 > max_threads ? max_threads : t * 2) {
+        matrix_set_num_threads(t);
+        int sign;
+        memcpy(work, src, count * sizeof(double));
+        lu_factor(work, n, NULL, &sign);    // warm up the pool
+
+        double best = 0.0;
+        for (int rep = 0; rep < 3; rep++) {
+            memcpy(work, src, count * sizeof(double));
+            double t0 = now_seconds();
+            lu_factor(work, n, NULL, &sign);
+            double dt = now_seconds() - t0;
+            if (rep == 0 || dt < best) best = dt;
+        }
+        if (t == 1) {
+            t_one = best;
+            memcpy(first, work, count * sizeof(double));
+        }
+        int same = memcmp(first, work, count * sizeof(double)) == 0;
+        printf("%8u %10.4f %11.2f %8.2fx %10.0f%% %s\n", t, best, flops / best * 1e-9,
+               t_one / best, t_one / best / t * 100.0, same ? "bit-identical" : "DIFFERS");
+        fflush(stdout);
+        if (t == max_threads) break;
+    }
+
+    free(src);
+    free(first);
+    free(work);
+    return 0;
+}
+
+// matrix-bench exact [max_n]: multi-modular exact determinant on random
+// int matrices with entries in [-999, 999]
+static int run_exact_benchmark(unsigned max_n) {
+    printf("%6s %8s %10s %8s\n", "n", "primes", "time (s)", "digits");
+    srand(42);
+    for (unsigned n = 16; n <= max_n; n *= 2) {
+        Matrix *matrix = create_matrix(n, n);
+        if (!matrix) return 1;
+        int *data = matrix->data;
+        for (size_t i = 0; i < (size_t)n * n; i++)
+            data[i] = rand() % 1999 - 999;
+
+        unsigned primes;
+        double t0 = now_seconds();
+        char *det = determinant_exact(matrix, &primes);
+        double dt = now_seconds() - t0;
+        printf("%6u %8u %10.4f %8zu\n", n, primes, dt, det ? strlen(det) - (det[0] == '-') : 0);
+        fflush(stdout);
+        free(det);
+        free_matrix(matrix);
+    }
+    return 0;
+}
+
+static double log_abs_diagonal(const double *lu, unsigned n) {
+    double sum = 0.0;
+    for (unsigned k = 0; k < n; k++)
+        sum += log(fabs(lu[(size_t)k * n + k]));
+    return sum;
+}
+
+// matrix-bench det-update [n]: determinant refresh after single-cell edits
+// through the LU cache, against a full refactorization. Random matrices of
+// this size overflow a double determinant, so accuracy is checked on
+// log|det| of the result against a fresh factorization.
+static int run_update_benchmark(unsigned n) {
+    Matrix *matrix = create_matrix(n, n);
+    double *u = calloc(n, sizeof(double)), *v = calloc(n, sizeof(double));
+    unsigned *piv = malloc(n * sizeof(unsigned));
+    double *check = malloc((size_t)n * n * sizeof(double));
+    if (!matrix || !u || !v || !piv || !check) return 1;
+    srand(42);
+    for (size_t i = 0; i < (size_t)n * n; i++)
+        ((int *)matrix->data)[i] = rand() % 1999 - 999;
+
+    LuCache *cache = lu_cache_new();
+    if (!cache) return 1;
+    double t0 = now_seconds();
+    lu_cache_determinant(cache, matrix);
+    double t_full = now_seconds() - t0;
+    double log_det = log_abs_diagonal(cache->factors->a, n);
+    printf("n=%u, full factorization %.4f s\n", n, t_full);
+
+    double total = 0.0, worst = 0.0;
+    unsigned edits = 0;
+    while (edits < LU_CACHE_UPDATES) {
+        unsigned i = rand() % n, j = rand() % n;
+        int old_value = (int)matrix_get(matrix, i, j), value = rand() % 1999 - 999;
+        if (value == old_value) continue;
+        uint64_t old_version = matrix->version;
+        set_element(matrix, i, j, value);
+        u[i] = value - old_value;
+        v[j] = 1.0;
+        t0 = now_seconds();
+        int status = lu_cache_update(cache, matrix, old_version, u, v);
+        double dt = now_seconds() - t0;
+        u[i] = 0.0;
+        v[j] = 0.0;
+        if (status != 0) {
+            printf("edit %u: cache fell back to refactoring\n", edits);
+            break;
+        }
+        log_det += log(fabs(cache->gamma[edits]));
+        total += dt;
+        if (dt > worst) worst = dt;
+        edits++;
+    }
+
+    matrix_to_doubles(matrix, check);
+    int sign;
+    lu_factor(check, n, piv, &sign);
+    double log_ref = log_abs_diagonal(check, n);
+    printf("%u edits: mean %.3f ms, worst %.3f ms per determinant refresh (%.0fx faster)\n",
+           edits, 1e3 * total / (edits ? edits : 1), 1e3 * worst,
+           t_full * (edits ? edits : 1) / (total > 0 ? total : 1));
+    printf("log|det| updated %.10f, refactored %.10f, relative difference %.2e\n",
+           log_det, log_ref, fabs(log_det - log_ref) / fabs(log_ref));
+
+    lu_cache_free(cache);
+    free_matrix(matrix);
+    free(u);
+    free(v);
+    free(piv);
+    free(check);
+    return 0;
+}
+
+// Textbook i-j-k loop, the GEMM benchmark baseline
+static void gemm_f64_naive(unsigned M, unsigned N, unsigned K, const double *a,
+                           const double *b, double *c) {
+    for (unsigned i = 0; i < M; i++)
+        for (unsigned j = 0; j < N; j++) {
+            double sum = 0.0;
+            for (unsigned p = 0; p < K; p++)
+                sum += a[(size_t)i * K + p] * b[(size_t)p * N + j];
+            c[(size_t)i * N + j] = sum;
+        }
+}
+
+static void gemm_i32_naive(unsigned M, unsigned N, unsigned K, const int *a,
+                           const int *b, int64_t *c) {
+    for (unsigned i = 0; i < M; i++)
+        for (unsigned j = 0; j < N; j++) {
+            int64_t sum = 0;
+            for (unsigned p = 0; p < K; p++)
+                sum += (int64_t)a[(size_t)i * K + p] * b[(size_t)p * N + j];
+            c[(size_t)i * N + j] = sum;
+        }
+}
+
+// Seconds per call, repeated until 0.2 s have passed
+#define BENCH_TIME(seconds, call)                 \
+    do {                                          \
+        unsigned reps_ = 0;                       \
+        double total_ = 0.0;                      \
+        do {                                      \
+            double t0_ = now_seconds();           \
+            call;                                 \
+            total_ += now_seconds() - t0_;        \
+            reps_++;                              \
+        } while (total_ < 0.2);                   \
+        seconds = total_ / reps_;                 \
+    } while (0)
+
+// One shape in both element types; the baseline is skipped when it would
+// take more than about 4 GFLOP
+static int bench_gemm_shape(unsigned M, unsigned K, unsigned N) {
+    size_t na = (size_t)M * K, nb = (size_t)K * N, nc = (size_t)M * N;
+    double *a = malloc(na * sizeof(double)), *b = malloc(nb * sizeof(double));
+    double *c = malloc(nc * sizeof(double)), *ref = malloc(nc * sizeof(double));
+    int *ai = malloc(na * sizeof(int)), *bi = malloc(nb * sizeof(int));
+    int64_t *ci = malloc(nc * sizeof(int64_t)), *refi = malloc(nc * sizeof(int64_t));
+    int status = 1;
+    if (!a || !b || !c || !ref || !ai || !bi || !ci || !refi) {
+        fprintf(stderr, "Out of memory at %ux%ux%u\n", M, K, N);
+        goto out;
+    }
+    for (size_t i = 0; i < na; i++) a[i] = ai[i] = rand() % 2001 - 1000;
+    for (size_t i = 0; i < nb; i++) b[i] = bi[i] = rand() % 2001 - 1000;
+
+    double flops = 2.0 * M * N * K, t_naive = 0.0, t_gemm;
+    int baseline = flops <= 4e9;
+    char shape[48];
+    snprintf(shape, sizeof(shape), "%ux%ux%u", M, K, N);
+
+    if (baseline) BENCH_TIME(t_naive, gemm_f64_naive(M, N, K, a, b, ref));
+    BENCH_TIME(t_gemm, gemm_f64(M, N, K, a, K, b, N, c, N));
+    double err = 0.0;
+    if (baseline)
+        for (size_t i = 0; i < nc; i++) err = fmax(err, fabs(c[i] - ref[i]));
+    if (baseline)
+        printf("%-18s %6s %12.2f %12.2f %8.1fx %s\n", shape, "double", flops / t_naive * 1e-9,
+               flops / t_gemm * 1e-9, t_naive / t_gemm, err == 0.0 ? "exact" : "MISMATCH");
+    else
+        printf("%-18s %6s %12s %12.2f %9s\n", shape, "double", "-", flops / t_gemm * 1e-9, "-");
+
+    if (baseline) BENCH_TIME(t_naive, gemm_i32_naive(M, N, K, ai, bi, refi));
+    BENCH_TIME(t_gemm, gemm_i32(M, N, K, ai, K, bi, N, ci, N));
+    int same = !baseline || memcmp(ci, refi, nc * sizeof(int64_t)) == 0;
+    if (baseline)
+        printf("%-18s %6s %12.2f %12.2f %8.1fx %s\n", shape, "int", flops / t_naive * 1e-9,
+               flops / t_gemm * 1e-9, t_naive / t_gemm, same ? "exact" : "MISMATCH");
+    else
+        printf("%-18s %6s %12s %12.2f %9s\n", shape, "int", "-", flops / t_gemm * 1e-9, "-");
+    fflush(stdout);
+    status = same && (!baseline || err == 0.0) ? 0 : 1;
+
+out:
+    free(a); free(b); free(c); free(ref);
+    free(ai); free(bi); free(ci); free(refi);
+    return status;
+}
+
+// matrix-bench gemm [max_n]: GFLOP/s (GOP/s for int) of the naive loop vs the
+// packed GEMM, square and tall-skinny. Elements are small integers, so the
+// double results must match the baseline exactly too.
+static int run_gemm_benchmark(unsigned max_n) {
+    gemm_select_kernels();
+    printf("GEMM kernels: double %s %ux%u, float %s %ux%u, int %s %ux%u, %u threads\n",
+           gemm_f64_kernel.name, gemm_f64_kernel.mr, gemm_f64_kernel.nr,
+           gemm_f32_kernel.name, gemm_f32_kernel.mr, gemm_f32_kernel.nr,
+           gemm_i64_kernel.name, gemm_i64_kernel.mr, gemm_i64_kernel.nr, matrix_get_num_threads());
+    printf("%-18s %6s %12s %12s %9s\n", "M x K x N", "type", "naive GF/s", "GEMM GF/s", "speedup");
+
+    srand(42);
+    int status = 0;
+    for (unsigned n = 128; n <= max_n; n *= 2)
+        status |= bench_gemm_shape(n, n, n);
+    static const unsigned skinny[][3] = { { 65536, 64, 64 }, { 65536, 256, 16 }, { 16384, 16, 1024 },
+                                          { 256, 65536, 256 } };
+    for (size_t i = 0; i < sizeof(skinny) / sizeof(skinny[0]); i++)
+        status |= bench_gemm_shape(skinny[i][0], skinny[i][1], skinny[i][2]);
+    return status;
+}
+
+// matrix-bench expr [n]: compound expressions over n x n saved matrices,
+// fused against one step at a time
+static int run_expr_benchmark(unsigned n) {
+    static const char *const names[] = { "A", "B", "C" };
+    srand(42);
+    for (int m = 0; m < 3; m++) {
+        Matrix *matrix = create_matrix(n, n);
+        int *data = matrix ? matrix_data_mut(matrix) : NULL;
+        if (!data || matrix_set_name(matrix, names[m]) != 0) {
+            fprintf(stderr, "Out of memory at n=%u\n", n);
+            return 1;
+        }
+        for (size_t i = 0; i < (size_t)n * n; i++) data[i] = rand() % 19 - 9;
+        if (registry_put(matrix) != 0) return 1;
+    }
+
+    static const char *const exprs[] = {
+        "A + B - C",
+        "2*A^T + B - 3*C",
+        "A + B + C - A^T - B^T - C^T",
+        "det(A*B + 2*C^T)",
+        "(A + B)*(A - C)^T + C",
+    };
+    printf("n=%u, %u threads\n", n, matrix_get_num_threads());
+    printf("%-28s %6s %10s %10s %12s %7s\n", "expression", "mode", "ms", "peak MB", "traffic MB", "passes");
+    int status = 0;
+    for (size_t i = 0; i < sizeof(exprs) / sizeof(exprs[0]); i++) {
+        Expr *expr = expr_parse(exprs[i]);
+        if (!expr) {
+            fprintf(stderr, "%s: %s\n", exprs[i], matrix_last_error());
+            return 1;
+        }
+        ExprResult results[2];
+        for (int fuse = 1; fuse >= 0; fuse--) {
+            ExprStats stats;
+            double t0 = now_seconds();
+            if (expr_eval(expr, fuse, &results[fuse], &stats) != 0) {
+                fprintf(stderr, "%s: %s\n", exprs[i], matrix_last_error());
+                expr_free(expr);
+                return 1;
+            }
+            printf("%-28s %6s %10.2f %10.1f %12.1f %7u\n", exprs[i], fuse ? "fused" : "steps",
+                   (now_seconds() - t0) * 1e3, stats.peak_bytes / 1048576.0,
+                   stats.traffic_bytes / 1048576.0, stats.passes);
+        }
+        // Both modes do the same arithmetic in the same order
+        int same = results[0].matrix ?
+                   memcmp(results[0].matrix->data, results[1].matrix->data,
+                          (size_t)n * n * sizeof(int)) == 0 :
+                   results[0].scalar == results[1].scalar;
+        if (!same) {
+            printf("%-28s results differ\n", exprs[i]);
+            status = 1;
+        }
+        for (int fuse = 0; fuse < 2; fuse++)
+            if (results[fuse].matrix) free_matrix(results[fuse].matrix);
+        expr_free(expr);
+    }
+    fflush(stdout);
+    clear_saved_matrices();
+    return status;
+}
+
+// The per-element fscanf loader the streaming reader replaced, kept as the
+// benchmark baseline
+static int load_text_reference(const char *filename, Matrix **out) {
+    FILE *file = fopen(filename, "r");
+    if (!file) return -1;
+    int count = 0;
+    char name[10];
+    unsigned M, N;
+    if (fscanf(file, "%d", &count) != 1 || count < 1 ||
+        fscanf(file, "%9s %u %u", name, &M, &N) != 3) {
+        fclose(file);
+        return -1;
+    }
+    Matrix *matrix = create_matrix(M, N);
+    int *data = matrix ? matrix->data : NULL;
+    for (size_t i = 0; matrix && i < (size_t)M * N; i++)
+        if (fscanf(file, "%d", &data[i]) != 1) break;
+    fclose(file);
+    *out = matrix;
+    return matrix ? 0 : -1;
+}
+
+// matrix-bench factor [n]: a determinant followed by solves, the inverse and
+// the rank of one matrix, with and without the factorization cache
+static int run_factor_benchmark(unsigned n) {
+    Matrix *a = create_matrix(n, n), *b = create_matrix(n, 1);
+    int *ad = a ? matrix_data_mut(a) : NULL, *bd = b ? matrix_data_mut(b) : NULL;
+    if (!ad || !bd || matrix_set_name(a, "A") != 0) {
+        fprintf(stderr, "Out of memory at n=%u\n", n);
+        return 1;
+    }
+    srand(42);
+    for (size_t i = 0; i < (size_t)n * n; i++) ad[i] = rand() % 1999 - 999;
+    for (unsigned i = 0; i < n; i++) bd[i] = rand() % 1999 - 999;
+    factor_cache_clear();
+    printf("n=%u, %u threads\n", n, matrix_get_num_threads());
+
+    // Without the cache every query factors again, as determinant() does
+    double t0 = now_seconds();
+    determinant(a);
+    double t_det = now_seconds() - t0;
+    t0 = now_seconds();
+    determinant(a);
+    double t_uncached = t_det + now_seconds() - t0;
+
+    t0 = now_seconds();
+    matrix_determinant(a);
+    double t_first = now_seconds() - t0;
+    t0 = now_seconds();
+    double *x = matrix_solve(a, b);
+    double t_solve = now_seconds() - t0;
+    if (!x) {
+        fprintf(stderr, "solve: %s\n", matrix_last_error());
+        return 1;
+    }
+    double residual = 0.0, norm = 0.0;
+    for (unsigned i = 0; i < n; i++) {
+        double r = -bd[i];
+        for (unsigned j = 0; j < n; j++) r += ad[(size_t)i * n + j] * x[j];
+        residual += r * r;
+        norm += (double)bd[i] * bd[i];
+    }
+    free(x);
+    printf("determinant then solve: %.1f ms uncached, %.1f ms cached "
+           "(%.1f ms factorization + %.3f ms solve)\n",
+           1e3 * t_uncached, 1e3 * (t_first + t_solve), 1e3 * t_first, 1e3 * t_solve);
+    printf("relative residual |Ax - b| / |b| %.2e\n", sqrt(residual / norm));
+
+    t0 = now_seconds();
+    double *inverse = matrix_inverse(a);
+    double t_inverse = now_seconds() - t0;
+    t0 = now_seconds();
+    int rank = matrix_rank(a);
+    double t_rank = now_seconds() - t0;
+    t0 = now_seconds();
+    matrix_rank(a);
+    double t_rank_again = now_seconds() - t0;
+    printf("inverse from cached LU %.1f ms, rank %d in %.1f ms, again %.3f ms\n",
+           1e3 * t_inverse, rank, 1e3 * t_rank, 1e3 * t_rank_again);
+    free(inverse);
+
+    FactorCacheStats stats;
+    factor_cache_get_stats(&stats);
+    printf("cache: %llu hits, %llu misses, %llu evictions, %u entries, %.1f MB\n",
+           (unsigned long long)stats.hits, (unsigned long long)stats.misses,
+           (unsigned long long)stats.evictions, stats.entries, stats.bytes / 1048576.0);
+    factor_cache_clear();
+    free_matrix(a);
+    free_matrix(b);
+    return 0;
+}
+
+// matrix-bench sparse [n] [dir]: a 2D grid operator on n unknowns numbered in
+// random order, factored with the sparse LU, then a determinant, a solve and
+// a save/load roundtrip through both file formats
+static int run_sparse_benchmark(unsigned n, const char *dir) {
+    unsigned side = (unsigned)sqrt((double)n);
+    n = side * side;
+    unsigned *label = malloc((n ? n : 1) * sizeof(unsigned));
+    MatrixCsr *csr = csr_new(n, 5 * (size_t)n);
+    Matrix *a = csr ? matrix_wrap_csr(n, n, csr) : NULL;
+    Matrix *b = create_matrix(n, 1);
+    int *bd = b ? matrix_data_mut(b) : NULL;
+    if (!label || !a || !bd || matrix_set_name(a, "A") != 0) {
+        fprintf(stderr, "Out of memory at n=%u\n", n);
+        return 1;
+    }
+    srand(42);
+    for (unsigned i = 0; i < n; i++) label[i] = i;
+    for (unsigned i = n; i > 1; i--) {
+        unsigned j = (unsigned)(((uint64_t)rand() * RAND_MAX + rand()) % i), t = label[i - 1];
+        label[i - 1] = label[j];
+        label[j] = t;
+    }
+
+    // Row label[g] holds grid point g: 4 + a small random shift on the
+    // diagonal, -1 towards each neighbour
+    unsigned *owner = malloc((n ? n : 1) * sizeof(unsigned));
+    if (!owner) return 1;
+    for (unsigned g = 0; g < n; g++) owner[label[g]] = g;
+    size_t nnz = 0;
+    for (unsigned i = 0; i < n; i++) {
+        unsigned g = owner[i], x = g % side, y = g / side, count = 0;
+        unsigned cols[5];
+        int values[5];
+        cols[count] = i;
+        values[count++] = 4 + rand() % 3;
+        if (x > 0) cols[count] = label[g - 1], values[count++] = -1;
+        if (x + 1 < side) cols[count] = label[g + 1], values[count++] = -1;
+        if (y > 0) cols[count] = label[g - side], values[count++] = -1;
+        if (y + 1 < side) cols[count] = label[g + side], values[count++] = -1;
+        for (unsigned s = 1; s < count; s++)
+            for (unsigned t = s; t > 0 && cols[t - 1] > cols[t]; t--) {
+                unsigned c = cols[t];
+                int v = values[t];
+                cols[t] = cols[t - 1], values[t] = values[t - 1];
+                cols[t - 1] = c, values[t - 1] = v;
+            }
+        for (unsigned s = 0; s < count; s++) {
+            csr->cols[nnz] = cols[s];
+            csr->values[nnz++] = values[s];
+        }
+        csr->row_ptr[i + 1] = nnz;
+        bd[i] = rand() % 1999 - 999;
+    }
+    free(owner);
+    free(label);
+    factor_cache_clear();
+    printf("n=%u (%ux%u grid), %zu nonzeros, dense storage would take %.1f GB\n",
+           n, side, side, nnz, (double)n * n * sizeof(int) / 1e9);
+
+    double t0 = now_seconds();
+    unsigned *order = amd_order(csr, n);
+    double t_order = now_seconds() - t0;
+    free(order);
+    t0 = now_seconds();
+    Factorization *f = matrix_sparse_lu(a, NULL);
+    double t_factor = now_seconds() - t0;
+    if (!f || !f->sparse) {
+        fprintf(stderr, "factorization: %s\n", f ? "matrix is singular" : matrix_last_error());
+        return 1;
+    }
+    const SparseLu *lu = f->sparse;
+    double log10_det = 0.0;
+    for (unsigned k = 0; k < n; k++) log10_det += log10(fabs(lu->ux[lu->up[k + 1] - 1]));
+    printf("ordering %.1f ms, factorization %.1f ms (ordering included), nnz(L+U) %llu, "
+           "%.1f MB\n", 1e3 * t_order, 1e3 * t_factor,
+           (unsigned long long)(lu->lp[n] + lu->up[n]), f->bytes / 1048576.0);
+    factorization_unref(f);
+
+    t0 = now_seconds();
+    double det = matrix_determinant(a);
+    double t_det = now_seconds() - t0;
+    t0 = now_seconds();
+    double *x = matrix_solve(a, b);
+    double t_solve = now_seconds() - t0;
+    if (!x) {
+        fprintf(stderr, "solve: %s\n", matrix_last_error());
+        return 1;
+    }
+    double residual = 0.0, norm = 0.0;
+    for (unsigned i = 0; i < n; i++) {
+        double r = -bd[i];
+        for (uint64_t p = csr->row_ptr[i]; p < csr->row_ptr[i + 1]; p++)
+            r += csr->values[p] * x[csr->cols[p]];
+        residual += r * r;
+        norm += (double)bd[i] * bd[i];
+    }
+    free(x);
+    printf("determinant %s1e%.1f from the cached LU in %.3f ms, solve %.1f ms, relative residual %.2e\n",
+           det < 0 ? "-" : "", log10_det, 1e3 * t_det, 1e3 * t_solve, sqrt(residual / norm));
+
+    char path[4096];
+    const char *suffixes[2] = { "dat", "matb" };
+    for (int s = 0; s < 2; s++) {
+        snprintf(path, sizeof(path), "%s/mat-bench-sparse.%s", dir, suffixes[s]);
+        clear_saved_matrices();
+        save_matrix(a, a->name);
+        t0 = now_seconds();
+        save_matrices_to_file(path);
+        double t_save = now_seconds() - t0;
+        t0 = now_seconds();
+        int status = load_matrices_from_file(path);
+        double t_load = now_seconds() - t0;
+        const MatrixCsr *loaded = status == 0 && num_saved_matrices == 1 ? saved_matrices[0]->csr : NULL;
+        int ok = loaded && memcmp(loaded->row_ptr, csr->row_ptr, ((size_t)n + 1) * sizeof(uint64_t)) == 0 &&
+                 memcmp(loaded->cols, csr->cols, nnz * sizeof(unsigned)) == 0 &&
+                 memcmp(loaded->values, csr->values, nnz * sizeof(int)) == 0;
+        struct stat st;
+        printf("%-5s save %.1f ms, load %.1f ms, %.1f MB%s\n", suffixes[s], 1e3 * t_save, 1e3 * t_load,
+               stat(path, &st) == 0 ? st.st_size / 1e6 : 0.0, ok ? "" : "  MISMATCH");
+        remove(path);
+    }
+    clear_saved_matrices();
+    factor_cache_clear();
+    free_matrix(a);
+    free_matrix(b);
+    return 0;
+}
+
+// Storage speed assumed for the slow-storage column of matrix-bench io
+#define BENCH_SLOW_STORAGE_MBPS 100.0
+
+// matrix-bench io [n] [dir]: save/load throughput of the text format against
+// the binary and compressed stores for one n x n matrix. Loads are timed
+// from the page cache; the last column adds the time to read the file at
+// BENCH_SLOW_STORAGE_MBPS, as from a network filesystem.
+static int run_io_benchmark(unsigned n, const char *dir) {
+    char text_path[4096], store_path[4096], packed_path[4096];
+    snprintf(text_path, sizeof(text_path), "%s/mat-bench-io.dat", dir);
+    snprintf(store_path, sizeof(store_path), "%s/mat-bench-io.matb", dir);
+    snprintf(packed_path, sizeof(packed_path), "%s/mat-bench-io.matz", dir);
+
+    clear_saved_matrices();
+    Matrix *matrix = create_matrix(n, n);
+    if (!matrix) return 1;
+    srand(42);
+    for (size_t i = 0; i < (size_t)n * n; i++)
+        ((int *)matrix->data)[i] = rand() % 200001 - 100000;
+    matrix_set_name(matrix, "bench");
+    double mb = (double)n * n * sizeof(int) / 1e6;
+
+    printf("n=%u (%.1f MB of elements)\n", n, mb);
+    printf("%-10s %10s %10s %12s %12s %12s %12s\n", "format", "save (s)", "load (s)", "save MB/s", "load MB/s",
+           "file MB", "slow load");
+    const char *paths[3] = { text_path, store_path, packed_path };
+    const char *names[3] = { "text", "binary", "compressed" };
+    for (int f = 0; f < 3; f++) {
+        clear_saved_matrices();
+        save_matrix(matrix, matrix->name);
+
+        double t0 = now_seconds();
+        save_matrices_to_file(paths[f]);
+        double t_save = now_seconds() - t0;
+
+        t0 = now_seconds();
+        int status = load_matrices_from_file(paths[f]);
+        double t_load = now_seconds() - t0;
+
+        struct stat st;
+        double file_mb = stat(paths[f], &st) == 0 ? st.st_size / 1e6 : 0.0;
+        int ok = status == 0 && num_saved_matrices == 1 &&
+                 memcmp(saved_matrices[0]->data, matrix->data, (size_t)n * n * sizeof(int)) == 0;
+        printf("%-10s %10.4f %10.4f %12.1f %12.1f %12.1f %12.4f%s\n", names[f], t_save, t_load,
+               mb / t_save, mb / t_load, file_mb, t_load + file_mb / BENCH_SLOW_STORAGE_MBPS,
+               ok ? "" : "  MISMATCH");
+        fflush(stdout);
+
+        if (f == 0) {
+            Matrix *reference = NULL;
+            t0 = now_seconds();
+            load_text_reference(text_path, &reference);
+            double t_ref = now_seconds() - t0;
+            printf("%-10s %10s %10.4f %12s %12.1f %12s %12s  (per-element fscanf, %.1fx slower)\n",
+                   "fscanf", "-", t_ref, "-", mb / t_ref, "-", "-", t_ref / t_load);
+            free_matrix(reference);
+        }
+    }
+
+    clear_saved_matrices();
+    free_matrix(matrix);
+    remove(text_path);
+    remove(store_path);
+    remove(packed_path);
+    return 0;
+}
+
+// matrix-bench journal [count] [dir]: persisting one edit among count saved
+// 256 x 256 matrices, by rewriting a .matb store against appending to the
+// journal, then the replay and compaction of that journal
+static int run_journal_benchmark(unsigned count, const char *dir) {
+    char store_path[4096], journal_path[4096];
+    snprintf(store_path, sizeof(store_path), "%s/mat-bench-journal.matb", dir);
+    snprintf(journal_path, sizeof(journal_path), "%s/mat-bench.journal", dir);
+    remove(journal_path);
+
+    clear_saved_matrices();
+    if (matrix_journal_open(journal_path) != 0) {
+        fprintf(stderr, "matrix-bench: %s\n", matrix_last_error());
+        return 1;
+    }
+    Matrix *big = create_matrix(256, 256), *small = create_matrix(8, 8);
+    if (!big || !small) return 1;
+    srand(7);
+    for (size_t i = 0; i < 256 * 256; i++)
+        ((int *)big->data)[i] = rand() % 2001 - 1000;
+    double t0 = now_seconds();
+    for (unsigned i = 0; i < count; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "m%u", i);
+        save_matrix(big, name);
+    }
+    double t_fill = now_seconds() - t0;
+    printf("%u matrices of 256 x 256 int32 (%.1f MB), journaled in %.3f s\n", count,
+           count * 256.0 * 256 * sizeof(int) / 1e6, t_fill);
+
+    t0 = now_seconds();
+    save_matrices_to_file(store_path);
+    double t_store = now_seconds() - t0;
+    set_element(big, 0, 0, 1);
+    t0 = now_seconds();
+    save_matrix(big, "m0");
+    double t_big = now_seconds() - t0;
+    t0 = now_seconds();
+    save_matrix(small, "small");
+    double t_small = now_seconds() - t0;
+    printf("%-28s %10.3f ms\n", "rewrite .matb store", 1e3 * t_store);
+    printf("%-28s %10.3f ms  (%.0fx less)\n", "journal 256 x 256 edit", 1e3 * t_big, t_store / t_big);
+    printf("%-28s %10.3f ms  (%.0fx less)\n", "journal 8 x 8 edit", 1e3 * t_small, t_store / t_small);
+
+    matrix_journal_close();
+    clear_saved_matrices();
+    t0 = now_seconds();
+    int status = matrix_journal_open(journal_path);
+    double t_replay = now_seconds() - t0;
+    int ok = status == 0 && num_saved_matrices == (int)count + 1 &&
+             matrix_get(saved_matrices[0], 0, 0) == 1;
+    printf("%-28s %10.3f ms%s\n", "replay", 1e3 * t_replay, ok ? "" : "  MISMATCH");
+
+    MatrixJournalStats before, after;
+    matrix_journal_stats(&before);
+    t0 = now_seconds();
+    matrix_journal_compact();
+    matrix_journal_close();
+    double t_compact = now_seconds() - t0;
+    matrix_journal_open(journal_path);
+    matrix_journal_stats(&after);
+    printf("%-28s %10.3f ms  (%.1f MB to %.1f MB)\n", "compaction", 1e3 * t_compact,
+           before.bytes / 1e6, after.bytes / 1e6);
+
+    matrix_journal_close();
+    clear_saved_matrices();
+    free_matrix(big);
+    free_matrix(small);
+    remove(store_path);
+    remove(journal_path);
+    return status != 0 || !ok;
+}
+
+// matrix-bench ooc [n] [dir]: determinant of a random n x n tiled matrix
+// through the out-of-core LU with a quarter of the matrix in memory, against
+// the in-core LU when that fits
+static int run_ooc_benchmark(unsigned n, const char *dir) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/mat-bench-ooc.mattile", dir);
+    const unsigned tile = 256;
+    MatrixTiled tiled;
+    if (matrix_tiled_create(path, n, n, tile, &tiled) != 0) {
+        fprintf(stderr, "matrix-bench: %s\n", matrix_last_error());
+        return 1;
+    }
+    double *rows = malloc((size_t)tile * n * sizeof(double));
+    if (!rows) return 1;
+    srand(42);
+    double t0 = now_seconds();
+    for (unsigned r0 = 0; r0 < n; r0 += tile) {
+        unsigned count = n - r0 < tile ? n - r0 : tile;
+        for (size_t i = 0; i < (size_t)count * n; i++)
+            rows[i] = rand() / (double)RAND_MAX * 2.0 - 1.0;
+        matrix_tiled_write_rows(&tiled, r0, count, rows);
+    }
+    free(rows);
+    double mb = (double)n * n * sizeof(double) / 1e6;
+    printf("n=%u, %.1f MB in %ux%u tiles, written in %.2f s\n", n, mb, tile, tile, now_seconds() - t0);
+
+    MatrixLogDet det;
+    size_t memory = (size_t)n * n * sizeof(double) / 4;
+    t0 = now_seconds();
+    int status = matrix_tiled_det(&tiled, memory, NULL, &det);
+    double t_ooc = now_seconds() - t0;
+    if (status != 0) {
+        fprintf(stderr, "matrix-bench: %s\n", matrix_last_error());
+        matrix_tiled_close(&tiled);
+        remove(path);
+        return 1;
+    }
+    double gflops = 2.0 / 3.0 * n * n * n / 1e9;
+    printf("%-22s %10.3f s %8.1f GFLOP/s  log|det| %.10g, sign %d\n", "out-of-core (1/4 mem)", t_ooc,
+           gflops / t_ooc, det.log_abs, det.sign);
+
+    if (n <= 8000) {
+        double *a = malloc((size_t)n * n * sizeof(double));
+        int sign;
+        if (a && matrix_tiled_read_rows(&tiled, 0, n, a) == 0) {
+            t0 = now_seconds();
+            int singular = lu_factor(a, n, NULL, &sign) != 0;
+            double t_core = now_seconds() - t0, log_abs = 0.0;
+            for (unsigned i = 0; i < n && !singular; i++) {
+                log_abs += log(fabs(a[(size_t)i * n + i]));
+                if (a[(size_t)i * n + i] < 0) sign = -sign;
+            }
+            printf("%-22s %10.3f s %8.1f GFLOP/s  log|det| %.10g, sign %d%s\n", "in-core", t_core,
+                   gflops / t_core, log_abs, singular ? 0 : sign,
+                   fabs(log_abs - det.log_abs) <= 1e-9 * fabs(log_abs) && sign == det.sign ? "" : "  MISMATCH");
+        }
+        free(a);
+    }
+    matrix_tiled_close(&tiled);
+    remove(path);
+    return 0;
+}
+
+// matrix-bench heatmap [n]: a 1000 x 800 pixel heatmap frame of float32
+// matrices up to n x n, fitted and zoomed in, before and after the min/max
+// pyramid is built; frame times should not grow with the matrix
+static int run_heatmap_benchmark(unsigned n) {
+    const unsigned width = 1000, height = 800;
+    uint32_t *pixels = malloc((size_t)width * height * sizeof(uint32_t));
+    if (!pixels) return 1;
+    printf("%8s %14s %14s %14s %14s\n", "n", "sampled (ms)", "pyramid (ms)", "fitted (ms)", "zoomed (ms)");
+    for (unsigned size = n / 16 ? n / 16 : 1; ; size *= 4) {
+        if (size > n) size = n;
+        Matrix *matrix = create_matrix_typed(size, size, MATRIX_FLOAT32);
+        float *data = matrix ? matrix_data_mut(matrix) : NULL;
+        if (!data) {
+            free_matrix(matrix);
+            free(pixels);
+            return 1;
+        }
+        srand(42);
+        for (size_t i = 0; i < (size_t)size * size; i++)
+            data[i] = rand() / (float)RAND_MAX * 2.0f - 1.0f;
+
+        double range[2];
+        MatrixView fitted = { 0, 0, fmax((double)size / height, (double)size / width), width, height };
+        MatrixView zoomed = { size / 2.0, size / 2.0, 1.0 / 60, width, height };
+        double t0 = now_seconds();
+        matrix_heatmap_render(matrix, NULL, &fitted, pixels, width, range);
+        double t_sampled = now_seconds() - t0;
+        t0 = now_seconds();
+        MatrixPyramid *pyramid = matrix_pyramid_build(matrix, NULL);
+        double t_pyramid = now_seconds() - t0;
+        t0 = now_seconds();
+        matrix_heatmap_render(matrix, pyramid, &fitted, pixels, width, range);
+        double t_fitted = now_seconds() - t0;
+        t0 = now_seconds();
+        matrix_heatmap_render(matrix, pyramid, &zoomed, pixels, width, range);
+        double t_zoomed = now_seconds() - t0;
+        printf("%8u %14.2f %14.2f %14.2f %14.2f\n", size, t_sampled * 1e3, t_pyramid * 1e3,
+               t_fitted * 1e3, t_zoomed * 1e3);
+        matrix_pyramid_free(pyramid);
+        free_matrix(matrix);
+        if (size == n) break;
+    }
+    free(pixels);
+    return 0;
+}
+
+// matrix-bench types [n] [dir]: the same n x n matrix stored as each element
+// type, timing the determinant, a product and a binary save and load
+static int run_types_benchmark(unsigned n, const char *dir) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/mat-bench-types.matb", dir);
+    Matrix *source = create_matrix(n, n);
+    if (!source) return 1;
+    srand(42);
+    for (size_t i = 0; i < (size_t)n * n; i++)
+        ((int *)source->data)[i] = rand() % 1999 - 999;
+
+    printf("n=%u\n", n);
+    printf("%-8s %10s %10s %10s %10s %10s\n", "type", "MB", "det (s)", "gemm (s)", "save (s)", "load (s)");
+    for (int t = 0; t < MATRIX_TYPE_COUNT; t++) {
+        Matrix *matrix = matrix_convert(source, (MatrixType)t);
+        if (!matrix) return 1;
+        matrix_set_name(matrix, "bench");
+
+        double t0 = now_seconds();
+        determinant(matrix);
+        double t_det = now_seconds() - t0;
+        t0 = now_seconds();
+        Matrix *product = matrix_multiply(matrix, matrix);
+        double t_gemm = now_seconds() - t0;
+
+        clear_saved_matrices();
+        save_matrix(matrix, matrix->name);
+        t0 = now_seconds();
+        save_matrices_to_file(path);
+        double t_save = now_seconds() - t0;
+        t0 = now_seconds();
+        int status = load_matrices_from_file(path);
+        double t_load = now_seconds() - t0;
+        size_t bytes = (size_t)n * n * matrix_types[t].size;
+        int ok = status == 0 && num_saved_matrices == 1 && saved_matrices[0]->type == matrix->type &&
+                 memcmp(saved_matrices[0]->data, matrix->data, bytes) == 0 && product;
+        printf("%-8s %10.1f %10.4f %10.4f %10.4f %10.4f%s\n", matrix_type_name(matrix->type), bytes / 1e6,
+               t_det, t_gemm, t_save, t_load, ok ? "" : "  MISMATCH");
+        fflush(stdout);
+        free_matrix(product);
+        free_matrix(matrix);
+    }
+    clear_saved_matrices();
+    factor_cache_clear();
+    free_matrix(source);
+    remove(path);
+    return 0;
+}
+
+// Random batch in struct-of-arrays layout, elements uniform in [-1, 1)
+static double *bench_random_batch(unsigned n, size_t count, unsigned seed) {
+    double *elements = malloc((size_t)n * n * count * sizeof(double));
+    if (!elements) return NULL;
+    uint64_t state = seed * 0x9E3779B97F4A7C15ULL + 1;
+    for (size_t i = 0; i < (size_t)n * n * count; i++) {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        elements[i] = (double)(state >> 11) * 0x1p-52 - 1.0;
+    }
+    return elements;
+}
+
+// matrix-bench det-batch [count] [dir]: count n x n determinants for n = 2..4
+// through the batched kernels, against determinant() on each matrix (on a
+// sample) and against memcpy of the same bytes, the bandwidth bound; then a
+// save and mapped reload of the 4x4 batch as a .matbatch file
+static int run_batch_benchmark(size_t count, const char *dir) {
+    size_t sample = count < 100000 ? count : 100000;
+    printf("count=%zu\n", count);
+    printf("%-4s %12s %12s %10s %12s %10s %10s\n", "n", "generic M/s", "batch M/s", "speedup",
+           "batch GB/s", "copy GB/s", "max err");
+    for (unsigned n = 2; n <= 4; n++) {
+        size_t bytes = (size_t)n * n * count * sizeof(double);
+        double *elements = bench_random_batch(n, count, n);
+        double *dets = malloc(count * sizeof(double));
+        double *copy = malloc(bytes);
+        Matrix *matrix = create_matrix_typed(n, n, MATRIX_FLOAT64);
+        if (!elements || !dets || !copy || !matrix) return 1;
+        memset(copy, 0, bytes);
+
+        double t_batch, t_copy, t_generic;
+        BENCH_TIME(t_batch, matrix_det_batch(n, count, elements, count, dets));
+        BENCH_TIME(t_copy, memcpy(copy, elements, bytes));
+
+        double max_err = 0.0;
+        double t0 = now_seconds();
+        for (size_t k = 0; k < sample; k++) {
+            double *data = matrix_data_mut(matrix);
+            for (unsigned e = 0; e < n * n; e++) data[e] = elements[e * count + k];
+            double err = fabs(determinant(matrix) - dets[k]);
+            if (err > max_err) max_err = err;
+        }
+        t_generic = (now_seconds() - t0) / sample;
+
+        printf("%-4u %12.1f %12.1f %9.1fx %12.2f %10.2f %10.1e\n", n, 1e-6 / t_generic,
+               count / t_batch * 1e-6, t_generic * count / t_batch,
+               (bytes + count * sizeof(double)) / t_batch * 1e-9, 2.0 * bytes / t_copy * 1e-9, max_err);
+        fflush(stdout);
+
+        if (n == 4) {
+            char path[4096];
+            snprintf(path, sizeof(path), "%s/mat-bench-batch.matbatch", dir);
+            t0 = now_seconds();
+            int status = matrix_batch_save(path, n, count, elements, count);
+            double t_save = now_seconds() - t0;
+            MatrixBatch batch;
+            t0 = now_seconds();
+            status = status || matrix_batch_open(path, &batch);
+            if (!status) status = matrix_det_batch(batch.n, batch.count, batch.elements, batch.stride, copy);
+            double t_load = now_seconds() - t0;
+            int ok = !status && memcmp(copy, dets, count * sizeof(double)) == 0;
+            printf("file: save %.3f s (%.2f GB/s), map + det %.3f s%s\n", t_save, bytes / t_save * 1e-9,
+                   t_load, ok ? "" : "  MISMATCH");
+            if (!status) matrix_batch_close(&batch);
+            remove(path);
+        }
+        free_matrix(matrix);
+        free(copy);
+        free(dets);
+        free(elements);
+    }
+    return 0;
+}
+
+// Regression suite
+//
+// Each case is timed by repeating it until BENCH_MIN_SECONDS have passed
+// (at least BENCH_MIN_REPS times) and keeping the fastest run, which is far
+// steadier between runs than the mean. Results are JSON lines:
+//     {"name":"det","n":512,"threads":4,"seconds":0.0123,"reps":41}
+// where seconds is the time of one operation. A baseline is an earlier
+// output; a result regresses when it is more than --tolerance slower than
+// the baseline entry with the same name, n and threads.
+#define BENCH_MIN_SECONDS 0.25
+#define BENCH_MIN_REPS 3
+#define BENCH_MAX_REPS 1000
+#define BENCH_TOLERANCE 0.25
+#define BENCH_REGISTRY_SIZE 8
+
+typedef struct {
+    char name[32];
+    unsigned n, threads;
+    double seconds;
+    unsigned reps;
+} BenchResult;
+
+typedef struct {
+    BenchResult *items;
+    size_t count, cap;
+    FILE *out;
+    double min_seconds;
+} BenchSuite;
+
+typedef struct {
+    Matrix *matrix;
+    const char *path;
+    unsigned count;         // registry cases: matrices per operation
+    char (*names)[16];
+    const double *batch;    // det-batch cases: count matrices of size n
+    double *dets;
+    unsigned n;
+} BenchCase;
+
+static Matrix *bench_random_matrix(unsigned n, unsigned seed, int range) {
+    Matrix *matrix = create_matrix(n, n);
+    if (!matrix) return NULL;
+    srand(seed);
+    int *data = matrix_data_mut(matrix);
+    for (size_t i = 0; i < (size_t)n * n; i++)
+        data[i] = rand() % (2 * range + 1) - range;
+    return matrix;
+}
+
+// Time op(c) and record it; ops counts the operations one call performs
+static int bench_run(BenchSuite *suite, const char *name, unsigned n, unsigned threads,
+                     int (*op)(BenchCase *c), BenchCase *c, unsigned ops) {
+    if (op(c) != 0) {
+        fprintf(stderr, "matrix-bench: %s n=%u failed\n", name, n);
+        return -1;
+    }
+    double best = INFINITY, total = 0.0;
+    unsigned reps = 0;
+    while (reps < BENCH_MAX_REPS && (reps < BENCH_MIN_REPS || total < suite->min_seconds)) {
+        double t0 = now_seconds();
+        if (op(c) != 0) {
+            fprintf(stderr, "matrix-bench: %s n=%u failed\n", name, n);
+            return -1;
+        }
+        double t = now_seconds() - t0;
+        if (t < best) best = t;
+        total += t;
+        reps++;
+    }
+
+    if (suite->count == suite->cap) {
+        size_t cap = suite->cap ? suite->cap * 2 : 64;
+        BenchResult *items = realloc(suite->items, cap * sizeof(BenchResult));
+        if (!items) return -1;
+        suite->items = items;
+        suite->cap = cap;
+    }
+    BenchResult *r = &suite->items[suite->count++];
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    r->n = n;
+    r->threads = threads;
+    r->seconds = best / ops;
+    r->reps = reps;
+    fprintf(suite->out, "{\"name\":\"%s\",\"n\":%u,\"threads\":%u,\"seconds\":%.9g,\"reps\":%u}\n",
+            r->name, r->n, r->threads, r->seconds, r->reps);
+    fflush(suite->out);
+    return 0;
+}
+
+static int bench_det(BenchCase *c) {
+    return isnan(determinant(c->matrix)) ? -1 : 0;
+}
+
+static int bench_save(BenchCase *c) {
+    save_matrices_to_file(c->path);
+    struct stat st;
+    return stat(c->path, &st) == 0 && st.st_size > 0 ? 0 : -1;
+}
+
+static int bench_load(BenchCase *c) {
+    return load_matrices_from_file(c->path) == 0 && num_saved_matrices == 1 ? 0 : -1;
+}
+
+static int bench_registry_save(BenchCase *c) {
+    clear_saved_matrices();
+    for (unsigned i = 0; i < c->count; i++)
+        if (save_matrix(c->matrix, c->names[i]) != 0) return -1;
+    return 0;
+}
+
+static int bench_registry_load(BenchCase *c) {
+    for (unsigned i = 0; i < c->count; i++) {
+        Matrix *matrix = load_matrix(c->names[i]);
+        if (!matrix) return -1;
+        free_matrix(matrix);
+    }
+    return 0;
+}
+
+static int run_suite_det(BenchSuite *suite, const unsigned *sizes, unsigned nsizes,
+                         const unsigned *threads, unsigned nthreads) {
+    for (unsigned s = 0; s < nsizes; s++) {
+        BenchCase c = { bench_random_matrix(sizes[s], 42, 100), NULL, 0, NULL };
+        if (!c.matrix) return -1;
+        for (unsigned t = 0; t < nthreads; t++) {
+            matrix_set_num_threads(threads[t]);
+            if (bench_run(suite, "det", sizes[s], threads[t], bench_det, &c, 1) != 0) {
+                free_matrix(c.matrix);
+                return -1;
+            }
+        }
+        free_matrix(c.matrix);
+    }
+    matrix_set_num_threads(0);
+    return 0;
+}
+
+static int run_suite_io(BenchSuite *suite, const unsigned *sizes, unsigned nsizes, const char *dir) {
+    static const char *formats[3] = { "text", "matb", "matz" };
+    static const char *suffixes[3] = { "dat", "matb", "matz" };
+    int status = 0;
+    for (unsigned s = 0; s < nsizes && status == 0; s++) {
+        Matrix *matrix = bench_random_matrix(sizes[s], 7, 100000);
+        if (!matrix) return -1;
+        for (int f = 0; f < 3 && status == 0; f++) {
+            char path[4096], save_name[32], load_name[32];
+            snprintf(path, sizeof(path), "%s/matrix-bench-io.%s", dir, suffixes[f]);
+            snprintf(save_name, sizeof(save_name), "save-%s", formats[f]);
+            snprintf(load_name, sizeof(load_name), "load-%s", formats[f]);
+            clear_saved_matrices();
+            BenchCase c = { matrix, path, 0, NULL };
+            status = save_matrix(matrix, "bench") != 0 ||
+                     bench_run(suite, save_name, sizes[s], 1, bench_save, &c, 1) != 0 ||
+                     bench_run(suite, load_name, sizes[s], 1, bench_load, &c, 1) != 0 ? -1 : 0;
+            remove(path);
+        }
+        free_matrix(matrix);
+    }
+    clear_saved_matrices();
+    return status;
+}
+
+static int bench_det_batch(BenchCase *c) {
+    return matrix_det_batch(c->n, c->count, c->batch, c->count, c->dets);
+}
+
+// Batched determinant cases time one matrix of a batch of count
+static int run_suite_det_batch(BenchSuite *suite, unsigned count) {
+    int status = 0;
+    for (unsigned n = 2; n <= 4 && status == 0; n++) {
+        double *batch = bench_random_batch(n, count, n);
+        BenchCase c = { NULL, NULL, count, NULL, batch, malloc(count * sizeof(double)), n };
+        status = batch && c.dets ? bench_run(suite, "det-batch", n, 1, bench_det_batch, &c, count) : -1;
+        free(batch);
+        free(c.dets);
+    }
+    return status;
+}
+
+// Registry cases time one save or lookup among count named matrices
+static int run_suite_registry(BenchSuite *suite, const unsigned *counts, unsigned ncounts) {
+    int status = 0;
+    for (unsigned s = 0; s < ncounts && status == 0; s++) {
+        BenchCase c = { bench_random_matrix(BENCH_REGISTRY_SIZE, 3, 100), NULL, counts[s],
+                        malloc(counts[s] * sizeof(*c.names)) };
+        if (!c.matrix || !c.names) status = -1;
+        for (unsigned i = 0; status == 0 && i < c.count; i++)
+            snprintf(c.names[i], sizeof(c.names[i]), "m%u", i);
+        if (status == 0)
+            status = bench_run(suite, "registry-save", counts[s], 1, bench_registry_save, &c, c.count) != 0 ||
+                     bench_run(suite, "registry-load", counts[s], 1, bench_registry_load, &c, c.count) != 0 ? -1 : 0;
+        clear_saved_matrices();
+        free_matrix(c.matrix);
+        free(c.names);
+    }
+    return status;
+}
+
+// Value of "key": in a JSON line, or NULL
+static const char *json_field(const char *line, const char *key) {
+    char pattern[64];
+    snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+    const char *p = strstr(line, pattern);
+    return p ? p + strlen(pattern) : NULL;
+}
+
+// Compare the suite against a baseline; returns the number of regressions,
+// or -1 if the baseline cannot be read
+static int compare_baseline(const BenchSuite *suite, const char *path, double tolerance) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "matrix-bench: cannot open baseline %s\n", path);
+        return -1;
+    }
+    int regressions = 0;
+    unsigned matched = 0;
+    char line[512];
+    while (fgets(line, sizeof(line), file)) {
+        const char *name = json_field(line, "name"), *n = json_field(line, "n"),
+                   *threads = json_field(line, "threads"), *seconds = json_field(line, "seconds");
+        if (!name || !n || !threads || !seconds || *name != '"') continue;
+        size_t len = strcspn(name + 1, "\"");
+        double base = strtod(seconds, NULL);
+        for (size_t i = 0; i < suite->count; i++) {
+            const BenchResult *r = &suite->items[i];
+            if (strlen(r->name) != len || strncmp(r->name, name + 1, len) != 0 ||
+                r->n != strtoul(n, NULL, 10) || r->threads != strtoul(threads, NULL, 10))
+                continue;
+            matched++;
+            double change = base > 0 ? r->seconds / base - 1.0 : 0.0;
+            if (change > tolerance) {
+                fprintf(stderr, "REGRESSION %s n=%u threads=%u: %.6g s, baseline %.6g s (%+.0f%%)\n",
+                        r->name, r->n, r->threads, r->seconds, base, change * 100);
+                regressions++;
+            }
+        }
+    }
+    fclose(file);
+    fprintf(stderr, "matrix-bench: %u of %zu results compared with %s, %d regression%s\n",
+            matched, suite->count, path, regressions, regressions == 1 ? "" : "s");
+    return regressions;
+}
+
+// Comma-separated unsigned list into out; returns the count, 0 if malformed
+static unsigned parse_list(const char *text, unsigned *out, unsigned max) {
+    unsigned count = 0;
+    while (*text && count < max) {
+        char *end;
+        unsigned long v = strtoul(text, &end, 10);
+        if (end == text || v == 0 || (*end && *end != ',')) return 0;
+        out[count++] = (unsigned)v;
+        text = *end ? end + 1 : end;
+    }
+    return count;
+}
+
+static void bench_usage(void) {
+    fprintf(stderr,
+            "Usage: matrix-bench [--quick] [--threads N,N...] [--out FILE] [--dir DIR]\n"
+            "                    [--baseline FILE] [--tolerance FRACTION]\n"
+            "       matrix-bench det|det-update|det-batch|exact|gemm|expr|factor|sparse|io|types|journal|ooc|heatmap|threads [ARGS]\n");
+}
+
+static int run_suite(int argc, char **argv) {
+    unsigned threads[16], nthreads = 0;
+    const char *out_path = NULL, *baseline = NULL, *dir = ".";
+    double tolerance = BENCH_TOLERANCE;
+    int quick = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--quick") == 0) {
+            quick = 1;
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            nthreads = parse_list(argv[++i], threads, 16);
+            if (nthreads == 0) {
+                bench_usage();
+                return 2;
+            }
+        } else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+            out_path = argv[++i];
+        } else if (strcmp(argv[i], "--dir") == 0 && i + 1 < argc) {
+            dir = argv[++i];
+        } else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+            baseline = argv[++i];
+        } else if (strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc) {
+            tolerance = atof(argv[++i]);
+        } else {
+            bench_usage();
+            return 2;
+        }
+    }
+    if (nthreads == 0) {
+        threads[nthreads++] = 1;
+        if (online_cpus() > 1) threads[nthreads++] = online_cpus();
+    }
+
+    static const unsigned det_sizes[] = { 64, 256, 512, 1024 };
+    static const unsigned io_sizes[] = { 256, 1024 };
+    static const unsigned registry_counts[] = { 1000, 10000 };
+    BenchSuite suite = { NULL, 0, 0, stdout, quick ? BENCH_MIN_SECONDS / 5 : BENCH_MIN_SECONDS };
+    if (out_path && !(suite.out = fopen(out_path, "w"))) {
+        fprintf(stderr, "matrix-bench: cannot write %s\n", out_path);
+        return 1;
+    }
+
+    int status = run_suite_det(&suite, det_sizes, quick ? 2 : 4, threads, nthreads) != 0 ||
+                 run_suite_io(&suite, io_sizes, quick ? 1 : 2, dir) != 0 ||
+                 run_suite_registry(&suite, registry_counts, quick ? 1 : 2) != 0 ||
+                 run_suite_det_batch(&suite, quick ? 1 << 16 : 1 << 20) != 0;
+    if (suite.out != stdout) fclose(suite.out);
+    if (!status && baseline) {
+        int regressions = compare_baseline(&suite, baseline, tolerance);
+        status = regressions != 0;
+    }
+    free(suite.items);
+    return status;
+}
+
+int main(int argc, char **argv) {
+    const char *cmd = argc > 1 ? argv[1] : "";
+    unsigned n = argc > 2 ? (unsigned)atoi(argv[2]) : 0;
+    const char *dir = argc > 3 ? argv[3] : ".";
+
+    if (strcmp(cmd, "det") == 0) return run_determinant_benchmark(n ? n : 4096);
+    if (strcmp(cmd, "det-update") == 0) return run_update_benchmark(n ? n : 2000);
+    if (strcmp(cmd, "det-batch") == 0) return run_batch_benchmark(n ? n : 10000000, dir);
+    if (strcmp(cmd, "exact") == 0) return run_exact_benchmark(n ? n : 512);
+    if (strcmp(cmd, "gemm") == 0) return run_gemm_benchmark(n ? n : 2048);
+    if (strcmp(cmd, "expr") == 0) return run_expr_benchmark(n ? n : 2000);
+    if (strcmp(cmd, "factor") == 0) return run_factor_benchmark(n ? n : 2000);
+    if (strcmp(cmd, "sparse") == 0) return run_sparse_benchmark(n ? n : 100000, dir);
+    if (strcmp(cmd, "io") == 0) return run_io_benchmark(n ? n : 2000, dir);
+    if (strcmp(cmd, "types") == 0) return run_types_benchmark(n ? n : 1000, dir);
+    if (strcmp(cmd, "ooc") == 0) return run_ooc_benchmark(n ? n : 4000, dir);
+    if (strcmp(cmd, "journal") == 0) return run_journal_benchmark(n ? n : 200, dir);
+    if (strcmp(cmd, "heatmap") == 0) return run_heatmap_benchmark(n ? n : 8000);
+    if (strcmp(cmd, "threads") == 0)
+        return run_scaling_benchmark(n ? n : 2048, argc > 3 ? (unsigned)atoi(argv[3]) : online_cpus());
+    if (cmd[0] && cmd[0] != '-') {
+        bench_usage();
+        return 2;
+    }
+    return run_suite(argc, argv);
+}
@@ -0,0 +1,142 @@
+// Engine internals shared by libmatrix, the batch front end of mat and the
+// white-box benchmarks in matrix-bench. Not part of the matrix.h interface.
+#ifndef MATRIX_INTERNAL_H
+#define MATRIX_INTERNAL_H
+
+#include <stdio.h>
+#include <time.h>
+
+#include "matrix.h"
+
+static inline double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+unsigned online_cpus(void);
+int has_suffix(const char *s, const char *suffix);
+
+// Per-type element kernels, indexed by MatrixType
+typedef struct {
+    const char *name;
+    size_t size;
+    double limit;           // integer range, INFINITY for floating point
+    void (*to_doubles)(const void *src, size_t count, double *out);
+    void (*from_doubles)(const double *src, size_t count, void *out);
+    size_t (*nonzeros)(const void *src, size_t count);
+    int (*format)(const void *src, size_t index, char *out, size_t size);
+    void (*write_text)(FILE *file, const void *src, size_t count);
+} MatrixTypeInfo;
+
+extern const MatrixTypeInfo matrix_types[MATRIX_TYPE_COUNT];
+int matrix_type_is_integer(MatrixType type);
+void matrix_to_doubles(const Matrix *matrix, double *out);
+
+// Sparse storage
+MatrixCsr *csr_new(unsigned rows, size_t cap);
+Matrix *matrix_wrap_csr(unsigned M, unsigned N, MatrixCsr *csr);
+int prefers_sparse(unsigned M, unsigned N, size_t nonzeros);
+unsigned *amd_order(const MatrixCsr *csr, unsigned n);
+
+// Saved-matrix registry
+int registry_put(Matrix *matrix);
+int registry_put_deferred(Matrix **matrices, int count, int clear);
+int registry_apply_deferred(int *cleared);
+void clear_saved_matrices(void);
+
+// Binary matrix store (.matb)
+typedef struct MatbEntry MatbEntry;
+
+typedef struct {
+    MatrixMapping *mapping;
+    const MatbEntry *entries;
+    uint64_t count;
+} MatrixStore;
+
+int is_matrix_store_file(const char *filename);
+int matrix_store_open(const char *filename, MatrixStore *store);
+Matrix *matrix_store_get(MatrixStore *store, uint64_t index);
+void matrix_store_close(MatrixStore *store);
+
+// Batch file (.matbatch)
+int is_matrix_batch_file(const char *path);
+
+// Tiled matrix file (.mattile)
+int is_matrix_tiled_file(const char *path);
+
+// Streaming text reader
+typedef struct {
+    FILE *file;
+    const char *path;
+    char *buf;
+    size_t pos, len;
+    uint64_t buf_offset;    // file offset of buf[0]
+    uint64_t line_start;    // file offset where the current line starts
+    unsigned long line;
+    int eof;
+    MatrixProgress *progress;   // kilobytes read, and cancellation; may be NULL
+} TextReader;
+
+int text_reader_open(TextReader *r, const char *path);
+void text_reader_close(TextReader *r);
+int text_read_count(TextReader *r, int *count);
+Matrix *text_read_matrix(TextReader *r);
+Matrix *text_read_csv(TextReader *r);
+
+// Factorizations
+typedef struct SparseLu {
+    unsigned n;
+    uint64_t *lp, *up;      // column starts in li/lx and ui/ux, n + 1 each
+    unsigned *li, *ui;      // row of each entry, in pivot order
+    double *lx, *ux;        // unit diagonal first in each column of L, diagonal last in U
+    size_t lcap, ucap;
+    unsigned *pinv;         // row i of A is row pinv[i] of L*U
+    unsigned *q;            // column k of L*U is column q[k] of A
+} SparseLu;
+
+enum { FACTOR_LU, FACTOR_SPARSE_LU, FACTOR_RREF };
+
+struct Factorization {
+    atomic_int refs;
+    int kind;
+    unsigned rows, cols;
+    double *a;              // LU: n x n factors, NULL if singular; RREF: reduced rows x cols
+    unsigned *piv;          // LU: row swapped with each row; RREF: column of each pivot
+    SparseLu *sparse;       // sparse LU: the factors, NULL if singular
+    double det;             // LU and sparse LU
+    double norm;            // largest |element| of the matrix
+    unsigned rank;          // RREF only
+    size_t bytes;
+};
+
+#define LU_CACHE_UPDATES 16
+
+struct LuCache {
+    unsigned n;
+    Factorization *factors; // LU of A0, NULL if there is no factorization
+    double det;             // determinant of the current matrix
+    uint64_t version;       // Matrix version det belongs to, 0 if none
+    unsigned updates;
+    double *w, *v;          // LU_CACHE_UPDATES vectors of n each
+    double gamma[LU_CACHE_UPDATES];
+};
+
+// Kernel selection, made once per process
+extern const char *lu_kernel_name;
+void lu_select_kernel(void);
+
+// C[MR x NR] += A strip * B strip over depth k, elements of the kernel's type
+typedef void (*GemmMicroKernel)(size_t k, const void *a, const void *b, void *c, size_t ldc);
+
+typedef struct {
+    GemmMicroKernel kernel;
+    unsigned mr, nr;
+    const char *name;
+    unsigned size;          // bytes per element of the packed strips and of C
+} GemmKernel;
+
+extern GemmKernel gemm_f64_kernel, gemm_f32_kernel, gemm_i64_kernel;
+void gemm_select_kernels(void);
+
+#endif
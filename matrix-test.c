@@ -0,0 +1,551 @@
+/*
+matrix-test: tests for libmatrix
+
+matrix-test [formats|journal|exact|expr|update] [DIR] runs one group, or every
+group without an argument, writing its files under DIR (default "."). Each
+failed check prints its line; the exit status is nonzero if any failed.
+ctest runs each group as its own test.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "matrix.h"
+#include "matrix-internal.h"
+
+static int failures;
+
+#define CHECK(cond)                                                              \
+    do {                                                                         \
+        if (!(cond)) {                                                           \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            if (*matrix_last_error()) fprintf(stderr, "  last error: %s\n", matrix_last_error()); \
+            failures++;                                                          \
+        }                                                                        \
+    } while (0)
+
+static const char *test_dir = ".";
+
+static void test_path(char *out, size_t size, const char *name) {
+    snprintf(out, size, "%s/mat-test-%s", test_dir, name);
+}
+
+// Same shape, type, name and elements, bit for bit
+static int same_matrix(const Matrix *a, const Matrix *b) {
+    if (a->M != b->M || a->N != b->N || a->type != b->type || strcmp(a->name, b->name) != 0)
+        return 0;
+    for (unsigned i = 0; i < a->M; i++) {
+        for (unsigned j = 0; j < a->N; j++) {
+            MatrixValue x = matrix_get_value(a, i, j), y = matrix_get_value(b, i, j);
+            if (matrix_type_is_integer(a->type) ? x.i != y.i : memcmp(&x.f, &y.f, sizeof(double)) != 0)
+                return 0;
+        }
+    }
+    return 1;
+}
+
+// matrix_file_read() callback collecting into a list
+typedef struct {
+    Matrix *matrices[8];
+    int count;
+} Collected;
+
+static int collect(Matrix *matrix, void *data) {
+    Collected *c = data;
+    if (c->count == 8) {
+        free_matrix(matrix);
+        return 1;
+    }
+    c->matrices[c->count++] = matrix;
+    return 0;
+}
+
+static void collected_free(Collected *c) {
+    for (int i = 0; i < c->count; i++) free_matrix(c->matrices[i]);
+    c->count = 0;
+}
+
+// One matrix of each element type, with values at the edges of their ranges,
+// and a sparse one
+static int make_matrices(Matrix **out) {
+    static const char *const names[] = { "i32", "i64", "f32", "f64", "sparse" };
+    for (int t = 0; t < MATRIX_TYPE_COUNT; t++) out[t] = create_matrix_typed(5, 7, (MatrixType)t);
+    out[4] = create_sparse_matrix(40, 30);
+    for (int k = 0; k < 5; k++) {
+        if (!out[k] || matrix_set_name(out[k], names[k]) != 0) return -1;
+    }
+    for (unsigned i = 0; i < 5; i++) {
+        for (unsigned j = 0; j < 7; j++) {
+            int v = (int)(i * 7 + j) * 37 % 101 - 50;
+            set_element(out[0], i, j, v);
+            set_element(out[1], i, j, v);
+            set_element(out[2], i, j, v / 3.0);
+            set_element(out[3], i, j, v / 7.0);
+        }
+    }
+    set_element(out[0], 0, 0, INT32_MIN);
+    set_element(out[0], 4, 6, INT32_MAX);
+    MatrixValue v;
+    v.i = INT64_MAX;
+    matrix_set_value(out[1], 0, 0, v);
+    v.i = INT64_MIN;
+    matrix_set_value(out[1], 1, 1, v);
+    v.i = ((int64_t)1 << 53) + 1;
+    matrix_set_value(out[1], 4, 6, v);
+    set_element(out[2], 0, 0, 3.4028234e38);
+    set_element(out[3], 0, 0, -1e-300);
+    set_element(out[3], 4, 6, 0.1);
+    for (unsigned k = 0; k < 40; k++) set_element(out[4], k, k * 7 % 30, (int)k - 20);
+    return 0;
+}
+
+static void test_formats(void) {
+    Matrix *matrices[5];
+    CHECK(make_matrices(matrices) == 0);
+
+    // Text, .matb and .matz hold every type and sparse matrices
+    static const char *const suffixes[] = { "store.txt", "store.matb", "store.matz" };
+    for (int s = 0; s < 3; s++) {
+        char path[4096];
+        test_path(path, sizeof(path), suffixes[s]);
+        CHECK(matrix_file_write(path, matrices, 5, NULL) == 0);
+        Collected c = { .count = 0 };
+        CHECK(matrix_file_read(path, collect, &c, NULL) == 0);
+        CHECK(c.count == 5);
+        for (int k = 0; k < c.count && k < 5; k++) {
+            if (!same_matrix(matrices[k], c.matrices[k]))
+                fprintf(stderr, "  %s: %s differs\n", suffixes[s], matrices[k]->name);
+            CHECK(same_matrix(matrices[k], c.matrices[k]));
+        }
+        collected_free(&c);
+        unlink(path);
+    }
+
+    // CSV is an import format: write one by hand, read it back as int32
+    char path[4096];
+    test_path(path, sizeof(path), "matrix.csv");
+    FILE *file = fopen(path, "w");
+    CHECK(file != NULL);
+    if (file) {
+        for (unsigned i = 0; i < matrices[0]->M; i++)
+            for (unsigned j = 0; j < matrices[0]->N; j++)
+                fprintf(file, "%d%s", (int)matrix_get(matrices[0], i, j), j + 1 < matrices[0]->N ? ", " : "\r\n");
+        fclose(file);
+        Collected c = { .count = 0 };
+        CHECK(matrix_file_read(path, collect, &c, NULL) == 0 && c.count == 1);
+        if (c.count == 1) {
+            CHECK(strcmp(c.matrices[0]->name, "mat-test-matrix") == 0);
+            CHECK(matrix_set_name(c.matrices[0], "i32") == 0 && same_matrix(matrices[0], c.matrices[0]));
+        }
+        collected_free(&c);
+    }
+    file = fopen(path, "w");
+    if (file) {
+        fputs("1,2\n3,,4\n", file);
+        fclose(file);
+        Collected c = { .count = 0 };
+        CHECK(matrix_file_read(path, collect, &c, NULL) != 0 && strstr(matrix_last_error(), ":2:3: empty field"));
+        collected_free(&c);
+    }
+    unlink(path);
+
+    // .matbatch: a strided batch comes back in the same layout
+    unsigned n = 3;
+    size_t count = 37, stride = 40;
+    double *elements = calloc((size_t)n * n * stride, sizeof(double));
+    CHECK(elements != NULL);
+    if (elements) {
+        for (size_t e = 0; e < (size_t)n * n; e++)
+            for (size_t k = 0; k < count; k++) elements[e * stride + k] = (double)(e * count + k) / 8.0 - 3.0;
+        test_path(path, sizeof(path), "batch.matbatch");
+        CHECK(matrix_batch_save(path, n, count, elements, stride) == 0);
+        MatrixBatch batch;
+        CHECK(matrix_batch_open(path, &batch) == 0);
+        CHECK(batch.n == n && batch.count == count);
+        int same = 1;
+        for (size_t e = 0; e < (size_t)n * n; e++)
+            for (size_t k = 0; k < count; k++)
+                same &= batch.elements[e * batch.stride + k] == elements[e * stride + k];
+        CHECK(same);
+        matrix_batch_close(&batch);
+        unlink(path);
+        free(elements);
+    }
+
+    // .mattile: rows written a few tile rows at a time read back whole, and the
+    // out-of-core determinant over several panels agrees with the in-memory one
+    n = 100;
+    double *rows = malloc((size_t)n * n * sizeof(double)), *back = malloc((size_t)n * n * sizeof(double));
+    Matrix *dense = create_matrix_typed(n, n, MATRIX_FLOAT64);
+    CHECK(rows && back && dense);
+    if (rows && back && dense) {
+        uint64_t state = 12345;
+        for (size_t i = 0; i < (size_t)n * n; i++) {
+            state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+            rows[i] = (double)(state >> 11) * 0x1p-52 - 1.0;
+        }
+        memcpy(matrix_data_mut(dense), rows, (size_t)n * n * sizeof(double));
+        test_path(path, sizeof(path), "tiled.mattile");
+        MatrixTiled tiled;
+        CHECK(matrix_tiled_create(path, n, n, 16, &tiled) == 0);
+        CHECK(matrix_tiled_write_rows(&tiled, 0, 32, rows) == 0);
+        CHECK(matrix_tiled_write_rows(&tiled, 32, n - 32, rows + (size_t)32 * n) == 0);
+        CHECK(matrix_tiled_close(&tiled) == 0);
+        CHECK(matrix_tiled_open(path, &tiled) == 0);
+        CHECK(tiled.rows == n && tiled.cols == n && tiled.tile == 16);
+        CHECK(matrix_tiled_read_rows(&tiled, 0, n, back) == 0);
+        CHECK(memcmp(rows, back, (size_t)n * n * sizeof(double)) == 0);
+        MatrixLogDet det;
+        CHECK(matrix_tiled_det(&tiled, 40000, NULL, &det) == 0);
+        double expected = determinant(dense);
+        CHECK(det.sign == (expected > 0 ? 1 : -1));
+        CHECK(fabs(det.log_abs - log(fabs(expected))) < 1e-9 * fabs(log(fabs(expected))) + 1e-9);
+        matrix_tiled_close(&tiled);
+        unlink(path);
+    }
+    free(rows);
+    free(back);
+    free_matrix(dense);
+    for (int k = 0; k < 5; k++) free_matrix(matrices[k]);
+}
+
+static int registry_has(const char *name, double first) {
+    Matrix *matrix = load_matrix(name);
+    int found = matrix && matrix_get(matrix, 0, 0) == first;
+    free_matrix(matrix);
+    return found;
+}
+
+static Matrix *named_matrix(const char *name, double first) {
+    Matrix *matrix = create_matrix(20, 20);
+    if (matrix) set_element(matrix, 0, 0, first);
+    if (matrix && matrix_set_name(matrix, name) != 0) {
+        free_matrix(matrix);
+        return NULL;
+    }
+    return matrix;
+}
+
+// What a file load's worker does: record two puts, "d" and "a"
+static void *put_deferred_main(void *arg) {
+    Matrix *matrices[2] = { named_matrix("d", 5), named_matrix("a", 6) };
+    *(int *)arg = matrices[0] && matrices[1] ? registry_put_deferred(matrices, 2, 0) : -1;
+    return NULL;
+}
+
+// A journal cut short mid-record loses only that record, and keeps working;
+// puts recorded on a worker thread reach the registry in journal order
+static void test_journal(void) {
+    char path[4096];
+    test_path(path, sizeof(path), "registry.journal");
+    unlink(path);
+    clear_saved_matrices();
+    CHECK(matrix_journal_open(path) == 0);
+    Matrix *matrix = create_matrix(20, 20);
+    CHECK(matrix != NULL);
+    if (!matrix) return;
+    set_element(matrix, 0, 0, 1);
+    CHECK(save_matrix(matrix, "a") == 0);
+    set_element(matrix, 0, 0, 2);
+    CHECK(save_matrix(matrix, "b") == 0);
+    set_element(matrix, 0, 0, 3);
+    CHECK(save_matrix(matrix, "a") == 0);
+    matrix_journal_close();
+
+    clear_saved_matrices();
+    CHECK(matrix_journal_open(path) == 0);
+    CHECK(num_saved_matrices == 2 && registry_has("a", 3) && registry_has("b", 2));
+    matrix_journal_close();
+
+    // Drop the tail of the last record, the second save of a
+    MatrixJournalStats stats;
+    clear_saved_matrices();
+    CHECK(matrix_journal_open(path) == 0 && matrix_journal_stats(&stats) == 0);
+    matrix_journal_close();
+    CHECK(truncate(path, (off_t)stats.bytes - 100) == 0);
+    clear_saved_matrices();
+    CHECK(matrix_journal_open(path) == 0);
+    CHECK(num_saved_matrices == 2 && registry_has("a", 1) && registry_has("b", 2));
+
+    // Appends after the recovered prefix replay too
+    set_element(matrix, 0, 0, 4);
+    CHECK(save_matrix(matrix, "c") == 0);
+    CHECK(delete_matrix("b") == 0);
+    matrix_journal_close();
+    clear_saved_matrices();
+    CHECK(matrix_journal_open(path) == 0);
+    CHECK(num_saved_matrices == 2 && registry_has("a", 1) && registry_has("c", 4) && !registry_has("b", 2));
+    CHECK(matrix_journal_compact() == 0);
+    matrix_journal_close();
+    clear_saved_matrices();
+    CHECK(matrix_journal_open(path) == 0);
+    CHECK(num_saved_matrices == 2 && registry_has("a", 1) && registry_has("c", 4));
+
+    // Puts recorded on another thread wait for the registry's thread, and a
+    // put made there first applies them, keeping journal order
+    pthread_t thread;
+    int status = -1;
+    CHECK(pthread_create(&thread, NULL, put_deferred_main, &status) == 0 &&
+          pthread_join(thread, NULL) == 0 && status == 0);
+    CHECK(num_saved_matrices == 2 && registry_has("a", 1));
+    set_element(matrix, 0, 0, 7);
+    CHECK(save_matrix(matrix, "d") == 0);
+    CHECK(num_saved_matrices == 3 && registry_has("a", 6) && registry_has("c", 4) && registry_has("d", 7));
+    // A clear recorded ahead of the puts replaces the registry
+    Matrix *e = named_matrix("e", 8);
+    int cleared = 0;
+    CHECK(e && registry_put_deferred(&e, 1, 1) == 0);
+    CHECK(registry_apply_deferred(&cleared) == 0 && cleared);
+    CHECK(num_saved_matrices == 1 && registry_has("e", 8));
+    matrix_journal_close();
+    clear_saved_matrices();
+    CHECK(matrix_journal_open(path) == 0);
+    CHECK(num_saved_matrices == 1 && registry_has("e", 8));
+    matrix_journal_close();
+
+    // A file that is not a journal leaves the registry as it was. The saved
+    // matrices still map the journal, so this is another file.
+    char other[4096];
+    test_path(other, sizeof(other), "other.journal");
+    FILE *file = fopen(other, "w");
+    if (file) {
+        fputs("not a journal", file);
+        fclose(file);
+    }
+    CHECK(matrix_journal_open(other) != 0);
+    CHECK(num_saved_matrices == 1 && registry_has("e", 8));
+    clear_saved_matrices();
+    free_matrix(matrix);
+    unlink(other);
+    unlink(path);
+}
+
+static void check_exact(const Matrix *matrix, const char *expected) {
+    char *det = determinant_exact(matrix, NULL);
+    if (!det || strcmp(det, expected) != 0)
+        fprintf(stderr, "  %s: got %s, expected %s\n", matrix->name, det ? det : "NULL", expected);
+    CHECK(det && strcmp(det, expected) == 0);
+    free(det);
+}
+
+static void test_exact(void) {
+    // Vandermonde matrix of 1..12: the product of 0!..11!, far past 2^64
+    Matrix *v = create_matrix_typed(12, 12, MATRIX_INT64);
+    if (v) {
+        matrix_set_name(v, "vandermonde");
+        for (unsigned i = 0; i < 12; i++) {
+            MatrixValue x = { .i = 1 };
+            for (unsigned j = 0; j < 12; j++, x.i *= i + 1) matrix_set_value(v, i, j, x);
+        }
+        check_exact(v, "265790267296391946810949632000000000");
+    }
+    CHECK(v != NULL);
+
+    // Rows swapped once: the sign flips
+    Matrix *a = create_matrix(2, 2);
+    if (a) {
+        matrix_set_name(a, "2x2");
+        set_element(a, 0, 0, 1);
+        set_element(a, 0, 1, 2);
+        set_element(a, 1, 0, 3);
+        set_element(a, 1, 1, 4);
+        check_exact(a, "-2");
+    }
+
+    // (2^31 - 1)^3, dense and sparse
+    Matrix *d = create_matrix(3, 3), *s = create_sparse_matrix(3, 3);
+    if (d && s) {
+        matrix_set_name(d, "diagonal");
+        matrix_set_name(s, "sparse diagonal");
+        for (unsigned i = 0; i < 3; i++) {
+            set_element(d, i, i, INT32_MAX);
+            set_element(s, i, i, INT32_MAX);
+        }
+        check_exact(d, "9903520300447984150353281023");
+        check_exact(s, "9903520300447984150353281023");
+        CHECK(s->csr != NULL);
+    }
+
+    // Singular, and 0 x 0
+    Matrix *z = create_matrix(4, 4), *e = create_matrix(0, 0);
+    if (z && e) {
+        matrix_set_name(z, "singular");
+        matrix_set_name(e, "empty");
+        for (unsigned i = 0; i < 4; i++)
+            for (unsigned j = 0; j < 4; j++) set_element(z, i, j, (int)(i + j));
+        check_exact(z, "0");
+        check_exact(e, "1");
+    }
+
+    // Floating point elements are refused with a reason
+    Matrix *f = create_matrix_typed(2, 2, MATRIX_FLOAT64);
+    if (f) {
+        CHECK(determinant_exact(f, NULL) == NULL);
+        CHECK(strstr(matrix_last_error(), "integer") != NULL);
+    }
+    free_matrix(v);
+    free_matrix(a);
+    free_matrix(d);
+    free_matrix(s);
+    free_matrix(z);
+    free_matrix(e);
+    free_matrix(f);
+}
+
+// Edits of several rows at once, as one rank-k update after rank-1 ones, and
+// of one column in many rows, as a single term, keep the cached determinant in
+// step with a refactorization
+static void test_update(void) {
+    unsigned n = 60, rows[] = { 3, 17, 41, 59 }, k = 4;
+    Matrix *matrix = create_matrix_typed(n, n, MATRIX_FLOAT64);
+    LuCache *cache = lu_cache_new();
+    double *u = calloc((size_t)k * n, sizeof(double)), *v = calloc((size_t)k * n, sizeof(double));
+    CHECK(matrix && cache && u && v);
+    if (!matrix || !cache || !u || !v) return;
+    srand(5);
+    for (unsigned i = 0; i < n; i++)
+        for (unsigned j = 0; j < n; j++) set_element(matrix, i, j, rand() % 201 - 100 + (i == j ? 500 : 0));
+    lu_cache_determinant(cache, matrix);
+
+    uint64_t version = matrix->version;
+    u[5] = 42 - matrix_get(matrix, 5, 6);
+    set_element(matrix, 5, 6, 42);
+    v[6] = 1.0;
+    CHECK(lu_cache_update(cache, matrix, version, u, v) == 0);
+    memset(u, 0, (size_t)k * n * sizeof(double));
+    memset(v, 0, (size_t)k * n * sizeof(double));
+
+    version = matrix->version;
+    for (unsigned r = 0; r < k; r++) {
+        u[(size_t)r * n + rows[r]] = 1.0;
+        for (unsigned j = r; j < n; j += 7) {
+            double value = rand() % 201 - 100;
+            v[(size_t)r * n + j] = value - matrix_get(matrix, rows[r], j);
+            set_element(matrix, rows[r], j, value);
+        }
+    }
+    CHECK(lu_cache_update_rank(cache, matrix, version, k, u, v) == 0);
+    CHECK(lu_cache_is_current(cache, matrix));
+    double updated = lu_cache_determinant(cache, matrix), expected = determinant(matrix);
+    CHECK(fabs(updated - expected) <= 1e-9 * fabs(expected));
+
+    // One column edited in more rows than the cache holds updates is still a
+    // single term, u = the column's change, v = e_col
+    memset(u, 0, (size_t)k * n * sizeof(double));
+    memset(v, 0, (size_t)k * n * sizeof(double));
+    version = matrix->version;
+    for (unsigned i = 0; i < n; i += 2) {
+        double value = rand() % 201 - 100;
+        u[i] = value - matrix_get(matrix, i, 11);
+        set_element(matrix, i, 11, value);
+    }
+    v[11] = 1.0;
+    CHECK(n / 2 > LU_CACHE_UPDATES);
+    CHECK(lu_cache_update(cache, matrix, version, u, v) == 0);
+    CHECK(lu_cache_is_current(cache, matrix));
+    updated = lu_cache_determinant(cache, matrix);
+    expected = determinant(matrix);
+    CHECK(fabs(updated - expected) <= 1e-9 * fabs(expected));
+
+    // A change of rank above n / 3 refactors instead
+    version = matrix->version;
+    set_element(matrix, 0, 0, 7);
+    CHECK(lu_cache_update_rank(cache, matrix, version, n / 2, u, v) != 0);
+    CHECK(!lu_cache_is_current(cache, matrix));
+    free(u);
+    free(v);
+    lu_cache_free(cache);
+    free_matrix(matrix);
+}
+
+// Fused and step-by-step evaluation give the same bits, and the right ones
+static void test_expr(void) {
+    static const char *const names[] = { "A", "B", "C" };
+    unsigned n = 70;
+    Matrix *m[3];
+    srand(11);
+    for (int k = 0; k < 3; k++) {
+        m[k] = create_matrix(n, n);
+        if (!m[k] || matrix_set_name(m[k], names[k]) != 0) {
+            CHECK(!"out of memory");
+            return;
+        }
+        int *data = matrix_data_mut(m[k]);
+        for (size_t i = 0; i < (size_t)n * n; i++) data[i] = rand() % 19 - 9;
+        CHECK(save_matrix(m[k], names[k]) == 0);
+    }
+
+    static const char *const exprs[] = {
+        "A + B - C",
+        "2*A^T + B - 3*C",
+        "A + B + C - A^T - B^T - C^T",
+        "det(A*B + 2*C^T)",
+        "(A + B)*(A - C)^T + C",
+    };
+    for (size_t e = 0; e < sizeof(exprs) / sizeof(exprs[0]); e++) {
+        Expr *expr = expr_parse(exprs[e]);
+        CHECK(expr != NULL);
+        if (!expr) continue;
+        ExprResult results[2];
+        ExprStats stats[2];
+        int ok = expr_eval(expr, 0, &results[0], &stats[0]) == 0;
+        ok = expr_eval(expr, 1, &results[1], &stats[1]) == 0 && ok;
+        CHECK(ok);
+        if (ok && results[0].matrix) {
+            CHECK(results[1].matrix && same_matrix(results[0].matrix, results[1].matrix));
+            // Fusing never costs more passes or memory traffic
+            CHECK(stats[1].passes <= stats[0].passes && stats[1].traffic_bytes <= stats[0].traffic_bytes);
+        } else if (ok) {
+            CHECK(!results[1].matrix && results[0].scalar == results[1].scalar);
+        }
+        if (ok && e == 1) {
+            int right = 1;
+            for (unsigned i = 0; i < n; i++)
+                for (unsigned j = 0; j < n; j++)
+                    right &= matrix_get(results[1].matrix, i, j) ==
+                             2 * matrix_get(m[0], j, i) + matrix_get(m[1], i, j) - 3 * matrix_get(m[2], i, j);
+            CHECK(right);
+        }
+        if (ok) {
+            free_matrix(results[0].matrix);
+            free_matrix(results[1].matrix);
+        }
+        expr_free(expr);
+    }
+    clear_saved_matrices();
+    for (int k = 0; k < 3; k++) free_matrix(m[k]);
+}
+
+static const struct {
+    const char *name;
+    void (*run)(void);
+} tests[] = {
+    { "formats", test_formats },
+    { "journal", test_journal },
+    { "exact", test_exact },
+    { "expr", test_expr },
+    { "update", test_update },
+};
+
+int main(int argc, char **argv) {
+    const char *only = argc > 1 ? argv[1] : NULL;
+    if (argc > 2) test_dir = argv[2];
+    int ran = 0;
+    for (size_t t = 0; t < sizeof(tests) / sizeof(tests[0]); t++) {
+        if (only && strcmp(only, tests[t].name) != 0) continue;
+        int before = failures;
+        tests[t].run();
+        printf("%-8s %s\n", tests[t].name, failures == before ? "ok" : "FAILED");
+        ran++;
+    }
+    if (!ran) {
+        fprintf(stderr, "Usage: matrix-test [formats|journal|exact|expr|update] [DIR]\n");
+        return 2;
+    }
+    return failures != 0;
+}
@@ -0,0 +1,8636 @@
+// Matrix engine (libmatrix): storage, the saved-matrix registry, file I/O,
+// the thread pool and every compute kernel. See matrix.h for the interface.
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <limits.h>
+#include <errno.h>
+#include <locale.h>
+#include <time.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MATRIX_X86 1
+#endif
+
+#ifdef MATRIX_ZLIB
+#include <zlib.h>
+#endif
+
+#include "matrix.h"
+#include "matrix-internal.h"
+
+Matrix **saved_matrices = NULL;
+int num_saved_matrices = 0;
+
+// Workspace allocator
+//
+// Element buffers and compute temporaries come from here. Every block is
+// WORKSPACE_ALIGN aligned, so rows start on a cache line and vector loads
+// never straddle two. Blocks of WORKSPACE_MAP_MIN bytes or more are mapped
+// directly and advised onto transparent huge pages, which cuts TLB misses
+// on large matrices; MAT_HUGEPAGES=0 turns the advice off. A header just
+// below each block records how to release it.
+//
+// Each thread also keeps a scratch arena for temporaries that live as long
+// as one call: take scratch_mark(), scratch_alloc() as needed, then
+// scratch_pop() back to the mark. A request that does not fit gets a block
+// of its own, and once the arena is empty again it grows to the most it
+// held, up to MAT_SCRATCH_MB (default 256) per thread. Repeating a
+// computation therefore stops allocating after the first run, which
+// matrix_alloc_stats() shows.
+#define WORKSPACE_ALIGN 64
+#define WORKSPACE_MAP_MIN ((size_t)2 << 20)
+#define SCRATCH_KEEP_DEFAULT_MB 256
+
+typedef struct {
+    size_t size;            // bytes requested
+    size_t mapped;          // length of the mapping, 0 if from the heap
+} WorkspaceHeader;
+
+_Static_assert(sizeof(WorkspaceHeader) <= WORKSPACE_ALIGN, "WorkspaceHeader layout");
+_Static_assert(sizeof(MatrixBuffer) <= WORKSPACE_ALIGN, "MatrixBuffer fits before its elements");
+
+static struct {
+    atomic_uint_fast64_t allocations, frees, scratch_grows, huge;
+    atomic_size_t live_bytes, peak_bytes;
+} workspace_stats;
+
+static int workspace_hugepages = 1;
+static size_t scratch_keep = (size_t)SCRATCH_KEEP_DEFAULT_MB << 20;
+static size_t workspace_page = 4096;
+static pthread_once_t workspace_once = PTHREAD_ONCE_INIT;
+
+static void workspace_init(void) {
+    const char *env = getenv("MAT_HUGEPAGES");
+    if (env && *env) workspace_hugepages = atoi(env) != 0;
+    env = getenv("MAT_SCRATCH_MB");
+    if (env && *env && atol(env) >= 0) scratch_keep = (size_t)atol(env) << 20;
+    long page = sysconf(_SC_PAGESIZE);
+    if (page > 0) workspace_page = (size_t)page;
+}
+
+static void workspace_count(size_t size) {
+    atomic_fetch_add(&workspace_stats.allocations, 1);
+    size_t live = atomic_fetch_add(&workspace_stats.live_bytes, size) + size;
+    size_t peak = atomic_load(&workspace_stats.peak_bytes);
+    while (live > peak && !atomic_compare_exchange_weak(&workspace_stats.peak_bytes, &peak, live)) {}
+}
+
+// size bytes aligned to WORKSPACE_ALIGN, NULL if out of memory. Release
+// with workspace_free().
+static void *workspace_alloc(size_t size) {
+    pthread_once(&workspace_once, workspace_init);
+    size_t total = size + WORKSPACE_ALIGN, mapped = 0;
+    char *base;
+    if (total < size) return NULL;
+    if (total >= WORKSPACE_MAP_MIN) {
+        mapped = (total + workspace_page - 1) & ~(workspace_page - 1);
+        base = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED) return NULL;
+#ifdef MADV_HUGEPAGE
+        if (workspace_hugepages && madvise(base, mapped, MADV_HUGEPAGE) == 0)
+            atomic_fetch_add(&workspace_stats.huge, 1);
+#endif
+    } else {
+        void *p;
+        if (posix_memalign(&p, WORKSPACE_ALIGN, total) != 0) return NULL;
+        base = p;
+    }
+    WorkspaceHeader *header = (WorkspaceHeader *)base;
+    header->size = size;
+    header->mapped = mapped;
+    workspace_count(size);
+    return base + WORKSPACE_ALIGN;
+}
+
+// workspace_alloc() with the bytes zeroed; fresh mappings already are
+static void *workspace_calloc(size_t size) {
+    char *p = workspace_alloc(size);
+    if (p && !((WorkspaceHeader *)(p - WORKSPACE_ALIGN))->mapped) memset(p, 0, size);
+    return p;
+}
+
+static void workspace_free(void *p) {
+    if (!p) return;
+    char *base = (char *)p - WORKSPACE_ALIGN;
+    const WorkspaceHeader *header = (const WorkspaceHeader *)base;
+    atomic_fetch_add(&workspace_stats.frees, 1);
+    atomic_fetch_sub(&workspace_stats.live_bytes, header->size);
+    if (header->mapped) munmap(base, header->mapped);
+    else free(base);
+}
+
+// Resize a workspace block, keeping its first min(old, new) bytes. Shrinking
+// a mapping unmaps its tail in place; NULL if out of memory, leaving p as it was.
+static void *workspace_realloc(void *p, size_t size) {
+    if (!p) return workspace_alloc(size);
+    WorkspaceHeader *header = (WorkspaceHeader *)((char *)p - WORKSPACE_ALIGN);
+    size_t old = header->size;
+    if (header->mapped && size <= old) {
+        size_t keep = (size + WORKSPACE_ALIGN + workspace_page - 1) & ~(workspace_page - 1);
+        if (keep < header->mapped) munmap((char *)header + keep, header->mapped - keep);
+        if (keep < header->mapped) header->mapped = keep;
+        header->size = size;
+        atomic_fetch_sub(&workspace_stats.live_bytes, old - size);
+        return p;
+    }
+    void *grown = workspace_alloc(size);
+    if (!grown) return NULL;
+    memcpy(grown, p, old < size ? old : size);
+    workspace_free(p);
+    return grown;
+}
+
+// Counters since startup
+void matrix_alloc_stats(MatrixAllocStats *stats) {
+    stats->allocations = atomic_load(&workspace_stats.allocations);
+    stats->frees = atomic_load(&workspace_stats.frees);
+    stats->scratch_grows = atomic_load(&workspace_stats.scratch_grows);
+    stats->huge = atomic_load(&workspace_stats.huge);
+    stats->live_bytes = atomic_load(&workspace_stats.live_bytes);
+    stats->peak_bytes = atomic_load(&workspace_stats.peak_bytes);
+}
+
+// A scratch request that did not fit the arena, standing in for the arena
+// bytes from at onwards
+typedef struct ScratchBlock {
+    struct ScratchBlock *prev;
+    size_t at;
+} ScratchBlock;
+
+typedef struct {
+    char *base;
+    size_t size;
+    size_t used;            // bytes handed out, spilled ones included
+    size_t high;            // most used since the arena was last empty
+    ScratchBlock *spill;    // newest first
+} ScratchArena;
+
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+
+static void scratch_arena_free(void *arg) {
+    ScratchArena *arena = arg;
+    while (arena->spill) {
+        ScratchBlock *block = arena->spill;
+        arena->spill = block->prev;
+        workspace_free(block);
+    }
+    workspace_free(arena->base);
+    free(arena);
+}
+
+static void scratch_init(void) {
+    pthread_key_create(&scratch_key, scratch_arena_free);
+}
+
+static ScratchArena *scratch_arena(void) {
+    pthread_once(&scratch_once, scratch_init);
+    ScratchArena *arena = pthread_getspecific(scratch_key);
+    if (!arena) {
+        arena = calloc(1, sizeof(ScratchArena));
+        if (arena && pthread_setspecific(scratch_key, arena) != 0) {
+            free(arena);
+            arena = NULL;
+        }
+    }
+    return arena;
+}
+
+static size_t scratch_mark(void) {
+    ScratchArena *arena = scratch_arena();
+    return arena ? arena->used : 0;
+}
+
+// size bytes of this thread's scratch, WORKSPACE_ALIGN aligned and valid
+// until scratch_pop() to an earlier mark. NULL if out of memory.
+static void *scratch_alloc(size_t size) {
+    ScratchArena *arena = scratch_arena();
+    if (!arena) return NULL;
+    size = size ? (size + WORKSPACE_ALIGN - 1) & ~(size_t)(WORKSPACE_ALIGN - 1) : WORKSPACE_ALIGN;
+    char *p;
+    if (arena->used + size <= arena->size) {
+        p = arena->base + arena->used;
+    } else {
+        ScratchBlock *block = workspace_alloc(WORKSPACE_ALIGN + size);
+        if (!block) return NULL;
+        block->prev = arena->spill;
+        block->at = arena->used;
+        arena->spill = block;
+        atomic_fetch_add(&workspace_stats.scratch_grows, 1);
+        p = (char *)block + WORKSPACE_ALIGN;
+    }
+    arena->used += size;
+    if (arena->used > arena->high) arena->high = arena->used;
+    return p;
+}
+
+// Release everything allocated since mark. Emptying the arena grows it to
+// fit the most it had to hold, so the same work next time fits in one piece.
+static void scratch_pop(size_t mark) {
+    ScratchArena *arena = scratch_arena();
+    if (!arena) return;
+    while (arena->spill && arena->spill->at >= mark) {
+        ScratchBlock *block = arena->spill;
+        arena->spill = block->prev;
+        workspace_free(block);
+    }
+    arena->used = mark;
+    if (mark > 0) return;
+    if (arena->high > arena->size && arena->high <= scratch_keep) {
+        workspace_free(arena->base);
+        arena->base = workspace_alloc(arena->high);
+        arena->size = arena->base ? arena->high : 0;
+    }
+    arena->high = 0;
+}
+
+static void mapping_unref(MatrixMapping *mapping) {
+    if (atomic_fetch_sub(&mapping->refs, 1) == 1) {
+        munmap(mapping->base, mapping->size);
+        free(mapping);
+    }
+}
+
+// Elements for size bytes, with the header in the same workspace block;
+// zeroed if zero is set. NULL if out of memory.
+static MatrixBuffer *buffer_new(size_t size, int zero) {
+    MatrixBuffer *buffer = zero ? workspace_calloc(WORKSPACE_ALIGN + size)
+                                : workspace_alloc(WORKSPACE_ALIGN + size);
+    if (!buffer) return NULL;
+    atomic_init(&buffer->refs, 1);
+    buffer->data = (char *)buffer + WORKSPACE_ALIGN;
+    buffer->mapping = NULL;
+    return buffer;
+}
+
+static void buffer_unref(MatrixBuffer *buffer) {
+    if (atomic_fetch_sub(&buffer->refs, 1) == 1) {
+        if (buffer->data == (char *)buffer + WORKSPACE_ALIGN) {
+            workspace_free(buffer);
+            return;
+        }
+        if (buffer->mapping) mapping_unref(buffer->mapping);
+        else workspace_free(buffer->data);
+        free(buffer);
+    }
+}
+
+static void csr_unref(MatrixCsr *csr) {
+    if (atomic_fetch_sub(&csr->refs, 1) == 1) {
+        if (csr->mapping) {
+            mapping_unref(csr->mapping);
+        } else {
+            free(csr->row_ptr);
+            free(csr->cols);
+            free(csr->values);
+        }
+        free(csr);
+    }
+}
+
+// Empty CSR arrays for rows rows with room for cap nonzeros
+MatrixCsr *csr_new(unsigned rows, size_t cap) {
+    MatrixCsr *csr = malloc(sizeof(MatrixCsr));
+    uint64_t *row_ptr = calloc((size_t)rows + 1, sizeof(uint64_t));
+    unsigned *cols = malloc((cap ? cap : 1) * sizeof(unsigned));
+    int *values = malloc((cap ? cap : 1) * sizeof(int));
+    if (!csr || !row_ptr || !cols || !values) {
+        free(csr);
+        free(row_ptr);
+        free(cols);
+        free(values);
+        return NULL;
+    }
+    atomic_init(&csr->refs, 1);
+    csr->row_ptr = row_ptr;
+    csr->cols = cols;
+    csr->values = values;
+    csr->cap = cap;
+    csr->mapping = NULL;
+    return csr;
+}
+
+static atomic_uint_fast64_t matrix_versions = 1;
+// Reason for the last failure, see matrix_last_error(). One per thread, so
+// jobs failing on worker threads neither race nor overwrite each other's.
+static _Thread_local char matrix_io_error[512];
+
+static uint64_t matrix_next_version(void) {
+    return atomic_fetch_add(&matrix_versions, 1);
+}
+
+// Tracing
+//
+// Scopes are recorded only while tracing is on, so a disabled scope is one
+// relaxed load. Each thread appends its finished scopes to a buffer of its
+// own; matrix_trace_stop() writes them all as Chrome trace events
+// (chrome://tracing, Perfetto) and prints a summary per scope name to
+// stderr: count, median and 99th percentile time, bytes and GFLOP/s.
+// Top-level operations also keep the last op timing, which is cheap enough
+// to take always: one clock read at either end of a call that does O(n^2)
+// work or more. Nested operations leave it to the outermost one.
+#define TRACE_MAX_EVENTS (1u << 20)     // per thread; later events are dropped
+
+typedef struct {
+    const char *name;
+    uint64_t start, dur;
+    uint64_t bytes;
+    double flops;
+} TraceEvent;
+
+typedef struct TraceBuffer {
+    struct TraceBuffer *next;
+    pthread_mutex_t lock;
+    unsigned tid;
+    TraceEvent *events;
+    size_t count, cap;
+    uint64_t dropped;
+} TraceBuffer;
+
+static atomic_int trace_on = 0;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static TraceBuffer *trace_buffers = NULL;   // every thread that ever recorded
+static unsigned trace_threads = 0;
+static char *trace_path = NULL;
+static uint64_t trace_origin;
+static _Thread_local TraceBuffer *trace_local = NULL;
+static _Thread_local unsigned trace_op_depth = 0;
+
+static pthread_mutex_t last_op_lock = PTHREAD_MUTEX_INITIALIZER;
+static MatrixOpTiming last_op;
+
+static uint64_t trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+MatrixTraceScope matrix_trace_begin(const char *name) {
+    MatrixTraceScope scope = { name, 0 };
+    if (atomic_load_explicit(&trace_on, memory_order_relaxed))
+        scope.start_ns = trace_now();
+    return scope;
+}
+
+static void trace_record(const char *name, uint64_t start, uint64_t end, uint64_t bytes, double flops) {
+    TraceBuffer *b = trace_local;
+    if (!b) {
+        b = calloc(1, sizeof(TraceBuffer));
+        if (!b) return;
+        pthread_mutex_init(&b->lock, NULL);
+        pthread_mutex_lock(&trace_lock);
+        b->tid = ++trace_threads;
+        b->next = trace_buffers;
+        trace_buffers = b;
+        pthread_mutex_unlock(&trace_lock);
+        trace_local = b;
+    }
+    pthread_mutex_lock(&b->lock);
+    if (b->count == b->cap && b->cap < TRACE_MAX_EVENTS) {
+        size_t cap = b->cap ? b->cap * 2 : 1024;
+        TraceEvent *events = realloc(b->events, cap * sizeof(TraceEvent));
+        if (events) {
+            b->events = events;
+            b->cap = cap;
+        }
+    }
+    if (b->count < b->cap)
+        b->events[b->count++] = (TraceEvent){ name, start, end - start, bytes, flops };
+    else
+        b->dropped++;
+    pthread_mutex_unlock(&b->lock);
+}
+
+// Close a scope; bytes and flops are what it moved and computed, 0 if unknown
+void matrix_trace_end(MatrixTraceScope scope, uint64_t bytes, double flops) {
+    if (scope.start_ns) trace_record(scope.name, scope.start_ns, trace_now(), bytes, flops);
+}
+
+// A top-level operation: timed always, for matrix_last_op()
+static MatrixTraceScope op_begin(const char *name) {
+    trace_op_depth++;
+    MatrixTraceScope scope = { name, trace_now() };
+    return scope;
+}
+
+static void op_end(MatrixTraceScope scope, uint64_t bytes, double flops) {
+    uint64_t end = trace_now();
+    if (--trace_op_depth == 0) {
+        pthread_mutex_lock(&last_op_lock);
+        last_op = (MatrixOpTiming){ scope.name, (end - scope.start_ns) * 1e-9, flops, bytes };
+        pthread_mutex_unlock(&last_op_lock);
+    }
+    if (atomic_load_explicit(&trace_on, memory_order_relaxed))
+        trace_record(scope.name, scope.start_ns, end, bytes, flops);
+}
+
+void matrix_last_op(MatrixOpTiming *out) {
+    pthread_mutex_lock(&last_op_lock);
+    *out = last_op;
+    pthread_mutex_unlock(&last_op_lock);
+}
+
+// Start recording, to be written to path by matrix_trace_stop(). Returns 0,
+// or -1 if tracing is already on.
+int matrix_trace_start(const char *path) {
+    char *copy = strdup(path);
+    pthread_mutex_lock(&trace_lock);
+    int status = -1;
+    if (copy && !trace_path) {
+        trace_path = copy;
+        copy = NULL;
+        for (TraceBuffer *b = trace_buffers; b; b = b->next) {
+            pthread_mutex_lock(&b->lock);
+            b->count = 0;
+            b->dropped = 0;
+            pthread_mutex_unlock(&b->lock);
+        }
+        trace_origin = trace_now();
+        atomic_store(&trace_on, 1);
+        status = 0;
+    }
+    pthread_mutex_unlock(&trace_lock);
+    free(copy);
+    return status;
+}
+
+typedef struct {
+    const char *name;
+    uint64_t *durations;
+    size_t count;
+    uint64_t bytes;
+    double flops, seconds;
+} TraceSummary;
+
+static int trace_compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void trace_write_summary(FILE *out, size_t total) {
+    TraceSummary *rows = calloc(total ? total : 1, sizeof(TraceSummary));
+    uint64_t *durations = malloc((total ? total : 1) * sizeof(uint64_t));
+    if (!rows || !durations) {
+        free(rows);
+        free(durations);
+        return;
+    }
+    // Group by name: count first, then hand each name its slice of durations
+    size_t nrows = 0;
+    for (TraceBuffer *b = trace_buffers; b; b = b->next) {
+        for (size_t i = 0; i < b->count; i++) {
+            const TraceEvent *e = &b->events[i];
+            size_t r = 0;
+            while (r < nrows && strcmp(rows[r].name, e->name) != 0) r++;
+            if (r == nrows) rows[nrows++].name = e->name;
+            rows[r].count++;
+            rows[r].bytes += e->bytes;
+            rows[r].flops += e->flops;
+            rows[r].seconds += e->dur * 1e-9;
+        }
+    }
+    size_t at = 0;
+    for (size_t r = 0; r < nrows; r++) {
+        rows[r].durations = durations + at;
+        at += rows[r].count;
+        rows[r].count = 0;
+    }
+    for (TraceBuffer *b = trace_buffers; b; b = b->next) {
+        for (size_t i = 0; i < b->count; i++) {
+            size_t r = 0;
+            while (strcmp(rows[r].name, b->events[i].name) != 0) r++;
+            rows[r].durations[rows[r].count++] = b->events[i].dur;
+        }
+    }
+
+    fprintf(out, "%-16s %8s %12s %12s %12s %12s %10s\n", "scope", "count", "p50 (ms)", "p99 (ms)",
+            "total (ms)", "MB", "GFLOP/s");
+    for (size_t r = 0; r < nrows; r++) {
+        TraceSummary *row = &rows[r];
+        qsort(row->durations, row->count, sizeof(uint64_t), trace_compare_u64);
+        // Nearest rank
+        double p50 = row->durations[(size_t)ceil(row->count * 0.50) - 1] * 1e-6;
+        double p99 = row->durations[(size_t)ceil(row->count * 0.99) - 1] * 1e-6;
+        fprintf(out, "%-16s %8zu %12.3f %12.3f %12.3f %12.1f", row->name, row->count, p50, p99,
+                row->seconds * 1e3, row->bytes / 1e6);
+        if (row->flops > 0 && row->seconds > 0) fprintf(out, " %10.2f\n", row->flops / row->seconds * 1e-9);
+        else fprintf(out, " %10s\n", "-");
+    }
+    free(rows);
+    free(durations);
+}
+
+// Stop recording, write the trace and print the summary to stderr. Returns
+// 0, or -1 if tracing was off or the file could not be written.
+int matrix_trace_stop(void) {
+    pthread_mutex_lock(&trace_lock);
+    if (!trace_path) {
+        pthread_mutex_unlock(&trace_lock);
+        return -1;
+    }
+    atomic_store(&trace_on, 0);
+    for (TraceBuffer *b = trace_buffers; b; b = b->next) pthread_mutex_lock(&b->lock);
+
+    FILE *file = fopen(trace_path, "w");
+    int status = file ? 0 : -1;
+    size_t total = 0;
+    uint64_t dropped = 0;
+    if (file) {
+        fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", file);
+        int first = 1;
+        for (TraceBuffer *b = trace_buffers; b; b = b->next) {
+            fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,"
+                    "\"args\":{\"name\":\"thread %u\"}}", first ? "" : ",\n", b->tid, b->tid);
+            first = 0;
+            for (size_t i = 0; i < b->count; i++) {
+                const TraceEvent *e = &b->events[i];
+                fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"matrix\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,"
+                        "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"bytes\":%" PRIu64 ",\"flops\":%.17g}}",
+                        e->name, b->tid, (double)(e->start - trace_origin) * 1e-3, e->dur * 1e-3,
+                        e->bytes, e->flops);
+            }
+            total += b->count;
+            dropped += b->dropped;
+        }
+        fputs("\n]}\n", file);
+        if (fclose(file) != 0) status = -1;
+    }
+    if (status != 0)
+        snprintf(matrix_io_error, sizeof(matrix_io_error), "%s: cannot write trace", trace_path);
+
+    fprintf(stderr, "trace: %zu events written to %s", total, trace_path);
+    if (dropped) fprintf(stderr, ", %" PRIu64 " dropped", dropped);
+    fputc('\n', stderr);
+    trace_write_summary(stderr, total);
+
+    for (TraceBuffer *b = trace_buffers; b; b = b->next) {
+        b->count = 0;
+        pthread_mutex_unlock(&b->lock);
+    }
+    free(trace_path);
+    trace_path = NULL;
+    pthread_mutex_unlock(&trace_lock);
+    return status;
+}
+
+static void trace_stop_at_exit(void) {
+    matrix_trace_stop();
+}
+
+// MAT_TRACE=FILE traces the whole run
+__attribute__((constructor)) static void trace_init_env(void) {
+    const char *path = getenv("MAT_TRACE");
+    if (path && *path && matrix_trace_start(path) == 0)
+        atexit(trace_stop_at_exit);
+}
+
+// Element kernels
+//
+// One set per type from MATRIX_TYPES, reached through matrix_types[type].
+// The numeric code reads elements as doubles through to_doubles, a plain
+// widening loop the compiler vectorizes for each type; float32 moves half
+// the bytes of float64 through it and int64 keeps values past 2^31.
+#define MATRIX_TYPE_KERNELS(ID, name, ctype, format, limit)                             \
+    static void name##_to_doubles(const void *src, size_t count, double *out) {        \
+        const ctype *s = src;                                                           \
+        for (size_t i = 0; i < count; i++) out[i] = (double)s[i];                      \
+    }                                                                                   \
+    static void name##_from_doubles(const double *src, size_t count, void *out) {      \
+        ctype *d = out;                                                                 \
+        for (size_t i = 0; i < count; i++) d[i] = (ctype)src[i];                       \
+    }                                                                                   \
+    static size_t name##_nonzeros(const void *src, size_t count) {                     \
+        const ctype *s = src;                                                           \
+        size_t nonzeros = 0;                                                            \
+        for (size_t i = 0; i < count; i++) nonzeros += s[i] != 0;                      \
+        return nonzeros;                                                                \
+    }                                                                                   \
+    static int name##_format(const void *src, size_t index, char *out, size_t size) {  \
+        return snprintf(out, size, format, ((const ctype *)src)[index]);               \
+    }                                                                                   \
+    static void name##_write_text(FILE *file, const void *src, size_t count) {         \
+        const ctype *s = src;                                                           \
+        for (size_t i = 0; i < count; i++) fprintf(file, format " ", s[i]);            \
+    }
+MATRIX_TYPES(MATRIX_TYPE_KERNELS)
+
+#define MATRIX_TYPE_INFO(ID, name, ctype, format, limit) \
+    { #name, sizeof(ctype), limit, name##_to_doubles, name##_from_doubles, name##_nonzeros, \
+      name##_format, name##_write_text },
+const MatrixTypeInfo matrix_types[MATRIX_TYPE_COUNT] = { MATRIX_TYPES(MATRIX_TYPE_INFO) };
+
+const char *matrix_type_name(MatrixType type) {
+    return matrix_types[type].name;
+}
+
+// Type called name ("int32", "float64", ...); returns 0, or -1 if unknown
+int matrix_type_from_name(const char *name, MatrixType *type) {
+    for (int t = 0; t < MATRIX_TYPE_COUNT; t++) {
+        if (strcmp(name, matrix_types[t].name) == 0) {
+            *type = (MatrixType)t;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int matrix_type_is_integer(MatrixType type) {
+    return isfinite(matrix_types[type].limit);
+}
+
+// Whether value can be stored as type without changing it, rounding aside
+// for floating point
+static int matrix_type_holds(MatrixType type, double value) {
+    double limit = matrix_types[type].limit;
+    if (!isfinite(limit)) return 1;
+    return value == floor(value) && value >= -limit && value < limit;
+}
+
+// Value of an element as written by the user: an integer within range for
+// integer types, parsed straight to int64 so no digit is lost, or a number
+// within the finite range of a floating point type (inf and nan written out
+// are fine). Returns 0, or -1 if text does not fit type.
+int matrix_parse_value(MatrixType type, const char *text, MatrixValue *value) {
+    char *end;
+    errno = 0;
+    if (matrix_type_is_integer(type)) {
+        long long v = strtoll(text, &end, 10);
+        if (errno == ERANGE || (type == MATRIX_INT32 && (v < INT32_MIN || v > INT32_MAX)))
+            return -1;
+        value->i = v;
+    } else {
+        value->f = strtod(text, &end);
+        // Past the largest finite value of the type, not infinity written out
+        if ((errno == ERANGE && isinf(value->f)) ||
+            (type == MATRIX_FLOAT32 && isinf((float)value->f) && !isinf(value->f)))
+            return -1;
+    }
+    if (end == text) return -1;
+    while (*end == ' ' || *end == '\t') end++;
+    return *end ? -1 : 0;
+}
+
+// matrix_parse_value() as a double, which rounds int64 values past 2^53
+int matrix_parse_element(MatrixType type, const char *text, double *value) {
+    MatrixValue v;
+    if (matrix_parse_value(type, text, &v) != 0) return -1;
+    *value = matrix_type_is_integer(type) ? (double)v.i : v.f;
+    return 0;
+}
+
+// A new unnamed matrix over buffer, taking ownership of it
+static Matrix *matrix_wrap_buffer(unsigned M, unsigned N, MatrixType type, MatrixBuffer *buffer) {
+    Matrix *matrix = malloc(sizeof(Matrix));
+    char *name = strdup("");
+    if (!matrix || !name || !buffer) {
+        free(matrix);
+        free(name);
+        if (buffer) buffer_unref(buffer);
+        return NULL;
+    }
+    matrix->M = M;
+    matrix->N = N;
+    matrix->type = type;
+    matrix->data = buffer->data;
+    matrix->name = name;
+    matrix->buffer = buffer;
+    matrix->csr = NULL;
+    matrix->version = matrix_next_version();
+    return matrix;
+}
+
+// Wrap existing elements in a new unnamed matrix. Takes ownership of data,
+// which came from workspace_alloc(), or of one reference to mapping when
+// data points into it; on failure both are released.
+static Matrix *matrix_wrap(unsigned M, unsigned N, MatrixType type, void *data, MatrixMapping *mapping) {
+    MatrixBuffer *buffer = data ? malloc(sizeof(MatrixBuffer)) : NULL;
+    if (!buffer) {
+        if (mapping) mapping_unref(mapping);
+        else workspace_free(data);
+        return NULL;
+    }
+    atomic_init(&buffer->refs, 1);
+    buffer->data = data;
+    buffer->mapping = mapping;
+    return matrix_wrap_buffer(M, N, type, buffer);
+}
+
+// Wrap CSR arrays in a new unnamed sparse matrix, taking ownership of csr
+Matrix *matrix_wrap_csr(unsigned M, unsigned N, MatrixCsr *csr) {
+    Matrix *matrix = malloc(sizeof(Matrix));
+    char *name = strdup("");
+    if (!matrix || !name || !csr) {
+        free(matrix);
+        free(name);
+        if (csr) csr_unref(csr);
+        return NULL;
+    }
+    matrix->M = M;
+    matrix->N = N;
+    matrix->type = MATRIX_INT32;
+    matrix->data = NULL;
+    matrix->name = name;
+    matrix->buffer = NULL;
+    matrix->csr = csr;
+    matrix->version = matrix_next_version();
+    return matrix;
+}
+
+// A new M x N matrix of int32 elements, all zero
+Matrix *create_matrix(unsigned M, unsigned N) {
+    return create_matrix_typed(M, N, MATRIX_INT32);
+}
+
+// A new M x N matrix of type elements, all zero
+Matrix *create_matrix_typed(unsigned M, unsigned N, MatrixType type) {
+    return matrix_wrap_buffer(M, N, type, buffer_new((size_t)M * N * matrix_types[type].size, 1));
+}
+
+// A new M x N matrix with all elements zero, stored sparse
+Matrix *create_sparse_matrix(unsigned M, unsigned N) {
+    return matrix_wrap_csr(M, N, csr_new(M, 0));
+}
+
+void free_matrix(Matrix *matrix) {
+    if (!matrix) return;
+    if (matrix->csr) csr_unref(matrix->csr);
+    else buffer_unref(matrix->buffer);
+    free(matrix->name);
+    free(matrix);
+}
+
+// Sparse or dense storage
+//
+// An int32 matrix is stored sparse when at most SPARSE_MAX_DENSITY of its
+// elements are nonzero and it has at least SPARSE_MIN_ELEMENTS of them;
+// smaller ones cost little either way and run faster dense. Other element
+// types are always dense. Loading picks the storage by this rule, and saving
+// picks the file encoding by it. Switching storage keeps the version, since
+// the elements stay the same.
+#define SPARSE_MAX_DENSITY 0.1
+#define SPARSE_MIN_ELEMENTS 65536
+
+int prefers_sparse(unsigned M, unsigned N, size_t nonzeros) {
+    size_t count = (size_t)M * N;
+    return count >= SPARSE_MIN_ELEMENTS && nonzeros <= SPARSE_MAX_DENSITY * count;
+}
+
+size_t matrix_nonzeros(const Matrix *matrix) {
+    if (matrix->csr) return matrix->csr->row_ptr[matrix->M];
+    return matrix_types[matrix->type].nonzeros(matrix->data, (size_t)matrix->M * matrix->N);
+}
+
+// Position of column j in CSR row i, or where it would be inserted
+static size_t csr_find(const MatrixCsr *csr, unsigned i, unsigned j) {
+    size_t lo = csr->row_ptr[i], hi = csr->row_ptr[i + 1];
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (csr->cols[mid] < j) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// Element (i, j) as a double, which is exact for every type but int64
+// values past 2^53
+double matrix_get(const Matrix *matrix, unsigned i, unsigned j) {
+    if (!matrix->csr) {
+        size_t size = matrix_types[matrix->type].size;
+        double value;
+        matrix_types[matrix->type].to_doubles((const char *)matrix->data + ((size_t)i * matrix->N + j) * size,
+                                              1, &value);
+        return value;
+    }
+    const MatrixCsr *csr = matrix->csr;
+    size_t at = csr_find(csr, i, j);
+    return at < csr->row_ptr[i + 1] && csr->cols[at] == j ? csr->values[at] : 0;
+}
+
+// Element (i, j) as text in out, exact for every type; returns the length
+// snprintf would have written
+int matrix_format_element(const Matrix *matrix, unsigned i, unsigned j, char *out, size_t size) {
+    if (matrix->csr) return snprintf(out, size, "%d", (int)matrix_get(matrix, i, j));
+    return matrix_types[matrix->type].format(matrix->data, (size_t)i * matrix->N + j, out, size);
+}
+
+// Every element of matrix, row-major, into the M x N doubles at out
+void matrix_to_doubles(const Matrix *matrix, double *out) {
+    size_t count = (size_t)matrix->M * matrix->N;
+    if (!matrix->csr) {
+        matrix_types[matrix->type].to_doubles(matrix->data, count, out);
+        return;
+    }
+    const MatrixCsr *csr = matrix->csr;
+    memset(out, 0, count * sizeof(double));
+    for (unsigned i = 0; i < matrix->M; i++)
+        for (uint64_t p = csr->row_ptr[i]; p < csr->row_ptr[i + 1]; p++)
+            out[(size_t)i * matrix->N + csr->cols[p]] = csr->values[p];
+}
+
+// Store matrix dense. Returns 0, or -1 if out of memory.
+int matrix_densify(Matrix *matrix) {
+    if (!matrix->csr) return 0;
+    MatrixBuffer *buffer = buffer_new((size_t)matrix->M * matrix->N * sizeof(int), 1);
+    if (!buffer) return -1;
+    int *data = buffer->data;
+    const MatrixCsr *csr = matrix->csr;
+    for (unsigned i = 0; i < matrix->M; i++)
+        for (uint64_t p = csr->row_ptr[i]; p < csr->row_ptr[i + 1]; p++)
+            data[(size_t)i * matrix->N + csr->cols[p]] = csr->values[p];
+    csr_unref(matrix->csr);
+    matrix->csr = NULL;
+    matrix->buffer = buffer;
+    matrix->data = data;
+    return 0;
+}
+
+// Store an int32 matrix sparse. Returns 0, or -1 if out of memory or matrix
+// has another element type.
+int matrix_sparsify(Matrix *matrix) {
+    if (matrix->csr) return 0;
+    if (matrix->type != MATRIX_INT32) return -1;
+    MatrixCsr *csr = csr_new(matrix->M, matrix_nonzeros(matrix));
+    if (!csr) return -1;
+    size_t nnz = 0;
+    for (unsigned i = 0; i < matrix->M; i++) {
+        const int *row = (const int *)matrix->data + (size_t)i * matrix->N;
+        for (unsigned j = 0; j < matrix->N; j++) {
+            if (!row[j]) continue;
+            csr->cols[nnz] = j;
+            csr->values[nnz++] = row[j];
+        }
+        csr->row_ptr[i + 1] = nnz;
+    }
+    buffer_unref(matrix->buffer);
+    matrix->buffer = NULL;
+    matrix->data = NULL;
+    matrix->csr = csr;
+    return 0;
+}
+
+// Whether matrix should be stored, and saved, sparse
+static int matrix_prefers_sparse(const Matrix *matrix) {
+    return matrix->type == MATRIX_INT32 && prefers_sparse(matrix->M, matrix->N, matrix_nonzeros(matrix));
+}
+
+// Switch matrix to the storage its density calls for, if memory allows
+void matrix_choose_storage(Matrix *matrix) {
+    if (matrix_prefers_sparse(matrix)) matrix_sparsify(matrix);
+    else matrix_densify(matrix);
+}
+
+// CSR arrays of matrix for writing, copied first if shared or mapped
+static MatrixCsr *matrix_csr_mut(Matrix *matrix) {
+    MatrixCsr *csr = matrix->csr;
+    if (atomic_load(&csr->refs) == 1 && !csr->mapping) return csr;
+    size_t nnz = csr->row_ptr[matrix->M];
+    MatrixCsr *copy = csr_new(matrix->M, nnz);
+    if (!copy) return NULL;
+    memcpy(copy->row_ptr, csr->row_ptr, ((size_t)matrix->M + 1) * sizeof(uint64_t));
+    memcpy(copy->cols, csr->cols, nnz * sizeof(unsigned));
+    memcpy(copy->values, csr->values, nnz * sizeof(int));
+    csr_unref(csr);
+    matrix->csr = copy;
+    return copy;
+}
+
+// Write one element of a sparse matrix, inserting or removing its entry,
+// which moves the entries after it: O(nonzeros)
+static int csr_set(Matrix *matrix, unsigned i, unsigned j, int value) {
+    MatrixCsr *csr = matrix_csr_mut(matrix);
+    if (!csr) return -1;
+    matrix->version = matrix_next_version();
+    size_t nnz = csr->row_ptr[matrix->M], at = csr_find(csr, i, j);
+    int present = at < csr->row_ptr[i + 1] && csr->cols[at] == j;
+    if (present && value) {
+        csr->values[at] = value;
+        return 0;
+    }
+    if (present) {
+        memmove(csr->cols + at, csr->cols + at + 1, (nnz - at - 1) * sizeof(unsigned));
+        memmove(csr->values + at, csr->values + at + 1, (nnz - at - 1) * sizeof(int));
+        for (unsigned r = i + 1; r <= matrix->M; r++) csr->row_ptr[r]--;
+        return 0;
+    }
+    if (nnz == csr->cap) {
+        size_t cap = csr->cap ? csr->cap * 2 : 64;
+        unsigned *cols = realloc(csr->cols, cap * sizeof(unsigned));
+        if (cols) csr->cols = cols;
+        int *values = cols ? realloc(csr->values, cap * sizeof(int)) : NULL;
+        if (!values) return -1;
+        csr->values = values;
+        csr->cap = cap;
+    }
+    memmove(csr->cols + at + 1, csr->cols + at, (nnz - at) * sizeof(unsigned));
+    memmove(csr->values + at + 1, csr->values + at, (nnz - at) * sizeof(int));
+    csr->cols[at] = j;
+    csr->values[at] = value;
+    for (unsigned r = i + 1; r <= matrix->M; r++) csr->row_ptr[r]++;
+    return 0;
+}
+
+// Elements of matrix for writing. A buffer shared with other matrices is
+// copied first, so the write stays private to this one, and a sparse matrix
+// is stored dense. NULL if out of memory.
+void *matrix_data_mut(Matrix *matrix) {
+    if (matrix_densify(matrix) != 0) return NULL;
+    MatrixBuffer *buffer = matrix->buffer;
+    matrix->version = matrix_next_version();
+    if (atomic_load(&buffer->refs) == 1) return matrix->data;
+
+    size_t size = (size_t)matrix->M * matrix->N * matrix_types[matrix->type].size;
+    MatrixBuffer *copy = buffer_new(size, 0);
+    if (!copy) return NULL;
+    memcpy(copy->data, buffer->data, size);
+    matrix->buffer = copy;
+    matrix->data = copy->data;
+    buffer_unref(buffer);
+    return copy->data;
+}
+
+int matrix_set_name(Matrix *matrix, const char *name) {
+    char *copy = strdup(name);
+    if (!copy) return -1;
+    free(matrix->name);
+    matrix->name = copy;
+    return 0;
+}
+
+// Writing an unchanged value leaves a shared buffer shared. A sparse matrix
+// stays sparse. value must fit the element type (see matrix_parse_element).
+int set_element(Matrix *matrix, unsigned i, unsigned j, double value) {
+    size_t index = (size_t)i * matrix->N + j;
+    if (matrix_get(matrix, i, j) == value) return 0;
+    if (matrix->csr) return csr_set(matrix, i, j, (int)value);
+    char *data = matrix_data_mut(matrix);
+    if (!data) return -1;
+    matrix_types[matrix->type].from_doubles(&value, 1, data + index * matrix_types[matrix->type].size);
+    return 0;
+}
+
+// Element (i, j) as stored: int64 for the integer types, exact whatever
+// its size
+MatrixValue matrix_get_value(const Matrix *matrix, unsigned i, unsigned j) {
+    MatrixValue value;
+    if (matrix->type == MATRIX_INT64)
+        value.i = ((const int64_t *)matrix->data)[(size_t)i * matrix->N + j];
+    else if (matrix_type_is_integer(matrix->type))
+        value.i = (int64_t)matrix_get(matrix, i, j);
+    else
+        value.f = matrix_get(matrix, i, j);
+    return value;
+}
+
+// set_element() for a value from matrix_parse_value(), which writes int64
+// elements without passing them through double
+int matrix_set_value(Matrix *matrix, unsigned i, unsigned j, MatrixValue value) {
+    if (matrix->type != MATRIX_INT64)
+        return set_element(matrix, i, j, matrix_type_is_integer(matrix->type) ? (double)value.i : value.f);
+    size_t index = (size_t)i * matrix->N + j;
+    if (((const int64_t *)matrix->data)[index] == value.i) return 0;
+    int64_t *data = matrix_data_mut(matrix);
+    if (!data) return -1;
+    data[index] = value.i;
+    return 0;
+}
+
+// A new handle on the same elements; they are copied on the first write
+Matrix *copy_matrix(Matrix *source) {
+    if (!source) return NULL;
+    
+    Matrix *copy = malloc(sizeof(Matrix));
+    if (!copy) return NULL;
+    copy->name = strdup(source->name);
+    if (!copy->name) {
+        free(copy);
+        return NULL;
+    }
+    copy->M = source->M;
+    copy->N = source->N;
+    copy->type = source->type;
+    copy->data = source->data;
+    copy->buffer = source->buffer;
+    copy->csr = source->csr;
+    copy->version = source->version;
+    if (source->csr) atomic_fetch_add(&source->csr->refs, 1);
+    else atomic_fetch_add(&source->buffer->refs, 1);
+    
+    return copy;
+}
+
+// A dense handle on the elements of matrix, for the kernels that index them
+// directly. NULL if out of memory.
+static Matrix *matrix_dense_copy(const Matrix *matrix) {
+    Matrix *copy = copy_matrix((Matrix *)matrix);
+    if (copy && matrix_densify(copy) != 0) {
+        free_matrix(copy);
+        copy = NULL;
+    }
+    return copy;
+}
+
+// A copy of matrix with type elements, named like it. Elements pass through
+// double a block at a time; NULL if out of memory or, for an integer type,
+// an element is out of its range or not an integer, with the reason in
+// matrix_last_error(). Nothing is rounded to fit.
+Matrix *matrix_convert(const Matrix *matrix, MatrixType type) {
+    if (matrix->type == type) return copy_matrix((Matrix *)matrix);
+    Matrix *source = matrix_dense_copy(matrix);
+    Matrix *result = source ? create_matrix_typed(matrix->M, matrix->N, type) : NULL;
+    char *name = result ? strdup(matrix->name) : NULL;
+    double *block = name ? malloc(4096 * sizeof(double)) : NULL;
+    if (!block) {
+        snprintf(matrix_io_error, sizeof(matrix_io_error), "out of memory");
+        free(name);
+        free_matrix(result);
+        free_matrix(source);
+        return NULL;
+    }
+    free(result->name);
+    result->name = name;
+
+    const MatrixTypeInfo *from = &matrix_types[matrix->type], *to = &matrix_types[type];
+    size_t count = (size_t)matrix->M * matrix->N;
+    for (size_t start = 0; start < count; start += 4096) {
+        size_t n = count - start < 4096 ? count - start : 4096;
+        from->to_doubles((const char *)source->data + start * from->size, n, block);
+        for (size_t i = 0; i < n && isfinite(to->limit); i++) {
+            if (!matrix_type_holds(type, block[i])) {
+                snprintf(matrix_io_error, sizeof(matrix_io_error),
+                         block[i] == floor(block[i]) ? "element (%zu, %zu) does not fit in %s"
+                                                     : "element (%zu, %zu) is not an integer, as %s needs",
+                         (start + i) / matrix->N + 1, (start + i) % matrix->N + 1, to->name);
+                free(block);
+                free_matrix(result);
+                free_matrix(source);
+                return NULL;
+            }
+        }
+        to->from_doubles(block, n, (char *)result->data + start * to->size);
+    }
+    free(block);
+    free_matrix(source);
+    return result;
+}
+
+// Registry hash index: open addressing with linear probing over a power of
+// two number of slots, each holding a saved_matrices index + 1 (0 = empty).
+// Kept at most half full. saved_record_bytes holds the size of each saved
+// matrix's journal record, 0 while there is no journal.
+static size_t saved_capacity = 0;
+static uint64_t *saved_record_bytes = NULL;
+static size_t *saved_index = NULL;
+static size_t saved_index_slots = 0;
+
+static int64_t journal_put(Matrix *matrix);
+static int journal_delete(const char *name);
+static void journal_clear(void);
+static void journal_account(uint64_t dropped, uint64_t added);
+static void journal_maybe_compact(void);
+int registry_apply_deferred(int *cleared);
+
+static uint64_t name_hash(const char *name) {
+    uint64_t h = 0xcbf29ce484222325ULL;    // FNV-1a
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++)
+        h = (h ^ *p) * 0x100000001b3ULL;
+    return h;
+}
+
+static void registry_index_insert(size_t i) {
+    size_t mask = saved_index_slots - 1;
+    size_t slot = name_hash(saved_matrices[i]->name) & mask;
+    while (saved_index[slot]) slot = (slot + 1) & mask;
+    saved_index[slot] = i + 1;
+}
+
+// Position of the saved matrix called name, or -1
+static int registry_find(const char *name) {
+    if (!saved_index_slots) return -1;
+    size_t mask = saved_index_slots - 1;
+    for (size_t slot = name_hash(name) & mask; saved_index[slot]; slot = (slot + 1) & mask) {
+        size_t i = saved_index[slot] - 1;
+        if (strcmp(saved_matrices[i]->name, name) == 0) return (int)i;
+    }
+    return -1;
+}
+
+// Room for one more saved matrix. Returns 0, or -1 if out of memory.
+static int registry_reserve(void) {
+    if ((size_t)num_saved_matrices == saved_capacity) {
+        size_t cap = saved_capacity ? saved_capacity * 2 : 16;
+        Matrix **grown = cap <= INT_MAX ? realloc(saved_matrices, cap * sizeof(Matrix *)) : NULL;
+        if (!grown) return -1;
+        saved_matrices = grown;
+        uint64_t *bytes = realloc(saved_record_bytes, cap * sizeof(uint64_t));
+        if (!bytes) return -1;
+        saved_record_bytes = bytes;
+        saved_capacity = cap;
+    }
+    if (2 * ((size_t)num_saved_matrices + 1) > saved_index_slots) {
+        size_t slots = saved_index_slots ? saved_index_slots * 2 : 32;
+        size_t *index = calloc(slots, sizeof(size_t));
+        if (!index) return -1;
+        free(saved_index);
+        saved_index = index;
+        saved_index_slots = slots;
+        for (int i = 0; i < num_saved_matrices; i++)
+            registry_index_insert(i);
+    }
+    return 0;
+}
+
+// The registry as a whole, so a journal can be replayed into an empty one
+// and swapped in only once the replay has succeeded
+typedef struct {
+    Matrix **matrices;
+    int count;
+    size_t capacity;
+    uint64_t *record_bytes;
+    size_t *index;
+    size_t index_slots;
+} RegistryState;
+
+// Exchange the registry with state
+static void registry_swap(RegistryState *state) {
+    RegistryState current = { saved_matrices, num_saved_matrices, saved_capacity, saved_record_bytes,
+                              saved_index, saved_index_slots };
+    saved_matrices = state->matrices;
+    num_saved_matrices = state->count;
+    saved_capacity = state->capacity;
+    saved_record_bytes = state->record_bytes;
+    saved_index = state->index;
+    saved_index_slots = state->index_slots;
+    *state = current;
+}
+
+static void registry_state_free(RegistryState *state) {
+    for (int i = 0; i < state->count; i++)
+        free_matrix(state->matrices[i]);
+    free(state->matrices);
+    free(state->record_bytes);
+    free(state->index);
+    memset(state, 0, sizeof(*state));
+}
+
+// Add matrix to the registry, replacing any saved matrix of the same name.
+// Takes ownership of matrix, also on failure. With a journal open the put
+// is recorded first, and a failed write leaves the registry as it was.
+int registry_put(Matrix *matrix) {
+    registry_apply_deferred(NULL);
+    int existing = registry_find(matrix->name);
+    int64_t bytes = existing >= 0 || registry_reserve() == 0 ? journal_put(matrix) : -1;
+    if (bytes < 0) {
+        free_matrix(matrix);
+        return -1;
+    }
+
+    if (existing >= 0) {
+        journal_account(saved_record_bytes[existing], (uint64_t)bytes);
+        free_matrix(saved_matrices[existing]);
+        saved_matrices[existing] = matrix;
+        saved_record_bytes[existing] = (uint64_t)bytes;
+    } else {
+        journal_account(0, (uint64_t)bytes);
+        saved_matrices[num_saved_matrices] = matrix;
+        saved_record_bytes[num_saved_matrices] = (uint64_t)bytes;
+        registry_index_insert(num_saved_matrices);
+        num_saved_matrices++;
+    }
+    journal_maybe_compact();
+    return 0;
+}
+
+// Save matrix to global storage under name. Shares the elements with matrix,
+// so this is O(1) whatever the size, or O(size of matrix) with a journal
+// open. Returns 0 on success.
+int save_matrix(Matrix *matrix, const char *name) {
+    if (!matrix || !name) return -1;
+
+    MatrixTraceScope scope = matrix_trace_begin("registry.save");
+    Matrix *copy = copy_matrix(matrix);
+    int status = -1;
+    if (copy && matrix_set_name(copy, name) != 0) free_matrix(copy);
+    else if (copy) status = registry_put(copy);
+    matrix_trace_end(scope, 0, 0.0);
+    return status;
+}
+
+// Remove the saved matrix called name, keeping the order of the others.
+// Returns 0, or -1 if there is none or the journal cannot record it.
+int delete_matrix(const char *name) {
+    registry_apply_deferred(NULL);
+    matrix_io_error[0] = '\0';
+    int i = name ? registry_find(name) : -1;
+    if (i < 0 || journal_delete(name) != 0) return -1;
+
+    journal_account(saved_record_bytes[i], 0);
+    free_matrix(saved_matrices[i]);
+    num_saved_matrices--;
+    memmove(&saved_matrices[i], &saved_matrices[i + 1], (num_saved_matrices - i) * sizeof(Matrix *));
+    memmove(&saved_record_bytes[i], &saved_record_bytes[i + 1], (num_saved_matrices - i) * sizeof(uint64_t));
+    memset(saved_index, 0, saved_index_slots * sizeof(size_t));
+    for (int j = 0; j < num_saved_matrices; j++)
+        registry_index_insert(j);
+    journal_maybe_compact();
+    return 0;
+}
+
+// Load matrix from global storage
+Matrix *load_matrix(const char *name) {
+    if (!name) return NULL;
+    
+    MatrixTraceScope scope = matrix_trace_begin("registry.load");
+    int i = registry_find(name);
+    Matrix *matrix = i >= 0 ? copy_matrix(saved_matrices[i]) : NULL;
+    matrix_trace_end(scope, 0, 0.0);
+    return matrix;
+}
+
+// Binary matrix store (.matb)
+//
+// A 64-byte header, then each matrix's elements as one block starting on a
+// 64-byte boundary, then the table of contents and the names. A block is
+// either the row-major elements, with the element type in the entry, or, for
+// an int32 matrix sparse enough to be stored sparse, its CSR arrays: M + 1
+// uint64 row offsets, then the column of each nonzero, then the values.
+// Files are written in host byte order; the byte-order mark in the header
+// lets a reader on the other endianness reject them. Loading maps the file
+// privately, so a Matrix points straight into the mapping and any edits stay
+// in copy-on-write pages of this process.
+//
+// A compressed store (.matz) holds dense matrices as packed blocks instead,
+// flagged MATB_PACKED in the entry type; see "Compressed store blocks".
+// Those are decoded into new matrices on load rather than mapped.
+#define MATB_MAGIC "MATSTORE"
+#define MATB_VERSION 1
+#define MATB_BYTE_ORDER 0x01020304u
+#define MATB_ALIGN 64
+#define MATB_INT32 1
+#define MATB_CSR_INT32 2
+#define MATB_INT64 3
+#define MATB_FLOAT32 4
+#define MATB_FLOAT64 5
+#define MATB_PACKED 0x100       // or'ed with a dense type
+
+// Entry element type of each dense MatrixType
+static const uint32_t matb_dense_types[MATRIX_TYPE_COUNT] = {
+    [MATRIX_INT32] = MATB_INT32, [MATRIX_INT64] = MATB_INT64,
+    [MATRIX_FLOAT32] = MATB_FLOAT32, [MATRIX_FLOAT64] = MATB_FLOAT64,
+};
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t count;
+    uint64_t toc_offset;
+    uint64_t file_size;
+    uint8_t reserved[24];
+} MatbHeader;
+
+typedef struct MatbEntry {
+    uint64_t name_offset;
+    uint32_t name_len;
+    uint32_t elem_type;
+    uint32_t rows;
+    uint32_t cols;
+    uint64_t data_offset;
+    uint64_t data_size;
+    uint64_t checksum;
+} MatbEntry;
+
+_Static_assert(sizeof(MatbHeader) == 64, "MatbHeader layout");
+_Static_assert(sizeof(MatbEntry) == 48, "MatbEntry layout");
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+// Four independent multiply-rotate lanes over 64-bit words, so the loop is
+// limited by load bandwidth rather than one dependency chain
+static uint64_t matb_checksum(const void *data, size_t size) {
+    const uint64_t P1 = 0x9E3779B185EBCA87ULL, P2 = 0xC2B2AE3D27D4EB4FULL;
+    const unsigned char *p = data;
+    MatrixTraceScope scope = matrix_trace_begin("matb.checksum");
+    uint64_t h0 = P1, h1 = P2, h2 = ~P1, h3 = ~P2;
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        uint64_t w[4];
+        memcpy(w, p + i, 32);
+        h0 = rotl64(h0 + w[0] * P2, 31) * P1;
+        h1 = rotl64(h1 + w[1] * P2, 31) * P1;
+        h2 = rotl64(h2 + w[2] * P2, 31) * P1;
+        h3 = rotl64(h3 + w[3] * P2, 31) * P1;
+    }
+    uint64_t acc = size * P1 + rotl64(h0, 1) + rotl64(h1, 7) + rotl64(h2, 12) + rotl64(h3, 18);
+    for (; i < size; i += 8) {
+        uint64_t w = 0;
+        memcpy(&w, p + i, size - i < 8 ? size - i : 8);
+        acc = rotl64(acc ^ (w * P2), 27) * P1;
+    }
+    acc ^= acc >> 33;
+    acc *= P2;
+    acc ^= acc >> 29;
+    matrix_trace_end(scope, size, 0.0);
+    return acc;
+}
+
+// Checksum of a CSR block, combined from its three arrays so writing does
+// not have to join them first
+static uint64_t matb_csr_checksum(const MatrixCsr *csr, unsigned rows) {
+    size_t nnz = csr->row_ptr[rows];
+    return matb_checksum(csr->row_ptr, ((size_t)rows + 1) * sizeof(uint64_t)) ^
+           rotl64(matb_checksum(csr->cols, nnz * sizeof(unsigned)), 21) ^
+           rotl64(matb_checksum(csr->values, nnz * sizeof(int)), 42);
+}
+
+int has_suffix(const char *s, const char *suffix) {
+    size_t n = strlen(s), m = strlen(suffix);
+    return n >= m && strcmp(s + n - m, suffix) == 0;
+}
+
+static int matb_write_packed(FILE *file, const Matrix *dense, MatbEntry *entry);
+static Matrix *matb_read_packed(const MatbEntry *e, const char *data, MatrixType type);
+
+static int write_padding(FILE *file, uint64_t *offset) {
+    static const char zeros[MATB_ALIGN];
+    size_t pad = (MATB_ALIGN - *offset % MATB_ALIGN) % MATB_ALIGN;
+    if (pad && fwrite(zeros, 1, pad, file) != pad) return -1;
+    *offset += pad;
+    return 0;
+}
+
+// Write the elements of matrix in the encoding its density calls for, from
+// a handle stored that way, and fill in entry's type, size and checksum.
+// packed stores dense matrices as packed blocks.
+static int matb_write_elements(FILE *file, Matrix *matrix, MatbEntry *entry, int packed) {
+    int sparse = matrix_prefers_sparse(matrix);
+    Matrix *view = copy_matrix(matrix);
+    if (!view || (sparse ? matrix_sparsify(view) : matrix_densify(view)) != 0) {
+        free_matrix(view);
+        return -1;
+    }
+
+    int status = 0;
+    if (sparse) {
+        const MatrixCsr *csr = view->csr;
+        size_t nnz = csr->row_ptr[view->M], ptr_size = ((size_t)view->M + 1) * sizeof(uint64_t);
+        entry->elem_type = MATB_CSR_INT32;
+        entry->data_size = ptr_size + nnz * (sizeof(unsigned) + sizeof(int));
+        entry->checksum = matb_csr_checksum(csr, view->M);
+        if (fwrite(csr->row_ptr, 1, ptr_size, file) != ptr_size ||
+            (nnz && (fwrite(csr->cols, sizeof(unsigned), nnz, file) != nnz ||
+                     fwrite(csr->values, sizeof(int), nnz, file) != nnz)))
+            status = -1;
+    } else if (packed) {
+        status = matb_write_packed(file, view, entry);
+    } else {
+        size_t size = (size_t)view->M * view->N * matrix_types[view->type].size;
+        entry->elem_type = matb_dense_types[view->type];
+        entry->data_size = size;
+        entry->checksum = matb_checksum(view->data, size);
+        if (size && fwrite(view->data, 1, size, file) != size) status = -1;
+    }
+    free_matrix(view);
+    return status;
+}
+
+// Write matrices to file as a .matb store, or a compressed one if packed.
+// progress counts rows. Returns 0 on success.
+static int save_matrices_to_store(FILE *file, Matrix *const *matrices, int count, int packed,
+                                  MatrixProgress *progress) {
+    MatbEntry *entries = calloc(count ? count : 1, sizeof(MatbEntry));
+    if (!entries) return -1;
+
+    MatbHeader header;
+    memset(&header, 0, sizeof(header));
+    int status = -1;
+    uint64_t offset = sizeof(header);
+    if (fwrite(&header, sizeof(header), 1, file) != 1) goto out;
+
+    for (int i = 0; i < count; i++) {
+        if (progress && atomic_load(&progress->cancel)) goto out;
+        if (write_padding(file, &offset) != 0) goto out;
+        entries[i].rows = matrices[i]->M;
+        entries[i].cols = matrices[i]->N;
+        entries[i].data_offset = offset;
+        if (matb_write_elements(file, matrices[i], &entries[i], packed) != 0) goto out;
+        offset += entries[i].data_size;
+        if (progress) atomic_fetch_add(&progress->done, matrices[i]->M);
+    }
+
+    if (write_padding(file, &offset) != 0) goto out;
+    header.toc_offset = offset;
+    uint64_t name_offset = offset + (uint64_t)count * sizeof(MatbEntry);
+    for (int i = 0; i < count; i++) {
+        entries[i].name_offset = name_offset;
+        entries[i].name_len = (uint32_t)strlen(matrices[i]->name);
+        name_offset += entries[i].name_len;
+    }
+    if (count && fwrite(entries, sizeof(MatbEntry), count, file) != (size_t)count) goto out;
+    for (int i = 0; i < count; i++)
+        if (fwrite(matrices[i]->name, 1, entries[i].name_len, file) != entries[i].name_len) goto out;
+
+    memcpy(header.magic, MATB_MAGIC, sizeof(header.magic));
+    header.version = MATB_VERSION;
+    header.byte_order = MATB_BYTE_ORDER;
+    header.count = count;
+    header.file_size = name_offset;
+    if (fseek(file, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, file) != 1) goto out;
+    status = 0;
+
+out:
+    free(entries);
+    return status;
+}
+
+int is_matrix_store_file(const char *filename) {
+    char magic[8];
+    FILE *file = fopen(filename, "rb");
+    if (!file) return 0;
+    int match = fread(magic, 1, sizeof(magic), file) == sizeof(magic) &&
+                memcmp(magic, MATB_MAGIC, sizeof(magic)) == 0;
+    fclose(file);
+    return match;
+}
+
+// Map a store and validate its header and table of contents
+int matrix_store_open(const char *filename, MatrixStore *store) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(MatbHeader)) {
+        close(fd);
+        return -1;
+    }
+    size_t size = (size_t)st.st_size;
+    void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return -1;
+
+    const MatbHeader *header = base;
+    uint64_t toc_bytes = header->count * sizeof(MatbEntry);
+    if (memcmp(header->magic, MATB_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != MATB_VERSION || header->byte_order != MATB_BYTE_ORDER ||
+        header->file_size != size || header->toc_offset > size ||
+        header->count > size / sizeof(MatbEntry) || toc_bytes > size - header->toc_offset) {
+        munmap(base, size);
+        return -1;
+    }
+
+    MatrixMapping *mapping = malloc(sizeof(MatrixMapping));
+    if (!mapping) {
+        munmap(base, size);
+        return -1;
+    }
+    mapping->base = base;
+    mapping->size = size;
+    atomic_init(&mapping->refs, 1);
+
+    store->mapping = mapping;
+    store->entries = (const MatbEntry *)((const char *)base + header->toc_offset);
+    store->count = header->count;
+    return 0;
+}
+
+// Sparse entry e of the store, its CSR arrays pointing into the mapping.
+// The structure is checked as well as the checksum, since later code indexes
+// by it without bounds checks.
+static Matrix *matrix_store_get_csr(MatrixStore *store, const MatbEntry *e, char *data) {
+    size_t ptr_size = ((size_t)e->rows + 1) * sizeof(uint64_t);
+    if (e->data_size < ptr_size) return NULL;
+    uint64_t *row_ptr = (uint64_t *)data;
+    uint64_t nnz = row_ptr[e->rows];
+    if (nnz > (e->data_size - ptr_size) / 8 || e->data_size != ptr_size + nnz * 8) return NULL;
+
+    MatrixCsr csr = { .row_ptr = row_ptr, .cols = (unsigned *)(data + ptr_size),
+                      .values = (int *)(data + ptr_size + nnz * sizeof(unsigned)), .cap = nnz };
+    if (matb_csr_checksum(&csr, e->rows) != e->checksum || row_ptr[0] != 0) return NULL;
+    for (unsigned i = 0; i < e->rows; i++) {
+        if (row_ptr[i + 1] < row_ptr[i]) return NULL;
+        for (uint64_t p = row_ptr[i]; p < row_ptr[i + 1]; p++)
+            if (csr.cols[p] >= e->cols || (p > row_ptr[i] && csr.cols[p] <= csr.cols[p - 1]))
+                return NULL;
+    }
+
+    MatrixCsr *shared = malloc(sizeof(MatrixCsr));
+    char *name = strndup((char *)store->mapping->base + e->name_offset, e->name_len);
+    if (!shared || !name) {
+        free(shared);
+        free(name);
+        return NULL;
+    }
+    *shared = csr;
+    atomic_init(&shared->refs, 1);
+    shared->mapping = store->mapping;
+    atomic_fetch_add(&store->mapping->refs, 1);
+    Matrix *matrix = matrix_wrap_csr(e->rows, e->cols, shared);
+    if (!matrix) {
+        free(name);
+        return NULL;
+    }
+    free(matrix->name);
+    matrix->name = name;
+    return matrix;
+}
+
+// Matrix index of the store, pointing into the mapping unless it is packed.
+// NULL if the entry is out of bounds or its checksum does not match.
+Matrix *matrix_store_get(MatrixStore *store, uint64_t index) {
+    if (index >= store->count) return NULL;
+    const MatbEntry *e = &store->entries[index];
+    size_t size = store->mapping->size;
+    if (e->data_offset % MATB_ALIGN != 0 ||
+        e->data_offset > size || e->data_size > size - e->data_offset ||
+        e->name_offset > size || e->name_len > size - e->name_offset)
+        return NULL;
+    char *data = (char *)store->mapping->base + e->data_offset;
+    if (e->elem_type == MATB_CSR_INT32) return matrix_store_get_csr(store, e, data);
+    int type = 0;
+    uint32_t dense_type = e->elem_type & ~(uint32_t)MATB_PACKED;
+    while (type < MATRIX_TYPE_COUNT && matb_dense_types[type] != dense_type) type++;
+    if (type == MATRIX_TYPE_COUNT) return NULL;
+    int packed = (e->elem_type & MATB_PACKED) != 0;
+    if (!packed && (e->data_size != (uint64_t)e->rows * e->cols * matrix_types[type].size ||
+                    matb_checksum(data, e->data_size) != e->checksum))
+        return NULL;
+
+    char *name = strndup((char *)store->mapping->base + e->name_offset, e->name_len);
+    if (!name) return NULL;
+    Matrix *matrix;
+    if (packed) {
+        matrix = matb_read_packed(e, data, (MatrixType)type);
+    } else {
+        atomic_fetch_add(&store->mapping->refs, 1);
+        matrix = matrix_wrap(e->rows, e->cols, (MatrixType)type, data, store->mapping);
+    }
+    if (!matrix) {
+        free(name);
+        return NULL;
+    }
+    free(matrix->name);
+    matrix->name = name;
+    return matrix;
+}
+
+// Drop the store's reference; matrices taken from it stay valid
+void matrix_store_close(MatrixStore *store) {
+    if (store->mapping) mapping_unref(store->mapping);
+    store->mapping = NULL;
+}
+
+// A sparse matrix in text: "name M N sparse count", then one "row column
+// value" line per nonzero, 0-based, in row-major order
+static void write_text_sparse(FILE *file, const Matrix *matrix, size_t nonzeros) {
+    fprintf(file, "%s %u %u sparse %zu\n", matrix->name, matrix->M, matrix->N, nonzeros);
+    const MatrixCsr *csr = matrix->csr;
+    for (unsigned i = 0; i < matrix->M; i++) {
+        if (csr) {
+            for (uint64_t p = csr->row_ptr[i]; p < csr->row_ptr[i + 1]; p++)
+                fprintf(file, "%u %u %d\n", i, csr->cols[p], csr->values[p]);
+            continue;
+        }
+        const int *row = (const int *)matrix->data + (size_t)i * matrix->N;
+        for (unsigned j = 0; j < matrix->N; j++)
+            if (row[j]) fprintf(file, "%u %u %d\n", i, j, row[j]);
+    }
+}
+
+// Numbers in files always use '.', whatever locale the UI runs in
+static locale_t numeric_c_locale;
+static pthread_once_t numeric_c_locale_once = PTHREAD_ONCE_INIT;
+
+static void numeric_c_locale_init(void) {
+    numeric_c_locale = newlocale(LC_NUMERIC_MASK, "C", (locale_t)0);
+}
+
+// Switch the calling thread to the C number format; returns the locale to
+// restore with uselocale()
+static locale_t numeric_c_locale_begin(void) {
+    pthread_once(&numeric_c_locale_once, numeric_c_locale_init);
+    return numeric_c_locale ? uselocale(numeric_c_locale) : uselocale((locale_t)0);
+}
+
+// Write matrices to file as text; progress counts rows. Returns 0 on success.
+static int save_matrices_to_text(FILE *file, Matrix *const *matrices, int count,
+                                 MatrixProgress *progress) {
+    fprintf(file, "%d\n", count);
+
+    int status = 0;
+    locale_t locale = numeric_c_locale_begin();
+    for (int i = 0; status == 0 && i < count; i++) {
+        Matrix *matrix = matrices[i];
+        if (matrix_prefers_sparse(matrix)) {
+            write_text_sparse(file, matrix, matrix_nonzeros(matrix));
+            if (progress) atomic_fetch_add(&progress->done, matrix->M);
+            continue;
+        }
+        // int32, the original format, is the one type left implicit
+        fprintf(file, "%s %u %u", matrix->name, matrix->M, matrix->N);
+        if (matrix->type != MATRIX_INT32) fprintf(file, " %s", matrix_type_name(matrix->type));
+        fprintf(file, "\n");
+
+        Matrix *dense = matrix_dense_copy(matrix);
+        if (!dense) {
+            status = -1;
+            break;
+        }
+        const MatrixTypeInfo *info = &matrix_types[dense->type];
+        for (unsigned row = 0; row < dense->M; row++) {
+            if (progress) {
+                if (atomic_load_explicit(&progress->cancel, memory_order_relaxed)) {
+                    status = -1;
+                    break;
+                }
+                atomic_fetch_add_explicit(&progress->done, 1, memory_order_relaxed);
+            }
+            info->write_text(file, (const char *)dense->data + (size_t)row * dense->N * info->size, dense->N);
+            fprintf(file, "\n");
+        }
+        free_matrix(dense);
+    }
+    uselocale(locale);
+    return ferror(file) ? -1 : status;
+}
+
+// Make a rename or create in the directory of path durable. Returns 0, or -1
+// if the directory cannot be opened or synced.
+static int fsync_parent_dir(const char *path) {
+    const char *slash = strrchr(path, '/');
+    char *dir = slash ? strndup(path, slash == path ? 1 : (size_t)(slash - path)) : strdup(".");
+    int fd = dir ? open(dir, O_RDONLY | O_DIRECTORY) : -1;
+    int status = fd >= 0 && fsync(fd) == 0 ? 0 : -1;
+    if (fd >= 0) close(fd);
+    free(dir);
+    return status;
+}
+
+// Write matrices to filename: text, or a binary store if the name ends in
+// .matb and a compressed one if it ends in .matz. The file is written under
+// a temporary name next to it and renamed over filename once complete, so
+// readers see the old file or the new one, never a partial one. progress,
+// which may be NULL, counts rows; cancelling leaves filename untouched.
+// Returns 0, or -1 with the reason in matrix_last_error(). Does not touch
+// the saved-matrix registry, so it may run on any thread.
+int matrix_file_write(const char *filename, Matrix *const *matrices, int count, MatrixProgress *progress) {
+    static atomic_uint temp_serial;
+    MatrixTraceScope op = op_begin("save");
+    if (progress) {
+        uint64_t rows = 0;
+        for (int i = 0; i < count; i++) rows += matrices[i]->M;
+        atomic_store(&progress->total, rows > UINT_MAX ? UINT_MAX : (unsigned)rows);
+    }
+
+    // Created with O_EXCL and mode 0666, so the umask applies as with fopen()
+    // to a new file
+    size_t len = strlen(filename) + 48;
+    char *temp = malloc(len);
+    int fd = -1;
+    for (int attempt = 0; temp && fd < 0 && attempt < 16; attempt++) {
+        snprintf(temp, len, "%s.tmp%ld.%u", filename, (long)getpid(), atomic_fetch_add(&temp_serial, 1));
+        fd = open(temp, O_WRONLY | O_CREAT | O_EXCL, 0666);
+        if (fd < 0 && errno != EEXIST) break;
+    }
+    // Replacing a file keeps its permissions
+    struct stat target;
+    if (fd >= 0 && stat(filename, &target) == 0 && fchmod(fd, target.st_mode & 07777) != 0) {
+        close(fd);
+        unlink(temp);
+        fd = -1;
+    }
+    FILE *file = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    if (!file) {
+        snprintf(matrix_io_error, sizeof(matrix_io_error), "%s: cannot create file", filename);
+        if (fd >= 0) {
+            close(fd);
+            unlink(temp);
+        }
+        free(temp);
+        op_end(op, 0, 0.0);
+        return -1;
+    }
+
+    int status;
+    if (has_suffix(filename, ".matb") || has_suffix(filename, ".matz"))
+        status = save_matrices_to_store(file, matrices, count, has_suffix(filename, ".matz"), progress);
+    else
+        status = save_matrices_to_text(file, matrices, count, progress);
+    if (fflush(file) != 0 || fsync(fileno(file)) != 0) status = -1;
+    if (fclose(file) != 0) status = -1;
+    if (status == 0 && rename(temp, filename) != 0) status = -1;
+    if (status == 0 && fsync_parent_dir(filename) != 0) {
+        // The new file is in place, only its durability is in doubt
+        snprintf(matrix_io_error, sizeof(matrix_io_error), "%s: cannot sync directory", filename);
+        free(temp);
+        op_end(op, 0, 0.0);
+        return -1;
+    }
+
+    uint64_t bytes = 0;
+    if (status == 0) {
+        struct stat st;
+        if (stat(filename, &st) == 0) bytes = (uint64_t)st.st_size;
+    } else {
+        unlink(temp);
+        if (progress && atomic_load(&progress->cancel))
+            snprintf(matrix_io_error, sizeof(matrix_io_error), "%s: cancelled", filename);
+        else
+            snprintf(matrix_io_error, sizeof(matrix_io_error), "%s: cannot write file", filename);
+    }
+    free(temp);
+    op_end(op, bytes, 0.0);
+    return status;
+}
+
+// Save all matrices to a file, as a binary store if the name ends in .matb
+// and a compressed one if it ends in .matz
+void save_matrices_to_file(const char *filename) {
+    matrix_file_write(filename, saved_matrices, num_saved_matrices, NULL);
+}
+
+// Streaming text reader
+//
+// Text matrix files and CSV exports are read through one TEXT_CHUNK buffer,
+// so memory stays bounded whatever the file size. Integers are parsed eight
+// bytes at a time: one word load finds the length of the digit run and three
+// multiplies convert it. Every error names the file, line and column.
+#define TEXT_CHUNK (1 << 20)
+#define TEXT_PAD 64     // zero bytes kept readable past the data for word loads
+
+// Description of the last failed load or operation on the calling thread
+const char *matrix_last_error(void) {
+    return matrix_io_error;
+}
+
+static void text_error(TextReader *r, const char *what) {
+    snprintf(matrix_io_error, sizeof(matrix_io_error), "%s:%lu:%llu: %s", r->path, r->line,
+             (unsigned long long)(r->buf_offset + r->pos - r->line_start + 1), what);
+}
+
+int text_reader_open(TextReader *r, const char *path) {
+    memset(r, 0, sizeof(*r));
+    r->path = path;
+    r->line = 1;
+    r->file = fopen(path, "rb");
+    r->buf = malloc(TEXT_CHUNK + TEXT_PAD);
+    if (!r->file || !r->buf) {
+        snprintf(matrix_io_error, sizeof(matrix_io_error), "%s: cannot open file", path);
+        if (r->file) fclose(r->file);
+        free(r->buf);
+        return -1;
+    }
+    memset(r->buf, 0, TEXT_PAD);
+    return 0;
+}
+
+void text_reader_close(TextReader *r) {
+    if (r->file) fclose(r->file);
+    free(r->buf);
+    r->file = NULL;
+    r->buf = NULL;
+}
+
+// Slide the unread tail to the front and top the buffer up. A cancelled
+// read sees the end of the file instead.
+static void text_fill(TextReader *r) {
+    size_t rest = r->len - r->pos;
+    memmove(r->buf, r->buf + r->pos, rest);
+    r->buf_offset += r->pos;
+    r->pos = 0;
+    size_t got = 0;
+    if (!r->progress || !atomic_load(&r->progress->cancel))
+        got = fread(r->buf + rest, 1, TEXT_CHUNK - rest, r->file);
+    r->len = rest + got;
+    if (r->progress) atomic_store(&r->progress->done, (unsigned)((r->buf_offset + r->len) >> 10));
+    if (got < TEXT_CHUNK - rest) r->eof = 1;
+    memset(r->buf + r->len, 0, TEXT_PAD);
+}
+
+// Separator bytes: blank, tab, CR, LF and comma. NUL is not one, so scans
+// stop at the zero padding past the data.
+static const unsigned char text_separator[256] = {
+    ['\t'] = 1, ['\n'] = 1, ['\r'] = 1, [' '] = 1, [','] = 1,
+};
+
+static inline int text_is_separator(char c) {
+    return text_separator[(unsigned char)c];
+}
+
+// Skip separators; returns 0 at end of input. Afterwards at least TEXT_PAD
+// bytes, or the rest of the file, are in the buffer.
+static inline int text_skip(TextReader *r) {
+    for (;;) {
+        const char *buf = r->buf;
+        size_t pos = r->pos;
+        while (text_is_separator(buf[pos])) {
+            if (buf[pos] == '\n') {
+                r->line++;
+                r->line_start = r->buf_offset + pos + 1;
+            }
+            pos++;
+        }
+        r->pos = pos;
+        if (r->len - pos >= TEXT_PAD || r->eof) return pos < r->len;
+        text_fill(r);
+        if (r->pos >= r->len) return 0;
+    }
+}
+
+// Value of the leading digit run of an 8-byte word; *count gets its length
+static inline uint64_t parse_digits8(uint64_t w, unsigned *count) {
+    uint64_t t = w ^ 0x3030303030303030ULL;
+    // A byte is a digit iff its high nibble is 0 after the xor and adding 6
+    // does not carry into bit 4. Carries only move towards later bytes, so
+    // the first non-digit is always found correctly.
+    uint64_t nondigit = (t & 0xF0F0F0F0F0F0F0F0ULL) |
+                        ((t + 0x0606060606060606ULL) & 0x1010101010101010ULL);
+    unsigned n = nondigit ? (unsigned)__builtin_ctzll(nondigit) / 8 : 8;
+    *count = n;
+    if (n == 0) return 0;
+
+    // Move the digits to the top bytes so the rest read as leading zeros
+    uint64_t v = n == 8 ? t : (t & ((1ULL << (8 * n)) - 1)) << (8 * (8 - n));
+    v = (v * 10 + (v >> 8)) & 0x00FF00FF00FF00FFULL;
+    v = (v * 100 + (v >> 16)) & 0x0000FFFF0000FFFFULL;
+    return (v * 10000 + (v >> 32)) & 0xFFFFFFFFULL;
+}
+
+// Optional sign and digits at p. Returns the bytes consumed; *digits is the
+// digit count, which stops growing past 16 since the value is out of range.
+static inline size_t text_scan_int(const char *p, uint64_t *value, unsigned *digits,
+                                   int *negative) {
+    static const uint64_t pow10[9] = { 1, 10, 100, 1000, 10000, 100000, 1000000,
+                                        10000000, 100000000 };
+    size_t i = (*p == '-' || *p == '+');
+    *negative = *p == '-';
+    uint64_t v = 0;
+    unsigned total = 0, n;
+    do {
+        uint64_t w;
+        memcpy(&w, p + i, sizeof(w));
+        uint64_t chunk = parse_digits8(w, &n);
+        v = v * pow10[n] + chunk;
+        total += n;
+        i += n;
+    } while (n == 8 && total <= 16);
+    *value = v;
+    *digits = total;
+    return i;
+}
+
+static inline int text_int_fits(uint64_t value, unsigned digits, int negative) {
+    return digits <= 10 && value <= (negative ? 2147483648ULL : 2147483647ULL);
+}
+
+static int text_read_int(TextReader *r, int *out) {
+    if (!text_skip(r)) {
+        text_error(r, "unexpected end of file, expected an integer");
+        return -1;
+    }
+    const char *p = r->buf + r->pos;
+    uint64_t value;
+    unsigned digits;
+    int negative;
+    size_t i = text_scan_int(p, &value, &digits, &negative);
+
+    if (digits == 0) {
+        text_error(r, "expected an integer");
+        return -1;
+    }
+    if (r->pos + i < r->len && !text_is_separator(p[i])) {
+        // text_scan_int() stops early in a long enough digit run
+        int overflow = p[i] >= '0' && p[i] <= '9';
+        if (!overflow) r->pos += i;
+        text_error(r, overflow ? "integer out of range" : "invalid character in integer");
+        return -1;
+    }
+    if (!text_int_fits(value, digits, negative)) {
+        text_error(r, "integer out of range");
+        return -1;
+    }
+    *out = negative ? (int)(0 - value) : (int)value;
+    r->pos += i;
+    return 0;
+}
+
+// Read count integers. The loop keeps the cursor in registers while every
+// token starts at least TEXT_PAD bytes before the end of the buffer, and
+// hands anything else (refills, the end of the file, errors) to text_read_int.
+static int text_read_ints(TextReader *r, int *out, size_t count) {
+    size_t k = 0;
+    while (k < count) {
+        const char *buf = r->buf;
+        size_t pos = r->pos, safe = r->len > TEXT_PAD ? r->len - TEXT_PAD : 0;
+        while (k < count) {
+            while (text_is_separator(buf[pos])) {
+                if (buf[pos] == '\n') {
+                    r->line++;
+                    r->line_start = r->buf_offset + pos + 1;
+                }
+                pos++;
+            }
+            if (pos >= safe) break;
+            uint64_t value;
+            unsigned digits;
+            int negative;
+            size_t i = text_scan_int(buf + pos, &value, &digits, &negative);
+            if (digits == 0 || !text_is_separator(buf[pos + i]) ||
+                !text_int_fits(value, digits, negative))
+                break;
+            out[k++] = negative ? (int)(0 - value) : (int)value;
+            pos += i;
+        }
+        r->pos = pos;
+        if (k < count && text_read_int(r, &out[k++]) != 0) return -1;
+    }
+    return 0;
+}
+
+static int text_read_int64(TextReader *r, int64_t *out) {
+    if (!text_skip(r)) {
+        text_error(r, "unexpected end of file, expected an integer");
+        return -1;
+    }
+    const char *p = r->buf + r->pos;
+    uint64_t value;
+    unsigned digits;
+    int negative;
+    size_t i = text_scan_int(p, &value, &digits, &negative);
+    if (digits == 0 || (r->pos + i < r->len && !text_is_separator(p[i]))) {
+        int overflow = digits && p[i] >= '0' && p[i] <= '9';
+        if (!overflow) r->pos += i;
+        text_error(r, digits == 0 ? "expected an integer" :
+                      overflow ? "integer out of range" : "invalid character in integer");
+        return -1;
+    }
+    if (digits > 19 || value > (negative ? 1ULL << 63 : (uint64_t)INT64_MAX)) {
+        text_error(r, "integer out of range");
+        return -1;
+    }
+    *out = negative ? (int64_t)(0 - value) : (int64_t)value;
+    r->pos += i;
+    return 0;
+}
+
+// A floating-point number in C notation, whatever the locale
+static int text_read_double(TextReader *r, double *out) {
+    if (!text_skip(r)) {
+        text_error(r, "unexpected end of file, expected a number");
+        return -1;
+    }
+    const char *p = r->buf + r->pos;
+    size_t n = 0;
+    while (n < TEXT_PAD && r->pos + n < r->len && !text_is_separator(p[n])) n++;
+    if (n == TEXT_PAD) {
+        text_error(r, "number too long");
+        return -1;
+    }
+    char token[TEXT_PAD + 1], *end;
+    memcpy(token, p, n);
+    token[n] = '\0';
+    locale_t locale = numeric_c_locale_begin();
+    errno = 0;
+    *out = strtod(token, &end);
+    uselocale(locale);
+    if (n == 0 || end != token + n) {
+        text_error(r, "expected a number");
+        return -1;
+    }
+    if (errno == ERANGE && isinf(*out)) {
+        text_error(r, "number out of range");
+        return -1;
+    }
+    r->pos += n;
+    return 0;
+}
+
+// Read the count elements of a type matrix into data
+static int text_read_elements(TextReader *r, MatrixType type, void *data, size_t count) {
+    if (type == MATRIX_INT32) return text_read_ints(r, data, count);
+    for (size_t i = 0; i < count; i++) {
+        if (type == MATRIX_INT64) {
+            if (text_read_int64(r, (int64_t *)data + i) != 0) return -1;
+            continue;
+        }
+        double value;
+        if (text_read_double(r, &value) != 0) return -1;
+        if (type != MATRIX_FLOAT32) {
+            ((double *)data)[i] = value;
+        } else if (isinf((float)value) && !isinf(value)) {
+            text_error(r, "number out of range for float32");
+            return -1;
+        } else {
+            ((float *)data)[i] = (float)value;
+        }
+    }
+    return 0;
+}
+
+// Read a name token into a new string; NULL on failure
+static char *text_read_name(TextReader *r) {
+    if (!text_skip(r)) {
+        text_error(r, "unexpected end of file, expected a matrix name");
+        return NULL;
+    }
+    size_t n = 0, cap = 16;
+    char *name = malloc(cap);
+    while (name && r->pos < r->len && !text_is_separator(r->buf[r->pos])) {
+        if (n + 1 == cap) {
+            char *grown = realloc(name, cap *= 2);
+            if (!grown) free(name);
+            name = grown;
+            if (!name) break;
+        }
+        name[n++] = r->buf[r->pos];
+        r->pos++;
+        if (r->pos == r->len && !r->eof) text_fill(r);
+    }
+    if (!name) {
+        text_error(r, "out of memory");
+        return NULL;
+    }
+    name[n] = '\0';
+    return name;
+}
+
+// Leading matrix count of a text matrix file
+int text_read_count(TextReader *r, int *count) {
+    if (text_read_int(r, count) != 0) return -1;
+    if (*count < 0) {
+        text_error(r, "negative matrix count");
+        return -1;
+    }
+    return 0;
+}
+
+// The "count" and entries of a sparse matrix after its "name M N sparse"
+static Matrix *text_read_sparse(TextReader *r, unsigned M, unsigned N) {
+    int count;
+    if (text_read_int(r, &count) != 0) return NULL;
+    if (count < 0 || (uint64_t)count > (uint64_t)M * N) {
+        text_error(r, "invalid nonzero count");
+        return NULL;
+    }
+    MatrixCsr *csr = csr_new(M, count);
+    if (!csr) {
+        text_error(r, "out of memory");
+        return NULL;
+    }
+
+    size_t nnz = 0;
+    unsigned row = 0;       // rows before this one are complete
+    int last_i = -1, last_j = -1;
+    for (int k = 0; k < count; k++) {
+        int entry[3];
+        if (text_read_ints(r, entry, 3) != 0) {
+            csr_unref(csr);
+            return NULL;
+        }
+        int i = entry[0], j = entry[1];
+        const char *problem = i < 0 || (unsigned)i >= M || j < 0 || (unsigned)j >= N ?
+                              "sparse entry outside the matrix" :
+                              i < last_i || (i == last_i && j <= last_j) ?
+                              "sparse entries must be in row-major order without repeats" : NULL;
+        if (problem) {
+            text_error(r, problem);
+            csr_unref(csr);
+            return NULL;
+        }
+        last_i = i;
+        last_j = j;
+        for (; row < (unsigned)i; row++) csr->row_ptr[row + 1] = nnz;
+        if (!entry[2]) continue;
+        csr->cols[nnz] = j;
+        csr->values[nnz++] = entry[2];
+    }
+    for (; row < M; row++) csr->row_ptr[row + 1] = nnz;
+
+    Matrix *matrix = matrix_wrap_csr(M, N, csr);
+    if (!matrix) text_error(r, "out of memory");
+    return matrix;
+}
+
+// Read the next "name M N" header and its int32 elements, "name M N type"
+// and its elements of that type, or "name M N sparse" and its nonzeros;
+// NULL on malformed input, with the reason in matrix_last_error()
+Matrix *text_read_matrix(TextReader *r) {
+    char *name = text_read_name(r);
+    if (!name) return NULL;
+    int M, N;
+    if (text_read_int(r, &M) != 0 || text_read_int(r, &N) != 0) {
+        free(name);
+        return NULL;
+    }
+    if (M <= 0 || N <= 0) {
+        text_error(r, "invalid matrix dimensions");
+        free(name);
+        return NULL;
+    }
+
+    MatrixType type = MATRIX_INT32;
+    char c = text_skip(r) ? r->buf[r->pos] : '\0';
+    if (c >= 'a' && c <= 'z') {
+        char *keyword = text_read_name(r);
+        if (!keyword) {
+            free(name);
+            return NULL;
+        }
+        int sparse = strcmp(keyword, "sparse") == 0;
+        int known = sparse || matrix_type_from_name(keyword, &type) == 0;
+        free(keyword);
+        Matrix *matrix = NULL;
+        if (!known) text_error(r, "expected an element type, \"sparse\" or an integer");
+        else if (sparse) matrix = text_read_sparse(r, M, N);
+        if (!known || sparse) {
+            if (!matrix) {
+                free(name);
+                return NULL;
+            }
+            free(matrix->name);
+            matrix->name = name;
+            return matrix;
+        }
+    }
+
+    Matrix *matrix = create_matrix_typed(M, N, type);
+    if (!matrix) {
+        text_error(r, "out of memory");
+        free(name);
+        return NULL;
+    }
+    free(matrix->name);
+    matrix->name = name;
+
+    if (text_read_elements(r, type, matrix->data, (size_t)M * N) != 0) {
+        free_matrix(matrix);
+        return NULL;
+    }
+    return matrix;
+}
+
+// Skip blanks within the line; returns the next byte, 0 at end of input
+static int text_skip_blanks(TextReader *r) {
+    for (;;) {
+        while (r->pos < r->len && (r->buf[r->pos] == ' ' || r->buf[r->pos] == '\t' || r->buf[r->pos] == '\r'))
+            r->pos++;
+        if (r->pos < r->len) return (unsigned char)r->buf[r->pos];
+        if (r->eof) return 0;
+        text_fill(r);
+    }
+}
+
+// A CSV export: one row per line, fields separated by a comma or blanks. A
+// comma with no field before or after it on its line is an error. The matrix
+// is named after the file.
+Matrix *text_read_csv(TextReader *r) {
+    size_t cap = 1024, count = 0;
+    int *values = workspace_alloc(cap * sizeof(int));
+    if (!values) {
+        text_error(r, "out of memory");
+        return NULL;
+    }
+
+    unsigned rows = 0, cols = 0, row_fields = 0;
+    int comma = 0;          // a comma since the last field of the row
+    char message[128];
+    for (;;) {
+        int c = text_skip_blanks(r);
+        if ((c == ',' && (comma || row_fields == 0)) || ((c == '\n' || c == 0) && comma)) {
+            text_error(r, "empty field");
+            workspace_free(values);
+            return NULL;
+        }
+        if (c == ',') {
+            comma = 1;
+            r->pos++;
+            continue;
+        }
+        if (c == '\n' || c == 0) {
+            if (row_fields) {
+                if (rows == 0) cols = row_fields;
+                if (row_fields != cols) {
+                    snprintf(message, sizeof(message), "row %u has %u fields, expected %u",
+                             rows + 1, row_fields, cols);
+                    text_error(r, message);
+                    workspace_free(values);
+                    return NULL;
+                }
+                rows++;
+                row_fields = 0;
+            }
+            if (c == 0) break;
+            r->pos++;
+            r->line++;
+            r->line_start = r->buf_offset + r->pos;
+            continue;
+        }
+        if (count == cap) {
+            int *grown = workspace_realloc(values, cap * 2 * sizeof(int));
+            if (!grown) {
+                text_error(r, "out of memory");
+                workspace_free(values);
+                return NULL;
+            }
+            values = grown;
+            cap *= 2;
+        }
+        if (text_read_int(r, &values[count]) != 0) {
+            workspace_free(values);
+            return NULL;
+        }
+        count++;
+        row_fields++;
+        comma = 0;
+    }
+    if (rows == 0) {
+        text_error(r, "empty CSV file");
+        workspace_free(values);
+        return NULL;
+    }
+
+    const char *base = strrchr(r->path, '/');
+    base = base ? base + 1 : r->path;
+    char *name = strndup(base, strcspn(base, "."));
+    Matrix *matrix = matrix_wrap(rows, cols, MATRIX_INT32, values, NULL);
+    if (!matrix || !name) {
+        free_matrix(matrix);
+        free(name);
+        text_error(r, "out of memory");
+        return NULL;
+    }
+    free(matrix->name);
+    matrix->name = name;
+    return matrix;
+}
+
+void clear_saved_matrices(void) {
+    registry_apply_deferred(NULL);
+    journal_clear();
+    for (int i = 0; i < num_saved_matrices; i++) {
+        free_matrix(saved_matrices[i]);
+        saved_matrices[i] = NULL;
+    }
+    num_saved_matrices = 0;
+    if (saved_index) memset(saved_index, 0, saved_index_slots * sizeof(size_t));
+    journal_maybe_compact();
+}
+
+// Each matrix of a binary store, without copying the elements of mapped
+// ones. A corrupt matrix is reported and skipped. progress counts matrices.
+static int read_matrices_from_store(const char *filename, MatrixReadFn each, void *data,
+                                    MatrixProgress *progress) {
+    MatrixStore store;
+    if (matrix_store_open(filename, &store) != 0) {
+        snprintf(matrix_io_error, sizeof(matrix_io_error), "%s: not a valid matrix store", filename);
+        return -1;
+    }
+
+    if (progress) atomic_store(&progress->total, store.count > UINT_MAX ? UINT_MAX : (unsigned)store.count);
+    int status = 0;
+    for (uint64_t i = 0; i < store.count; i++) {
+        if (progress && atomic_load(&progress->cancel)) {
+            status = -1;
+            break;
+        }
+        Matrix *matrix = matrix_store_get(&store, i);
+        if (progress) atomic_fetch_add(&progress->done, 1);
+        if (!matrix) {
+            snprintf(matrix_io_error, sizeof(matrix_io_error), "%s: matrix %llu is corrupt",
+                     filename, (unsigned long long)i + 1);
+            status = -1;
+            continue;
+        }
+        if (each(matrix, data) != 0) {
+            status = -1;
+            break;
+        }
+    }
+    matrix_store_close(&store);
+    return status;
+}
+
+// The matrix of a CSV export, or each matrix of a text file, in the storage
+// its density calls for. progress counts kilobytes read.
+static int read_matrices_from_text(const char *filename, MatrixReadFn each, void *data,
+                                   MatrixProgress *progress) {
+    TextReader reader;
+    if (text_reader_open(&reader, filename) != 0) return -1;
+    reader.progress = progress;
+    if (progress) {
+        struct stat st;
+        uint64_t kb = fstat(fileno(reader.file), &st) == 0 ? (uint64_t)st.st_size >> 10 : 0;
+        atomic_store(&progress->total, kb > UINT_MAX ? UINT_MAX : (unsigned)kb);
+    }
+
+    int status = 0, count = 1, csv = has_suffix(filename, ".csv");
+    if (!csv) status = text_read_count(&reader, &count);
+    for (int i = 0; status == 0 && i < count; i++) {
+        MatrixTraceScope parse = matrix_trace_begin("parse");
+        uint64_t start = reader.buf_offset + reader.pos;
+        Matrix *matrix = csv ? text_read_csv(&reader) : text_read_matrix(&reader);
+        matrix_trace_end(parse, reader.buf_offset + reader.pos - start, 0.0);
+        if (!matrix) {
+            status = -1;
+            break;
+        }
+        matrix_choose_storage(matrix);
+        if (each(matrix, data) != 0) status = -1;
+    }
+
+    text_reader_close(&reader);
+    return status;
+}
+
+// Read every matrix of a text file or binary store, or the one in a .csv
+// export, handing each to each(matrix, data) as soon as it is read. each
+// takes ownership and returns nonzero to stop. progress, which may be NULL,
+// gets a total and counts up to it; setting its cancel flag stops the read
+// at the next matrix or buffer refill. Returns 0, or -1 with the reason in
+// matrix_last_error(). Does not touch the saved-matrix registry, so it may
+// run on any thread.
+int matrix_file_read(const char *filename, MatrixReadFn each, void *data, MatrixProgress *progress) {
+    MatrixTraceScope op = op_begin("load");
+    matrix_io_error[0] = '\0';
+    int status;
+    if (!has_suffix(filename, ".csv") && is_matrix_store_file(filename))
+        status = read_matrices_from_store(filename, each, data, progress);
+    else
+        status = read_matrices_from_text(filename, each, data, progress);
+    if (status != 0 && progress && atomic_load(&progress->cancel))
+        snprintf(matrix_io_error, sizeof(matrix_io_error), "%s: cancelled", filename);
+    struct stat st;
+    op_end(op, stat(filename, &st) == 0 ? (uint64_t)st.st_size : 0, 0.0);
+    return status;
+}
+
+typedef struct {
+    const char *filename;
+    int cleared;
+} RegistryLoad;
+
+// The registry is replaced only once the file yields its first matrix, so
+// a file that cannot be read leaves it as it was
+static int registry_load_put(Matrix *matrix, void *data) {
+    RegistryLoad *load = data;
+    if (!load->cleared) {
+        clear_saved_matrices();
+        load->cleared = 1;
+    }
+    if (registry_put(matrix) != 0) {
+        snprintf(matrix_io_error, sizeof(matrix_io_error), "%s: out of memory", load->filename);
+        return -1;
+    }
+    return 0;
+}
+
+// Load all matrices from a text or binary file, or add the one in a .csv
+// export. Returns 0 on success; on failure -1, with the reason in
+// matrix_last_error().
+int load_matrices_from_file(const char *filename) {
+    RegistryLoad load = { filename, has_suffix(filename, ".csv") };
+    int status = matrix_file_read(filename, registry_load_put, &load, NULL);
+    if (status == 0 && !load.cleared) clear_saved_matrices();
+    return status;
+}
+
+// Registry journal
+//
+// With a journal open, every change to the registry is appended to it as
+// one record before it takes effect: a put holds the matrix's name and
+// elements, encoded as in a .matb store, a delete its name, and a clear
+// nothing. Saving one matrix therefore writes O(its size), where saving to
+// a store rewrites them all. Opening the journal replays it, mapping the
+// elements of each put like a store does, and cuts off a record a crash
+// left half written. Records replaced, deleted or cleared since are dead
+// space; once there is JOURNAL_DEAD_MIN of it and more than of live
+// records, a background thread rewrites the live ones to a new file,
+// takes over what was appended meanwhile, and renames it over the journal.
+#define JOURNAL_MAGIC "MATJOURN"
+#define JOURNAL_VERSION 1
+#define JOURNAL_RECORD_MAGIC "JREC"
+#define JOURNAL_DEAD_MIN (64u << 20)
+
+enum { JOURNAL_PUT = 1, JOURNAL_DELETE, JOURNAL_CLEAR };
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint8_t reserved[48];
+} JournalHeader;
+
+// Followed by the name, then for a put the elements on the next MATB_ALIGN
+// boundary. Records start on one as well.
+typedef struct {
+    char magic[4];
+    uint32_t kind;
+    uint64_t size;          // whole record, padding included
+    uint64_t name_checksum;
+    uint64_t reserved;
+    MatbEntry entry;        // offsets from the start of the record
+} JournalRecord;
+
+_Static_assert(sizeof(JournalHeader) == MATB_ALIGN, "JournalHeader layout");
+_Static_assert(sizeof(JournalRecord) == 80, "JournalRecord layout");
+
+static struct {
+    pthread_mutex_t lock;   // file and size, between appends and the compactor
+    FILE *file;
+    char *path;
+    uint64_t size;          // end of the last record, where the next one goes
+    uint64_t live;          // bytes of the records a replay still needs
+    int64_t replay_bytes;   // size of the record being replayed, -1 if none
+    int dir_unsynced;       // the rename of the last compaction is not yet durable
+    int compacting;
+    atomic_int compacted;   // the compactor has finished and can be joined
+    pthread_t compactor;
+} journal = { .lock = PTHREAD_MUTEX_INITIALIZER, .replay_bytes = -1 };
+
+typedef struct {
+    Matrix **matrices;
+    int count;
+    uint64_t size;          // journal size the matrices stand for
+} JournalSnapshot;
+
+// Write a record at *offset, a multiple of MATB_ALIGN, and move it past the
+// record. matrix is NULL but for puts. The header goes last, so a record cut
+// short usually has none; the checksums catch the rest.
+static int journal_write_record(FILE *file, uint64_t *offset, uint32_t kind,
+                                const char *name, Matrix *matrix) {
+    JournalRecord record;
+    memset(&record, 0, sizeof(record));
+    uint64_t start = *offset, pos = start + sizeof(record);
+    size_t name_len = strlen(name);
+    if (name_len > UINT32_MAX || fseeko(file, (off_t)pos, SEEK_SET) != 0 ||
+        (name_len && fwrite(name, 1, name_len, file) != name_len))
+        return -1;
+    pos += name_len;
+    record.entry.name_offset = sizeof(record);
+    record.entry.name_len = (uint32_t)name_len;
+    if (write_padding(file, &pos) != 0) return -1;
+    if (matrix) {
+        record.entry.rows = matrix->M;
+        record.entry.cols = matrix->N;
+        record.entry.data_offset = pos - start;
+        if (matb_write_elements(file, matrix, &record.entry, 0) != 0) return -1;
+        pos += record.entry.data_size;
+        if (write_padding(file, &pos) != 0) return -1;
+    }
+
+    memcpy(record.magic, JOURNAL_RECORD_MAGIC, sizeof(record.magic));
+    record.kind = kind;
+    record.size = pos - start;
+    record.name_checksum = matb_checksum(name, name_len);
+    if (fseeko(file, (off_t)start, SEEK_SET) != 0 || fwrite(&record, sizeof(record), 1, file) != 1 ||
+        fseeko(file, (off_t)pos, SEEK_SET) != 0)
+        return -1;
+    *offset = pos;
+    return 0;
+}
+
+// With journal.lock held: whether records may be appended, which needs the
+// rename of the last compaction to be durable
+static int journal_writable(void) {
+    if (journal.dir_unsynced) journal.dir_unsynced = fsync_parent_dir(journal.path) != 0;
+    return !journal.dir_unsynced;
+}
+
+// With journal.lock held: make the records written from journal.size to end
+// durable if status is 0, or cut them off. Returns 0, or -1 with the reason
+// in matrix_last_error() and the journal as it was.
+static int journal_commit(uint64_t end, int status) {
+    if (status == 0 && fflush(journal.file) == 0 && fdatasync(fileno(journal.file)) == 0) {
+        journal.size = end;
+        return 0;
+    }
+    clearerr(journal.file);
+    if (ftruncate(fileno(journal.file), (off_t)journal.size) != 0) { /* replay cuts it off */ }
+    snprintf(matrix_io_error, sizeof(matrix_io_error), "%s: cannot write journal", journal.path);
+    return -1;
+}
+
+// Append a record and make it durable. Returns its size, or -1 with the
+// reason in matrix_last_error() and the journal as it was.
+static int64_t journal_append(uint32_t kind, const char *name, Matrix *matrix) {
+    MatrixTraceScope scope = matrix_trace_begin("journal.append");
+    pthread_mutex_lock(&journal.lock);
+    uint64_t start = journal.size, end = start;
+    int status = journal_writable() ? journal_write_record(journal.file, &end, kind, name, matrix) : -1;
+    int64_t bytes = journal_commit(end, status) == 0 ? (int64_t)(end - start) : -1;
+    pthread_mutex_unlock(&journal.lock);
+    matrix_trace_end(scope, bytes > 0 ? (uint64_t)bytes : 0, 0.0);
+    return bytes;
+}
+
+// Record putting matrix in the registry. Returns the record size, 0 without
+// a journal, or -1 if it cannot be written.
+static int64_t journal_put(Matrix *matrix) {
+    if (!journal.file) return 0;
+    if (journal.replay_bytes >= 0) return journal.replay_bytes;
+    return journal_append(JOURNAL_PUT, matrix->name, matrix);
+}
+
+static int journal_delete(const char *name) {
+    if (!journal.file || journal.replay_bytes >= 0) return 0;
+    return journal_append(JOURNAL_DELETE, name, NULL) < 0 ? -1 : 0;
+}
+
+// A failed clear record is reported in matrix_last_error(), but the registry
+// is cleared regardless, as its callers expect
+static void journal_clear(void) {
+    if (!journal.file) return;
+    if (journal.replay_bytes < 0) journal_append(JOURNAL_CLEAR, "", NULL);
+    journal.live = 0;
+}
+
+// A record of added bytes replaced one of dropped bytes, or none if 0
+static void journal_account(uint64_t dropped, uint64_t added) {
+    journal.live += added - dropped;
+}
+
+// Puts recorded by registry_put_deferred() and not yet in the registry, in
+// journal order, under journal.lock
+typedef struct {
+    Matrix *matrix;         // NULL for a clear
+    int64_t bytes;          // size of its record, 0 without a journal
+} DeferredPut;
+
+static struct {
+    DeferredPut *items;
+    size_t count, capacity;
+} deferred;
+
+// Record a clear of the registry, if clear is set, and puts of count
+// matrices, all with one sync, and queue them for the thread that owns the
+// registry. Unlike registry_put() this may run on any thread, so a file can
+// be loaded into a journaled registry without the owner waiting on disk.
+// Takes ownership of the matrices, also on failure. Returns 0, or -1 with
+// the reason in matrix_last_error() and nothing recorded or queued.
+int registry_put_deferred(Matrix **matrices, int count, int clear) {
+    MatrixTraceScope scope = matrix_trace_begin("journal.append");
+    pthread_mutex_lock(&journal.lock);
+    size_t need = deferred.count + (size_t)count + (clear != 0);
+    int status = 0;
+    if (need > deferred.capacity) {
+        size_t cap = deferred.capacity ? deferred.capacity : 16;
+        while (cap < need) cap *= 2;
+        DeferredPut *items = realloc(deferred.items, cap * sizeof(DeferredPut));
+        if (items) {
+            deferred.items = items;
+            deferred.capacity = cap;
+        } else {
+            snprintf(matrix_io_error, sizeof(matrix_io_error), "out of memory");
+            status = -1;
+        }
+    }
+
+    // Filled in past the queue's end, which moves only once all is durable
+    uint64_t start = journal.size, end = start;
+    if (status == 0) {
+        DeferredPut *item = deferred.items + deferred.count;
+        size_t n = need - deferred.count;
+        if (clear) item[0].matrix = NULL;
+        for (int i = 0; i < count; i++) item[(clear != 0) + i].matrix = matrices[i];
+        for (size_t i = 0; i < n; i++) item[i].bytes = 0;
+        if (journal.file) {
+            status = journal_writable() ? 0 : -1;
+            for (size_t i = 0; status == 0 && i < n; i++) {
+                Matrix *matrix = item[i].matrix;
+                uint64_t from = end;
+                status = journal_write_record(journal.file, &end, matrix ? JOURNAL_PUT : JOURNAL_CLEAR,
+                                              matrix ? matrix->name : "", matrix);
+                item[i].bytes = (int64_t)(end - from);
+            }
+            status = journal_commit(end, status);
+        }
+        if (status == 0) deferred.count = need;
+    }
+    pthread_mutex_unlock(&journal.lock);
+    if (status != 0)
+        for (int i = 0; i < count; i++) free_matrix(matrices[i]);
+    matrix_trace_end(scope, status == 0 ? end - start : 0, 0.0);
+    return status;
+}
+
+// Apply the puts registry_put_deferred() queued, in order, on the thread
+// that owns the registry; every other change to the registry does so first.
+// *cleared (optional) is set if one of them cleared the registry. Returns 0,
+// or -1 if memory ran out for some matrix, which is then left out although
+// the journal holds it.
+int registry_apply_deferred(int *cleared) {
+    if (cleared) *cleared = 0;
+    pthread_mutex_lock(&journal.lock);
+    DeferredPut *items = deferred.items;
+    size_t count = deferred.count;
+    deferred.items = NULL;
+    deferred.count = deferred.capacity = 0;
+    pthread_mutex_unlock(&journal.lock);
+    if (!count) {
+        free(items);
+        return 0;
+    }
+
+    // Recorded already: like a replay, the registry takes the record sizes
+    int status = 0;
+    int64_t replay_bytes = journal.replay_bytes;
+    for (size_t i = 0; i < count; i++) {
+        journal.replay_bytes = items[i].bytes;
+        if (!items[i].matrix) {
+            clear_saved_matrices();
+            if (cleared) *cleared = 1;
+        } else if (registry_put(items[i].matrix) != 0) {
+            snprintf(matrix_io_error, sizeof(matrix_io_error), "out of memory");
+            status = -1;
+        }
+    }
+    journal.replay_bytes = replay_bytes;
+    free(items);
+    journal_maybe_compact();
+    return status;
+}
+
+static void journal_snapshot_free(JournalSnapshot *snap) {
+    for (int i = 0; i < snap->count; i++)
+        free_matrix(snap->matrices[i]);
+    free(snap->matrices);
+    free(snap);
+}
+
+// Write the snapshot as a new journal, then, holding the lock so no append
+// comes between, copy what was appended since, unchanged: record offsets
+// are relative and both files align records alike. A failure leaves the
+// old journal in place.
+static void *journal_compact_main(void *arg) {
+    JournalSnapshot *snap = arg;
+    MatrixTraceScope scope = matrix_trace_begin("journal.compact");
+    static atomic_uint temp_serial;
+    size_t len = strlen(journal.path) + 48;
+    char *temp = malloc(len);
+    FILE *file = NULL;
+    int status = -1, fd = -1;
+    uint64_t offset = sizeof(JournalHeader);
+    // A new file of a name not used before, never one left behind or placed
+    // there by someone else, with the journal's permissions
+    for (int attempt = 0; temp && fd < 0 && attempt < 16; attempt++) {
+        snprintf(temp, len, "%s.compact%ld.%u", journal.path, (long)getpid(),
+                 atomic_fetch_add(&temp_serial, 1));
+        fd = open(temp, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0 && errno != EEXIST) break;
+    }
+    struct stat st;
+    if (fd >= 0 && (fstat(fileno(journal.file), &st) != 0 || fchmod(fd, st.st_mode & 07777) != 0 ||
+                    !(file = fdopen(fd, "w+b")))) {
+        close(fd);
+        unlink(temp);
+    }
+    if (!file) goto out;
+
+    JournalHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+    header.version = JOURNAL_VERSION;
+    header.byte_order = MATB_BYTE_ORDER;
+    if (fwrite(&header, sizeof(header), 1, file) != 1) goto out;
+    for (int i = 0; i < snap->count; i++)
+        if (journal_write_record(file, &offset, JOURNAL_PUT, snap->matrices[i]->name,
+                                 snap->matrices[i]) != 0)
+            goto out;
+
+    pthread_mutex_lock(&journal.lock);
+    char buf[1 << 16];
+    fd = fileno(journal.file);
+    status = 0;
+    for (uint64_t from = snap->size; status == 0 && from < journal.size; ) {
+        size_t n = journal.size - from < sizeof(buf) ? (size_t)(journal.size - from) : sizeof(buf);
+        ssize_t got = pread(fd, buf, n, (off_t)from);
+        if (got <= 0 || fwrite(buf, 1, (size_t)got, file) != (size_t)got) status = -1;
+        from += got > 0 ? (uint64_t)got : 0;
+        offset += got > 0 ? (uint64_t)got : 0;
+    }
+    if (status == 0 && (fflush(file) != 0 || fsync(fileno(file)) != 0 || rename(temp, journal.path) != 0))
+        status = -1;
+    if (status == 0) {
+        fclose(journal.file);
+        journal.file = file;
+        journal.size = offset;
+        file = NULL;
+        // Until the rename is durable, appends to the new file could be
+        // lost with it; journal_append() retries the sync if it fails here
+        journal.dir_unsynced = fsync_parent_dir(journal.path) != 0;
+    }
+    pthread_mutex_unlock(&journal.lock);
+
+out:
+    if (file) {
+        fclose(file);
+        unlink(temp);
+    }
+    free(temp);
+    matrix_trace_end(scope, status == 0 ? offset : 0, 0.0);
+    journal_snapshot_free(snap);
+    atomic_store(&journal.compacted, 1);
+    return NULL;
+}
+
+// Wait for a running compaction to finish
+static void journal_join(void) {
+    if (!journal.compacting) return;
+    pthread_join(journal.compactor, NULL);
+    journal.compacting = 0;
+}
+
+// Start compacting the journal in the background. Returns 0, or -1 if there
+// is no journal, a compaction is still running or memory is short.
+int matrix_journal_compact(void) {
+    // A put recorded but not yet applied would be in neither the snapshot
+    // nor what is copied after it
+    registry_apply_deferred(NULL);
+    if (!journal.file || journal.replay_bytes >= 0) return -1;
+    if (journal.compacting && !atomic_load(&journal.compacted)) return -1;
+    journal_join();
+
+    JournalSnapshot *snap = calloc(1, sizeof(JournalSnapshot));
+    if (!snap) return -1;
+    snap->matrices = malloc((num_saved_matrices ? num_saved_matrices : 1) * sizeof(Matrix *));
+    if (!snap->matrices) {
+        free(snap);
+        return -1;
+    }
+    // Handles, so the registry can change while they are written
+    for (; snap->count < num_saved_matrices; snap->count++) {
+        snap->matrices[snap->count] = copy_matrix(saved_matrices[snap->count]);
+        if (!snap->matrices[snap->count]) {
+            journal_snapshot_free(snap);
+            return -1;
+        }
+    }
+    pthread_mutex_lock(&journal.lock);
+    int behind = deferred.count != 0;
+    snap->size = journal.size;
+    pthread_mutex_unlock(&journal.lock);
+    if (behind) {
+        // Recorded meanwhile; the next change tries again
+        journal_snapshot_free(snap);
+        return -1;
+    }
+    atomic_store(&journal.compacted, 0);
+    if (pthread_create(&journal.compactor, NULL, journal_compact_main, snap) != 0) {
+        journal_snapshot_free(snap);
+        return -1;
+    }
+    journal.compacting = 1;
+    return 0;
+}
+
+static void journal_maybe_compact(void) {
+    if (!journal.file || journal.replay_bytes >= 0) return;
+    pthread_mutex_lock(&journal.lock);
+    uint64_t dead = journal.size - sizeof(JournalHeader) - journal.live;
+    pthread_mutex_unlock(&journal.lock);
+    if (dead >= JOURNAL_DEAD_MIN && dead > journal.live) matrix_journal_compact();
+}
+
+// Apply the records of a mapped journal from offset on. Returns where the
+// valid records end; *status is -1 if memory ran out before that.
+static uint64_t journal_replay(MatrixMapping *mapping, uint64_t offset, int *status) {
+    const char *base = mapping->base;
+    uint64_t size = mapping->size;
+    while (size - offset >= sizeof(JournalRecord)) {
+        JournalRecord record;
+        memcpy(&record, base + offset, sizeof(record));
+        if (memcmp(record.magic, JOURNAL_RECORD_MAGIC, sizeof(record.magic)) != 0 ||
+            record.size % MATB_ALIGN != 0 || record.size < sizeof(record) || record.size > size - offset ||
+            record.entry.name_offset != sizeof(record) ||
+            record.entry.name_len > record.size - sizeof(record))
+            break;
+        const char *name = base + offset + sizeof(record);
+        if (matb_checksum(name, record.entry.name_len) != record.name_checksum) break;
+
+        journal.replay_bytes = (int64_t)record.size;
+        if (record.kind == JOURNAL_PUT) {
+            MatbEntry entry = record.entry;
+            if (entry.data_offset > record.size || entry.data_size > record.size - entry.data_offset) break;
+            entry.name_offset += offset;
+            entry.data_offset += offset;
+            MatrixStore store = { mapping, &entry, 1 };
+            Matrix *matrix = matrix_store_get(&store, 0);
+            if (!matrix) break;
+            if (registry_put(matrix) != 0) {
+                *status = -1;
+                break;
+            }
+        } else if (record.kind == JOURNAL_DELETE) {
+            char *copy = strndup(name, record.entry.name_len);
+            if (!copy) {
+                *status = -1;
+                break;
+            }
+            delete_matrix(copy);
+            free(copy);
+        } else if (record.kind == JOURNAL_CLEAR) {
+            clear_saved_matrices();
+        } else {
+            break;
+        }
+        offset += record.size;
+    }
+    journal.replay_bytes = -1;
+    return offset;
+}
+
+// Replace the registry with the contents of the journal at path, which is
+// created if missing, and record every later change to the registry there.
+// Returns 0, or -1 with the reason in matrix_last_error(), no journal open
+// and the registry as it was: the journal is replayed into an empty
+// registry that replaces it only once the whole replay has succeeded.
+int matrix_journal_open(const char *path) {
+    MatrixTraceScope op = op_begin("journal.open");
+    registry_apply_deferred(NULL);
+    matrix_journal_close();
+    matrix_io_error[0] = '\0';
+    int fd = open(path, O_RDWR | O_CREAT, 0666);
+    FILE *file = fd >= 0 ? fdopen(fd, "r+b") : NULL;
+    if (!file) {
+        snprintf(matrix_io_error, sizeof(matrix_io_error), "%s: cannot open journal", path);
+        if (fd >= 0) close(fd);
+        op_end(op, 0, 0.0);
+        return -1;
+    }
+
+    struct stat st;
+    JournalHeader header;
+    int status = fstat(fd, &st);
+    if (status == 0 && st.st_size == 0) {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+        header.version = JOURNAL_VERSION;
+        header.byte_order = MATB_BYTE_ORDER;
+        if (fwrite(&header, sizeof(header), 1, file) != 1 || fflush(file) != 0 || fsync(fd) != 0 ||
+            fstat(fd, &st) != 0)
+            status = -1;
+    }
+    size_t size = status == 0 ? (size_t)st.st_size : 0;
+    void *base = size >= sizeof(header) ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0)
+                                        : MAP_FAILED;
+    MatrixMapping *mapping = base != MAP_FAILED ? malloc(sizeof(MatrixMapping)) : NULL;
+    if (mapping) memcpy(&header, base, sizeof(header));
+    if (!mapping || memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != JOURNAL_VERSION || header.byte_order != MATB_BYTE_ORDER) {
+        snprintf(matrix_io_error, sizeof(matrix_io_error), "%s: not a matrix journal", path);
+        free(mapping);
+        if (base != MAP_FAILED) munmap(base, size);
+        fclose(file);
+        op_end(op, 0, 0.0);
+        return -1;
+    }
+    mapping->base = base;
+    mapping->size = size;
+    atomic_init(&mapping->refs, 1);
+
+    journal.file = file;
+    journal.path = strdup(path);
+    journal.replay_bytes = 0;
+    RegistryState previous = { 0 };
+    registry_swap(&previous);
+    uint64_t end = journal_replay(mapping, sizeof(header), &status);
+    mapping_unref(mapping);
+    journal.size = end;
+    if (!journal.path || status != 0) {
+        snprintf(matrix_io_error, sizeof(matrix_io_error), "%s: out of memory", path);
+        status = -1;
+    } else if (end < size && ftruncate(fd, (off_t)end) != 0) {
+        snprintf(matrix_io_error, sizeof(matrix_io_error), "%s: cannot write journal", path);
+        status = -1;
+    }
+    // Journaling on top of a partial replay would lose the rest at the next
+    // compaction, so the registry goes back to what it was
+    if (status != 0) {
+        matrix_journal_close();
+        registry_swap(&previous);
+    } else {
+        journal_maybe_compact();
+    }
+    registry_state_free(&previous);
+    op_end(op, size, 0.0);
+    return status;
+}
+
+// Finish any compaction and stop journaling. The registry keeps its
+// matrices.
+void matrix_journal_close(void) {
+    journal_join();
+    if (journal.file) fclose(journal.file);
+    free(journal.path);
+    journal.file = NULL;
+    journal.path = NULL;
+    journal.size = journal.live = 0;
+    journal.dir_unsynced = 0;
+}
+
+// Size of the journal and of the records in it that are still needed;
+// returns 0, or -1 if no journal is open
+int matrix_journal_stats(MatrixJournalStats *out) {
+    if (!journal.file) return -1;
+    pthread_mutex_lock(&journal.lock);
+    out->bytes = journal.size;
+    pthread_mutex_unlock(&journal.lock);
+    out->live_bytes = journal.live + sizeof(JournalHeader);
+    out->compacting = journal.compacting && !atomic_load(&journal.compacted);
+    return 0;
+}
+
+// Work-stealing thread pool
+//
+// Each worker owns a deque: it pushes and pops its own tasks at the bottom,
+// which keeps a task's successors on the core that just touched their data,
+// while idle workers steal the oldest task from the top of someone else's.
+// Threads outside the pool (the GTK thread, batch mode) push into a shared
+// injection deque and execute tasks themselves while they wait, so a pool of
+// N threads runs N - 1 workers plus the caller.
+typedef struct PoolTask {
+    void (*run)(struct PoolTask *task);
+    void *ctx;
+    unsigned type;
+    unsigned a, b, c;
+} PoolTask;
+
+typedef struct {
+    pthread_mutex_t lock;
+    PoolTask *items;
+    size_t head, tail;      // live tasks are [head, tail), indexed modulo cap
+    size_t cap;
+} TaskDeque;
+
+typedef struct {
+    unsigned nthreads;
+    unsigned nworkers;
+    pthread_t *threads;
+    TaskDeque *deques;      // one per worker, then the injection deque
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    atomic_size_t pending;
+    int shutdown;
+} ThreadPool;
+
+static ThreadPool *_Atomic pool = NULL;
+static pthread_mutex_t pool_init_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned pool_requested_threads = 0;
+static _Thread_local int pool_worker_index = -1;
+
+static void deque_init(TaskDeque *d) {
+    pthread_mutex_init(&d->lock, NULL);
+    d->items = NULL;
+    d->head = d->tail = d->cap = 0;
+}
+
+static void deque_push(TaskDeque *d, const PoolTask *task) {
+    pthread_mutex_lock(&d->lock);
+    if (d->tail - d->head == d->cap) {
+        size_t cap = d->cap ? d->cap * 2 : 256;
+        PoolTask *items = malloc(cap * sizeof(PoolTask));
+        if (!items) abort();
+        for (size_t i = d->head; i < d->tail; i++)
+            items[i - d->head] = d->items[i % d->cap];
+        free(d->items);
+        d->items = items;
+        d->tail -= d->head;
+        d->head = 0;
+        d->cap = cap;
+    }
+    d->items[d->tail % d->cap] = *task;
+    d->tail++;
+    pthread_mutex_unlock(&d->lock);
+}
+
+static int deque_pop_bottom(TaskDeque *d, PoolTask *out) {
+    int found = 0;
+    pthread_mutex_lock(&d->lock);
+    if (d->tail != d->head) {
+        d->tail--;
+        *out = d->items[d->tail % d->cap];
+        found = 1;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return found;
+}
+
+static int deque_steal_top(TaskDeque *d, PoolTask *out) {
+    int found = 0;
+    pthread_mutex_lock(&d->lock);
+    if (d->tail != d->head) {
+        *out = d->items[d->head % d->cap];
+        d->head++;
+        found = 1;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return found;
+}
+
+static unsigned pool_self(const ThreadPool *p) {
+    return pool_worker_index >= 0 ? (unsigned)pool_worker_index : p->nworkers;
+}
+
+static int pool_take(ThreadPool *p, PoolTask *out) {
+    if (atomic_load(&p->pending) == 0) return 0;
+
+    unsigned self = pool_self(p), count = p->nworkers + 1;
+    int found = deque_pop_bottom(&p->deques[self], out);
+    for (unsigned i = 1; !found && i < count; i++)
+        found = deque_steal_top(&p->deques[(self + i) % count], out);
+    if (found) atomic_fetch_sub(&p->pending, 1);
+    return found;
+}
+
+static void *pool_worker_main(void *arg) {
+    ThreadPool *p = pool;
+    pool_worker_index = (int)(intptr_t)arg;
+    for (;;) {
+        PoolTask task;
+        if (pool_take(p, &task)) {
+            task.run(&task);
+            continue;
+        }
+        pthread_mutex_lock(&p->lock);
+        while (!p->shutdown && atomic_load(&p->pending) == 0)
+            pthread_cond_wait(&p->wake, &p->lock);
+        int stop = p->shutdown;
+        pthread_mutex_unlock(&p->lock);
+        if (stop) return NULL;
+    }
+}
+
+unsigned online_cpus(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (unsigned)n : 1;
+}
+
+static void pool_destroy(ThreadPool *p) {
+    pthread_mutex_lock(&p->lock);
+    p->shutdown = 1;
+    pthread_cond_broadcast(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+    for (unsigned i = 0; i < p->nworkers; i++)
+        pthread_join(p->threads[i], NULL);
+    for (unsigned i = 0; i <= p->nworkers; i++) {
+        pthread_mutex_destroy(&p->deques[i].lock);
+        free(p->deques[i].items);
+    }
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->wake);
+    free(p->threads);
+    free(p->deques);
+    free(p);
+}
+
+// Thread count: matrix_set_num_threads() if called, else MAT_THREADS, else
+// one thread per online CPU
+static ThreadPool *pool_get(void) {
+    ThreadPool *ready = atomic_load(&pool);
+    if (ready) return ready;
+
+    pthread_mutex_lock(&pool_init_lock);
+    if (!pool) {
+        unsigned n = pool_requested_threads;
+        const char *env = getenv("MAT_THREADS");
+        if (n == 0 && env && atoi(env) > 0) n = (unsigned)atoi(env);
+        if (n == 0) n = online_cpus();
+
+        ThreadPool *p = calloc(1, sizeof(ThreadPool));
+        if (!p) abort();
+        p->nthreads = n;
+        p->nworkers = n - 1;
+        p->threads = calloc(n, sizeof(pthread_t));
+        p->deques = calloc(n, sizeof(TaskDeque));
+        if (!p->threads || !p->deques) abort();
+        for (unsigned i = 0; i < n; i++)
+            deque_init(&p->deques[i]);
+        pthread_mutex_init(&p->lock, NULL);
+        pthread_cond_init(&p->wake, NULL);
+        atomic_init(&p->pending, 0);
+
+        atomic_store(&pool, p);
+        for (unsigned i = 0; i < p->nworkers; i++)
+            pthread_create(&p->threads[i], NULL, pool_worker_main, (void *)(intptr_t)i);
+    }
+    ThreadPool *p = pool;
+    pthread_mutex_unlock(&pool_init_lock);
+    return p;
+}
+
+// Set the number of threads used by the compute kernels, 0 meaning one per
+// CPU. Must not be called while a computation is running.
+void matrix_set_num_threads(unsigned n) {
+    pthread_mutex_lock(&pool_init_lock);
+    pool_requested_threads = n;
+    if (pool) {
+        pool_destroy(pool);
+        atomic_store(&pool, NULL);
+    }
+    pthread_mutex_unlock(&pool_init_lock);
+}
+
+unsigned matrix_get_num_threads(void) {
+    return pool_get()->nthreads;
+}
+
+static void pool_push(const PoolTask *task) {
+    ThreadPool *p = pool_get();
+    deque_push(&p->deques[pool_self(p)], task);
+    atomic_fetch_add(&p->pending, 1);
+    pthread_mutex_lock(&p->lock);
+    pthread_cond_signal(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+}
+
+static void pool_signal_done(atomic_int *done) {
+    ThreadPool *p = pool_get();
+    pthread_mutex_lock(&p->lock);
+    atomic_store(done, 1);
+    pthread_cond_broadcast(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+}
+
+// Execute tasks on the calling thread until *done is set
+static void pool_wait(atomic_int *done) {
+    ThreadPool *p = pool_get();
+    while (!atomic_load(done)) {
+        PoolTask task;
+        if (pool_take(p, &task)) {
+            task.run(&task);
+            continue;
+        }
+        pthread_mutex_lock(&p->lock);
+        while (!atomic_load(done) && atomic_load(&p->pending) == 0)
+            pthread_cond_wait(&p->wake, &p->lock);
+        pthread_mutex_unlock(&p->lock);
+    }
+}
+
+// Compressed store blocks
+//
+// A packed block splits a dense matrix into chunks of chunk_rows rows that
+// decode independently, so loading runs one pool task per chunk. Integer
+// chunks take the smaller of two encodings: the zigzag varint of each
+// element's difference from the previous one, which suits smooth or
+// clustered values, or frame of reference, every element minus the chunk
+// minimum in a fixed number of bits, which suits values spread over a range.
+// Floating point elements are byte-shuffled (all first bytes, then all
+// second bytes, ...) so exponents and sign bytes sit together. Each chunk is
+// then deflated when that makes it smaller.
+//
+//     MatbPackHeader, chunks x MatbChunk, then the chunk bytes
+#define MATB_CHUNK_BYTES (1 << 20)  // element bytes per chunk, before encoding
+#define MATB_CHUNK_RAW 0            // encoded only
+#define MATB_CHUNK_DEFLATE 1        // encoded, then zlib
+#define PACK_DELTA_VARINT 0         // first byte of an integer chunk's encoding
+#define PACK_FRAME 1                // then the int64 minimum and the bit width
+#define PACK_FRAME_MAX_BITS 56      // one unaligned 8-byte load per element
+#define PACK_DEFLATE_PROBE (64 << 10)   // bytes deflated to decide whether to deflate the rest
+
+typedef struct {
+    uint32_t chunk_rows;    // rows per chunk, fewer in the last one
+    uint32_t chunks;
+    uint64_t reserved;
+} MatbPackHeader;
+
+typedef struct {
+    uint64_t offset;        // from the start of the block
+    uint32_t size;          // stored bytes
+    uint32_t method;        // MATB_CHUNK_RAW or MATB_CHUNK_DEFLATE
+    uint64_t encoded_size;  // bytes once inflated
+} MatbChunk;
+
+_Static_assert(sizeof(MatbPackHeader) == 16, "MatbPackHeader layout");
+_Static_assert(sizeof(MatbChunk) == 24, "MatbChunk layout");
+
+static inline int64_t pack_get(MatrixType type, const void *src, size_t i) {
+    return type == MATRIX_INT32 ? ((const int32_t *)src)[i] : ((const int64_t *)src)[i];
+}
+
+static inline void pack_put(MatrixType type, void *dst, size_t i, uint64_t value) {
+    if (type == MATRIX_INT32) ((int32_t *)dst)[i] = (int32_t)value;
+    else ((int64_t *)dst)[i] = (int64_t)value;
+}
+
+// Largest encoding of count elements of type
+static size_t pack_bound(MatrixType type, size_t count) {
+    return matrix_type_is_integer(type) ? 1 + count * 10 : count * matrix_types[type].size;
+}
+
+static size_t pack_elements(MatrixType type, const void *src, size_t count, uint8_t *out) {
+    size_t size = matrix_types[type].size;
+    if (!matrix_type_is_integer(type)) {
+        const uint8_t *in = src;
+        for (size_t b = 0; b < size; b++)
+            for (size_t i = 0; i < count; i++)
+                out[b * count + i] = in[i * size + b];
+        return count * size;
+    }
+
+    uint8_t *p = out;
+    *p++ = PACK_DELTA_VARINT;
+    uint64_t prev = 0;
+    int64_t min = count ? pack_get(type, src, 0) : 0, max = min;
+    for (size_t i = 0; i < count; i++) {
+        int64_t value = pack_get(type, src, i);
+        if (value < min) min = value;
+        if (value > max) max = value;
+        uint64_t d = (uint64_t)value - prev;
+        uint64_t z = (d << 1) ^ (uint64_t)((int64_t)d >> 63);
+        prev = (uint64_t)value;
+        while (z >= 0x80) {
+            *p++ = (uint8_t)z | 0x80;
+            z >>= 7;
+        }
+        *p++ = (uint8_t)z;
+    }
+
+    uint64_t range = (uint64_t)max - (uint64_t)min;
+    unsigned bits = range ? 64 - __builtin_clzll(range) : 0;
+    size_t frame_size = 10 + (count * bits + 7) / 8 + 8;
+    if (bits > PACK_FRAME_MAX_BITS || frame_size >= (size_t)(p - out)) return (size_t)(p - out);
+
+    memset(out, 0, frame_size);
+    out[0] = PACK_FRAME;
+    memcpy(out + 1, &min, sizeof(min));
+    out[9] = (uint8_t)bits;
+    uint8_t *packed = out + 10;
+    for (size_t i = 0, bit = 0; i < count; i++, bit += bits) {
+        uint64_t word, v = (uint64_t)pack_get(type, src, i) - (uint64_t)min;
+        memcpy(&word, packed + bit / 8, sizeof(word));
+        word |= v << (bit % 8);
+        memcpy(packed + bit / 8, &word, sizeof(word));
+    }
+    return frame_size;
+}
+
+// Decode count elements from in[0, size); returns 0, or -1 if the encoding
+// does not hold exactly count elements
+static int unpack_elements(MatrixType type, const uint8_t *in, size_t size, size_t count, void *dst) {
+    size_t elem = matrix_types[type].size;
+    if (!matrix_type_is_integer(type)) {
+        if (size != count * elem) return -1;
+        uint8_t *out = dst;
+        for (size_t b = 0; b < elem; b++)
+            for (size_t i = 0; i < count; i++)
+                out[i * elem + b] = in[b * count + i];
+        return 0;
+    }
+    if (size == 0) return -1;
+
+    if (in[0] == PACK_FRAME) {
+        int64_t min;
+        if (size < 10) return -1;
+        memcpy(&min, in + 1, sizeof(min));
+        unsigned bits = in[9];
+        if (bits > PACK_FRAME_MAX_BITS || size != 10 + (count * bits + 7) / 8 + 8) return -1;
+        const uint8_t *packed = in + 10;
+        uint64_t mask = bits ? ~0ULL >> (64 - bits) : 0;
+        for (size_t i = 0, bit = 0; i < count; i++, bit += bits) {
+            uint64_t word;
+            memcpy(&word, packed + bit / 8, sizeof(word));
+            pack_put(type, dst, i, (uint64_t)min + ((word >> (bit % 8)) & mask));
+        }
+        return 0;
+    }
+    if (in[0] != PACK_DELTA_VARINT) return -1;
+
+    const uint8_t *p = in + 1, *end = in + size;
+    uint64_t prev = 0;
+    for (size_t i = 0; i < count; i++) {
+        uint64_t z = 0;
+        for (unsigned shift = 0;; shift += 7) {
+            if (p == end || shift > 63) return -1;
+            uint8_t byte = *p++;
+            z |= (uint64_t)(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) break;
+        }
+        prev += (z >> 1) ^ -(z & 1);
+        pack_put(type, dst, i, prev);
+    }
+    return p == end ? 0 : -1;
+}
+
+typedef struct {
+    MatrixType type;
+    unsigned rows, cols, chunk_rows;
+    char *elements;         // the matrix, row-major
+    const char *block;      // unpacking: the stored block
+    MatbChunk *chunks;
+    uint8_t **packed;       // packing: the stored bytes of each chunk
+    atomic_int failed;
+    atomic_size_t remaining;
+    atomic_int done;
+} MatbPackJob;
+
+static void matb_pack_chunk(PoolTask *task) {
+    MatbPackJob *job = task->ctx;
+    unsigned c = task->a, r0 = c * job->chunk_rows;
+    unsigned r1 = job->rows - r0 < job->chunk_rows ? job->rows : r0 + job->chunk_rows;
+    size_t count = (size_t)(r1 - r0) * job->cols, elem = matrix_types[job->type].size;
+    MatrixTraceScope scope = matrix_trace_begin("matb.pack");
+
+    size_t bound = pack_bound(job->type, count);
+    uint8_t *encoded = bound <= UINT32_MAX ? malloc(bound ? bound : 1) : NULL;
+    size_t size = encoded ? pack_elements(job->type, job->elements + (size_t)r0 * job->cols * elem,
+                                          count, encoded) : 0;
+    MatbChunk *chunk = &job->chunks[c];
+    chunk->encoded_size = size;
+    chunk->method = MATB_CHUNK_RAW;
+    chunk->size = (uint32_t)size;
+    job->packed[c] = encoded;
+#ifdef MATRIX_ZLIB
+    // Frame-packed random values gain nothing from deflate, so a chunk whose
+    // start does not shrink is stored as it is
+    uLongf deflated_size = compressBound(size), probe_size = deflated_size;
+    uint8_t *deflated = encoded ? malloc(deflated_size) : NULL;
+    size_t probe = size < PACK_DEFLATE_PROBE ? size : PACK_DEFLATE_PROBE;
+    if (deflated && (probe == size ||
+                     (compress2(deflated, &probe_size, encoded, probe, Z_BEST_SPEED) == Z_OK &&
+                      probe_size < probe - probe / 32)) &&
+        compress2(deflated, &deflated_size, encoded, size, Z_BEST_SPEED) == Z_OK &&
+        deflated_size < size) {
+        free(encoded);
+        job->packed[c] = deflated;
+        chunk->method = MATB_CHUNK_DEFLATE;
+        chunk->size = (uint32_t)deflated_size;
+    } else {
+        free(deflated);
+    }
+#endif
+    if (!encoded) atomic_store(&job->failed, 1);
+    matrix_trace_end(scope, count * elem, 0.0);
+    if (atomic_fetch_sub(&job->remaining, 1) == 1)
+        pool_signal_done(&job->done);
+}
+
+static void matb_unpack_chunk(PoolTask *task) {
+    MatbPackJob *job = task->ctx;
+    unsigned c = task->a, r0 = c * job->chunk_rows;
+    unsigned r1 = job->rows - r0 < job->chunk_rows ? job->rows : r0 + job->chunk_rows;
+    size_t count = (size_t)(r1 - r0) * job->cols, elem = matrix_types[job->type].size;
+    const MatbChunk *chunk = &job->chunks[c];
+    const uint8_t *in = (const uint8_t *)job->block + chunk->offset;
+    MatrixTraceScope scope = matrix_trace_begin("matb.unpack");
+
+    size_t mark = scratch_mark();
+    int status = -1;
+    if (chunk->method == MATB_CHUNK_RAW) {
+        status = unpack_elements(job->type, in, chunk->size, count,
+                                 job->elements + (size_t)r0 * job->cols * elem);
+    }
+#ifdef MATRIX_ZLIB
+    else if (chunk->method == MATB_CHUNK_DEFLATE && chunk->encoded_size <= pack_bound(job->type, count)) {
+        uint8_t *encoded = scratch_alloc(chunk->encoded_size);
+        uLongf size = chunk->encoded_size;
+        if (encoded && uncompress(encoded, &size, in, chunk->size) == Z_OK && size == chunk->encoded_size)
+            status = unpack_elements(job->type, encoded, size, count,
+                                     job->elements + (size_t)r0 * job->cols * elem);
+    }
+#endif
+    scratch_pop(mark);
+    if (status != 0) atomic_store(&job->failed, 1);
+    matrix_trace_end(scope, count * elem, 0.0);
+    if (atomic_fetch_sub(&job->remaining, 1) == 1)
+        pool_signal_done(&job->done);
+}
+
+static void matb_pack_run(MatbPackJob *job, void (*run)(PoolTask *task), unsigned chunks) {
+    atomic_init(&job->failed, 0);
+    atomic_init(&job->remaining, chunks);
+    atomic_init(&job->done, chunks == 0);
+    for (unsigned c = 0; c < chunks; c++) {
+        PoolTask task = { run, job, 0, c, 0, 0 };
+        pool_push(&task);
+    }
+    pool_wait(&job->done);
+}
+
+// Write dense in a packed block and fill in entry's type, size and checksum
+static int matb_write_packed(FILE *file, const Matrix *dense, MatbEntry *entry) {
+    size_t elem = matrix_types[dense->type].size;
+    size_t row_bytes = (size_t)dense->N * elem;
+    unsigned chunk_rows = row_bytes >= MATB_CHUNK_BYTES ? 1 : (unsigned)(MATB_CHUNK_BYTES / row_bytes);
+    unsigned chunks = dense->M ? (dense->M - 1) / chunk_rows + 1 : 0;
+    MatbPackHeader header = { chunk_rows, chunks, 0 };
+    MatbPackJob job = { dense->type, dense->M, dense->N, chunk_rows, dense->data, NULL,
+                        calloc(chunks ? chunks : 1, sizeof(MatbChunk)),
+                        calloc(chunks ? chunks : 1, sizeof(uint8_t *)) };
+    int status = -1;
+    if (!job.chunks || !job.packed) goto out;
+    matb_pack_run(&job, matb_pack_chunk, chunks);
+    if (atomic_load(&job.failed)) goto out;
+
+    uint64_t offset = sizeof(header) + (uint64_t)chunks * sizeof(MatbChunk);
+    for (unsigned c = 0; c < chunks; c++) {
+        job.chunks[c].offset = offset;
+        offset += job.chunks[c].size;
+    }
+    entry->elem_type = MATB_PACKED | matb_dense_types[dense->type];
+    entry->data_size = offset;
+
+    // The checksum covers the block as stored, in the order it is written
+    char *block = malloc(offset);
+    if (!block) goto out;
+    memcpy(block, &header, sizeof(header));
+    memcpy(block + sizeof(header), job.chunks, (size_t)chunks * sizeof(MatbChunk));
+    for (unsigned c = 0; c < chunks; c++)
+        memcpy(block + job.chunks[c].offset, job.packed[c], job.chunks[c].size);
+    entry->checksum = matb_checksum(block, offset);
+    status = fwrite(block, 1, offset, file) == offset ? 0 : -1;
+    free(block);
+
+out:
+    for (unsigned c = 0; job.packed && c < chunks; c++)
+        free(job.packed[c]);
+    free(job.packed);
+    free(job.chunks);
+    return status;
+}
+
+// Decode the packed block of entry e into a new matrix of type; NULL if the
+// block is malformed or its chunks do not decode
+static Matrix *matb_read_packed(const MatbEntry *e, const char *data, MatrixType type) {
+    MatbPackHeader header;
+    if (e->data_size < sizeof(header) || matb_checksum(data, e->data_size) != e->checksum) return NULL;
+    memcpy(&header, data, sizeof(header));
+    uint64_t table_end = sizeof(header) + (uint64_t)header.chunks * sizeof(MatbChunk);
+    if (header.chunk_rows == 0 || header.chunks != (e->rows ? (e->rows - 1) / header.chunk_rows + 1 : 0) ||
+        table_end > e->data_size)
+        return NULL;
+    MatbChunk *chunks = malloc((header.chunks ? header.chunks : 1) * sizeof(MatbChunk));
+    if (!chunks) return NULL;
+    memcpy(chunks, data + sizeof(header), (size_t)header.chunks * sizeof(MatbChunk));
+    for (unsigned c = 0; c < header.chunks; c++) {
+        if (chunks[c].offset < table_end || chunks[c].offset > e->data_size ||
+            chunks[c].size > e->data_size - chunks[c].offset) {
+            free(chunks);
+            return NULL;
+        }
+    }
+
+    Matrix *matrix = create_matrix_typed(e->rows, e->cols, type);
+    if (matrix) {
+        MatbPackJob job = { type, e->rows, e->cols, header.chunk_rows, matrix_data_mut(matrix), data, chunks };
+        matb_pack_run(&job, matb_unpack_chunk, header.chunks);
+        if (atomic_load(&job.failed)) {
+            free_matrix(matrix);
+            matrix = NULL;
+        }
+    }
+    free(chunks);
+    return matrix;
+}
+
+// Blocked LU factorization
+//
+// Right-looking LU with partial pivoting over a row-major n x n double array,
+// split into LU_BLOCK x LU_BLOCK tiles. Step k factors panel k, applies its
+// row swaps and triangular solve to each block column to the right, then
+// updates every trailing tile. Each of those is a task in a dependency graph
+// run on the thread pool; a tile is always updated by the same kernel calls in
+// the same order, so the result is bit-identical for any thread count.
+#define LU_BLOCK 64
+
+typedef void (*LuUpdateKernel)(double *c, size_t ldc, const double *l, size_t ldl,
+                               const double *u, size_t ldu,
+                               unsigned rows, unsigned cols, unsigned depth);
+
+// C[rows x cols] -= L[rows x depth] * U[depth x cols]
+static void lu_update_scalar(double *c, size_t ldc, const double *l, size_t ldl,
+                             const double *u, size_t ldu,
+                             unsigned rows, unsigned cols, unsigned depth) {
+    for (unsigned i = 0; i < rows; i++) {
+        double *ci = c + i * ldc;
+        const double *li = l + i * ldl;
+        for (unsigned p = 0; p < depth; p++) {
+            double f = li[p];
+            const double *up = u + p * ldu;
+            for (unsigned j = 0; j < cols; j++)
+                ci[j] -= f * up[j];
+        }
+    }
+}
+
+// Scalar cleanup for the rows/columns a vector kernel does not cover
+static void lu_update_edge(double *c, size_t ldc, const double *l, size_t ldl, const double *u,
+                           unsigned row0, unsigned rows, unsigned col0, unsigned cols,
+                           size_t ldu, unsigned depth) {
+    for (unsigned i = row0; i < rows; i++) {
+        for (unsigned p = 0; p < depth; p++) {
+            double f = l[i * ldl + p];
+            const double *up = u + p * ldu;
+            for (unsigned j = col0; j < cols; j++)
+                c[i * ldc + j] -= f * up[j];
+        }
+    }
+}
+
+#ifdef MATRIX_X86
+// 4x8 register tile: 8 ymm accumulators, one broadcast per row per k
+__attribute__((target("avx2,fma")))
+static void lu_update_avx2(double *c, size_t ldc, const double *l, size_t ldl,
+                           const double *u, size_t ldu,
+                           unsigned rows, unsigned cols, unsigned depth) {
+    unsigned i = 0;
+    for (; i + 4 <= rows; i += 4) {
+        const double *l0 = l + i * ldl, *l1 = l0 + ldl, *l2 = l1 + ldl, *l3 = l2 + ldl;
+        unsigned j = 0;
+        for (; j + 8 <= cols; j += 8) {
+            __m256d c00 = _mm256_setzero_pd(), c01 = _mm256_setzero_pd();
+            __m256d c10 = _mm256_setzero_pd(), c11 = _mm256_setzero_pd();
+            __m256d c20 = _mm256_setzero_pd(), c21 = _mm256_setzero_pd();
+            __m256d c30 = _mm256_setzero_pd(), c31 = _mm256_setzero_pd();
+            const double *up = u + j;
+            for (unsigned p = 0; p < depth; p++, up += ldu) {
+                __m256d u0 = _mm256_loadu_pd(up);
+                __m256d u1 = _mm256_loadu_pd(up + 4);
+                __m256d a;
+                a = _mm256_broadcast_sd(l0 + p);
+                c00 = _mm256_fmadd_pd(a, u0, c00); c01 = _mm256_fmadd_pd(a, u1, c01);
+                a = _mm256_broadcast_sd(l1 + p);
+                c10 = _mm256_fmadd_pd(a, u0, c10); c11 = _mm256_fmadd_pd(a, u1, c11);
+                a = _mm256_broadcast_sd(l2 + p);
+                c20 = _mm256_fmadd_pd(a, u0, c20); c21 = _mm256_fmadd_pd(a, u1, c21);
+                a = _mm256_broadcast_sd(l3 + p);
+                c30 = _mm256_fmadd_pd(a, u0, c30); c31 = _mm256_fmadd_pd(a, u1, c31);
+            }
+            double *cp = c + i * ldc + j;
+            _mm256_storeu_pd(cp, _mm256_sub_pd(_mm256_loadu_pd(cp), c00));
+            _mm256_storeu_pd(cp + 4, _mm256_sub_pd(_mm256_loadu_pd(cp + 4), c01));
+            cp += ldc;
+            _mm256_storeu_pd(cp, _mm256_sub_pd(_mm256_loadu_pd(cp), c10));
+            _mm256_storeu_pd(cp + 4, _mm256_sub_pd(_mm256_loadu_pd(cp + 4), c11));
+            cp += ldc;
+            _mm256_storeu_pd(cp, _mm256_sub_pd(_mm256_loadu_pd(cp), c20));
+            _mm256_storeu_pd(cp + 4, _mm256_sub_pd(_mm256_loadu_pd(cp + 4), c21));
+            cp += ldc;
+            _mm256_storeu_pd(cp, _mm256_sub_pd(_mm256_loadu_pd(cp), c30));
+            _mm256_storeu_pd(cp + 4, _mm256_sub_pd(_mm256_loadu_pd(cp + 4), c31));
+        }
+        if (j < cols)
+            lu_update_edge(c + i * ldc, ldc, l0, ldl, u, 0, 4, j, cols, ldu, depth);
+    }
+    if (i < rows)
+        lu_update_edge(c, ldc, l, ldl, u, i, rows, 0, cols, ldu, depth);
+}
+
+// 4x16 register tile: 8 zmm accumulators
+__attribute__((target("avx512f")))
+static void lu_update_avx512(double *c, size_t ldc, const double *l, size_t ldl,
+                             const double *u, size_t ldu,
+                             unsigned rows, unsigned cols, unsigned depth) {
+    unsigned i = 0;
+    for (; i + 4 <= rows; i += 4) {
+        const double *l0 = l + i * ldl, *l1 = l0 + ldl, *l2 = l1 + ldl, *l3 = l2 + ldl;
+        unsigned j = 0;
+        for (; j + 16 <= cols; j += 16) {
+            __m512d c00 = _mm512_setzero_pd(), c01 = _mm512_setzero_pd();
+            __m512d c10 = _mm512_setzero_pd(), c11 = _mm512_setzero_pd();
+            __m512d c20 = _mm512_setzero_pd(), c21 = _mm512_setzero_pd();
+            __m512d c30 = _mm512_setzero_pd(), c31 = _mm512_setzero_pd();
+            const double *up = u + j;
+            for (unsigned p = 0; p < depth; p++, up += ldu) {
+                __m512d u0 = _mm512_loadu_pd(up);
+                __m512d u1 = _mm512_loadu_pd(up + 8);
+                __m512d a;
+                a = _mm512_set1_pd(l0[p]);
+                c00 = _mm512_fmadd_pd(a, u0, c00); c01 = _mm512_fmadd_pd(a, u1, c01);
+                a = _mm512_set1_pd(l1[p]);
+                c10 = _mm512_fmadd_pd(a, u0, c10); c11 = _mm512_fmadd_pd(a, u1, c11);
+                a = _mm512_set1_pd(l2[p]);
+                c20 = _mm512_fmadd_pd(a, u0, c20); c21 = _mm512_fmadd_pd(a, u1, c21);
+                a = _mm512_set1_pd(l3[p]);
+                c30 = _mm512_fmadd_pd(a, u0, c30); c31 = _mm512_fmadd_pd(a, u1, c31);
+            }
+            double *cp = c + i * ldc + j;
+            _mm512_storeu_pd(cp, _mm512_sub_pd(_mm512_loadu_pd(cp), c00));
+            _mm512_storeu_pd(cp + 8, _mm512_sub_pd(_mm512_loadu_pd(cp + 8), c01));
+            cp += ldc;
+            _mm512_storeu_pd(cp, _mm512_sub_pd(_mm512_loadu_pd(cp), c10));
+            _mm512_storeu_pd(cp + 8, _mm512_sub_pd(_mm512_loadu_pd(cp + 8), c11));
+            cp += ldc;
+            _mm512_storeu_pd(cp, _mm512_sub_pd(_mm512_loadu_pd(cp), c20));
+            _mm512_storeu_pd(cp + 8, _mm512_sub_pd(_mm512_loadu_pd(cp + 8), c21));
+            cp += ldc;
+            _mm512_storeu_pd(cp, _mm512_sub_pd(_mm512_loadu_pd(cp), c30));
+            _mm512_storeu_pd(cp + 8, _mm512_sub_pd(_mm512_loadu_pd(cp + 8), c31));
+        }
+        if (j < cols)
+            lu_update_edge(c + i * ldc, ldc, l0, ldl, u, 0, 4, j, cols, ldu, depth);
+    }
+    if (i < rows)
+        lu_update_edge(c, ldc, l, ldl, u, i, rows, 0, cols, ldu, depth);
+}
+#endif
+
+static LuUpdateKernel lu_update_kernel = NULL;
+const char *lu_kernel_name = "scalar";
+
+// Pick the widest update kernel the CPU supports. MAT_KERNEL=scalar|avx2|avx512
+// forces a narrower one, which is mostly useful for benchmarking.
+void lu_select_kernel(void) {
+    if (lu_update_kernel) return;
+
+    const char *force = getenv("MAT_KERNEL");
+    LuUpdateKernel kernel = lu_update_scalar;
+    const char *name = "scalar";
+#ifdef MATRIX_X86
+    __builtin_cpu_init();
+    int want_avx512 = !force || strcmp(force, "avx512") == 0;
+    int want_avx2 = !force || strcmp(force, "avx2") == 0 || strcmp(force, "avx512") == 0;
+    if (want_avx512 && __builtin_cpu_supports("avx512f")) {
+        kernel = lu_update_avx512;
+        name = "avx512";
+    } else if (want_avx2 && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        kernel = lu_update_avx2;
+        name = "avx2";
+    }
+#else
+    (void)force;
+#endif
+    lu_kernel_name = name;
+    lu_update_kernel = kernel;
+}
+
+typedef struct {
+    double *a;
+    unsigned n;
+    unsigned nb;            // number of block columns
+    unsigned *piv;
+    atomic_int *udeps;      // [k*nb + j]: inputs U(k,j) is still waiting for
+    atomic_int *gleft;      // [k*nb + j]: tile updates of step k left in block j
+    atomic_size_t remaining;
+    atomic_int singular;
+    atomic_int cancelled;
+    MatrixProgress *progress;
+    atomic_int done;
+} LuGraph;
+
+enum { LU_TASK_PANEL, LU_TASK_ROW, LU_TASK_UPDATE, LU_TASK_SWAP_LEFT };
+static const char *const lu_task_names[] = { "lu.panel", "lu.row", "lu.update", "lu.swap" };
+
+static inline unsigned lu_block_size(const LuGraph *g, unsigned b) {
+    unsigned start = b * LU_BLOCK;
+    return g->n - start < LU_BLOCK ? g->n - start : LU_BLOCK;
+}
+
+// Unblocked factorization of panel k: rows k0..rows of block column k, in an
+// array with ld elements per row. Row swaps stay inside the panel; the other
+// block columns apply them in their own tasks.
+static int lu_factor_panel(double *a, size_t ld, unsigned rows, unsigned k0, unsigned kb,
+                           unsigned *piv) {
+    for (unsigned j = k0; j < k0 + kb; j++) {
+        unsigned max_row = j;
+        double best = fabs(a[(size_t)j * ld + j]);
+        for (unsigned i = j + 1; i < rows; i++) {
+            double v = fabs(a[(size_t)i * ld + j]);
+            if (v > best) {
+                best = v;
+                max_row = i;
+            }
+        }
+        piv[j] = max_row;
+        if (best == 0.0) return -1;
+
+        if (max_row != j) {
+            double *r0 = a + (size_t)j * ld, *r1 = a + (size_t)max_row * ld;
+            for (unsigned c = k0; c < k0 + kb; c++) {
+                double tmp = r0[c];
+                r0[c] = r1[c];
+                r1[c] = tmp;
+            }
+        }
+
+        const double *pivot_row = a + (size_t)j * ld;
+        double pivot = pivot_row[j];
+        for (unsigned i = j + 1; i < rows; i++) {
+            double *row = a + (size_t)i * ld;
+            double factor = row[j] / pivot;
+            row[j] = factor;
+            for (unsigned c = j + 1; c < k0 + kb; c++)
+                row[c] -= factor * pivot_row[c];
+        }
+    }
+    return 0;
+}
+
+// Apply the swaps recorded for rows r0..r1 to columns c0..c0+cb
+static void lu_apply_swaps(double *a, unsigned n, const unsigned *piv,
+                           unsigned r0, unsigned r1, unsigned c0, unsigned cb) {
+    for (unsigned r = r0; r < r1; r++) {
+        if (piv[r] == r) continue;
+        double *x = a + (size_t)r * n + c0, *y = a + (size_t)piv[r] * n + c0;
+        for (unsigned c = 0; c < cb; c++) {
+            double tmp = x[c];
+            x[c] = y[c];
+            y[c] = tmp;
+        }
+    }
+}
+
+// Solve L11 * U1j = A1j in place for one block column, L11 unit lower triangular
+static void lu_solve_block_row(double *a, unsigned n, unsigned k0, unsigned kb,
+                               unsigned c0, unsigned cb) {
+    for (unsigned i = k0 + 1; i < k0 + kb; i++) {
+        double *row = a + (size_t)i * n;
+        for (unsigned p = k0; p < i; p++) {
+            double f = row[p];
+            const double *src = a + (size_t)p * n;
+            for (unsigned c = c0; c < c0 + cb; c++)
+                row[c] -= f * src[c];
+        }
+    }
+}
+
+static void lu_run_task(PoolTask *task);
+
+static void lu_spawn(LuGraph *g, unsigned type, unsigned k, unsigned i, unsigned j) {
+    PoolTask t = { lu_run_task, g, type, k, i, j };
+    pool_push(&t);
+}
+
+static void lu_release_row(LuGraph *g, unsigned k, unsigned j) {
+    if (atomic_fetch_sub(&g->udeps[k * g->nb + j], 1) == 1)
+        lu_spawn(g, LU_TASK_ROW, k, 0, j);
+}
+
+// Task graph, for panel P(k), block row U(k,j) and tile update G(k,i,j):
+//   P(k)     after every G(k-1,i,k)
+//   U(k,j)   after P(k) and every G(k-1,i,j)
+//   G(k,i,j) after U(k,j)
+// and once the last panel is done, the L part of each earlier block column
+// picks up the row swaps of the panels to its right.
+static void lu_run_task(PoolTask *task) {
+    LuGraph *g = task->ctx;
+    unsigned k = task->a, i = task->b, j = task->c;
+    unsigned n = g->n, nb = g->nb;
+    unsigned k0 = k * LU_BLOCK, kb = lu_block_size(g, k);
+    // Once a zero pivot is found or the caller cancels, the remaining tasks
+    // only keep the counts right
+    int skip = atomic_load(&g->singular) || atomic_load(&g->cancelled);
+    MatrixTraceScope scope = matrix_trace_begin(lu_task_names[task->type]);
+    double flops = 0.0;
+
+    switch (task->type) {
+    case LU_TASK_PANEL:
+        if (!skip && g->progress) {
+            // Step k updates (nb - k)^2 tiles, which dominates its cost
+            atomic_fetch_add(&g->progress->done, (nb - k) * (nb - k));
+            if (atomic_load(&g->progress->cancel)) {
+                atomic_store(&g->cancelled, 1);
+                skip = 1;
+            }
+        }
+        if (!skip && lu_factor_panel(g->a, n, n, k0, kb, g->piv) != 0)
+            atomic_store(&g->singular, 1);
+        flops = (double)kb * kb * (n - k0);
+        if (k == nb - 1) {
+            for (unsigned b = 0; b + 1 < nb; b++)
+                lu_spawn(g, LU_TASK_SWAP_LEFT, 0, 0, b);
+        } else {
+            for (unsigned b = k + 1; b < nb; b++)
+                lu_release_row(g, k, b);
+        }
+        break;
+
+    case LU_TASK_ROW:
+        if (!skip) {
+            unsigned j0 = j * LU_BLOCK, jb = lu_block_size(g, j);
+            lu_apply_swaps(g->a, n, g->piv, k0, k0 + kb, j0, jb);
+            lu_solve_block_row(g->a, n, k0, kb, j0, jb);
+            flops = (double)kb * kb * jb;
+        }
+        for (unsigned b = k + 1; b < nb; b++)
+            lu_spawn(g, LU_TASK_UPDATE, k, b, j);
+        break;
+
+    case LU_TASK_UPDATE:
+        if (!skip) {
+            size_t i0 = (size_t)i * LU_BLOCK, j0 = (size_t)j * LU_BLOCK;
+            lu_update_kernel(g->a + i0 * n + j0, n, g->a + i0 * n + k0, n,
+                             g->a + (size_t)k0 * n + j0, n,
+                             lu_block_size(g, i), lu_block_size(g, j), kb);
+            flops = 2.0 * lu_block_size(g, i) * lu_block_size(g, j) * kb;
+        }
+        if (atomic_fetch_sub(&g->gleft[k * nb + j], 1) == 1) {
+            if (j == k + 1)
+                lu_spawn(g, LU_TASK_PANEL, k + 1, 0, 0);
+            else
+                lu_release_row(g, k + 1, j);
+        }
+        break;
+
+    case LU_TASK_SWAP_LEFT:
+        if (!skip)
+            lu_apply_swaps(g->a, n, g->piv, (j + 1) * LU_BLOCK, n, j * LU_BLOCK, LU_BLOCK);
+        break;
+    }
+    matrix_trace_end(scope, 0, skip ? 0.0 : flops);
+
+    if (atomic_fetch_sub(&g->remaining, 1) == 1)
+        pool_signal_done(&g->done);
+}
+
+// Factor a = P*L*U in place. piv (optional) receives the row swapped with
+// each row k; sign receives the permutation parity. Returns -1 if an exactly
+// zero pivot column is found, 0 otherwise.
+int lu_factor(double *a, unsigned n, unsigned *piv, int *sign) {
+    return lu_factor_progress(a, n, piv, sign, NULL);
+}
+
+// lu_factor reporting to progress (optional), which is checked for
+// cancellation before every panel. Returns -2 if cancelled, leaving a
+// partially factored.
+int lu_factor_progress(double *a, unsigned n, unsigned *piv, int *sign, MatrixProgress *progress) {
+    lu_select_kernel();
+    *sign = 1;
+    if (n == 0) return 0;
+
+    LuGraph g;
+    g.a = a;
+    g.n = n;
+    g.nb = (n + LU_BLOCK - 1) / LU_BLOCK;
+    size_t nb = g.nb, mark = scratch_mark();
+    g.piv = piv ? piv : scratch_alloc(n * sizeof(unsigned));
+    g.udeps = scratch_alloc(nb * nb * sizeof(atomic_int));
+    g.gleft = scratch_alloc(nb * nb * sizeof(atomic_int));
+    if (!g.piv || !g.udeps || !g.gleft) {
+        scratch_pop(mark);
+        return -1;
+    }
+
+    for (size_t k = 0; k < nb; k++) {
+        for (size_t j = k + 1; j < nb; j++) {
+            atomic_init(&g.udeps[k * nb + j], k == 0 ? 1 : 2);
+            atomic_init(&g.gleft[k * nb + j], (int)(nb - 1 - k));
+        }
+    }
+    // panels + block rows + tile updates + left swaps
+    size_t tasks = nb + nb * (nb - 1) / 2 + (nb - 1) * nb * (2 * nb - 1) / 6 + (nb - 1);
+    atomic_init(&g.remaining, tasks);
+    atomic_init(&g.singular, 0);
+    atomic_init(&g.cancelled, 0);
+    atomic_init(&g.done, 0);
+    g.progress = progress;
+    if (progress) {
+        atomic_store(&progress->done, 0);
+        atomic_store(&progress->total, (unsigned)(nb * (nb + 1) * (2 * nb + 1) / 6));
+    }
+
+    lu_spawn(&g, LU_TASK_PANEL, 0, 0, 0);
+    pool_wait(&g.done);
+
+    int status = atomic_load(&g.cancelled) ? -2 : atomic_load(&g.singular) ? -1 : 0;
+    if (status == 0) {
+        for (unsigned r = 0; r < n; r++)
+            if (g.piv[r] != r) *sign = -*sign;
+    }
+
+    scratch_pop(mark);
+    return status;
+}
+
+// Sparse LU
+//
+// A sparse matrix is factored as P*A*Q = L*U without ever being formed
+// dense. Q is an approximate minimum degree ordering of the pattern of
+// A + A^T, which keeps the fill-in of L and U small. Columns are then
+// factored left-looking (Gilbert-Peierls): a depth-first search over L finds
+// the rows where L^-1 a_k can be nonzero, a sparse triangular solve computes
+// them, and the pivot is the diagonal entry unless another row is more than
+// 1 / SPARSE_PIVOT_TOL times larger, so pivoting keeps to the ordering except
+// on badly conditioned columns. The cost follows the nonzeros of L and U
+// rather than n^3.
+#define SPARSE_PIVOT_TOL 0.1
+#define SPARSE_NONE UINT_MAX
+
+static void sparse_lu_free(SparseLu *lu) {
+    if (!lu) return;
+    free(lu->lp);
+    free(lu->up);
+    free(lu->li);
+    free(lu->ui);
+    free(lu->lx);
+    free(lu->ux);
+    free(lu->pinv);
+    free(lu->q);
+    free(lu);
+}
+
+// Transpose of the rows x cols CSR arrays into tp (cols + 1), ti and tx
+// (optional), i.e. the matrix by columns. Rows come out sorted in each column.
+static void csr_transpose(const MatrixCsr *csr, unsigned rows, unsigned cols,
+                          uint64_t *tp, unsigned *ti, int *tx) {
+    memset(tp, 0, ((size_t)cols + 1) * sizeof(uint64_t));
+    size_t nnz = csr->row_ptr[rows];
+    for (size_t p = 0; p < nnz; p++) tp[csr->cols[p] + 1]++;
+    for (unsigned j = 0; j < cols; j++) tp[j + 1] += tp[j];
+    for (unsigned i = 0; i < rows; i++) {
+        for (uint64_t p = csr->row_ptr[i]; p < csr->row_ptr[i + 1]; p++) {
+            uint64_t at = tp[csr->cols[p]]++;
+            ti[at] = i;
+            if (tx) tx[at] = csr->values[p];
+        }
+    }
+    // The fill pass moved every start to the next column's
+    for (unsigned j = cols; j > 0; j--) tp[j] = tp[j - 1];
+    tp[0] = 0;
+}
+
+// Approximate minimum degree
+//
+// Elimination on the graph of A + A^T, kept as a quotient graph: an
+// eliminated node becomes an element standing for the clique of its
+// remaining neighbours, so memory stays near the size of the pattern. Each
+// variable keeps the elements and the variables it touches, and the
+// elements next to the pivot are absorbed into the new one. Degrees are the
+// AMD bound
+//     d_i = min(n_left, d_i + |Lp \ i|, |A_i \ i| + |Lp \ i| + sum_e |Le \ Lp|)
+// with |Le \ Lp| found for all elements in one sweep. There is no
+// supervariable detection, which costs time on matrices with many
+// identically structured rows but not ordering quality.
+typedef struct {
+    unsigned *items;
+    unsigned len, cap;
+} AmdList;
+
+enum { AMD_VARIABLE, AMD_ELEMENT, AMD_ABSORBED };
+
+static int amd_push(AmdList *list, unsigned item) {
+    if (list->len == list->cap) {
+        unsigned cap = list->cap ? list->cap * 2 : 4;
+        unsigned *items = realloc(list->items, cap * sizeof(unsigned));
+        if (!items) return -1;
+        list->items = items;
+        list->cap = cap;
+    }
+    list->items[list->len++] = item;
+    return 0;
+}
+
+static void amd_clear(AmdList *list) {
+    free(list->items);
+    memset(list, 0, sizeof(*list));
+}
+
+typedef struct {
+    unsigned n;
+    AmdList *vars;          // A_i: variables next to variable i
+    AmdList *elems;         // E_i: elements next to variable i
+    AmdList *members;       // L_e: variables of element e
+    unsigned char *status;
+    unsigned *degree, *head, *next, *prev;
+    unsigned *mark;
+    size_t *w;
+} Amd;
+
+static void amd_free(Amd *g) {
+    for (unsigned i = 0; g->vars && i < g->n; i++) {
+        amd_clear(&g->vars[i]);
+        amd_clear(&g->elems[i]);
+        amd_clear(&g->members[i]);
+    }
+    free(g->vars);
+    free(g->elems);
+    free(g->members);
+    free(g->status);
+    free(g->degree);
+    free(g->head);
+    free(g->next);
+    free(g->prev);
+    free(g->mark);
+    free(g->w);
+}
+
+// Degree buckets: doubly linked lists of the variables of each degree
+static void amd_bucket_insert(Amd *g, unsigned i) {
+    unsigned d = g->degree[i];
+    g->next[i] = g->head[d];
+    g->prev[i] = SPARSE_NONE;
+    if (g->head[d] != SPARSE_NONE) g->prev[g->head[d]] = i;
+    g->head[d] = i;
+}
+
+static void amd_bucket_remove(Amd *g, unsigned i) {
+    if (g->prev[i] != SPARSE_NONE) g->next[g->prev[i]] = g->next[i];
+    else g->head[g->degree[i]] = g->next[i];
+    if (g->next[i] != SPARSE_NONE) g->prev[g->next[i]] = g->prev[i];
+}
+
+// Symmetric pattern of the n x n csr, without the diagonal
+static int amd_init(Amd *g, const MatrixCsr *csr, unsigned n) {
+    size_t nnz = csr->row_ptr[n];
+    uint64_t *tp = malloc(((size_t)n + 1) * sizeof(uint64_t));
+    unsigned *ti = malloc((nnz ? nnz : 1) * sizeof(unsigned));
+    g->n = n;
+    g->vars = calloc(n ? n : 1, sizeof(AmdList));
+    g->elems = calloc(n ? n : 1, sizeof(AmdList));
+    g->members = calloc(n ? n : 1, sizeof(AmdList));
+    g->status = calloc(n ? n : 1, 1);
+    g->degree = malloc((n ? n : 1) * sizeof(unsigned));
+    g->head = malloc((n ? n : 1) * sizeof(unsigned));
+    g->next = malloc((n ? n : 1) * sizeof(unsigned));
+    g->prev = malloc((n ? n : 1) * sizeof(unsigned));
+    g->mark = calloc(n ? n : 1, sizeof(unsigned));
+    g->w = calloc(n ? n : 1, sizeof(size_t));
+    int status = tp && ti && g->vars && g->elems && g->members && g->status && g->degree &&
+                 g->head && g->next && g->prev && g->mark && g->w ? 0 : -1;
+    if (status == 0) csr_transpose(csr, n, n, tp, ti, NULL);
+
+    for (unsigned i = 0; status == 0 && i < n; i++) {
+        // Merge row i with column i, both sorted
+        uint64_t a = csr->row_ptr[i], a_end = csr->row_ptr[i + 1], b = tp[i], b_end = tp[i + 1];
+        AmdList *list = &g->vars[i];
+        list->cap = (unsigned)(a_end - a + b_end - b);
+        list->items = malloc((list->cap ? list->cap : 1) * sizeof(unsigned));
+        if (!list->items) {
+            status = -1;
+            break;
+        }
+        while (a < a_end || b < b_end) {
+            unsigned j = b == b_end || (a < a_end && csr->cols[a] < ti[b]) ? csr->cols[a++] : ti[b++];
+            if (j != i && (list->len == 0 || list->items[list->len - 1] != j))
+                list->items[list->len++] = j;
+        }
+        g->degree[i] = list->len;
+        g->head[i] = SPARSE_NONE;
+    }
+    for (unsigned i = 0; status == 0 && i < n; i++) amd_bucket_insert(g, i);
+    free(tp);
+    free(ti);
+    return status;
+}
+
+// Fill-reducing elimination order of the pattern of the n x n csr (order[k]
+// is the k-th pivot), or NULL if out of memory
+unsigned *amd_order(const MatrixCsr *csr, unsigned n) {
+    Amd g;
+    memset(&g, 0, sizeof(g));
+    unsigned *order = malloc((n ? n : 1) * sizeof(unsigned));
+    if (!order || amd_init(&g, csr, n) != 0) {
+        amd_free(&g);
+        free(order);
+        return NULL;
+    }
+
+    size_t wflg = 1;
+    unsigned mindeg = 0;
+    for (unsigned k = 0; k < n; k++) {
+        while (g.head[mindeg] == SPARSE_NONE) mindeg++;
+        unsigned p = g.head[mindeg];
+        amd_bucket_remove(&g, p);
+        order[k] = p;
+        g.status[p] = AMD_ELEMENT;
+
+        // Lp: the live variables next to p directly or through its elements,
+        // which are absorbed into p
+        unsigned stamp = k + 1;
+        AmdList lp = { 0 };
+        g.mark[p] = stamp;
+        for (unsigned t = 0; t < g.vars[p].len; t++) {
+            unsigned i = g.vars[p].items[t];
+            if (g.status[i] != AMD_VARIABLE || g.mark[i] == stamp) continue;
+            g.mark[i] = stamp;
+            if (amd_push(&lp, i) != 0) goto fail;
+        }
+        for (unsigned t = 0; t < g.elems[p].len; t++) {
+            unsigned e = g.elems[p].items[t];
+            if (g.status[e] != AMD_ELEMENT) continue;
+            for (unsigned s = 0; s < g.members[e].len; s++) {
+                unsigned i = g.members[e].items[s];
+                if (g.status[i] != AMD_VARIABLE || g.mark[i] == stamp) continue;
+                g.mark[i] = stamp;
+                if (amd_push(&lp, i) != 0) goto fail;
+            }
+            g.status[e] = AMD_ABSORBED;
+            amd_clear(&g.members[e]);
+        }
+        amd_clear(&g.vars[p]);
+        amd_clear(&g.elems[p]);
+        g.members[p] = lp;
+
+        // w[e] - wflg = |Le \ Lp| for every element next to Lp
+        for (unsigned t = 0; t < lp.len; t++) {
+            AmdList *elems = &g.elems[lp.items[t]];
+            for (unsigned s = 0; s < elems->len; s++) {
+                unsigned e = elems->items[s];
+                if (g.status[e] != AMD_ELEMENT) continue;
+                if (g.w[e] < wflg) g.w[e] = g.members[e].len + wflg;
+                g.w[e]--;
+            }
+        }
+
+        unsigned left = n - k - 1, lp_ext = lp.len - 1;
+        for (unsigned t = 0; t < lp.len; t++) {
+            unsigned i = lp.items[t];
+            size_t ext = 0;
+            AmdList *elems = &g.elems[i], *vars = &g.vars[i];
+            unsigned kept = 0;
+            for (unsigned s = 0; s < elems->len; s++) {
+                unsigned e = elems->items[s];
+                if (g.status[e] != AMD_ELEMENT) continue;
+                size_t outside = g.w[e] - wflg;
+                if (outside == 0) {
+                    // Le inside Lp: absorbed into p as well
+                    g.status[e] = AMD_ABSORBED;
+                    amd_clear(&g.members[e]);
+                    continue;
+                }
+                ext += outside;
+                elems->items[kept++] = e;
+            }
+            elems->len = kept;
+            if (amd_push(elems, p) != 0) goto fail;
+
+            // Variables in Lp are now reached through p
+            kept = 0;
+            for (unsigned s = 0; s < vars->len; s++) {
+                unsigned j = vars->items[s];
+                if (g.status[j] != AMD_VARIABLE || g.mark[j] == stamp) continue;
+                vars->items[kept++] = j;
+            }
+            vars->len = kept;
+            ext += kept;
+
+            size_t d = left - 1;
+            if ((size_t)g.degree[i] + lp_ext < d) d = (size_t)g.degree[i] + lp_ext;
+            if (ext + lp_ext < d) d = ext + lp_ext;
+            amd_bucket_remove(&g, i);
+            g.degree[i] = (unsigned)d;
+            amd_bucket_insert(&g, i);
+            if (d < mindeg) mindeg = (unsigned)d;
+        }
+        wflg += (size_t)n + 1;
+    }
+    amd_free(&g);
+    return order;
+
+fail:
+    amd_free(&g);
+    free(order);
+    return NULL;
+}
+
+// Rows reachable from row j in the graph of the columns of L factored so
+// far, pushed onto xi below top in topological order. Iterative, with
+// pstack holding where each node on the stack resumes.
+static unsigned sparse_dfs(const SparseLu *lu, unsigned j, unsigned top, unsigned *xi,
+                           uint64_t *pstack, unsigned *visited, unsigned stamp) {
+    long head = 0;
+    xi[0] = j;
+    while (head >= 0) {
+        j = xi[head];
+        unsigned col = lu->pinv[j];
+        if (visited[j] != stamp) {
+            visited[j] = stamp;
+            pstack[head] = col == SPARSE_NONE ? 0 : lu->lp[col] + 1;    // past the unit diagonal
+        }
+        int done = 1;
+        uint64_t end = col == SPARSE_NONE ? 0 : lu->lp[col + 1];
+        for (uint64_t p = pstack[head]; p < end; p++) {
+            unsigned i = lu->li[p];
+            if (visited[i] == stamp) continue;
+            pstack[head] = p + 1;
+            xi[++head] = i;
+            done = 0;
+            break;
+        }
+        if (done) {
+            head--;
+            xi[--top] = j;
+        }
+    }
+    return top;
+}
+
+static int sparse_reserve(unsigned **index, double **values, size_t *cap, size_t needed) {
+    if (needed <= *cap) return 0;
+    size_t grown = 2 * *cap + needed;
+    unsigned *i = realloc(*index, grown * sizeof(unsigned));
+    if (i) *index = i;
+    double *v = i ? realloc(*values, grown * sizeof(double)) : NULL;
+    if (!v) return -1;
+    *values = v;
+    *cap = grown;
+    return 0;
+}
+
+// Factor the n x n csr. Returns 0, 1 if the matrix is singular (no nonzero
+// pivot left for some column), -1 if out of memory and -2 if progress
+// (optional) cancels.
+static int sparse_lu_factor(const MatrixCsr *csr, unsigned n, MatrixProgress *progress,
+                            SparseLu **out) {
+    *out = NULL;
+    size_t nnz = csr->row_ptr[n];
+    size_t mark = scratch_mark();
+    SparseLu *lu = calloc(1, sizeof(SparseLu));
+    uint64_t *ap = scratch_alloc(((size_t)n + 1) * sizeof(uint64_t));
+    unsigned *ai = scratch_alloc(nnz * sizeof(unsigned));
+    int *ax = scratch_alloc(nnz * sizeof(int));
+    double *x = scratch_alloc((size_t)n * sizeof(double));
+    unsigned *xi = scratch_alloc((size_t)n * sizeof(unsigned));
+    uint64_t *pstack = scratch_alloc((size_t)n * sizeof(uint64_t));
+    unsigned *visited = scratch_alloc((size_t)n * sizeof(unsigned));
+    int status = -1;
+    if (!lu || !ap || !ai || !ax || !x || !xi || !pstack || !visited) goto out;
+    memset(x, 0, (size_t)n * sizeof(double));
+    memset(visited, 0, (size_t)n * sizeof(unsigned));
+
+    lu->n = n;
+    lu->lp = malloc(((size_t)n + 1) * sizeof(uint64_t));
+    lu->up = malloc(((size_t)n + 1) * sizeof(uint64_t));
+    lu->pinv = malloc((n ? n : 1) * sizeof(unsigned));
+    MatrixTraceScope order = matrix_trace_begin("sparse_lu.order");
+    lu->q = amd_order(csr, n);
+    matrix_trace_end(order, nnz * sizeof(unsigned), 0.0);
+    if (!lu->lp || !lu->up || !lu->pinv || !lu->q ||
+        sparse_reserve(&lu->li, &lu->lx, &lu->lcap, 4 * nnz + n) != 0 ||
+        sparse_reserve(&lu->ui, &lu->ux, &lu->ucap, 4 * nnz + n) != 0)
+        goto out;
+    for (unsigned i = 0; i < n; i++) lu->pinv[i] = SPARSE_NONE;
+    csr_transpose(csr, n, n, ap, ai, ax);
+    if (progress) {
+        atomic_store(&progress->done, 0);
+        atomic_store(&progress->total, n);
+    }
+
+    size_t lnz = 0, unz = 0;
+    status = 0;
+    for (unsigned k = 0; k < n; k++) {
+        if (progress && k % 256 == 0) {
+            if (atomic_load(&progress->cancel)) {
+                status = -2;
+                goto out;
+            }
+            atomic_store(&progress->done, k);
+        }
+        lu->lp[k] = lnz;
+        lu->up[k] = unz;
+        if (sparse_reserve(&lu->li, &lu->lx, &lu->lcap, lnz + n) != 0 ||
+            sparse_reserve(&lu->ui, &lu->ux, &lu->ucap, unz + n) != 0) {
+            status = -1;
+            goto out;
+        }
+
+        // x = L \ A(:, col) on the rows the search reaches
+        unsigned col = lu->q[k], top = n, stamp = k + 1;
+        for (uint64_t p = ap[col]; p < ap[col + 1]; p++)
+            if (visited[ai[p]] != stamp) top = sparse_dfs(lu, ai[p], top, xi, pstack, visited, stamp);
+        for (unsigned p = top; p < n; p++) x[xi[p]] = 0.0;
+        for (uint64_t p = ap[col]; p < ap[col + 1]; p++) x[ai[p]] = ax[p];
+        for (unsigned px = top; px < n; px++) {
+            unsigned j = xi[px], J = lu->pinv[j];
+            if (J == SPARSE_NONE) continue;
+            double xj = x[j];
+            for (uint64_t p = lu->lp[J] + 1; p < lu->lp[J + 1]; p++)
+                x[lu->li[p]] -= lu->lx[p] * xj;
+        }
+
+        // Rows already pivotal go to U, the largest of the rest is the pivot
+        unsigned ipiv = SPARSE_NONE;
+        double largest = 0.0;
+        for (unsigned p = top; p < n; p++) {
+            unsigned i = xi[p];
+            if (lu->pinv[i] == SPARSE_NONE) {
+                if (fabs(x[i]) > largest) {
+                    largest = fabs(x[i]);
+                    ipiv = i;
+                }
+            } else {
+                lu->ui[unz] = lu->pinv[i];
+                lu->ux[unz++] = x[i];
+            }
+        }
+        if (ipiv == SPARSE_NONE) {
+            status = 1;
+            goto out;
+        }
+        if (lu->pinv[col] == SPARSE_NONE && fabs(x[col]) >= SPARSE_PIVOT_TOL * largest) ipiv = col;
+
+        double pivot = x[ipiv];
+        lu->ui[unz] = k;
+        lu->ux[unz++] = pivot;
+        lu->pinv[ipiv] = k;
+        lu->li[lnz] = ipiv;
+        lu->lx[lnz++] = 1.0;
+        for (unsigned p = top; p < n; p++) {
+            unsigned i = xi[p];
+            if (lu->pinv[i] == SPARSE_NONE) {
+                lu->li[lnz] = i;
+                lu->lx[lnz++] = x[i] / pivot;
+            }
+            x[i] = 0.0;
+        }
+    }
+    lu->lp[n] = lnz;
+    lu->up[n] = unz;
+    for (size_t p = 0; p < lnz; p++) lu->li[p] = lu->pinv[lu->li[p]];
+    if (progress) atomic_store(&progress->done, n);
+    *out = lu;
+    lu = NULL;
+
+out:
+    sparse_lu_free(lu);
+    scratch_pop(mark);
+    return status;
+}
+
+// b = A^-1 b in place; work is n doubles of scratch
+static void sparse_lu_solve(const SparseLu *lu, double *b, double *work) {
+    unsigned n = lu->n;
+    for (unsigned i = 0; i < n; i++) work[lu->pinv[i]] = b[i];
+    for (unsigned j = 0; j < n; j++) {
+        double xj = work[j];
+        if (xj == 0.0) continue;
+        for (uint64_t p = lu->lp[j] + 1; p < lu->lp[j + 1]; p++)
+            work[lu->li[p]] -= lu->lx[p] * xj;
+    }
+    for (unsigned j = n; j-- > 0;) {
+        work[j] /= lu->ux[lu->up[j + 1] - 1];
+        double xj = work[j];
+        if (xj == 0.0) continue;
+        for (uint64_t p = lu->up[j]; p + 1 < lu->up[j + 1]; p++)
+            work[lu->ui[p]] -= lu->ux[p] * xj;
+    }
+    for (unsigned k = 0; k < n; k++) b[lu->q[k]] = work[k];
+}
+
+// +1 or -1 for an even or odd permutation
+static int permutation_sign(const unsigned *perm, unsigned n) {
+    size_t mark = scratch_mark();
+    unsigned char *seen = scratch_alloc(n);
+    if (!seen) return 1;
+    memset(seen, 0, n);
+    int sign = 1;
+    for (unsigned i = 0; i < n; i++) {
+        if (seen[i]) continue;
+        unsigned length = 0;
+        for (unsigned j = i; !seen[j]; j = perm[j]) {
+            seen[j] = 1;
+            length++;
+        }
+        if (length % 2 == 0) sign = -sign;
+    }
+    scratch_pop(mark);
+    return sign;
+}
+
+// det(A) = sign(P) * sign(Q) * prod diag(U)
+static double sparse_lu_determinant(const SparseLu *lu) {
+    double det = permutation_sign(lu->pinv, lu->n) * permutation_sign(lu->q, lu->n);
+    for (unsigned k = 0; k < lu->n; k++) det *= lu->ux[lu->up[k + 1] - 1];
+    return det;
+}
+
+// Determinant of the n x n doubles at data, which are overwritten by the factors
+static double determinant_of_doubles(double *data, unsigned n) {
+    int sign;
+    if (lu_factor(data, n, NULL, &sign) != 0) return 0.0;
+
+    double det = 1.0;
+    for (unsigned k = 0; k < n; k++)
+        det *= data[(size_t)k * n + k];
+    return det * sign;
+}
+
+double determinant(Matrix *matrix) {
+    if (matrix->M != matrix->N) return 0.0;
+    unsigned n = matrix->M;
+    MatrixTraceScope op = op_begin("det");
+    if (matrix->csr) {
+        SparseLu *lu;
+        double det = sparse_lu_factor(matrix->csr, n, NULL, &lu) == 0 ? sparse_lu_determinant(lu) : 0.0;
+        sparse_lu_free(lu);
+        op_end(op, matrix->csr->row_ptr[n] * (sizeof(unsigned) + sizeof(int)), 0.0);
+        return det;
+    }
+    size_t mark = scratch_mark();
+    double *data = scratch_alloc((size_t)n * n * sizeof(double));
+    double det = 0.0;
+    if (data) {
+        matrix_to_doubles(matrix, data);
+        det = determinant_of_doubles(data, n);
+    }
+    scratch_pop(mark);
+    op_end(op, (uint64_t)n * n * matrix_types[matrix->type].size, 2.0 / 3.0 * n * n * n);
+    return det;
+}
+
+// Factorization cache
+//
+// Factorizations are kept per matrix, keyed by registry name and content
+// version, so a determinant, any number of solves and the inverse of one
+// matrix share a single O(n^3) LU, after which each right-hand side costs
+// O(n^2); sparse matrices get a sparse LU instead. Rank and the reduced row
+// echelon form share one Gauss-Jordan elimination the same way. The cache
+// holds at most factor_cache.limit bytes (MAT_FACTOR_CACHE_MB, default 512)
+// and evicts the least recently used entry first. Factorizations are
+// reference counted, so one evicted while a caller still holds it stays
+// valid until released.
+#define FACTOR_CACHE_DEFAULT_MB 512
+
+typedef struct {
+    char *name;
+    uint64_t version;
+    Factorization *factors;
+    uint64_t last_used;
+} FactorCacheEntry;
+
+static struct {
+    pthread_mutex_t lock;
+    FactorCacheEntry *entries;
+    unsigned count, cap;
+    size_t bytes, limit;    // limit 0 until the first use reads the environment
+    uint64_t clock;
+    uint64_t hits, misses, evictions;
+} factor_cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+void factorization_unref(Factorization *f) {
+    if (f && atomic_fetch_sub(&f->refs, 1) == 1) {
+        free(f->a);
+        free(f->piv);
+        sparse_lu_free(f->sparse);
+        free(f);
+    }
+}
+
+static void factor_cache_init_limit(void) {
+    if (factor_cache.limit) return;
+    const char *env = getenv("MAT_FACTOR_CACHE_MB");
+    size_t mb = env && atol(env) > 0 ? (size_t)atol(env) : FACTOR_CACHE_DEFAULT_MB;
+    factor_cache.limit = mb << 20;
+}
+
+static void factor_cache_remove(unsigned i) {
+    FactorCacheEntry *e = &factor_cache.entries[i];
+    factor_cache.bytes -= e->factors->bytes;
+    factorization_unref(e->factors);
+    free(e->name);
+    factor_cache.entries[i] = factor_cache.entries[--factor_cache.count];
+}
+
+// Evict least recently used entries until extra more bytes fit. Lock held.
+static void factor_cache_make_room(size_t extra) {
+    while (factor_cache.count && factor_cache.bytes + extra > factor_cache.limit) {
+        unsigned oldest = 0;
+        for (unsigned i = 1; i < factor_cache.count; i++)
+            if (factor_cache.entries[i].last_used < factor_cache.entries[oldest].last_used)
+                oldest = i;
+        factor_cache_remove(oldest);
+        factor_cache.evictions++;
+    }
+}
+
+// A new reference to the cached factorization of matrix, or NULL (a miss)
+static Factorization *factor_cache_find(const Matrix *matrix, int kind) {
+    Factorization *found = NULL;
+    pthread_mutex_lock(&factor_cache.lock);
+    for (unsigned i = 0; i < factor_cache.count; i++) {
+        FactorCacheEntry *e = &factor_cache.entries[i];
+        if (e->version == matrix->version && e->factors->kind == kind &&
+            strcmp(e->name, matrix->name) == 0) {
+            e->last_used = ++factor_cache.clock;
+            found = e->factors;
+            atomic_fetch_add(&found->refs, 1);
+            break;
+        }
+    }
+    if (found) factor_cache.hits++;
+    else factor_cache.misses++;
+    pthread_mutex_unlock(&factor_cache.lock);
+    return found;
+}
+
+// Keep a reference to f for matrix. Returns f, or the factorization another
+// thread stored for the same matrix meanwhile, in which case f is released.
+static Factorization *factor_cache_insert(const Matrix *matrix, Factorization *f) {
+    pthread_mutex_lock(&factor_cache.lock);
+    factor_cache_init_limit();
+    for (unsigned i = 0; i < factor_cache.count; i++) {
+        FactorCacheEntry *e = &factor_cache.entries[i];
+        if (e->version == matrix->version && e->factors->kind == f->kind &&
+            strcmp(e->name, matrix->name) == 0) {
+            Factorization *stored = e->factors;
+            atomic_fetch_add(&stored->refs, 1);
+            pthread_mutex_unlock(&factor_cache.lock);
+            factorization_unref(f);
+            return stored;
+        }
+    }
+    // One too large for the whole cache is handed out without being kept
+    if (f->bytes <= factor_cache.limit) {
+        factor_cache_make_room(f->bytes);
+        if (factor_cache.count == factor_cache.cap) {
+            unsigned cap = factor_cache.cap ? factor_cache.cap * 2 : 16;
+            FactorCacheEntry *grown = realloc(factor_cache.entries, cap * sizeof(FactorCacheEntry));
+            if (grown) {
+                factor_cache.entries = grown;
+                factor_cache.cap = cap;
+            }
+        }
+        char *name = strdup(matrix->name);
+        if (name && factor_cache.count < factor_cache.cap) {
+            FactorCacheEntry *e = &factor_cache.entries[factor_cache.count++];
+            e->name = name;
+            e->version = matrix->version;
+            e->factors = f;
+            e->last_used = ++factor_cache.clock;
+            atomic_fetch_add(&f->refs, 1);
+            factor_cache.bytes += f->bytes;
+        } else {
+            free(name);
+        }
+    }
+    pthread_mutex_unlock(&factor_cache.lock);
+    return f;
+}
+
+void factor_cache_get_stats(FactorCacheStats *stats) {
+    pthread_mutex_lock(&factor_cache.lock);
+    factor_cache_init_limit();
+    stats->hits = factor_cache.hits;
+    stats->misses = factor_cache.misses;
+    stats->evictions = factor_cache.evictions;
+    stats->entries = factor_cache.count;
+    stats->bytes = factor_cache.bytes;
+    stats->limit = factor_cache.limit;
+    pthread_mutex_unlock(&factor_cache.lock);
+}
+
+// Bound the cache to bytes, evicting as needed; 0 restores the default
+void factor_cache_set_limit(size_t bytes) {
+    pthread_mutex_lock(&factor_cache.lock);
+    factor_cache.limit = bytes;
+    factor_cache_init_limit();
+    factor_cache_make_room(0);
+    pthread_mutex_unlock(&factor_cache.lock);
+}
+
+// Drop every entry and reset the counters
+void factor_cache_clear(void) {
+    pthread_mutex_lock(&factor_cache.lock);
+    while (factor_cache.count) factor_cache_remove(factor_cache.count - 1);
+    factor_cache.hits = factor_cache.misses = factor_cache.evictions = 0;
+    pthread_mutex_unlock(&factor_cache.lock);
+}
+
+// LU factors of a square matrix, from the cache or factored now with
+// progress (optional). NULL if matrix is not square, memory runs out or
+// progress cancels, with the reason in matrix_last_error().
+Factorization *matrix_lu(const Matrix *matrix, MatrixProgress *progress) {
+    if (matrix->M != matrix->N) {
+        snprintf(matrix_io_error, sizeof(matrix_io_error), "%u x %u matrix is not square",
+                 matrix->M, matrix->N);
+        return NULL;
+    }
+    Factorization *f = factor_cache_find(matrix, FACTOR_LU);
+    if (f) return f;
+
+    unsigned n = matrix->N;
+    MatrixTraceScope op = op_begin("lu");
+    f = calloc(1, sizeof(Factorization));
+    if (f) {
+        atomic_init(&f->refs, 1);
+        f->kind = FACTOR_LU;
+        f->rows = f->cols = n;
+        f->a = malloc((size_t)n * n * sizeof(double));
+        f->piv = malloc(n * sizeof(unsigned));
+    }
+    if (!f || !f->a || !f->piv) {
+        factorization_unref(f);
+        snprintf(matrix_io_error, sizeof(matrix_io_error), "out of memory");
+        op_end(op, 0, 0.0);
+        return NULL;
+    }
+    matrix_to_doubles(matrix, f->a);
+    for (size_t i = 0; i < (size_t)n * n; i++)
+        f->norm = fmax(f->norm, fabs(f->a[i]));
+
+    int sign;
+    int status = lu_factor_progress(f->a, n, f->piv, &sign, progress);
+    if (status == -2) {
+        factorization_unref(f);
+        snprintf(matrix_io_error, sizeof(matrix_io_error), "cancelled");
+        op_end(op, 0, 0.0);
+        return NULL;
+    }
+    if (status != 0) {
+        // Singular: only the determinant, 0, is worth keeping
+        free(f->a);
+        free(f->piv);
+        f->a = NULL;
+        f->piv = NULL;
+    } else {
+        f->det = sign;
+        for (unsigned k = 0; k < n; k++)
+            f->det *= f->a[(size_t)k * n + k];
+    }
+    f->bytes = sizeof(Factorization) + (f->a ? (size_t)n * n * sizeof(double) + n * sizeof(unsigned) : 0);
+    op_end(op, (uint64_t)n * n * sizeof(double), 2.0 / 3.0 * n * n * n);
+    return factor_cache_insert(matrix, f);
+}
+
+// Sparse LU factors of a square sparse matrix, as matrix_lu
+Factorization *matrix_sparse_lu(const Matrix *matrix, MatrixProgress *progress) {
+    if (matrix->M != matrix->N || !matrix->csr) {
+        snprintf(matrix_io_error, sizeof(matrix_io_error), "%u x %u matrix is not square and sparse",
+                 matrix->M, matrix->N);
+        return NULL;
+    }
+    Factorization *f = factor_cache_find(matrix, FACTOR_SPARSE_LU);
+    if (f) return f;
+
+    unsigned n = matrix->N;
+    MatrixTraceScope op = op_begin("sparse_lu");
+    f = calloc(1, sizeof(Factorization));
+    int status = -1;
+    if (f) {
+        atomic_init(&f->refs, 1);
+        f->kind = FACTOR_SPARSE_LU;
+        f->rows = f->cols = n;
+        status = sparse_lu_factor(matrix->csr, n, progress, &f->sparse);
+    }
+    if (status < 0) {
+        factorization_unref(f);
+        snprintf(matrix_io_error, sizeof(matrix_io_error), status == -2 ? "cancelled" : "out of memory");
+        op_end(op, 0, 0.0);
+        return NULL;
+    }
+    const MatrixCsr *csr = matrix->csr;
+    for (uint64_t p = 0; p < csr->row_ptr[n]; p++)
+        f->norm = fmax(f->norm, fabs((double)csr->values[p]));
+    f->bytes = sizeof(Factorization);
+    if (f->sparse) {
+        // Singular otherwise, with determinant 0
+        const SparseLu *lu = f->sparse;
+        f->det = sparse_lu_determinant(lu);
+        f->bytes += sizeof(SparseLu) + 2 * ((size_t)n + 1) * sizeof(uint64_t) + 2 * (size_t)n * sizeof(unsigned) +
+                    (lu->lcap + lu->ucap) * (sizeof(unsigned) + sizeof(double));
+    }
+    op_end(op, csr->row_ptr[n] * (sizeof(unsigned) + sizeof(int)), 0.0);
+    return factor_cache_insert(matrix, f);
+}
+
+double factorization_determinant(const Factorization *f) {
+    return f->det;
+}
+
+// Four independent sums, so the loop is not one long dependency chain
+static inline double lu_dot(const double *a, const double *b, size_t len) {
+    double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    size_t k = 0;
+    for (; k + 4 <= len; k += 4) {
+        s0 += a[k] * b[k];
+        s1 += a[k + 1] * b[k + 1];
+        s2 += a[k + 2] * b[k + 2];
+        s3 += a[k + 3] * b[k + 3];
+    }
+    for (; k < len; k++) s0 += a[k] * b[k];
+    return (s0 + s1) + (s2 + s3);
+}
+
+// x = A^-1 x in place for P*A = L*U held in lu and piv
+static void lu_solve_vector(const double *lu, const unsigned *piv, unsigned n, double *x) {
+    for (unsigned k = 0; k < n; k++) {
+        double tmp = x[k];
+        x[k] = x[piv[k]];
+        x[piv[k]] = tmp;
+    }
+    // Forward substitution with unit L from the first nonzero, which for a
+    // unit vector skips a good part of the work
+    unsigned first = 0;
+    while (first < n && x[first] == 0.0) first++;
+    for (unsigned i = first + 1; i < n; i++)
+        x[i] -= lu_dot(lu + (size_t)i * n + first, x + first, i - first);
+    for (unsigned i = n; i-- > 0;) {
+        const double *row = lu + (size_t)i * n;
+        x[i] = (x[i] - lu_dot(row + i + 1, x + i + 1, n - i - 1)) / row[i];
+    }
+}
+
+// X = A^-1 X in place for the row-major n x k block X. Rows are substituted
+// LU_SOLVE_BLOCK at a time: what the rows already solved contribute to a
+// block is one GEMM, leaving only the small triangles on the diagonal to the
+// row loop, whose inner loop runs along contiguous rows of X. Returns 0, or
+// -1 if out of memory.
+#define LU_SOLVE_BLOCK 128
+
+static void lu_subtract_rows(double *x, const double *t, size_t count) {
+    for (size_t i = 0; i < count; i++) x[i] -= t[i];
+}
+
+static int lu_solve_rows(const double *lu, const unsigned *piv, unsigned n, double *x, unsigned k) {
+    size_t ld = k, mark = scratch_mark();
+    double *t = scratch_alloc((size_t)LU_SOLVE_BLOCK * k * sizeof(double));
+    if (!t) return -1;
+    for (unsigned r = 0; r < n; r++) {
+        if (piv[r] == r) continue;
+        double *a = x + r * ld, *b = x + piv[r] * ld;
+        for (unsigned j = 0; j < k; j++) {
+            double tmp = a[j];
+            a[j] = b[j];
+            b[j] = tmp;
+        }
+    }
+
+    int status = 0;
+    for (unsigned i0 = 0; i0 < n && status == 0; i0 += LU_SOLVE_BLOCK) {
+        unsigned i1 = n - i0 < LU_SOLVE_BLOCK ? n : i0 + LU_SOLVE_BLOCK;
+        if (i0 > 0) {
+            status = gemm_f64(i1 - i0, k, i0, lu + (size_t)i0 * n, n, x, ld, t, ld);
+            lu_subtract_rows(x + i0 * ld, t, (size_t)(i1 - i0) * k);
+        }
+        for (unsigned i = i0 + 1; i < i1; i++) {
+            double *xi = x + i * ld;
+            for (unsigned p = i0; p < i; p++) {
+                double l = lu[(size_t)i * n + p];
+                const double *xp = x + p * ld;
+                for (unsigned j = 0; j < k; j++) xi[j] -= l * xp[j];
+            }
+        }
+    }
+    for (unsigned i1 = n; i1 > 0 && status == 0;) {
+        unsigned i0 = i1 > LU_SOLVE_BLOCK ? i1 - LU_SOLVE_BLOCK : 0;
+        if (i1 < n) {
+            status = gemm_f64(i1 - i0, k, n - i1, lu + (size_t)i0 * n + i1, n, x + i1 * ld, ld, t, ld);
+            lu_subtract_rows(x + i0 * ld, t, (size_t)(i1 - i0) * k);
+        }
+        for (unsigned i = i1; i-- > i0;) {
+            double *xi = x + i * ld;
+            for (unsigned p = i + 1; p < i1; p++) {
+                double u = lu[(size_t)i * n + p];
+                const double *xp = x + p * ld;
+                for (unsigned j = 0; j < k; j++) xi[j] -= u * xp[j];
+            }
+            double d = 1.0 / lu[(size_t)i * n + i];
+            for (unsigned j = 0; j < k; j++) xi[j] *= d;
+        }
+        i1 = i0;
+    }
+    scratch_pop(mark);
+    return status;
+}
+
+// The LU that suits the storage of matrix: sparse for a sparse matrix
+static Factorization *matrix_factor(const Matrix *matrix) {
+    return matrix->csr ? matrix_sparse_lu(matrix, NULL) : matrix_lu(matrix, NULL);
+}
+
+static int factorization_singular(const Factorization *f) {
+    return f->kind == FACTOR_SPARSE_LU ? !f->sparse : !f->a;
+}
+
+// X = A^-1 X for the row-major n x k doubles at x, with f the LU of A.
+// Returns 0, or -1 if out of memory.
+static int factorization_solve(const Factorization *f, double *x, unsigned k) {
+    unsigned n = f->rows;
+    if (f->kind == FACTOR_LU) {
+        if (k == 1) {
+            lu_solve_vector(f->a, f->piv, n, x);
+            return 0;
+        }
+        return lu_solve_rows(f->a, f->piv, n, x, k);
+    }
+    // Sparse: one column at a time
+    size_t mark = scratch_mark();
+    double *column = scratch_alloc(2 * (size_t)n * sizeof(double));
+    if (!column) return -1;
+    for (unsigned c = 0; c < k; c++) {
+        for (unsigned i = 0; i < n; i++) column[i] = x[(size_t)i * k + c];
+        sparse_lu_solve(f->sparse, column, column + n);
+        for (unsigned i = 0; i < n; i++) x[(size_t)i * k + c] = column[i];
+    }
+    scratch_pop(mark);
+    return 0;
+}
+
+// Determinant of a square matrix through the cache; 0 if it cannot be computed
+double matrix_determinant(const Matrix *matrix) {
+    Factorization *f = matrix_factor(matrix);
+    double det = f ? f->det : 0.0;
+    factorization_unref(f);
+    return det;
+}
+
+// Solve A X = B for X, in a new row-major a->N x b->N array. NULL if the
+// shapes do not fit, A is singular or memory runs out, with the reason in
+// matrix_last_error().
+double *matrix_solve(const Matrix *a, const Matrix *b) {
+    if (a->M != a->N || b->M != a->M) {
+        snprintf(matrix_io_error, sizeof(matrix_io_error),
+                 "cannot solve a %u x %u system for a %u x %u right-hand side",
+                 a->M, a->N, b->M, b->N);
+        return NULL;
+    }
+    MatrixTraceScope op = op_begin("solve");
+    Factorization *f = matrix_factor(a);
+    double *x = NULL;
+    if (!f) {
+        // matrix_factor() set the error
+    } else if (factorization_singular(f)) {
+        snprintf(matrix_io_error, sizeof(matrix_io_error), "matrix is singular");
+    } else if (!(x = malloc((size_t)b->M * b->N * sizeof(double)))) {
+        snprintf(matrix_io_error, sizeof(matrix_io_error), "out of memory");
+    } else {
+        matrix_to_doubles(b, x);
+        if (factorization_solve(f, x, b->N) != 0) {
+            snprintf(matrix_io_error, sizeof(matrix_io_error), "out of memory");
+            free(x);
+            x = NULL;
+        }
+    }
+    factorization_unref(f);
+    op_end(op, 0, 0.0);
+    return x;
+}
+
+// Inverse of a square matrix as a new row-major n x n array; NULL as for
+// matrix_solve
+double *matrix_inverse(const Matrix *matrix) {
+    if (matrix->M != matrix->N) {
+        snprintf(matrix_io_error, sizeof(matrix_io_error), "%u x %u matrix is not square",
+                 matrix->M, matrix->N);
+        return NULL;
+    }
+    MatrixTraceScope op = op_begin("inverse");
+    Factorization *f = matrix_factor(matrix);
+    unsigned n = matrix->N;
+    double *x = NULL;
+    if (!f) {
+        // matrix_factor() set the error
+    } else if (factorization_singular(f)) {
+        snprintf(matrix_io_error, sizeof(matrix_io_error), "matrix is singular");
+    } else if (!(x = calloc((size_t)n * n, sizeof(double)))) {
+        snprintf(matrix_io_error, sizeof(matrix_io_error), "out of memory");
+    } else {
+        for (unsigned i = 0; i < n; i++)
+            x[(size_t)i * n + i] = 1.0;
+        if (factorization_solve(f, x, n) != 0) {
+            snprintf(matrix_io_error, sizeof(matrix_io_error), "out of memory");
+            free(x);
+            x = NULL;
+        }
+    }
+    factorization_unref(f);
+    op_end(op, 0, 0.0);
+    return x;
+}
+
+// Magnitude below which an eliminated entry of a rows x cols matrix with
+// largest element norm counts as zero, so the rank of an integer matrix is
+// not thrown off by rounding
+static double rank_tolerance(unsigned rows, unsigned cols, double norm) {
+    return (rows > cols ? rows : cols) * DBL_EPSILON * norm;
+}
+
+// Gauss-Jordan elimination with partial pivoting of the row-major rows x cols
+// doubles at a, in place. pivots (rows entries) receives the pivot columns;
+// returns the rank.
+static unsigned rref_of_doubles(double *a, unsigned rows, unsigned cols, unsigned *pivots) {
+    double norm = 0.0;
+    for (size_t i = 0; i < (size_t)rows * cols; i++)
+        norm = fmax(norm, fabs(a[i]));
+    double tol = rank_tolerance(rows, cols, norm);
+
+    unsigned rank = 0;
+    for (unsigned c = 0; c < cols && rank < rows; c++) {
+        unsigned best = rank;
+        for (unsigned i = rank + 1; i < rows; i++)
+            if (fabs(a[(size_t)i * cols + c]) > fabs(a[(size_t)best * cols + c])) best = i;
+        if (fabs(a[(size_t)best * cols + c]) <= tol) {
+            for (unsigned i = rank; i < rows; i++)
+                a[(size_t)i * cols + c] = 0.0;
+            continue;
+        }
+        double *p = a + (size_t)rank * cols;
+        if (best != rank) {
+            double *q = a + (size_t)best * cols;
+            for (unsigned j = c; j < cols; j++) {
+                double tmp = p[j];
+                p[j] = q[j];
+                q[j] = tmp;
+            }
+        }
+        double d = 1.0 / p[c];
+        for (unsigned j = c + 1; j < cols; j++) p[j] *= d;
+        p[c] = 1.0;
+        for (unsigned i = 0; i < rows; i++) {
+            double *r = a + (size_t)i * cols;
+            double f = r[c];
+            if (i == rank || f == 0.0) continue;
+            for (unsigned j = c + 1; j < cols; j++) r[j] -= f * p[j];
+            r[c] = 0.0;
+        }
+        pivots[rank++] = c;
+    }
+    return rank;
+}
+
+// Reduced row echelon form of matrix, from the cache or computed now
+static Factorization *matrix_rref_factors(const Matrix *matrix) {
+    Factorization *f = factor_cache_find(matrix, FACTOR_RREF);
+    if (f) return f;
+
+    unsigned rows = matrix->M, cols = matrix->N;
+    MatrixTraceScope op = op_begin("rref");
+    f = calloc(1, sizeof(Factorization));
+    if (f) {
+        atomic_init(&f->refs, 1);
+        f->kind = FACTOR_RREF;
+        f->rows = rows;
+        f->cols = cols;
+        f->a = malloc((size_t)rows * cols * sizeof(double));
+        f->piv = malloc(rows * sizeof(unsigned));
+    }
+    if (!f || !f->a || !f->piv) {
+        factorization_unref(f);
+        snprintf(matrix_io_error, sizeof(matrix_io_error), "out of memory");
+        op_end(op, 0, 0.0);
+        return NULL;
+    }
+    matrix_to_doubles(matrix, f->a);
+    f->rank = rref_of_doubles(f->a, rows, cols, f->piv);
+    f->bytes = sizeof(Factorization) + (size_t)rows * cols * sizeof(double) + rows * sizeof(unsigned);
+    op_end(op, (uint64_t)rows * cols * sizeof(double), 2.0 * rows * cols * f->rank);
+    return factor_cache_insert(matrix, f);
+}
+
+// Rank of matrix, or -1 if memory runs out. A square matrix whose LU pivots
+// all clear the elimination tolerance has full rank, which the LU (likely
+// cached by a determinant already) shows at a third of the cost of a
+// Gauss-Jordan pass; anything else takes the RREF.
+int matrix_rank(const Matrix *matrix) {
+    if (matrix->M == matrix->N) {
+        Factorization *lu = matrix_factor(matrix);
+        unsigned n = matrix->N, k = 0;
+        if (lu && !factorization_singular(lu)) {
+            double tol = rank_tolerance(n, n, lu->norm);
+            if (lu->kind == FACTOR_SPARSE_LU)
+                while (k < n && fabs(lu->sparse->ux[lu->sparse->up[k + 1] - 1]) > tol) k++;
+            else
+                while (k < n && fabs(lu->a[(size_t)k * n + k]) > tol) k++;
+        }
+        factorization_unref(lu);
+        if (k == n && n > 0) return (int)n;
+    }
+    Factorization *f = matrix_rref_factors(matrix);
+    if (!f) return -1;
+    int rank = (int)f->rank;
+    factorization_unref(f);
+    return rank;
+}
+
+// Reduced row echelon form of matrix as a new row-major M x N array, with
+// its rank in *rank (optional). NULL if memory runs out.
+double *matrix_rref(const Matrix *matrix, unsigned *rank) {
+    Factorization *f = matrix_rref_factors(matrix);
+    if (!f) return NULL;
+    size_t bytes = (size_t)f->rows * f->cols * sizeof(double);
+    double *out = malloc(bytes);
+    if (out) memcpy(out, f->a, bytes);
+    else snprintf(matrix_io_error, sizeof(matrix_io_error), "out of memory");
+    if (rank) *rank = f->rank;
+    factorization_unref(f);
+    return out;
+}
+
+// Incremental determinant
+//
+// LuCache keeps P*A0 = L*U for the last fully factored matrix A0, shared
+// with the factorization cache, and the rank-1 changes u_m v_m^T made since.
+// Each change costs one solve with the current matrix, O(n^2): by the matrix
+// determinant lemma
+//     det(A + u v^T) = det(A) * (1 + v^T A^-1 u),
+// and by Sherman-Morrison a solve with A_m is a solve with A0 followed by
+//     y -= w_k * (v_k . y) / gamma_k,  w_k = A_{k-1}^-1 u_k,  gamma_k = 1 + v_k . w_k
+// for k = 1..m. A rank-k change arrives as k such pairs at once; their
+// solves with A0 then share one blocked multi-column solve. The next
+// determinant refactors instead once LU_CACHE_UPDATES changes have piled up,
+// when a change has rank above n / LU_CACHE_MAX_RANK_DIV (its solves would
+// cost about as much as refactoring), or when gamma nearly cancels, as that
+// loses accuracy in every later solve.
+#define LU_CACHE_MIN_GAMMA 1e-6
+#define LU_CACHE_MAX_RANK_DIV 3
+
+LuCache *lu_cache_new(void) {
+    return calloc(1, sizeof(LuCache));
+}
+
+static void lu_cache_reset(LuCache *cache) {
+    factorization_unref(cache->factors);
+    free(cache->w);
+    free(cache->v);
+    memset(cache, 0, sizeof(*cache));
+}
+
+void lu_cache_free(LuCache *cache) {
+    if (!cache) return;
+    lu_cache_reset(cache);
+    free(cache);
+}
+
+// x = A_m^-1 x in place, given x = A0^-1 x
+static void lu_cache_correct(const LuCache *cache, unsigned m, double *x) {
+    unsigned n = cache->n;
+    for (unsigned k = 0; k < m; k++) {
+        const double *w = cache->w + (size_t)k * n, *v = cache->v + (size_t)k * n;
+        double f = lu_dot(v, x, n) / cache->gamma[k];
+        for (unsigned i = 0; i < n; i++) x[i] -= f * w[i];
+    }
+}
+
+// Whether the cached determinant belongs to matrix as it is now
+int lu_cache_is_current(const LuCache *cache, const Matrix *matrix) {
+    return cache->version == matrix->version && cache->n == matrix->N && matrix->M == matrix->N;
+}
+
+// Factor matrix into the cache, or take its factors from the factorization
+// cache, reporting to progress (optional). Returns 0 on success, a singular
+// matrix included, and -1 if matrix is not square, memory runs out or
+// progress cancels; the cache is then left stale.
+int lu_cache_refresh(LuCache *cache, const Matrix *matrix, MatrixProgress *progress) {
+    if (matrix->M != matrix->N) return -1;
+    unsigned n = matrix->N;
+    cache->updates = 0;
+    cache->version = 0;
+    if (cache->n != n || !cache->w) {
+        lu_cache_reset(cache);
+        cache->n = n;
+        cache->w = malloc((size_t)LU_CACHE_UPDATES * n * sizeof(double));
+        cache->v = malloc((size_t)LU_CACHE_UPDATES * n * sizeof(double));
+        if (!cache->w || !cache->v) {
+            lu_cache_reset(cache);
+            return -1;
+        }
+    }
+
+    Factorization *f = matrix_lu(matrix, progress);
+    if (!f) return -1;
+    factorization_unref(cache->factors);
+    cache->factors = NULL;
+    cache->det = f->det;
+    cache->version = matrix->version;
+    // A singular matrix leaves nothing to update from; the next change refactors
+    if (f->a) cache->factors = f;
+    else factorization_unref(f);
+    return 0;
+}
+
+// Determinant of a square matrix. Returns the cached value when the cache is
+// at matrix's version, and refactors otherwise.
+double lu_cache_determinant(LuCache *cache, const Matrix *matrix) {
+    if (matrix->M != matrix->N) return 0.0;
+    if (lu_cache_is_current(cache, matrix)) return cache->det;
+    if (lu_cache_refresh(cache, matrix, NULL) != 0) return determinant((Matrix *)matrix);
+    return cache->det;
+}
+
+// Record that matrix changed by sum_j u_j v_j^T over k pairs, u and v
+// holding k vectors of n each, moving it from old_version to its current
+// version: an edit of rows r_1..r_k is u_j = e_{r_j}, v_j = the change of
+// row r_j, and one of columns c_1..c_k is u_j = the change of column c_j,
+// v_j = e_{c_j}. Returns 0 if the cache now matches matrix; otherwise it is
+// left stale and the next determinant refactors.
+int lu_cache_update_rank(LuCache *cache, const Matrix *matrix, uint64_t old_version, unsigned k,
+                         const double *u, const double *v) {
+    unsigned n = cache->n, m = cache->updates;
+    if (!cache->factors || cache->version != old_version || n != matrix->N || k == 0 ||
+        k > LU_CACHE_UPDATES - m || (k > 1 && k > n / LU_CACHE_MAX_RANK_DIV)) {
+        cache->version = 0;
+        return -1;
+    }
+
+    MatrixTraceScope op = op_begin("det.update");
+    double flops = 2.0 * n * n * k + 4.0 * n * (m + k / 2.0) * k;
+    double *w = cache->w + (size_t)m * n;
+    memcpy(cache->v + (size_t)m * n, v, (size_t)k * n * sizeof(double));
+    int status = 0;
+    if (k == 1) {
+        memcpy(w, u, n * sizeof(double));
+        lu_solve_vector(cache->factors->a, cache->factors->piv, n, w);
+    } else {
+        // The k solves with A0 as one n x k block
+        size_t mark = scratch_mark();
+        double *x = scratch_alloc((size_t)n * k * sizeof(double));
+        for (unsigned i = 0; x && i < n; i++)
+            for (unsigned j = 0; j < k; j++) x[(size_t)i * k + j] = u[(size_t)j * n + i];
+        status = x ? lu_solve_rows(cache->factors->a, cache->factors->piv, n, x, k) : -1;
+        for (unsigned i = 0; status == 0 && i < n; i++)
+            for (unsigned j = 0; j < k; j++) w[(size_t)j * n + i] = x[(size_t)i * k + j];
+        scratch_pop(mark);
+    }
+
+    // Then each pair in turn, as if it came alone
+    double det = cache->det;
+    for (unsigned j = 0; status == 0 && j < k; j++, m++) {
+        double *wj = cache->w + (size_t)m * n;
+        lu_cache_correct(cache, m, wj);
+        double dot = lu_dot(cache->v + (size_t)m * n, wj, n), gamma = 1.0 + dot;
+        if (fabs(gamma) < LU_CACHE_MIN_GAMMA * fmax(1.0, fabs(dot))) status = -1;
+        cache->gamma[m] = gamma;
+        det *= gamma;
+    }
+    op_end(op, (uint64_t)n * n * sizeof(double), flops);
+    if (status != 0) {
+        cache->version = 0;
+        return -1;
+    }
+
+    cache->updates = m;
+    cache->det = det;
+    cache->version = matrix->version;
+    return 0;
+}
+
+// lu_cache_update_rank() for one change u v^T: a cell edit is u = delta e_row,
+// v = e_col, a row edit u = e_row, v = the change of the row
+int lu_cache_update(LuCache *cache, const Matrix *matrix, uint64_t old_version,
+                    const double *u, const double *v) {
+    return lu_cache_update_rank(cache, matrix, old_version, 1, u, v);
+}
+
+// Batched small determinants
+//
+// Geometry and Jacobian workloads come as millions of 2x2 to 4x4 matrices,
+// where the generic path spends far more on allocation and pivot search
+// than on arithmetic. matrix_det_batch() takes them in struct-of-arrays
+// layout, one array per element position, and evaluates the closed-form
+// expansions below on a vector of matrices at a time: each lane is a
+// different matrix, so there are no shuffles or horizontal reductions, and
+// every load is a contiguous stream. 4x4 goes through the six 2x2 minors of
+// the top and bottom row pairs (Laplace expansion), 40 multiplies and adds.
+//
+// .matbatch files hold such a batch ready for mapping: a 64-byte header,
+// then the n * n element arrays, each stride float64s long and 64-byte
+// aligned, so a mapped file is computed on in place.
+#define DET_BATCH_MAX 4
+#define DET_BATCH_CHUNK ((size_t)1 << 16)   // matrices per pool task
+#define MATBATCH_MAGIC "MATBATCH"
+#define MATBATCH_VERSION 1
+
+#define DET_BATCH_1(m, d) (d) = (m)[0]
+#define DET_BATCH_2(m, d) (d) = (m)[0] * (m)[3] - (m)[1] * (m)[2]
+#define DET_BATCH_3(m, d)                                                       \
+    (d) = (m)[0] * ((m)[4] * (m)[8] - (m)[5] * (m)[7]) -                        \
+          (m)[1] * ((m)[3] * (m)[8] - (m)[5] * (m)[6]) +                        \
+          (m)[2] * ((m)[3] * (m)[7] - (m)[4] * (m)[6])
+#define DET_BATCH_4(m, d)                                                       \
+    do {                                                                        \
+        __typeof__((m)[0]) s0 = (m)[0] * (m)[5] - (m)[1] * (m)[4];              \
+        __typeof__((m)[0]) s1 = (m)[0] * (m)[6] - (m)[2] * (m)[4];              \
+        __typeof__((m)[0]) s2 = (m)[0] * (m)[7] - (m)[3] * (m)[4];              \
+        __typeof__((m)[0]) s3 = (m)[1] * (m)[6] - (m)[2] * (m)[5];              \
+        __typeof__((m)[0]) s4 = (m)[1] * (m)[7] - (m)[3] * (m)[5];              \
+        __typeof__((m)[0]) s5 = (m)[2] * (m)[7] - (m)[3] * (m)[6];              \
+        __typeof__((m)[0]) c5 = (m)[10] * (m)[15] - (m)[11] * (m)[14];          \
+        __typeof__((m)[0]) c4 = (m)[9] * (m)[15] - (m)[11] * (m)[13];           \
+        __typeof__((m)[0]) c3 = (m)[9] * (m)[14] - (m)[10] * (m)[13];           \
+        __typeof__((m)[0]) c2 = (m)[8] * (m)[15] - (m)[11] * (m)[12];           \
+        __typeof__((m)[0]) c1 = (m)[8] * (m)[14] - (m)[10] * (m)[12];           \
+        __typeof__((m)[0]) c0 = (m)[8] * (m)[13] - (m)[9] * (m)[12];            \
+        (d) = s0 * c5 - s1 * c4 + s2 * c3 + s3 * c2 - s4 * c1 + s5 * c0;        \
+    } while (0)
+
+// Floating point operations per matrix, for the op timing
+static const double det_batch_flops[DET_BATCH_MAX + 1] = { 0, 0, 3, 14, 47 };
+
+typedef void (*DetBatchKernel)(const double *src, size_t stride, size_t k0, size_t k1, double *out);
+
+// Matrices [k0, k1) of the batch, lanes of them per step; the tail one by one
+#define DET_BATCH_KERNEL(N, suffix, vec, lanes, attr)                           \
+    attr static void det_batch##N##_##suffix(const double *src, size_t stride,  \
+                                             size_t k0, size_t k1, double *out) { \
+        size_t k = k0;                                                          \
+        for (; k + (lanes) <= k1; k += (lanes)) {                               \
+            vec m[N * N], d;                                                    \
+            for (unsigned e = 0; e < N * N; e++)                                \
+                memcpy(&m[e], src + e * stride + k, sizeof(vec));               \
+            DET_BATCH_##N(m, d);                                                \
+            memcpy(out + k, &d, sizeof(vec));                                   \
+        }                                                                       \
+        for (; k < k1; k++) {                                                   \
+            double m[N * N], d;                                                 \
+            for (unsigned e = 0; e < N * N; e++) m[e] = src[e * stride + k];    \
+            DET_BATCH_##N(m, d);                                                \
+            out[k] = d;                                                         \
+        }                                                                       \
+    }
+
+#define DET_BATCH_KERNELS(suffix, vec, lanes, attr)     \
+    DET_BATCH_KERNEL(1, suffix, vec, lanes, attr)       \
+    DET_BATCH_KERNEL(2, suffix, vec, lanes, attr)       \
+    DET_BATCH_KERNEL(3, suffix, vec, lanes, attr)       \
+    DET_BATCH_KERNEL(4, suffix, vec, lanes, attr)
+
+typedef double DetVec2 __attribute__((vector_size(16)));
+DET_BATCH_KERNELS(sse2, DetVec2, 2, )
+
+#ifdef MATRIX_X86
+typedef double DetVec4 __attribute__((vector_size(32)));
+typedef double DetVec8 __attribute__((vector_size(64)));
+DET_BATCH_KERNELS(avx2, DetVec4, 4, __attribute__((target("avx2"))))
+DET_BATCH_KERNELS(avx512, DetVec8, 8, __attribute__((target("avx512f"))))
+#endif
+
+static DetBatchKernel det_batch_kernels[DET_BATCH_MAX + 1];
+static pthread_once_t det_batch_once = PTHREAD_ONCE_INIT;
+
+// Same choice and MAT_KERNEL override as the LU update kernels. Without
+// AVX the generic vectors are two lanes wide, which the compiler maps to
+// SSE2 or NEON.
+static void det_batch_select_kernels(void) {
+    DetBatchKernel generic[] = { NULL, det_batch1_sse2, det_batch2_sse2, det_batch3_sse2, det_batch4_sse2 };
+    memcpy(det_batch_kernels, generic, sizeof(generic));
+#ifdef MATRIX_X86
+    const char *force = getenv("MAT_KERNEL");
+    __builtin_cpu_init();
+    int want_avx512 = !force || strcmp(force, "avx512") == 0;
+    int want_avx2 = !force || strcmp(force, "avx2") == 0 || strcmp(force, "avx512") == 0;
+    if (want_avx512 && __builtin_cpu_supports("avx512f")) {
+        DetBatchKernel k[] = { NULL, det_batch1_avx512, det_batch2_avx512, det_batch3_avx512, det_batch4_avx512 };
+        memcpy(det_batch_kernels, k, sizeof(k));
+    } else if (want_avx2 && __builtin_cpu_supports("avx2")) {
+        DetBatchKernel k[] = { NULL, det_batch1_avx2, det_batch2_avx2, det_batch3_avx2, det_batch4_avx2 };
+        memcpy(det_batch_kernels, k, sizeof(k));
+    }
+#endif
+}
+
+typedef struct {
+    DetBatchKernel kernel;
+    const double *src;
+    size_t stride, count;
+    double *out;
+    atomic_size_t remaining;
+    atomic_int done;
+} DetBatchJob;
+
+static void det_batch_task(PoolTask *task) {
+    DetBatchJob *job = task->ctx;
+    size_t k0 = (size_t)task->a * DET_BATCH_CHUNK;
+    size_t k1 = job->count - k0 < DET_BATCH_CHUNK ? job->count : k0 + DET_BATCH_CHUNK;
+    MatrixTraceScope scope = matrix_trace_begin("det_batch.chunk");
+    job->kernel(job->src, job->stride, k0, k1, job->out);
+    matrix_trace_end(scope, 0, 0.0);
+    if (atomic_fetch_sub(&job->remaining, 1) == 1)
+        pool_signal_done(&job->done);
+}
+
+// Determinants of count n x n matrices, 1 <= n <= 4, in struct-of-arrays
+// layout: element (i, j) of matrix k is elements[(i * n + j) * stride + k],
+// with stride >= count. out receives count determinants. Returns 0, or -1
+// if n is out of range.
+int matrix_det_batch(unsigned n, size_t count, const double *elements, size_t stride, double *out) {
+    if (n == 0 || n > DET_BATCH_MAX || stride < count) {
+        snprintf(matrix_io_error, sizeof(matrix_io_error),
+                 "batched determinants take 1x1 to %ux%u matrices", DET_BATCH_MAX, DET_BATCH_MAX);
+        return -1;
+    }
+    pthread_once(&det_batch_once, det_batch_select_kernels);
+    MatrixTraceScope op = op_begin("det_batch");
+    size_t chunks = (count + DET_BATCH_CHUNK - 1) / DET_BATCH_CHUNK;
+    if (chunks <= 1) {
+        det_batch_kernels[n](elements, stride, 0, count, out);
+    } else {
+        DetBatchJob job = { det_batch_kernels[n], elements, stride, count, out };
+        atomic_init(&job.remaining, chunks);
+        atomic_init(&job.done, 0);
+        for (size_t c = 0; c < chunks; c++) {
+            PoolTask task = { det_batch_task, &job, 0, (unsigned)c, 0, 0 };
+            pool_push(&task);
+        }
+        pool_wait(&job.done);
+    }
+    op_end(op, count * ((uint64_t)n * n + 1) * sizeof(double), count * det_batch_flops[n]);
+    return 0;
+}
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t n;
+    uint32_t reserved0;
+    uint64_t count;
+    uint64_t stride;        // float64s per element array, a multiple of 8
+    uint8_t reserved[24];
+} MatbatchHeader;
+
+_Static_assert(sizeof(MatbatchHeader) == 64, "MatbatchHeader layout");
+
+static size_t matbatch_stride(size_t count) {
+    return (count + 7) & ~(size_t)7;
+}
+
+// Write a batch in the layout of matrix_det_batch() to a .matbatch file.
+// Returns 0, or -1 with the reason in matrix_last_error().
+int matrix_batch_save(const char *path, unsigned n, size_t count, const double *elements, size_t stride) {
+    if (n == 0 || n > DET_BATCH_MAX || stride < count) {
+        snprintf(matrix_io_error, sizeof(matrix_io_error), "%s: invalid batch", path);
+        return -1;
+    }
+    MatrixTraceScope op = op_begin("save_batch");
+    FILE *file = fopen(path, "wb");
+    MatbatchHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MATBATCH_MAGIC, sizeof(header.magic));
+    header.version = MATBATCH_VERSION;
+    header.byte_order = MATB_BYTE_ORDER;
+    header.n = n;
+    header.count = count;
+    header.stride = matbatch_stride(count);
+
+    static const double zeros[8];
+    size_t pad = header.stride - count;
+    int status = file && fwrite(&header, sizeof(header), 1, file) == 1 ? 0 : -1;
+    for (unsigned e = 0; status == 0 && e < n * n; e++) {
+        if (fwrite(elements + e * stride, sizeof(double), count, file) != count ||
+            (pad && fwrite(zeros, sizeof(double), pad, file) != pad))
+            status = -1;
+    }
+    if (file && fclose(file) != 0) status = -1;
+    if (status != 0) snprintf(matrix_io_error, sizeof(matrix_io_error), "%s: cannot write file", path);
+    op_end(op, sizeof(header) + (uint64_t)n * n * header.stride * sizeof(double), 0.0);
+    return status;
+}
+
+int is_matrix_batch_file(const char *path) {
+    char magic[8];
+    FILE *file = fopen(path, "rb");
+    if (!file) return 0;
+    int match = fread(magic, 1, sizeof(magic), file) == sizeof(magic) &&
+                memcmp(magic, MATBATCH_MAGIC, sizeof(magic)) == 0;
+    fclose(file);
+    return match;
+}
+
+// Map a .matbatch file; batch->elements points into the mapping until
+// matrix_batch_close(). Returns 0, or -1 with the reason in
+// matrix_last_error().
+int matrix_batch_open(const char *path, MatrixBatch *batch) {
+    memset(batch, 0, sizeof(*batch));
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(MatbatchHeader)) {
+        snprintf(matrix_io_error, sizeof(matrix_io_error), "%s: cannot open batch file", path);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    size_t size = (size_t)st.st_size;
+    void *base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        snprintf(matrix_io_error, sizeof(matrix_io_error), "%s: cannot map batch file", path);
+        return -1;
+    }
+
+    const MatbatchHeader *h = base;
+    int valid = memcmp(h->magic, MATBATCH_MAGIC, sizeof(h->magic)) == 0 &&
+                h->version == MATBATCH_VERSION && h->byte_order == MATB_BYTE_ORDER &&
+                h->n >= 1 && h->n <= DET_BATCH_MAX && h->stride == matbatch_stride(h->count) &&
+                h->stride <= (size - sizeof(MatbatchHeader)) / sizeof(double) / (h->n * h->n) &&
+                size == sizeof(MatbatchHeader) + (size_t)h->n * h->n * h->stride * sizeof(double);
+    MatrixMapping *mapping = valid ? malloc(sizeof(MatrixMapping)) : NULL;
+    if (!mapping) {
+        snprintf(matrix_io_error, sizeof(matrix_io_error),
+                 valid ? "out of memory" : "%s: not a valid batch file", path);
+        munmap(base, size);
+        return -1;
+    }
+#ifdef MADV_SEQUENTIAL
+    madvise(base, size, MADV_SEQUENTIAL);
+#endif
+    mapping->base = base;
+    mapping->size = size;
+    atomic_init(&mapping->refs, 1);
+    batch->n = h->n;
+    batch->count = h->count;
+    batch->stride = h->stride;
+    batch->elements = (const double *)((const char *)base + sizeof(MatbatchHeader));
+    batch->mapping = mapping;
+    return 0;
+}
+
+void matrix_batch_close(MatrixBatch *batch) {
+    if (batch->mapping) mapping_unref(batch->mapping);
+    batch->mapping = NULL;
+    batch->elements = NULL;
+}
+
+// Exact integer determinant
+//
+// The determinant of an int matrix is computed modulo enough primes that
+// their product exceeds twice the Hadamard bound, one prime per pool task,
+// and the residues are combined with Garner's CRT into a signed big integer.
+// Elimination mod p runs in Montgomery form, so the inner loop is
+// multiplies, shifts and unsigned min with no division. The primes are 31-bit
+// when the AVX2 row kernel runs, eight lanes per step, and 62-bit otherwise:
+// a scalar 62-bit step costs about two 31-bit ones, but half as many
+// eliminations are needed and the CRT combine has half the digits.
+#ifdef __SIZEOF_INT128__
+#define MATRIX_WIDE_PRIMES 1
+typedef unsigned __int128 CrtProduct;   // a product of two residues
+#else
+typedef uint64_t CrtProduct;
+#endif
+
+typedef struct {
+    uint32_t p;
+    uint32_t pinv;      // -p^-1 mod 2^32
+    uint32_t r2;        // 2^64 mod p
+} MontPrime;
+
+static inline uint32_t mont_reduce(uint64_t t, const MontPrime *m) {
+    uint32_t q = (uint32_t)t * m->pinv;
+    uint32_t r = (uint32_t)((t + (uint64_t)q * m->p) >> 32);
+    return r >= m->p ? r - m->p : r;
+}
+
+static inline uint32_t mont_mul(uint32_t a, uint32_t b, const MontPrime *m) {
+    return mont_reduce((uint64_t)a * b, m);
+}
+
+static void mont_init(MontPrime *m, uint32_t p) {
+    uint32_t inv = p;
+    for (int i = 0; i < 4; i++)
+        inv *= 2 - p * inv;
+    uint64_t r = (1ULL << 32) % p;
+    m->p = p;
+    m->pinv = -inv;
+    m->r2 = (uint32_t)(r * r % p);
+}
+
+static uint32_t mont_from_int(int64_t value, const MontPrime *m) {
+    int64_t v = value % (int64_t)m->p;
+    if (v < 0) v += m->p;
+    return mont_mul((uint32_t)v, m->r2, m);
+}
+
+static uint32_t mont_pow(uint32_t base, uint32_t e, const MontPrime *m) {
+    uint32_t result = mont_mul(1, m->r2, m);
+    while (e) {
+        if (e & 1) result = mont_mul(result, base, m);
+        base = mont_mul(base, base, m);
+        e >>= 1;
+    }
+    return result;
+}
+
+typedef void (*ModRowKernel)(uint32_t *row, const uint32_t *pivot_row, uint32_t f,
+                             unsigned count, const MontPrime *m);
+
+// row[j] = row[j] - f * pivot_row[j] mod p, all in Montgomery form
+static void mod_row_update_scalar(uint32_t *row, const uint32_t *pivot_row, uint32_t f,
+                                  unsigned count, const MontPrime *m) {
+    for (unsigned j = 0; j < count; j++) {
+        uint32_t t = mont_mul(f, pivot_row[j], m);
+        uint32_t d = row[j] - t;
+        row[j] = d > d + m->p ? d + m->p : d;
+    }
+}
+
+#ifdef MATRIX_X86
+// Eight lanes per step: even and odd lanes go through _mm256_mul_epu32
+// separately and are blended back; reductions use min(x, x - p) because p < 2^31
+__attribute__((target("avx2")))
+static void mod_row_update_avx2(uint32_t *row, const uint32_t *pivot_row, uint32_t f,
+                                unsigned count, const MontPrime *m) {
+    const __m256i vp = _mm256_set1_epi32((int)m->p);
+    const __m256i vpinv = _mm256_set1_epi32((int)m->pinv);
+    const __m256i vf = _mm256_set1_epi32((int)f);
+    const __m256i hi_mask = _mm256_set1_epi64x((long long)0xFFFFFFFF00000000ULL);
+    unsigned j = 0;
+    for (; j + 8 <= count; j += 8) {
+        __m256i b = _mm256_loadu_si256((const __m256i *)(pivot_row + j));
+        __m256i prod_e = _mm256_mul_epu32(vf, b);
+        __m256i prod_o = _mm256_mul_epu32(vf, _mm256_srli_epi64(b, 32));
+        __m256i q_e = _mm256_mul_epu32(prod_e, vpinv);
+        __m256i q_o = _mm256_mul_epu32(prod_o, vpinv);
+        __m256i t_e = _mm256_srli_epi64(_mm256_add_epi64(prod_e, _mm256_mul_epu32(q_e, vp)), 32);
+        __m256i t_o = _mm256_and_si256(_mm256_add_epi64(prod_o, _mm256_mul_epu32(q_o, vp)), hi_mask);
+        __m256i t = _mm256_blend_epi32(t_e, t_o, 0xAA);
+        t = _mm256_min_epu32(t, _mm256_sub_epi32(t, vp));
+
+        __m256i x = _mm256_loadu_si256((const __m256i *)(row + j));
+        __m256i d = _mm256_sub_epi32(x, t);
+        d = _mm256_min_epu32(d, _mm256_add_epi32(d, vp));
+        _mm256_storeu_si256((__m256i *)(row + j), d);
+    }
+    if (j < count)
+        mod_row_update_scalar(row + j, pivot_row + j, f, count - j, m);
+}
+#endif
+
+static ModRowKernel mod_row_kernel = NULL;
+
+static void mod_select_kernel(void) {
+    if (mod_row_kernel) return;
+    ModRowKernel kernel = mod_row_update_scalar;
+#ifdef MATRIX_X86
+    const char *force = getenv("MAT_KERNEL");
+    __builtin_cpu_init();
+    if ((!force || strcmp(force, "scalar") != 0) && __builtin_cpu_supports("avx2"))
+        kernel = mod_row_update_avx2;
+#endif
+    mod_row_kernel = kernel;
+}
+
+// Determinant of matrix mod m->p; a is n*n words of scratch
+static uint32_t determinant_mod_prime(const Matrix *matrix, const MontPrime *m, uint32_t *a) {
+    unsigned n = matrix->M;
+    if (matrix->type == MATRIX_INT64) {
+        const int64_t *data = matrix->data;
+        for (size_t i = 0; i < (size_t)n * n; i++)
+            a[i] = mont_from_int(data[i], m);
+    } else {
+        const int32_t *data = matrix->data;
+        for (size_t i = 0; i < (size_t)n * n; i++)
+            a[i] = mont_from_int(data[i], m);
+    }
+
+    uint32_t det = mont_mul(1, m->r2, m);
+    int negate = 0;
+    for (unsigned k = 0; k < n; k++) {
+        unsigned pivot_row = k;
+        while (pivot_row < n && a[(size_t)pivot_row * n + k] == 0)
+            pivot_row++;
+        if (pivot_row == n) return 0;
+
+        uint32_t *rk = a + (size_t)k * n;
+        if (pivot_row != k) {
+            uint32_t *rp = a + (size_t)pivot_row * n;
+            for (unsigned j = k; j < n; j++) {
+                uint32_t tmp = rk[j];
+                rk[j] = rp[j];
+                rp[j] = tmp;
+            }
+            negate = !negate;
+        }
+
+        det = mont_mul(det, rk[k], m);
+        uint32_t inv = mont_pow(rk[k], m->p - 2, m);
+        for (unsigned i = k + 1; i < n; i++) {
+            uint32_t *ri = a + (size_t)i * n;
+            if (ri[k] == 0) continue;
+            uint32_t f = mont_mul(ri[k], inv, m);
+            mod_row_kernel(ri + k + 1, rk + k + 1, f, n - k - 1, m);
+        }
+    }
+
+    uint32_t result = mont_reduce(det, m);
+    return negate && result ? m->p - result : result;
+}
+
+#ifdef MATRIX_WIDE_PRIMES
+// The same for primes below 2^62, with 128-bit products
+typedef struct {
+    uint64_t p;
+    uint64_t pinv;      // -p^-1 mod 2^64
+    uint64_t r2;        // 2^128 mod p
+} MontPrime64;
+
+static inline uint64_t mont64_reduce(CrtProduct t, const MontPrime64 *m) {
+    uint64_t q = (uint64_t)t * m->pinv;
+    uint64_t r = (uint64_t)((t + (CrtProduct)q * m->p) >> 64);
+    return r >= m->p ? r - m->p : r;
+}
+
+static inline uint64_t mont64_mul(uint64_t a, uint64_t b, const MontPrime64 *m) {
+    return mont64_reduce((CrtProduct)a * b, m);
+}
+
+static void mont64_init(MontPrime64 *m, uint64_t p) {
+    uint64_t inv = p;
+    for (int i = 0; i < 5; i++)
+        inv *= 2 - p * inv;
+    uint64_t r = -p % p;
+    m->p = p;
+    m->pinv = -inv;
+    m->r2 = (uint64_t)((CrtProduct)r * r % p);
+}
+
+static uint64_t mont64_from_int(int64_t value, const MontPrime64 *m) {
+    int64_t v = value % (int64_t)m->p;
+    if (v < 0) v += m->p;
+    return mont64_mul((uint64_t)v, m->r2, m);
+}
+
+static uint64_t mont64_pow(uint64_t base, uint64_t e, const MontPrime64 *m) {
+    uint64_t result = mont64_mul(1, m->r2, m);
+    while (e) {
+        if (e & 1) result = mont64_mul(result, base, m);
+        base = mont64_mul(base, base, m);
+        e >>= 1;
+    }
+    return result;
+}
+
+// Determinant of matrix mod m->p; a is n*n words of scratch
+static uint64_t determinant_mod_prime64(const Matrix *matrix, const MontPrime64 *m, uint64_t *a) {
+    unsigned n = matrix->M;
+    if (matrix->type == MATRIX_INT64) {
+        const int64_t *data = matrix->data;
+        for (size_t i = 0; i < (size_t)n * n; i++)
+            a[i] = mont64_from_int(data[i], m);
+    } else {
+        const int32_t *data = matrix->data;
+        for (size_t i = 0; i < (size_t)n * n; i++)
+            a[i] = mont64_from_int(data[i], m);
+    }
+
+    uint64_t det = mont64_mul(1, m->r2, m);
+    int negate = 0;
+    for (unsigned k = 0; k < n; k++) {
+        unsigned pivot_row = k;
+        while (pivot_row < n && a[(size_t)pivot_row * n + k] == 0)
+            pivot_row++;
+        if (pivot_row == n) return 0;
+
+        uint64_t *rk = a + (size_t)k * n;
+        if (pivot_row != k) {
+            uint64_t *rp = a + (size_t)pivot_row * n;
+            for (unsigned j = k; j < n; j++) {
+                uint64_t tmp = rk[j];
+                rk[j] = rp[j];
+                rp[j] = tmp;
+            }
+            negate = !negate;
+        }
+
+        det = mont64_mul(det, rk[k], m);
+        uint64_t inv = mont64_pow(rk[k], m->p - 2, m);
+        for (unsigned i = k + 1; i < n; i++) {
+            uint64_t *ri = a + (size_t)i * n;
+            if (ri[k] == 0) continue;
+            // Multiplying by the factor out of Montgomery form with Shoup's
+            // precomputed quotient is the same product and needs one high
+            // multiply per element instead of two. The corrections are masks,
+            // as their branches would be taken at random.
+            uint64_t f = mont64_reduce(mont64_mul(ri[k], inv, m), m);
+            uint64_t f_shoup = (uint64_t)(((CrtProduct)f << 64) / m->p), p = m->p;
+            for (unsigned j = k + 1; j < n; j++) {
+                uint64_t q = (uint64_t)(((CrtProduct)f_shoup * rk[j]) >> 64);
+                uint64_t t = f * rk[j] - q * p;
+                t -= p & -(uint64_t)(t >= p);
+                uint64_t d = ri[j] - t;
+                ri[j] = d + (p & -(uint64_t)(ri[j] < t));
+            }
+        }
+    }
+
+    uint64_t result = mont64_reduce(det, m);
+    return negate && result ? m->p - result : result;
+}
+
+// Miller-Rabin with the first twelve prime bases, deterministic below 2^64
+static int is_prime_u64(uint64_t n) {
+    static const uint64_t bases[] = { 2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37 };
+    for (int b = 0; b < 12; b++)
+        if (n % bases[b] == 0) return n == bases[b];
+    uint64_t d = n - 1;
+    int s = 0;
+    while (d % 2 == 0) {
+        d /= 2;
+        s++;
+    }
+    MontPrime64 m;
+    mont64_init(&m, n);
+    uint64_t one = mont64_mul(1, m.r2, &m), minus_one = n - one;
+    for (int b = 0; b < 12; b++) {
+        uint64_t x = mont64_pow(mont64_mul(bases[b], m.r2, &m), d, &m);
+        if (x == one || x == minus_one) continue;
+        int witness = 1;
+        for (int r = 1; r < s && witness; r++) {
+            x = mont64_mul(x, x, &m);
+            if (x == minus_one) witness = 0;
+        }
+        if (witness) return 0;
+    }
+    return 1;
+}
+#endif
+
+static int is_prime_u32(uint32_t n) {
+    if (n < 2) return 0;
+    if (n % 2 == 0) return n == 2;
+    uint32_t d = n - 1;
+    int s = 0;
+    while (d % 2 == 0) {
+        d /= 2;
+        s++;
+    }
+    static const uint32_t bases[] = { 2, 7, 61 };   // deterministic below 2^32
+    for (int b = 0; b < 3; b++) {
+        uint32_t a = bases[b] % n;
+        if (a == 0) continue;
+        uint64_t x = 1, base = a;
+        for (uint32_t e = d; e; e >>= 1) {
+            if (e & 1) x = x * base % n;
+            base = base * base % n;
+        }
+        if (x == 1 || x == n - 1) continue;
+        int witness = 1;
+        for (int r = 1; r < s && witness; r++) {
+            x = x * x % n;
+            if (x == n - 1) witness = 0;
+        }
+        if (witness) return 0;
+    }
+    return 1;
+}
+
+// The largest primes below 2^31, and below 2^62, generated on first use
+typedef struct {
+    uint64_t *primes;
+    unsigned count;
+} CrtPrimes;
+
+static CrtPrimes crt_primes[2];
+static pthread_mutex_t crt_primes_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Copy the first count primes of a width (1 for 62-bit) into out, extending
+// its table as needed
+static int get_crt_primes(uint64_t *out, unsigned count, int wide) {
+    CrtPrimes *table = &crt_primes[wide];
+    pthread_mutex_lock(&crt_primes_lock);
+    if (count > table->count) {
+        uint64_t *primes = realloc(table->primes, count * sizeof(uint64_t));
+        if (!primes) {
+            pthread_mutex_unlock(&crt_primes_lock);
+            return -1;
+        }
+        table->primes = primes;
+        uint64_t candidate = table->count ? primes[table->count - 1] - 2
+                           : wide ? ((uint64_t)1 << 62) - 1 : 0x7FFFFFFFu;
+        while (table->count < count) {
+#ifdef MATRIX_WIDE_PRIMES
+            int prime = wide ? is_prime_u64(candidate) : is_prime_u32((uint32_t)candidate);
+#else
+            int prime = is_prime_u32((uint32_t)candidate);
+#endif
+            if (prime) primes[table->count++] = candidate;
+            candidate -= 2;
+        }
+    }
+    memcpy(out, table->primes, count * sizeof(uint64_t));
+    pthread_mutex_unlock(&crt_primes_lock);
+    return 0;
+}
+
+// Minimal unsigned big integer for CRT reconstruction, 32-bit limbs, little endian
+typedef struct {
+    uint32_t *limb;
+    size_t len;
+} BigUint;
+
+// x = x * mul + add, mul and add below the widest prime
+static int big_mul_add(BigUint *x, uint64_t mul, uint64_t add) {
+    uint64_t carry = add;
+    for (size_t i = 0; i < x->len; i++) {
+        CrtProduct t = (CrtProduct)x->limb[i] * mul + carry;
+        x->limb[i] = (uint32_t)t;
+        carry = (uint64_t)(t >> 32);
+    }
+    while (carry) {
+        uint32_t *limb = realloc(x->limb, (x->len + 1) * sizeof(uint32_t));
+        if (!limb) return -1;
+        x->limb = limb;
+        x->limb[x->len++] = (uint32_t)carry;
+        carry >>= 32;
+    }
+    return 0;
+}
+
+// Compare 2*x with y
+static int big_cmp_double(const BigUint *x, const BigUint *y) {
+    size_t len = (x->len > y->len ? x->len : y->len) + 1;
+    for (size_t i = len; i-- > 0;) {
+        uint32_t xi = (i < x->len ? x->limb[i] << 1 : 0) | (i > 0 && i - 1 < x->len ? x->limb[i - 1] >> 31 : 0);
+        uint32_t yi = i < y->len ? y->limb[i] : 0;
+        if (xi != yi) return xi < yi ? -1 : 1;
+    }
+    return 0;
+}
+
+// x = y - x, requires y >= x
+static int big_sub_from(BigUint *x, const BigUint *y) {
+    if (x->len < y->len) {
+        uint32_t *limb = realloc(x->limb, y->len * sizeof(uint32_t));
+        if (!limb) return -1;
+        memset(limb + x->len, 0, (y->len - x->len) * sizeof(uint32_t));
+        x->limb = limb;
+        x->len = y->len;
+    }
+    int64_t borrow = 0;
+    for (size_t i = 0; i < y->len; i++) {
+        int64_t t = (int64_t)y->limb[i] - x->limb[i] - borrow;
+        borrow = t < 0;
+        x->limb[i] = (uint32_t)t;
+    }
+    return 0;
+}
+
+static char *big_to_decimal(BigUint *x, int negative) {
+    // Each 32-bit limb is at most 10 digits
+    size_t cap = x->len * 10 + 3;
+    char *out = malloc(cap);
+    if (!out) return NULL;
+    char *p = out + cap - 1;
+    *p = '\0';
+
+    while (x->len > 0 && x->limb[x->len - 1] == 0)
+        x->len--;
+    if (x->len == 0) {
+        *--p = '0';
+        negative = 0;
+    }
+    while (x->len > 0) {
+        uint64_t rem = 0;
+        for (size_t i = x->len; i-- > 0;) {
+            uint64_t cur = (rem << 32) | x->limb[i];
+            x->limb[i] = (uint32_t)(cur / 1000000000u);
+            rem = cur % 1000000000u;
+        }
+        while (x->len > 0 && x->limb[x->len - 1] == 0)
+            x->len--;
+        for (int d = 0; d < 9 && (x->len > 0 || rem > 0 || d == 0); d++) {
+            *--p = (char)('0' + rem % 10);
+            rem /= 10;
+        }
+    }
+    if (negative) *--p = '-';
+    memmove(out, p, strlen(p) + 1);
+    return out;
+}
+
+// Garner's algorithm: mixed-radix digits, then the symmetric residue in
+// (-M/2, M/2] as a decimal string
+static char *crt_combine(const uint64_t *residues, const uint64_t *primes, unsigned count) {
+    uint64_t *digits = malloc(count * sizeof(uint64_t));
+    BigUint value = { malloc(sizeof(uint32_t)), 1 };
+    BigUint modulus = { malloc(sizeof(uint32_t)), 1 };
+    char *result = NULL;
+    if (!digits || !value.limb || !modulus.limb) goto out;
+
+    for (unsigned i = 0; i < count; i++) {
+        uint64_t p = primes[i], acc = 0, scale = 1;
+        for (unsigned j = 0; j < i; j++) {
+            acc = (uint64_t)(((CrtProduct)digits[j] * scale + acc) % p);
+            scale = (uint64_t)((CrtProduct)scale * (primes[j] % p) % p);
+        }
+        uint64_t inv = 1, base = scale;
+        for (uint64_t e = p - 2; e; e >>= 1) {
+            if (e & 1) inv = (uint64_t)((CrtProduct)inv * base % p);
+            base = (uint64_t)((CrtProduct)base * base % p);
+        }
+        digits[i] = (uint64_t)((CrtProduct)((residues[i] + p - acc) % p) * inv % p);
+    }
+
+    value.limb[0] = 0;
+    if (big_mul_add(&value, 0, digits[count - 1]) != 0) goto out;
+    for (unsigned i = count - 1; i-- > 0;)
+        if (big_mul_add(&value, primes[i], digits[i]) != 0) goto out;
+    modulus.limb[0] = 1;
+    for (unsigned i = 0; i < count; i++)
+        if (big_mul_add(&modulus, primes[i], 0) != 0) goto out;
+
+    int negative = big_cmp_double(&value, &modulus) > 0;
+    if (negative && big_sub_from(&value, &modulus) != 0) goto out;
+    result = big_to_decimal(&value, negative);
+
+out:
+    free(digits);
+    free(value.limb);
+    free(modulus.limb);
+    return result;
+}
+
+typedef struct {
+    const Matrix *matrix;
+    const uint64_t *primes;
+    uint64_t *residues;
+    int wide;                   // 62-bit primes
+    MatrixProgress *progress;
+    atomic_size_t remaining;
+    atomic_int failed;
+    atomic_int done;
+} ExactDetJob;
+
+static void exact_det_task(PoolTask *task) {
+    ExactDetJob *job = task->ctx;
+    unsigned n = job->matrix->M;
+    if (job->progress && atomic_load(&job->progress->cancel)) atomic_store(&job->failed, 1);
+    size_t mark = scratch_mark();
+    size_t bytes = (size_t)n * n * (job->wide ? sizeof(uint64_t) : sizeof(uint32_t));
+    void *scratch = atomic_load(&job->failed) ? NULL : scratch_alloc(bytes);
+    if (scratch) {
+        MatrixTraceScope scope = matrix_trace_begin("det_exact.prime");
+#ifdef MATRIX_WIDE_PRIMES
+        if (job->wide) {
+            MontPrime64 m;
+            mont64_init(&m, job->primes[task->a]);
+            job->residues[task->a] = determinant_mod_prime64(job->matrix, &m, scratch);
+        }
+#endif
+        if (!job->wide) {
+            MontPrime m;
+            mont_init(&m, (uint32_t)job->primes[task->a]);
+            job->residues[task->a] = determinant_mod_prime(job->matrix, &m, scratch);
+        }
+        matrix_trace_end(scope, bytes, 0.0);
+        scratch_pop(mark);
+        if (job->progress) atomic_fetch_add(&job->progress->done, 1);
+    } else {
+        atomic_store(&job->failed, 1);
+    }
+    if (atomic_fetch_sub(&job->remaining, 1) == 1)
+        pool_signal_done(&job->done);
+}
+
+// log2 of the Hadamard bound prod_i ||row_i||; -1 if some row is all zero
+static double hadamard_log2(const Matrix *matrix) {
+    double total = 0.0;
+    for (unsigned i = 0; i < matrix->M; i++) {
+        double norm2 = 0.0;
+        for (unsigned j = 0; j < matrix->N; j++) {
+            double v = matrix_get(matrix, i, j);
+            norm2 += v * v;
+        }
+        if (norm2 == 0.0) return -1.0;
+        total += 0.5 * log2(norm2);
+    }
+    return total;
+}
+
+// Exact determinant as a decimal string (caller frees), NULL if the matrix
+// is not square, has floating-point elements or memory runs out, with the
+// reason in matrix_last_error(). primes_used (optional) receives the number
+// of primes the Hadamard bound called for.
+char *determinant_exact(const Matrix *matrix, unsigned *primes_used) {
+    return determinant_exact_progress(matrix, primes_used, NULL);
+}
+
+// determinant_exact reporting to progress (optional) one prime at a time.
+// Cancelling skips the primes not started yet and returns NULL.
+char *determinant_exact_progress(const Matrix *matrix, unsigned *primes_used,
+                                 MatrixProgress *progress) {
+    if (!matrix || matrix->M != matrix->N) {
+        snprintf(matrix_io_error, sizeof(matrix_io_error), "not square");
+        return NULL;
+    }
+    if (primes_used) *primes_used = 0;
+    if (!matrix_type_is_integer(matrix->type)) {
+        snprintf(matrix_io_error, sizeof(matrix_io_error), "exact determinants need integer elements");
+        return NULL;
+    }
+    if (matrix->csr) {
+        // The modular eliminations fill in completely anyway
+        Matrix *dense = matrix_dense_copy(matrix);
+        char *det = dense ? determinant_exact_progress(dense, primes_used, progress) : NULL;
+        free_matrix(dense);
+        return det;
+    }
+
+    double bits = hadamard_log2(matrix);
+    if (matrix->M == 0 || bits < 0.0) {
+        char *zero = malloc(2);
+        if (zero) strcpy(zero, matrix->M == 0 ? "1" : "0");
+        else snprintf(matrix_io_error, sizeof(matrix_io_error), "out of memory");
+        return zero;
+    }
+
+    // Every prime is above 2^30.99, or 2^61.99; one bit for the sign and one
+    // spare prime for rounding in the bound
+    mod_select_kernel();
+#ifdef MATRIX_WIDE_PRIMES
+    int wide = mod_row_kernel == mod_row_update_scalar;
+#else
+    int wide = 0;
+#endif
+    unsigned count = (unsigned)ceil((bits + 1.0) / (wide ? 61.99 : 30.99)) + 1;
+    uint64_t *primes = malloc(2 * (size_t)count * sizeof(uint64_t));
+    if (!primes || get_crt_primes(primes, count, wide) != 0) {
+        free(primes);
+        snprintf(matrix_io_error, sizeof(matrix_io_error), "out of memory");
+        return NULL;
+    }
+    uint64_t *residues = primes + count;
+
+    MatrixTraceScope op = op_begin("det_exact");
+    ExactDetJob job;
+    job.matrix = matrix;
+    job.primes = primes;
+    job.residues = residues;
+    job.wide = wide;
+    job.progress = progress;
+    if (progress) {
+        atomic_store(&progress->done, 0);
+        atomic_store(&progress->total, count);
+    }
+    atomic_init(&job.remaining, count);
+    atomic_init(&job.failed, 0);
+    atomic_init(&job.done, 0);
+    for (unsigned i = 0; i < count; i++) {
+        PoolTask t = { exact_det_task, &job, 0, i, 0, 0 };
+        pool_push(&t);
+    }
+    pool_wait(&job.done);
+
+    MatrixTraceScope crt = matrix_trace_begin("det_exact.crt");
+    char *result = atomic_load(&job.failed) ? NULL : crt_combine(residues, primes, count);
+    matrix_trace_end(crt, 0, 0.0);
+    if (!result)
+        snprintf(matrix_io_error, sizeof(matrix_io_error),
+                 progress && atomic_load(&progress->cancel) ? "cancelled" : "out of memory");
+    free(primes);
+    if (primes_used) *primes_used = count;
+    op_end(op, (uint64_t)matrix->M * matrix->N * matrix_types[matrix->type].size, 0.0);
+    return result;
+}
+
+// Matrix multiplication
+//
+// Packed, cache-blocked GEMM in the style of BLIS. C is split into
+// GEMM_MC x GEMM_NC tiles, one pool task each, so threads never share
+// output. A task walks K in GEMM_KC steps: it packs its slice of B into
+// NR-wide column strips and its slice of A into MR-high row strips, which
+// the micro-kernel then streams with unit stride while an MR x NR block of
+// C stays in registers. Integer products are exact: int elements are widened
+// to int64 while packing and accumulated in int64. float32 products are
+// packed and accumulated in float, twice the lanes of a double kernel.
+#define GEMM_MC 96
+#define GEMM_KC 256
+#define GEMM_NC 512
+#define GEMM_MAX_TILE (8 * 16 * 8)  // bytes in the largest MR x NR tile of any kernel
+
+typedef void (*GemmPack)(const void *src, size_t ld, unsigned rows, unsigned cols,
+                         unsigned width, void *dst);
+
+// Rows x cols of a row-major source into strips of width rows, depth-major:
+// dst[strip][p][r] = src[strip * width + r][p], zero-padded to whole strips
+static void gemm_pack_rows_f64(const void *src, size_t ld, unsigned rows, unsigned cols,
+                               unsigned width, void *dst) {
+    const double *s = src;
+    double *d = dst;
+    for (unsigned r0 = 0; r0 < rows; r0 += width) {
+        unsigned h = rows - r0 < width ? rows - r0 : width;
+        for (unsigned p = 0; p < cols; p++) {
+            for (unsigned r = 0; r < h; r++) *d++ = s[(size_t)(r0 + r) * ld + p];
+            for (unsigned r = h; r < width; r++) *d++ = 0.0;
+        }
+    }
+}
+
+// gemm_pack_rows_f64 with the signs flipped, so the kernels subtract A * B
+static void gemm_pack_rows_f64_neg(const void *src, size_t ld, unsigned rows, unsigned cols,
+                                   unsigned width, void *dst) {
+    const double *s = src;
+    double *d = dst;
+    for (unsigned r0 = 0; r0 < rows; r0 += width) {
+        unsigned h = rows - r0 < width ? rows - r0 : width;
+        for (unsigned p = 0; p < cols; p++) {
+            for (unsigned r = 0; r < h; r++) *d++ = -s[(size_t)(r0 + r) * ld + p];
+            for (unsigned r = h; r < width; r++) *d++ = 0.0;
+        }
+    }
+}
+
+static void gemm_pack_rows_f32(const void *src, size_t ld, unsigned rows, unsigned cols,
+                               unsigned width, void *dst) {
+    const float *s = src;
+    float *d = dst;
+    for (unsigned r0 = 0; r0 < rows; r0 += width) {
+        unsigned h = rows - r0 < width ? rows - r0 : width;
+        for (unsigned p = 0; p < cols; p++) {
+            for (unsigned r = 0; r < h; r++) *d++ = s[(size_t)(r0 + r) * ld + p];
+            for (unsigned r = h; r < width; r++) *d++ = 0.0f;
+        }
+    }
+}
+
+static void gemm_pack_rows_i32(const void *src, size_t ld, unsigned rows, unsigned cols,
+                               unsigned width, void *dst) {
+    const int *s = src;
+    int64_t *d = dst;
+    for (unsigned r0 = 0; r0 < rows; r0 += width) {
+        unsigned h = rows - r0 < width ? rows - r0 : width;
+        for (unsigned p = 0; p < cols; p++) {
+            for (unsigned r = 0; r < h; r++) *d++ = s[(size_t)(r0 + r) * ld + p];
+            for (unsigned r = h; r < width; r++) *d++ = 0;
+        }
+    }
+}
+
+// Rows x cols into strips of width columns: dst[strip][p][c] = src[p][strip * width + c]
+static void gemm_pack_cols_f64(const void *src, size_t ld, unsigned rows, unsigned cols,
+                               unsigned width, void *dst) {
+    const double *s = src;
+    double *d = dst;
+    for (unsigned c0 = 0; c0 < cols; c0 += width) {
+        unsigned w = cols - c0 < width ? cols - c0 : width;
+        for (unsigned p = 0; p < rows; p++) {
+            const double *row = s + (size_t)p * ld + c0;
+            for (unsigned c = 0; c < w; c++) *d++ = row[c];
+            for (unsigned c = w; c < width; c++) *d++ = 0.0;
+        }
+    }
+}
+
+static void gemm_pack_cols_f32(const void *src, size_t ld, unsigned rows, unsigned cols,
+                               unsigned width, void *dst) {
+    const float *s = src;
+    float *d = dst;
+    for (unsigned c0 = 0; c0 < cols; c0 += width) {
+        unsigned w = cols - c0 < width ? cols - c0 : width;
+        for (unsigned p = 0; p < rows; p++) {
+            const float *row = s + (size_t)p * ld + c0;
+            for (unsigned c = 0; c < w; c++) *d++ = row[c];
+            for (unsigned c = w; c < width; c++) *d++ = 0.0f;
+        }
+    }
+}
+
+static void gemm_pack_cols_i32(const void *src, size_t ld, unsigned rows, unsigned cols,
+                               unsigned width, void *dst) {
+    const int *s = src;
+    int64_t *d = dst;
+    for (unsigned c0 = 0; c0 < cols; c0 += width) {
+        unsigned w = cols - c0 < width ? cols - c0 : width;
+        for (unsigned p = 0; p < rows; p++) {
+            const int *row = s + (size_t)p * ld + c0;
+            for (unsigned c = 0; c < w; c++) *d++ = row[c];
+            for (unsigned c = w; c < width; c++) *d++ = 0;
+        }
+    }
+}
+
+static void gemm_kernel_f64_scalar(size_t k, const void *a, const void *b, void *c, size_t ldc) {
+    const double *ap = a, *bp = b;
+    double *cp = c;
+    double acc[4][4] = { { 0 } };
+    for (size_t p = 0; p < k; p++, ap += 4, bp += 4)
+        for (unsigned i = 0; i < 4; i++)
+            for (unsigned j = 0; j < 4; j++)
+                acc[i][j] += ap[i] * bp[j];
+    for (unsigned i = 0; i < 4; i++)
+        for (unsigned j = 0; j < 4; j++)
+            cp[i * ldc + j] += acc[i][j];
+}
+
+static void gemm_kernel_f32_scalar(size_t k, const void *a, const void *b, void *c, size_t ldc) {
+    const float *ap = a, *bp = b;
+    float *cp = c;
+    float acc[4][4] = { { 0 } };
+    for (size_t p = 0; p < k; p++, ap += 4, bp += 4)
+        for (unsigned i = 0; i < 4; i++)
+            for (unsigned j = 0; j < 4; j++)
+                acc[i][j] += ap[i] * bp[j];
+    for (unsigned i = 0; i < 4; i++)
+        for (unsigned j = 0; j < 4; j++)
+            cp[i * ldc + j] += acc[i][j];
+}
+
+static void gemm_kernel_i64_scalar(size_t k, const void *a, const void *b, void *c, size_t ldc) {
+    const int64_t *ap = a, *bp = b;
+    int64_t *cp = c;
+    int64_t acc[4][4] = { { 0 } };
+    for (size_t p = 0; p < k; p++, ap += 4, bp += 4)
+        for (unsigned i = 0; i < 4; i++)
+            for (unsigned j = 0; j < 4; j++)
+                acc[i][j] += ap[i] * bp[j];
+    for (unsigned i = 0; i < 4; i++)
+        for (unsigned j = 0; j < 4; j++)
+            cp[i * ldc + j] += acc[i][j];
+}
+
+#ifdef MATRIX_X86
+// 6x8 tile: 12 ymm accumulators, two B loads and six broadcasts per k
+__attribute__((target("avx2,fma")))
+static void gemm_kernel_f64_avx2(size_t k, const void *a, const void *b, void *c, size_t ldc) {
+    const double *ap = a, *bp = b;
+    double *cp = c;
+    __m256d c00 = _mm256_setzero_pd(), c01 = _mm256_setzero_pd();
+    __m256d c10 = _mm256_setzero_pd(), c11 = _mm256_setzero_pd();
+    __m256d c20 = _mm256_setzero_pd(), c21 = _mm256_setzero_pd();
+    __m256d c30 = _mm256_setzero_pd(), c31 = _mm256_setzero_pd();
+    __m256d c40 = _mm256_setzero_pd(), c41 = _mm256_setzero_pd();
+    __m256d c50 = _mm256_setzero_pd(), c51 = _mm256_setzero_pd();
+    for (size_t p = 0; p < k; p++, ap += 6, bp += 8) {
+        __m256d b0 = _mm256_load_pd(bp), b1 = _mm256_load_pd(bp + 4);
+        __m256d x;
+        x = _mm256_broadcast_sd(ap);
+        c00 = _mm256_fmadd_pd(x, b0, c00); c01 = _mm256_fmadd_pd(x, b1, c01);
+        x = _mm256_broadcast_sd(ap + 1);
+        c10 = _mm256_fmadd_pd(x, b0, c10); c11 = _mm256_fmadd_pd(x, b1, c11);
+        x = _mm256_broadcast_sd(ap + 2);
+        c20 = _mm256_fmadd_pd(x, b0, c20); c21 = _mm256_fmadd_pd(x, b1, c21);
+        x = _mm256_broadcast_sd(ap + 3);
+        c30 = _mm256_fmadd_pd(x, b0, c30); c31 = _mm256_fmadd_pd(x, b1, c31);
+        x = _mm256_broadcast_sd(ap + 4);
+        c40 = _mm256_fmadd_pd(x, b0, c40); c41 = _mm256_fmadd_pd(x, b1, c41);
+        x = _mm256_broadcast_sd(ap + 5);
+        c50 = _mm256_fmadd_pd(x, b0, c50); c51 = _mm256_fmadd_pd(x, b1, c51);
+    }
+#define GEMM_STORE_ROW(r, lo, hi)                                                   \
+    _mm256_storeu_pd(cp + r * ldc, _mm256_add_pd(_mm256_loadu_pd(cp + r * ldc), lo)); \
+    _mm256_storeu_pd(cp + r * ldc + 4, _mm256_add_pd(_mm256_loadu_pd(cp + r * ldc + 4), hi))
+    GEMM_STORE_ROW(0, c00, c01);
+    GEMM_STORE_ROW(1, c10, c11);
+    GEMM_STORE_ROW(2, c20, c21);
+    GEMM_STORE_ROW(3, c30, c31);
+    GEMM_STORE_ROW(4, c40, c41);
+    GEMM_STORE_ROW(5, c50, c51);
+#undef GEMM_STORE_ROW
+}
+
+// 8x16 tile: 16 zmm accumulators
+__attribute__((target("avx512f")))
+static void gemm_kernel_f64_avx512(size_t k, const void *a, const void *b, void *c, size_t ldc) {
+    const double *ap = a, *bp = b;
+    double *cp = c;
+    __m512d c00 = _mm512_setzero_pd(), c01 = _mm512_setzero_pd();
+    __m512d c10 = _mm512_setzero_pd(), c11 = _mm512_setzero_pd();
+    __m512d c20 = _mm512_setzero_pd(), c21 = _mm512_setzero_pd();
+    __m512d c30 = _mm512_setzero_pd(), c31 = _mm512_setzero_pd();
+    __m512d c40 = _mm512_setzero_pd(), c41 = _mm512_setzero_pd();
+    __m512d c50 = _mm512_setzero_pd(), c51 = _mm512_setzero_pd();
+    __m512d c60 = _mm512_setzero_pd(), c61 = _mm512_setzero_pd();
+    __m512d c70 = _mm512_setzero_pd(), c71 = _mm512_setzero_pd();
+    for (size_t p = 0; p < k; p++, ap += 8, bp += 16) {
+        __m512d b0 = _mm512_load_pd(bp), b1 = _mm512_load_pd(bp + 8);
+        __m512d x;
+        x = _mm512_set1_pd(ap[0]);
+        c00 = _mm512_fmadd_pd(x, b0, c00); c01 = _mm512_fmadd_pd(x, b1, c01);
+        x = _mm512_set1_pd(ap[1]);
+        c10 = _mm512_fmadd_pd(x, b0, c10); c11 = _mm512_fmadd_pd(x, b1, c11);
+        x = _mm512_set1_pd(ap[2]);
+        c20 = _mm512_fmadd_pd(x, b0, c20); c21 = _mm512_fmadd_pd(x, b1, c21);
+        x = _mm512_set1_pd(ap[3]);
+        c30 = _mm512_fmadd_pd(x, b0, c30); c31 = _mm512_fmadd_pd(x, b1, c31);
+        x = _mm512_set1_pd(ap[4]);
+        c40 = _mm512_fmadd_pd(x, b0, c40); c41 = _mm512_fmadd_pd(x, b1, c41);
+        x = _mm512_set1_pd(ap[5]);
+        c50 = _mm512_fmadd_pd(x, b0, c50); c51 = _mm512_fmadd_pd(x, b1, c51);
+        x = _mm512_set1_pd(ap[6]);
+        c60 = _mm512_fmadd_pd(x, b0, c60); c61 = _mm512_fmadd_pd(x, b1, c61);
+        x = _mm512_set1_pd(ap[7]);
+        c70 = _mm512_fmadd_pd(x, b0, c70); c71 = _mm512_fmadd_pd(x, b1, c71);
+    }
+#define GEMM_STORE_ROW(r, lo, hi)                                                   \
+    _mm512_storeu_pd(cp + r * ldc, _mm512_add_pd(_mm512_loadu_pd(cp + r * ldc), lo)); \
+    _mm512_storeu_pd(cp + r * ldc + 8, _mm512_add_pd(_mm512_loadu_pd(cp + r * ldc + 8), hi))
+    GEMM_STORE_ROW(0, c00, c01);
+    GEMM_STORE_ROW(1, c10, c11);
+    GEMM_STORE_ROW(2, c20, c21);
+    GEMM_STORE_ROW(3, c30, c31);
+    GEMM_STORE_ROW(4, c40, c41);
+    GEMM_STORE_ROW(5, c50, c51);
+    GEMM_STORE_ROW(6, c60, c61);
+    GEMM_STORE_ROW(7, c70, c71);
+#undef GEMM_STORE_ROW
+}
+
+// The double kernels' register tiles over float: 6x16 in 12 ymm and 8x32
+// in 16 zmm accumulators
+__attribute__((target("avx2,fma")))
+static void gemm_kernel_f32_avx2(size_t k, const void *a, const void *b, void *c, size_t ldc) {
+    const float *ap = a, *bp = b;
+    float *cp = c;
+    __m256 c00 = _mm256_setzero_ps(), c01 = _mm256_setzero_ps();
+    __m256 c10 = _mm256_setzero_ps(), c11 = _mm256_setzero_ps();
+    __m256 c20 = _mm256_setzero_ps(), c21 = _mm256_setzero_ps();
+    __m256 c30 = _mm256_setzero_ps(), c31 = _mm256_setzero_ps();
+    __m256 c40 = _mm256_setzero_ps(), c41 = _mm256_setzero_ps();
+    __m256 c50 = _mm256_setzero_ps(), c51 = _mm256_setzero_ps();
+    for (size_t p = 0; p < k; p++, ap += 6, bp += 16) {
+        __m256 b0 = _mm256_load_ps(bp), b1 = _mm256_load_ps(bp + 8);
+        __m256 x;
+        x = _mm256_broadcast_ss(ap);
+        c00 = _mm256_fmadd_ps(x, b0, c00); c01 = _mm256_fmadd_ps(x, b1, c01);
+        x = _mm256_broadcast_ss(ap + 1);
+        c10 = _mm256_fmadd_ps(x, b0, c10); c11 = _mm256_fmadd_ps(x, b1, c11);
+        x = _mm256_broadcast_ss(ap + 2);
+        c20 = _mm256_fmadd_ps(x, b0, c20); c21 = _mm256_fmadd_ps(x, b1, c21);
+        x = _mm256_broadcast_ss(ap + 3);
+        c30 = _mm256_fmadd_ps(x, b0, c30); c31 = _mm256_fmadd_ps(x, b1, c31);
+        x = _mm256_broadcast_ss(ap + 4);
+        c40 = _mm256_fmadd_ps(x, b0, c40); c41 = _mm256_fmadd_ps(x, b1, c41);
+        x = _mm256_broadcast_ss(ap + 5);
+        c50 = _mm256_fmadd_ps(x, b0, c50); c51 = _mm256_fmadd_ps(x, b1, c51);
+    }
+#define GEMM_STORE_ROW(r, lo, hi)                                                   \
+    _mm256_storeu_ps(cp + r * ldc, _mm256_add_ps(_mm256_loadu_ps(cp + r * ldc), lo)); \
+    _mm256_storeu_ps(cp + r * ldc + 8, _mm256_add_ps(_mm256_loadu_ps(cp + r * ldc + 8), hi))
+    GEMM_STORE_ROW(0, c00, c01);
+    GEMM_STORE_ROW(1, c10, c11);
+    GEMM_STORE_ROW(2, c20, c21);
+    GEMM_STORE_ROW(3, c30, c31);
+    GEMM_STORE_ROW(4, c40, c41);
+    GEMM_STORE_ROW(5, c50, c51);
+#undef GEMM_STORE_ROW
+}
+
+__attribute__((target("avx512f")))
+static void gemm_kernel_f32_avx512(size_t k, const void *a, const void *b, void *c, size_t ldc) {
+    const float *ap = a, *bp = b;
+    float *cp = c;
+    __m512 c00 = _mm512_setzero_ps(), c01 = _mm512_setzero_ps();
+    __m512 c10 = _mm512_setzero_ps(), c11 = _mm512_setzero_ps();
+    __m512 c20 = _mm512_setzero_ps(), c21 = _mm512_setzero_ps();
+    __m512 c30 = _mm512_setzero_ps(), c31 = _mm512_setzero_ps();
+    __m512 c40 = _mm512_setzero_ps(), c41 = _mm512_setzero_ps();
+    __m512 c50 = _mm512_setzero_ps(), c51 = _mm512_setzero_ps();
+    __m512 c60 = _mm512_setzero_ps(), c61 = _mm512_setzero_ps();
+    __m512 c70 = _mm512_setzero_ps(), c71 = _mm512_setzero_ps();
+    for (size_t p = 0; p < k; p++, ap += 8, bp += 32) {
+        __m512 b0 = _mm512_load_ps(bp), b1 = _mm512_load_ps(bp + 16);
+        __m512 x;
+        x = _mm512_set1_ps(ap[0]);
+        c00 = _mm512_fmadd_ps(x, b0, c00); c01 = _mm512_fmadd_ps(x, b1, c01);
+        x = _mm512_set1_ps(ap[1]);
+        c10 = _mm512_fmadd_ps(x, b0, c10); c11 = _mm512_fmadd_ps(x, b1, c11);
+        x = _mm512_set1_ps(ap[2]);
+        c20 = _mm512_fmadd_ps(x, b0, c20); c21 = _mm512_fmadd_ps(x, b1, c21);
+        x = _mm512_set1_ps(ap[3]);
+        c30 = _mm512_fmadd_ps(x, b0, c30); c31 = _mm512_fmadd_ps(x, b1, c31);
+        x = _mm512_set1_ps(ap[4]);
+        c40 = _mm512_fmadd_ps(x, b0, c40); c41 = _mm512_fmadd_ps(x, b1, c41);
+        x = _mm512_set1_ps(ap[5]);
+        c50 = _mm512_fmadd_ps(x, b0, c50); c51 = _mm512_fmadd_ps(x, b1, c51);
+        x = _mm512_set1_ps(ap[6]);
+        c60 = _mm512_fmadd_ps(x, b0, c60); c61 = _mm512_fmadd_ps(x, b1, c61);
+        x = _mm512_set1_ps(ap[7]);
+        c70 = _mm512_fmadd_ps(x, b0, c70); c71 = _mm512_fmadd_ps(x, b1, c71);
+    }
+#define GEMM_STORE_ROW(r, lo, hi)                                                   \
+    _mm512_storeu_ps(cp + r * ldc, _mm512_add_ps(_mm512_loadu_ps(cp + r * ldc), lo)); \
+    _mm512_storeu_ps(cp + r * ldc + 16, _mm512_add_ps(_mm512_loadu_ps(cp + r * ldc + 16), hi))
+    GEMM_STORE_ROW(0, c00, c01);
+    GEMM_STORE_ROW(1, c10, c11);
+    GEMM_STORE_ROW(2, c20, c21);
+    GEMM_STORE_ROW(3, c30, c31);
+    GEMM_STORE_ROW(4, c40, c41);
+    GEMM_STORE_ROW(5, c50, c51);
+    GEMM_STORE_ROW(6, c60, c61);
+    GEMM_STORE_ROW(7, c70, c71);
+#undef GEMM_STORE_ROW
+}
+
+// 4x8 tile of int64: _mm256_mul_epi32 multiplies the sign-extended low
+// halves of each lane, which is exactly the widened int product
+__attribute__((target("avx2")))
+static void gemm_kernel_i64_avx2(size_t k, const void *a, const void *b, void *c, size_t ldc) {
+    const int64_t *ap = a, *bp = b;
+    int64_t *cp = c;
+    __m256i c00 = _mm256_setzero_si256(), c01 = _mm256_setzero_si256();
+    __m256i c10 = _mm256_setzero_si256(), c11 = _mm256_setzero_si256();
+    __m256i c20 = _mm256_setzero_si256(), c21 = _mm256_setzero_si256();
+    __m256i c30 = _mm256_setzero_si256(), c31 = _mm256_setzero_si256();
+    for (size_t p = 0; p < k; p++, ap += 4, bp += 8) {
+        __m256i b0 = _mm256_load_si256((const __m256i *)bp);
+        __m256i b1 = _mm256_load_si256((const __m256i *)(bp + 4));
+        __m256i x;
+        x = _mm256_set1_epi64x(ap[0]);
+        c00 = _mm256_add_epi64(c00, _mm256_mul_epi32(x, b0));
+        c01 = _mm256_add_epi64(c01, _mm256_mul_epi32(x, b1));
+        x = _mm256_set1_epi64x(ap[1]);
+        c10 = _mm256_add_epi64(c10, _mm256_mul_epi32(x, b0));
+        c11 = _mm256_add_epi64(c11, _mm256_mul_epi32(x, b1));
+        x = _mm256_set1_epi64x(ap[2]);
+        c20 = _mm256_add_epi64(c20, _mm256_mul_epi32(x, b0));
+        c21 = _mm256_add_epi64(c21, _mm256_mul_epi32(x, b1));
+        x = _mm256_set1_epi64x(ap[3]);
+        c30 = _mm256_add_epi64(c30, _mm256_mul_epi32(x, b0));
+        c31 = _mm256_add_epi64(c31, _mm256_mul_epi32(x, b1));
+    }
+#define GEMM_STORE_ROW(r, lo, hi)                                                   \
+    do {                                                                            \
+        __m256i *row = (__m256i *)(cp + r * ldc);                                   \
+        _mm256_storeu_si256(row, _mm256_add_epi64(_mm256_loadu_si256(row), lo));    \
+        _mm256_storeu_si256(row + 1, _mm256_add_epi64(_mm256_loadu_si256(row + 1), hi)); \
+    } while (0)
+    GEMM_STORE_ROW(0, c00, c01);
+    GEMM_STORE_ROW(1, c10, c11);
+    GEMM_STORE_ROW(2, c20, c21);
+    GEMM_STORE_ROW(3, c30, c31);
+#undef GEMM_STORE_ROW
+}
+
+// 8x16 tile of int64: 16 zmm accumulators
+__attribute__((target("avx512f")))
+static void gemm_kernel_i64_avx512(size_t k, const void *a, const void *b, void *c, size_t ldc) {
+    const int64_t *ap = a, *bp = b;
+    int64_t *cp = c;
+    __m512i c00 = _mm512_setzero_si512(), c01 = _mm512_setzero_si512();
+    __m512i c10 = _mm512_setzero_si512(), c11 = _mm512_setzero_si512();
+    __m512i c20 = _mm512_setzero_si512(), c21 = _mm512_setzero_si512();
+    __m512i c30 = _mm512_setzero_si512(), c31 = _mm512_setzero_si512();
+    __m512i c40 = _mm512_setzero_si512(), c41 = _mm512_setzero_si512();
+    __m512i c50 = _mm512_setzero_si512(), c51 = _mm512_setzero_si512();
+    __m512i c60 = _mm512_setzero_si512(), c61 = _mm512_setzero_si512();
+    __m512i c70 = _mm512_setzero_si512(), c71 = _mm512_setzero_si512();
+    for (size_t p = 0; p < k; p++, ap += 8, bp += 16) {
+        __m512i b0 = _mm512_load_si512(bp), b1 = _mm512_load_si512(bp + 8);
+        __m512i x;
+#define GEMM_ROW(r, lo, hi)                                   \
+        x = _mm512_set1_epi64(ap[r]);                         \
+        lo = _mm512_add_epi64(lo, _mm512_mul_epi32(x, b0));   \
+        hi = _mm512_add_epi64(hi, _mm512_mul_epi32(x, b1))
+        GEMM_ROW(0, c00, c01);
+        GEMM_ROW(1, c10, c11);
+        GEMM_ROW(2, c20, c21);
+        GEMM_ROW(3, c30, c31);
+        GEMM_ROW(4, c40, c41);
+        GEMM_ROW(5, c50, c51);
+        GEMM_ROW(6, c60, c61);
+        GEMM_ROW(7, c70, c71);
+#undef GEMM_ROW
+    }
+#define GEMM_STORE_ROW(r, lo, hi)                                                      \
+    _mm512_storeu_si512(cp + r * ldc, _mm512_add_epi64(_mm512_loadu_si512(cp + r * ldc), lo)); \
+    _mm512_storeu_si512(cp + r * ldc + 8, _mm512_add_epi64(_mm512_loadu_si512(cp + r * ldc + 8), hi))
+    GEMM_STORE_ROW(0, c00, c01);
+    GEMM_STORE_ROW(1, c10, c11);
+    GEMM_STORE_ROW(2, c20, c21);
+    GEMM_STORE_ROW(3, c30, c31);
+    GEMM_STORE_ROW(4, c40, c41);
+    GEMM_STORE_ROW(5, c50, c51);
+    GEMM_STORE_ROW(6, c60, c61);
+    GEMM_STORE_ROW(7, c70, c71);
+#undef GEMM_STORE_ROW
+}
+#endif
+
+GemmKernel gemm_f64_kernel, gemm_f32_kernel, gemm_i64_kernel;
+
+// Same choice and MAT_KERNEL override as the LU update kernels
+void gemm_select_kernels(void) {
+    if (gemm_f64_kernel.kernel) return;
+    GemmKernel f64 = { gemm_kernel_f64_scalar, 4, 4, "scalar", 8 };
+    GemmKernel f32 = { gemm_kernel_f32_scalar, 4, 4, "scalar", 4 };
+    GemmKernel i64 = { gemm_kernel_i64_scalar, 4, 4, "scalar", 8 };
+#ifdef MATRIX_X86
+    const char *force = getenv("MAT_KERNEL");
+    __builtin_cpu_init();
+    int want_avx512 = !force || strcmp(force, "avx512") == 0;
+    int want_avx2 = !force || strcmp(force, "avx2") == 0 || strcmp(force, "avx512") == 0;
+    if (want_avx512 && __builtin_cpu_supports("avx512f")) {
+        f64 = (GemmKernel){ gemm_kernel_f64_avx512, 8, 16, "avx512", 8 };
+        f32 = (GemmKernel){ gemm_kernel_f32_avx512, 8, 32, "avx512", 4 };
+        i64 = (GemmKernel){ gemm_kernel_i64_avx512, 8, 16, "avx512", 8 };
+    } else if (want_avx2 && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        f64 = (GemmKernel){ gemm_kernel_f64_avx2, 6, 8, "avx2", 8 };
+        f32 = (GemmKernel){ gemm_kernel_f32_avx2, 6, 16, "avx2", 4 };
+        i64 = (GemmKernel){ gemm_kernel_i64_avx2, 4, 8, "avx2", 8 };
+    }
+#endif
+    gemm_i64_kernel = i64;
+    gemm_f32_kernel = f32;
+    gemm_f64_kernel = f64;
+}
+
+// Packing buffers for A and B, allocated once per thread and freed when it exits
+#define GEMM_SCRATCH ((size_t)(GEMM_MC + GEMM_NC + 32) * GEMM_KC * 8)
+
+static pthread_key_t gemm_scratch_key;
+static pthread_once_t gemm_scratch_once = PTHREAD_ONCE_INIT;
+
+static void gemm_scratch_init(void) {
+    pthread_key_create(&gemm_scratch_key, workspace_free);
+}
+
+static char *gemm_scratch(void) {
+    pthread_once(&gemm_scratch_once, gemm_scratch_init);
+    char *scratch = pthread_getspecific(gemm_scratch_key);
+    if (!scratch) {
+        scratch = workspace_alloc(GEMM_SCRATCH);
+        if (scratch && pthread_setspecific(gemm_scratch_key, scratch) != 0) {
+            workspace_free(scratch);
+            scratch = NULL;
+        }
+    }
+    return scratch;
+}
+
+typedef struct {
+    const GemmKernel *kernel;
+    GemmPack pack_a, pack_b;
+    unsigned M, N, K;
+    const char *a, *b;      // source elements, elem_size bytes each
+    size_t lda, ldb, elem_size;
+    char *c;                // result elements, kernel->size bytes each
+    size_t ldc;
+    int accumulate;         // add the product to C rather than replace it
+    unsigned tiles_n;
+    atomic_size_t remaining;
+    atomic_int failed;
+    atomic_int done;
+} GemmJob;
+
+static void gemm_tile_task(PoolTask *task) {
+    GemmJob *job = task->ctx;
+    const GemmKernel *kern = job->kernel;
+    unsigned mr = kern->mr, nr = kern->nr;
+    size_t size = kern->size;
+    unsigned i0 = task->a / job->tiles_n * GEMM_MC, j0 = task->a % job->tiles_n * GEMM_NC;
+    unsigned mc = job->M - i0 < GEMM_MC ? job->M - i0 : GEMM_MC;
+    unsigned nc = job->N - j0 < GEMM_NC ? job->N - j0 : GEMM_NC;
+    unsigned mc_pad = (mc + mr - 1) / mr * mr, nc_pad = (nc + nr - 1) / nr * nr;
+
+    MatrixTraceScope scope = matrix_trace_begin("gemm.tile");
+    char *ap = gemm_scratch();
+    if (!ap) {
+        atomic_store(&job->failed, 1);
+    } else {
+        // A strips first, padded to a whole number of 64-byte lines
+        char *bp = ap + (size_t)(GEMM_MC + 16) * GEMM_KC * size;
+        char *c = job->c + ((size_t)i0 * job->ldc + j0) * size;
+        if (!job->accumulate)
+            for (unsigned i = 0; i < mc; i++) memset(c + (size_t)i * job->ldc * size, 0, (size_t)nc * size);
+
+        _Alignas(64) char edge[GEMM_MAX_TILE];
+        for (unsigned p0 = 0; p0 < job->K; p0 += GEMM_KC) {
+            unsigned kc = job->K - p0 < GEMM_KC ? job->K - p0 : GEMM_KC;
+            job->pack_b(job->b + ((size_t)p0 * job->ldb + j0) * job->elem_size, job->ldb,
+                        kc, nc, nr, bp);
+            job->pack_a(job->a + ((size_t)i0 * job->lda + p0) * job->elem_size, job->lda,
+                        mc, kc, mr, ap);
+            for (unsigned jr = 0; jr < nc_pad; jr += nr) {
+                const char *bs = bp + (size_t)jr * kc * size;
+                unsigned w = nc - jr < nr ? nc - jr : nr;
+                for (unsigned ir = 0; ir < mc_pad; ir += mr) {
+                    const char *as = ap + (size_t)ir * kc * size;
+                    char *cs = c + ((size_t)ir * job->ldc + jr) * size;
+                    unsigned h = mc - ir < mr ? mc - ir : mr;
+                    if (h == mr && w == nr) {
+                        kern->kernel(kc, as, bs, cs, job->ldc);
+                        continue;
+                    }
+                    // Partial tile: run the kernel on a copy padded to full size
+                    memset(edge, 0, sizeof(edge));
+                    for (unsigned i = 0; i < h; i++)
+                        memcpy(edge + (size_t)i * nr * size, cs + (size_t)i * job->ldc * size, (size_t)w * size);
+                    kern->kernel(kc, as, bs, edge, nr);
+                    for (unsigned i = 0; i < h; i++)
+                        memcpy(cs + (size_t)i * job->ldc * size, edge + (size_t)i * nr * size, (size_t)w * size);
+                }
+            }
+        }
+    }
+    matrix_trace_end(scope, ((uint64_t)mc + nc) * job->K * job->elem_size, 2.0 * mc * nc * job->K);
+    if (atomic_fetch_sub(&job->remaining, 1) == 1)
+        pool_signal_done(&job->done);
+}
+
+static int gemm_run(GemmJob *job) {
+    if (job->M == 0 || job->N == 0) return 0;
+    unsigned tiles_m = (job->M + GEMM_MC - 1) / GEMM_MC;
+    job->tiles_n = (job->N + GEMM_NC - 1) / GEMM_NC;
+    size_t tiles = (size_t)tiles_m * job->tiles_n;
+    atomic_init(&job->remaining, tiles);
+    atomic_init(&job->failed, 0);
+    atomic_init(&job->done, 0);
+    for (size_t t = 0; t < tiles; t++) {
+        PoolTask task = { gemm_tile_task, job, 0, (unsigned)t, 0, 0 };
+        pool_push(&task);
+    }
+    pool_wait(&job->done);
+    return atomic_load(&job->failed) ? -1 : 0;
+}
+
+// C (M x N) = A (M x K) * B (K x N), all row-major doubles. Returns 0, or -1
+// if out of memory.
+int gemm_f64(unsigned M, unsigned N, unsigned K, const double *a, size_t lda,
+             const double *b, size_t ldb, double *c, size_t ldc) {
+    gemm_select_kernels();
+    GemmJob job = { &gemm_f64_kernel, gemm_pack_rows_f64, gemm_pack_cols_f64, M, N, K,
+                    (const char *)a, (const char *)b, lda, ldb, sizeof(double), (char *)c, ldc };
+    return gemm_run(&job);
+}
+
+// C (M x N) -= A (M x K) * B (K x N), all row-major doubles. Returns 0, or
+// -1 if out of memory.
+static int gemm_f64_sub(unsigned M, unsigned N, unsigned K, const double *a, size_t lda,
+                        const double *b, size_t ldb, double *c, size_t ldc) {
+    gemm_select_kernels();
+    GemmJob job = { &gemm_f64_kernel, gemm_pack_rows_f64_neg, gemm_pack_cols_f64, M, N, K,
+                    (const char *)a, (const char *)b, lda, ldb, sizeof(double), (char *)c, ldc, 1 };
+    return gemm_run(&job);
+}
+
+// C (M x N) = A (M x K) * B (K x N), all row-major floats, accumulated in
+// float. Returns 0, or -1 if out of memory.
+static int gemm_f32(unsigned M, unsigned N, unsigned K, const float *a, size_t lda,
+                    const float *b, size_t ldb, float *c, size_t ldc) {
+    gemm_select_kernels();
+    GemmJob job = { &gemm_f32_kernel, gemm_pack_rows_f32, gemm_pack_cols_f32, M, N, K,
+                    (const char *)a, (const char *)b, lda, ldb, sizeof(float), (char *)c, ldc };
+    return gemm_run(&job);
+}
+
+// C (M x N, int64) = A (M x K) * B (K x N) over int elements, exact as long
+// as every sum stays within int64
+int gemm_i32(unsigned M, unsigned N, unsigned K, const int *a, size_t lda,
+             const int *b, size_t ldb, int64_t *c, size_t ldc) {
+    gemm_select_kernels();
+    GemmJob job = { &gemm_i64_kernel, gemm_pack_rows_i32, gemm_pack_cols_i32, M, N, K,
+                    (const char *)a, (const char *)b, lda, ldb, sizeof(int), (char *)c, ldc };
+    return gemm_run(&job);
+}
+
+// Product of two dense float32 operands, multiplied in float32 straight from
+// their elements
+static Matrix *matrix_multiply_floats(const Matrix *a, const Matrix *b) {
+    float *data = workspace_alloc((size_t)a->M * b->N * sizeof(float));
+    if (!data || gemm_f32(a->M, b->N, a->N, a->data, a->N, b->data, b->N, data, b->N) != 0) {
+        workspace_free(data);
+        snprintf(matrix_io_error, sizeof(matrix_io_error), "out of memory");
+        return NULL;
+    }
+    Matrix *product = matrix_wrap(a->M, b->N, MATRIX_FLOAT32, data, NULL);
+    if (!product) snprintf(matrix_io_error, sizeof(matrix_io_error), "out of memory");
+    return product;
+}
+
+// Product of other dense operands, one of them not int32, through the double
+// GEMM. Integer operands give an int64 product, exact as long as every
+// partial sum stays within 2^53; otherwise the product is float64.
+static Matrix *matrix_multiply_doubles(const Matrix *a, const Matrix *b) {
+    int integer = matrix_type_is_integer(a->type) && matrix_type_is_integer(b->type);
+    MatrixType type = integer ? MATRIX_INT64 : MATRIX_FLOAT64;
+    size_t count = (size_t)a->M * b->N, mark = scratch_mark();
+    double *da = scratch_alloc((size_t)a->M * a->N * sizeof(double));
+    double *db = da ? scratch_alloc((size_t)b->M * b->N * sizeof(double)) : NULL;
+    double *dc = db ? scratch_alloc(count * sizeof(double)) : NULL;
+    void *data = workspace_alloc(count * matrix_types[type].size);
+    Matrix *product = NULL;
+    if (!da || !db || !dc || !data) {
+        snprintf(matrix_io_error, sizeof(matrix_io_error), "out of memory");
+        goto out;
+    }
+    matrix_to_doubles(a, da);
+    matrix_to_doubles(b, db);
+    if (integer) {
+        double max_a = 0.0, max_b = 0.0;
+        for (size_t i = 0; i < (size_t)a->M * a->N; i++) max_a = fmax(max_a, fabs(da[i]));
+        for (size_t i = 0; i < (size_t)b->M * b->N; i++) max_b = fmax(max_b, fabs(db[i]));
+        if ((double)a->N * max_a * max_b >= 0x1p53) {
+            snprintf(matrix_io_error, sizeof(matrix_io_error), "elements too large to multiply exactly");
+            goto out;
+        }
+    }
+    if (gemm_f64(a->M, b->N, a->N, da, a->N, db, b->N, dc, b->N) != 0) {
+        snprintf(matrix_io_error, sizeof(matrix_io_error), "out of memory");
+        goto out;
+    }
+    matrix_types[type].from_doubles(dc, count, data);
+    product = matrix_wrap(a->M, b->N, type, data, NULL);
+    data = NULL;
+    if (!product) snprintf(matrix_io_error, sizeof(matrix_io_error), "out of memory");
+
+out:
+    scratch_pop(mark);
+    workspace_free(data);
+    return product;
+}
+
+// matrix_multiply() without the op timing
+static Matrix *multiply(const Matrix *a, const Matrix *b) {
+    if (a->N != b->M) {
+        snprintf(matrix_io_error, sizeof(matrix_io_error),
+                 "cannot multiply %ux%u by %ux%u", a->M, a->N, b->M, b->N);
+        return NULL;
+    }
+    if (a->csr || b->csr) {
+        // The GEMM kernels read dense operands
+        Matrix *dense_a = matrix_dense_copy(a), *dense_b = matrix_dense_copy(b);
+        Matrix *product = dense_a && dense_b ? multiply(dense_a, dense_b) : NULL;
+        if (!dense_a || !dense_b) snprintf(matrix_io_error, sizeof(matrix_io_error), "out of memory");
+        free_matrix(dense_a);
+        free_matrix(dense_b);
+        return product;
+    }
+    if (a->type == MATRIX_FLOAT32 && b->type == MATRIX_FLOAT32) return matrix_multiply_floats(a, b);
+    if (a->type != MATRIX_INT32 || b->type != MATRIX_INT32) return matrix_multiply_doubles(a, b);
+
+    // |c_ij| <= K * max|a| * max|b|; past int64 the kernels would wrap
+    const int *ad = a->data, *bd = b->data;
+    double max_a = 0.0, max_b = 0.0;
+    for (size_t i = 0; i < (size_t)a->M * a->N; i++) max_a = fmax(max_a, fabs((double)ad[i]));
+    for (size_t i = 0; i < (size_t)b->M * b->N; i++) max_b = fmax(max_b, fabs((double)bd[i]));
+    if ((double)a->N * max_a * max_b >= 0x1p63) {
+        snprintf(matrix_io_error, sizeof(matrix_io_error), "elements too large to multiply exactly");
+        return NULL;
+    }
+
+    size_t count = (size_t)a->M * b->N;
+    int64_t *wide = workspace_alloc(count * sizeof(int64_t));
+    int *data = workspace_alloc(count * sizeof(int));
+    if (!wide || !data || gemm_i32(a->M, b->N, a->N, ad, a->N, bd, b->N, wide, b->N) != 0) {
+        workspace_free(wide);
+        workspace_free(data);
+        snprintf(matrix_io_error, sizeof(matrix_io_error), "out of memory");
+        return NULL;
+    }
+    size_t i = 0;
+    for (; i < count && wide[i] >= INT_MIN && wide[i] <= INT_MAX; i++)
+        data[i] = (int)wide[i];
+    Matrix *product;
+    if (i < count) {
+        // Too large for int32: keep the exact int64 product
+        workspace_free(data);
+        product = matrix_wrap(a->M, b->N, MATRIX_INT64, wide, NULL);
+    } else {
+        workspace_free(wide);
+        product = matrix_wrap(a->M, b->N, MATRIX_INT32, data, NULL);
+    }
+    if (!product) snprintf(matrix_io_error, sizeof(matrix_io_error), "out of memory");
+    return product;
+}
+
+// Product a * b as a new unnamed matrix. Two int32 operands multiply exactly
+// into int32, or into int64 when an element of the product needs it, and two
+// float32 ones in float32; see matrix_multiply_doubles for the other types.
+// NULL if the shapes do not match, the elements are too large to multiply
+// exactly or memory runs out; the reason is in matrix_last_error().
+Matrix *matrix_multiply(const Matrix *a, const Matrix *b) {
+    MatrixTraceScope op = op_begin("multiply");
+    Matrix *product = multiply(a, b);
+    uint64_t elements = (uint64_t)a->M * a->N + (uint64_t)b->M * b->N + (uint64_t)a->M * b->N;
+    op_end(op, elements * sizeof(double), 2.0 * a->M * b->N * a->N);
+    return product;
+}
+
+// Out-of-core LU
+//
+// A .mattile file holds a float64 matrix too large for memory as square
+// tiles, each tile x tile elements, row-major and zero-padded at the edges.
+// After a 64-byte header they are in column-major tile order, tile (I, J)
+// being number J * tile_rows + I, so the tiles of a block column are
+// contiguous.
+//
+// matrix_tiled_det() factors such a matrix left-looking, one panel of
+// block columns at a time, panels as wide as the memory budget allows.
+// Panel J is loaded whole and brought up to date by each earlier panel K in
+// turn: K's row swaps, then a triangular solve and GEMM update with K's L
+// factor, streamed one tile row at a time. Then the panel is factored in
+// memory with partial pivoting over all its rows, and its L factor is
+// appended to an unlinked scratch file, rows contiguous. A reader thread
+// fetches the next tile row of L while the current one updates the panel,
+// so the reads overlap the GEMMs. An L factor keeps its rows in the order
+// of its own panel's pivots; later swaps are applied to the panels it
+// updates instead, which is all the determinant needs and saves rewriting
+// earlier panels. With n rows and B bytes a panel is about B / (8 n)
+// columns wide, so the I/O is O(n^3 / panel width) against O(n^3) flops.
+#define TILE_MAGIC "MATTILES"
+#define TILE_VERSION 1
+#define TILE_MIN 8
+#define TILE_MAX 4096
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t rows;
+    uint32_t cols;
+    uint32_t tile;
+    uint32_t elem_type;     // MATB_FLOAT64
+    uint8_t reserved[32];
+} TileHeader;
+
+_Static_assert(sizeof(TileHeader) == 64, "TileHeader layout");
+
+static int pread_full(int fd, void *buf, size_t size, uint64_t offset) {
+    for (char *p = buf; size > 0; ) {
+        ssize_t got = pread(fd, p, size, (off_t)offset);
+        if (got <= 0) {
+            if (got < 0 && errno == EINTR) continue;
+            return -1;
+        }
+        p += got;
+        size -= (size_t)got;
+        offset += (uint64_t)got;
+    }
+    return 0;
+}
+
+static int pwrite_full(int fd, const void *buf, size_t size, uint64_t offset) {
+    for (const char *p = buf; size > 0; ) {
+        ssize_t put = pwrite(fd, p, size, (off_t)offset);
+        if (put <= 0) {
+            if (put < 0 && errno == EINTR) continue;
+            return -1;
+        }
+        p += put;
+        size -= (size_t)put;
+        offset += (uint64_t)put;
+    }
+    return 0;
+}
+
+static inline unsigned tiled_count(unsigned n, unsigned tile) {
+    return n / tile + (n % tile != 0);
+}
+
+static inline uint64_t tiled_offset(const MatrixTiled *t, unsigned I, unsigned J) {
+    return sizeof(TileHeader) + ((uint64_t)J * tiled_count(t->rows, t->tile) + I) * t->tile * t->tile * sizeof(double);
+}
+
+int is_matrix_tiled_file(const char *path) {
+    char magic[8];
+    FILE *file = fopen(path, "rb");
+    if (!file) return 0;
+    int match = fread(magic, 1, sizeof(magic), file) == sizeof(magic) &&
+                memcmp(magic, TILE_MAGIC, sizeof(magic)) == 0;
+    fclose(file);
+    return match;
+}
+
+// Create a rows x cols .mattile file of zeros with tile x tile tiles, tile
+// a multiple of 8. Returns 0, or -1 with the reason in matrix_last_error().
+int matrix_tiled_create(const char *path, unsigned rows, unsigned cols, unsigned tile,
+                        MatrixTiled *tiled) {
+    if (tile < TILE_MIN || tile > TILE_MAX || tile % 8 != 0 || rows == 0 || cols == 0) {
+        snprintf(matrix_io_error, sizeof(matrix_io_error),
+                 "%s: tiles must be a multiple of 8 from %d to %d", path, TILE_MIN, TILE_MAX);
+        return -1;
+    }
+    TileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TILE_MAGIC, sizeof(header.magic));
+    header.version = TILE_VERSION;
+    header.byte_order = MATB_BYTE_ORDER;
+    header.rows = rows;
+    header.cols = cols;
+    header.tile = tile;
+    header.elem_type = MATB_FLOAT64;
+
+    tiled->rows = rows;
+    tiled->cols = cols;
+    tiled->tile = tile;
+    tiled->path = strdup(path);
+    tiled->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    // The tiles start out as a hole, read back as zeros
+    uint64_t size = tiled_offset(tiled, 0, tiled_count(cols, tile));
+    if (!tiled->path || tiled->fd < 0 || pwrite_full(tiled->fd, &header, sizeof(header), 0) != 0 ||
+        ftruncate(tiled->fd, (off_t)size) != 0) {
+        snprintf(matrix_io_error, sizeof(matrix_io_error), "%s: cannot create file", path);
+        if (tiled->fd >= 0) {
+            close(tiled->fd);
+            unlink(path);
+        }
+        free(tiled->path);
+        tiled->path = NULL;
+        tiled->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+// Open a .mattile file for reading and writing. Returns 0, or -1 with the
+// reason in matrix_last_error().
+int matrix_tiled_open(const char *path, MatrixTiled *tiled) {
+    TileHeader header;
+    struct stat st;
+    tiled->fd = open(path, O_RDWR);
+    if (tiled->fd < 0) {
+        snprintf(matrix_io_error, sizeof(matrix_io_error), "%s: cannot open file", path);
+        return -1;
+    }
+    int valid = pread_full(tiled->fd, &header, sizeof(header), 0) == 0 && fstat(tiled->fd, &st) == 0 &&
+                memcmp(header.magic, TILE_MAGIC, sizeof(header.magic)) == 0 &&
+                header.version == TILE_VERSION && header.byte_order == MATB_BYTE_ORDER &&
+                header.elem_type == MATB_FLOAT64 && header.rows && header.cols &&
+                header.tile >= TILE_MIN && header.tile <= TILE_MAX && header.tile % 8 == 0;
+    if (valid) {
+        tiled->rows = header.rows;
+        tiled->cols = header.cols;
+        tiled->tile = header.tile;
+        valid = (uint64_t)st.st_size >= tiled_offset(tiled, 0, tiled_count(tiled->cols, tiled->tile));
+    }
+    tiled->path = valid ? strdup(path) : NULL;
+    if (!tiled->path) {
+        snprintf(matrix_io_error, sizeof(matrix_io_error),
+                 valid ? "out of memory" : "%s: not a valid tiled matrix", path);
+        close(tiled->fd);
+        tiled->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+// Close the file, making what was written durable. Returns 0, or -1 if the
+// writes could not be completed.
+int matrix_tiled_close(MatrixTiled *tiled) {
+    int status = 0;
+    if (tiled->fd >= 0 && (fsync(tiled->fd) != 0 || close(tiled->fd) != 0)) status = -1;
+    free(tiled->path);
+    tiled->path = NULL;
+    tiled->fd = -1;
+    return status;
+}
+
+// Write count rows of cols doubles each from rows, starting at row0. Whole
+// tiles are written, so row0 must start a tile row and count must end one
+// or reach the last row. Returns 0, or -1 with the reason in
+// matrix_last_error().
+int matrix_tiled_write_rows(MatrixTiled *tiled, unsigned row0, unsigned count, const double *rows) {
+    unsigned t = tiled->tile;
+    if (row0 % t != 0 || row0 > tiled->rows || count > tiled->rows - row0 ||
+        (count % t != 0 && row0 + count != tiled->rows)) {
+        snprintf(matrix_io_error, sizeof(matrix_io_error), "%s: rows %u to %u are not whole tile rows",
+                 tiled->path, row0, row0 + count);
+        return -1;
+    }
+    double *buf = workspace_alloc((size_t)t * t * sizeof(double));
+    if (!buf) {
+        snprintf(matrix_io_error, sizeof(matrix_io_error), "out of memory");
+        return -1;
+    }
+    int status = 0;
+    for (unsigned r0 = 0; status == 0 && r0 < count; r0 += t) {
+        unsigned h = count - r0 < t ? count - r0 : t;
+        for (unsigned J = 0; status == 0 && J < tiled_count(tiled->cols, t); J++) {
+            unsigned c0 = J * t, w = tiled->cols - c0 < t ? tiled->cols - c0 : t;
+            memset(buf, 0, (size_t)t * t * sizeof(double));
+            for (unsigned i = 0; i < h; i++)
+                memcpy(buf + (size_t)i * t, rows + (size_t)(r0 + i) * tiled->cols + c0, w * sizeof(double));
+            status = pwrite_full(tiled->fd, buf, (size_t)t * t * sizeof(double),
+                                 tiled_offset(tiled, (row0 + r0) / t, J));
+        }
+    }
+    workspace_free(buf);
+    if (status != 0) snprintf(matrix_io_error, sizeof(matrix_io_error), "%s: cannot write file", tiled->path);
+    return status;
+}
+
+// Read count rows of cols doubles each into rows, starting at row0.
+// Returns 0, or -1 with the reason in matrix_last_error().
+int matrix_tiled_read_rows(const MatrixTiled *tiled, unsigned row0, unsigned count, double *rows) {
+    unsigned t = tiled->tile;
+    if (row0 > tiled->rows || count > tiled->rows - row0) {
+        snprintf(matrix_io_error, sizeof(matrix_io_error), "%s: rows %u to %u are out of range",
+                 tiled->path, row0, row0 + count);
+        return -1;
+    }
+    double *buf = workspace_alloc((size_t)t * t * sizeof(double));
+    if (!buf) {
+        snprintf(matrix_io_error, sizeof(matrix_io_error), "out of memory");
+        return -1;
+    }
+    int status = 0;
+    for (unsigned r = row0; status == 0 && r < row0 + count; ) {
+        unsigned I = r / t, first = r % t;
+        unsigned h = t - first < row0 + count - r ? t - first : row0 + count - r;
+        for (unsigned J = 0; status == 0 && J < tiled_count(tiled->cols, t); J++) {
+            unsigned c0 = J * t, w = tiled->cols - c0 < t ? tiled->cols - c0 : t;
+            status = pread_full(tiled->fd, buf, (size_t)t * t * sizeof(double), tiled_offset(tiled, I, J));
+            for (unsigned i = 0; status == 0 && i < h; i++)
+                memcpy(rows + (size_t)(r - row0 + i) * tiled->cols + c0, buf + (size_t)(first + i) * t,
+                       w * sizeof(double));
+        }
+        r += h;
+    }
+    workspace_free(buf);
+    if (status != 0) snprintf(matrix_io_error, sizeof(matrix_io_error), "%s: cannot read file", tiled->path);
+    return status;
+}
+
+// Reads on a thread of their own, one request at a time, so the caller can
+// compute on one buffer while the next is filled
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int fd;
+    void *buf;
+    size_t size;
+    uint64_t offset;
+    int pending;            // a request is waiting or being read
+    int status;             // of the last read
+    int stop;
+} OocReader;
+
+static void *ooc_reader_main(void *arg) {
+    OocReader *r = arg;
+    pthread_mutex_lock(&r->lock);
+    for (;;) {
+        while (!r->pending && !r->stop) pthread_cond_wait(&r->cond, &r->lock);
+        if (r->stop) break;
+        pthread_mutex_unlock(&r->lock);
+        MatrixTraceScope scope = matrix_trace_begin("ooc.read");
+        int status = pread_full(r->fd, r->buf, r->size, r->offset);
+        matrix_trace_end(scope, r->size, 0.0);
+        pthread_mutex_lock(&r->lock);
+        r->status = status;
+        r->pending = 0;
+        pthread_cond_broadcast(&r->cond);
+    }
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+static void ooc_reader_request(OocReader *r, void *buf, size_t size, uint64_t offset) {
+    pthread_mutex_lock(&r->lock);
+    r->buf = buf;
+    r->size = size;
+    r->offset = offset;
+    r->pending = 1;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+}
+
+// Wait for the request in flight; returns its status
+static int ooc_reader_wait(OocReader *r) {
+    pthread_mutex_lock(&r->lock);
+    while (r->pending) pthread_cond_wait(&r->cond, &r->lock);
+    int status = r->status;
+    pthread_mutex_unlock(&r->lock);
+    return status;
+}
+
+typedef struct {
+    const MatrixTiled *a;
+    unsigned n, tile;
+    unsigned width;         // panel width, a multiple of tile
+    double *panel;          // n x width, row-major
+    double *chunk[2];       // tile x width rows of an L factor
+    double *stage;          // one tile
+    unsigned *piv;          // row swapped with each row, global
+    int scratch;            // L factor of each finished panel, rows k0..n
+    OocReader reader;
+    MatrixProgress *progress;
+} OocLu;
+
+// Scratch file offset of the L factor of panel k
+static inline uint64_t ooc_l_offset(const OocLu *lu, unsigned k) {
+    uint64_t rows = 0;
+    for (unsigned p = 0; p < k; p++) rows += lu->n - p * lu->width;
+    return rows * lu->width * sizeof(double);
+}
+
+// Columns j0..j0+jw of the matrix into the panel
+static int ooc_load_panel(OocLu *lu, unsigned j0, unsigned jw) {
+    MatrixTraceScope scope = matrix_trace_begin("ooc.load");
+    unsigned t = lu->tile;
+    int status = 0;
+    for (unsigned J = j0 / t; status == 0 && J * t < j0 + jw; J++) {
+        unsigned c0 = J * t - j0, w = jw - c0 < t ? jw - c0 : t;
+        for (unsigned I = 0; status == 0 && I * t < lu->n; I++) {
+            unsigned h = lu->n - I * t < t ? lu->n - I * t : t;
+            status = pread_full(lu->a->fd, lu->stage, (size_t)t * t * sizeof(double),
+                                tiled_offset(lu->a, I, J));
+            for (unsigned i = 0; status == 0 && i < h; i++)
+                memcpy(lu->panel + (size_t)(I * t + i) * lu->width + c0, lu->stage + (size_t)i * t,
+                       w * sizeof(double));
+        }
+    }
+    matrix_trace_end(scope, (uint64_t)lu->n * jw * sizeof(double), 0.0);
+    return status;
+}
+
+// Rows r0..r0+h of the panel, the diagonal block of L factor chunk l
+// starting at column d: solve the unit lower triangle in LU_BLOCK steps, each
+// updating the rows below it with a GEMM
+static int ooc_solve_diagonal(OocLu *lu, const double *l, unsigned d, unsigned r0, unsigned h,
+                              unsigned jw) {
+    size_t ld = lu->width;
+    double *b = lu->panel + (size_t)r0 * ld;
+    for (unsigned b0 = 0; b0 < h; b0 += LU_BLOCK) {
+        unsigned bb = h - b0 < LU_BLOCK ? h - b0 : LU_BLOCK;
+        for (unsigned i = b0 + 1; i < b0 + bb; i++) {
+            double *row = b + (size_t)i * ld;
+            for (unsigned p = b0; p < i; p++) {
+                double f = l[(size_t)i * ld + d + p];
+                const double *src = b + (size_t)p * ld;
+                for (unsigned c = 0; c < jw; c++)
+                    row[c] -= f * src[c];
+            }
+        }
+        if (b0 + bb < h &&
+            gemm_f64_sub(h - b0 - bb, jw, bb, l + (size_t)(b0 + bb) * ld + d + b0, ld,
+                         b + (size_t)b0 * ld, ld, b + (size_t)(b0 + bb) * ld, ld) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+// Factor the rows x cols panel at a, ld elements per row, with partial
+// pivoting over all its rows: LU_BLOCK columns unblocked, then their swaps
+// and solve across the rest and a GEMM update of the trailing part. Returns
+// 0, 1 if a pivot column is exactly zero, or -1 if out of memory.
+static int ooc_factor_panel(double *a, size_t ld, unsigned rows, unsigned cols, unsigned *piv) {
+    MatrixTraceScope scope = matrix_trace_begin("ooc.factor");
+    int status = 0;
+    for (unsigned k0 = 0; status == 0 && k0 < cols; k0 += LU_BLOCK) {
+        unsigned kb = cols - k0 < LU_BLOCK ? cols - k0 : LU_BLOCK, c1 = k0 + kb;
+        if (lu_factor_panel(a, ld, rows, k0, kb, piv) != 0) {
+            status = 1;
+            break;
+        }
+        lu_apply_swaps(a, (unsigned)ld, piv, k0, c1, 0, k0);
+        lu_apply_swaps(a, (unsigned)ld, piv, k0, c1, c1, cols - c1);
+        lu_solve_block_row(a, (unsigned)ld, k0, kb, c1, cols - c1);
+        if (gemm_f64_sub(rows - c1, cols - c1, kb, a + (size_t)c1 * ld + k0, ld,
+                         a + (size_t)k0 * ld + c1, ld, a + (size_t)c1 * ld + c1, ld) != 0)
+            status = -1;
+    }
+    matrix_trace_end(scope, 0, (double)rows * cols * cols - (double)cols * cols * cols / 3);
+    return status;
+}
+
+// Bring panel j (columns j0..j0+jw) up to date with every earlier panel,
+// streaming their L factors a tile row at a time with the next one in flight
+static int ooc_update_panel(OocLu *lu, unsigned j, unsigned jw) {
+    unsigned t = lu->tile, n = lu->n, w = lu->width, tiles = tiled_count(n, t);
+    if (j == 0) return 0;
+    unsigned k = 0, I = 0, next_k = 0, next_I = 0, cur = 0;
+    ooc_reader_request(&lu->reader, lu->chunk[0], (size_t)(n - I * t < t ? n - I * t : t) * w * sizeof(double),
+                       ooc_l_offset(lu, 0));
+    for (;;) {
+        if (ooc_reader_wait(&lu->reader) != 0) return -1;
+        unsigned r0 = I * t, h = n - r0 < t ? n - r0 : t, k0 = k * w;
+        // The next tile row: of this L factor, or the first of the next one
+        next_k = k;
+        next_I = I + 1;
+        if (next_I == tiles) {
+            next_k = k + 1;
+            next_I = next_k * w / t;
+        }
+        if (next_k < j) {
+            unsigned nr0 = next_I * t, nh = n - nr0 < t ? n - nr0 : t;
+            ooc_reader_request(&lu->reader, lu->chunk[cur ^ 1], (size_t)nh * w * sizeof(double),
+                               ooc_l_offset(lu, next_k) + (uint64_t)(nr0 - next_k * w) * w * sizeof(double));
+        }
+
+        MatrixTraceScope scope = matrix_trace_begin("ooc.update");
+        const double *l = lu->chunk[cur];
+        int status = 0;
+        if (r0 == k0) lu_apply_swaps(lu->panel, w, lu->piv, k0, k0 + w, 0, jw);
+        double *row = lu->panel + (size_t)r0 * w, *u = lu->panel + (size_t)k0 * w;
+        double depth = r0 < k0 + w ? r0 - k0 + h / 2.0 : w;
+        if (r0 < k0 + w) {
+            // Within the diagonal block: the rows of U solved so far, then this block's triangle
+            status = gemm_f64_sub(h, jw, r0 - k0, l, w, u, w, row, w) != 0 ||
+                     ooc_solve_diagonal(lu, l, r0 - k0, r0, h, jw) != 0 ? -1 : 0;
+        } else {
+            status = gemm_f64_sub(h, jw, w, l, w, u, w, row, w);
+        }
+        matrix_trace_end(scope, (uint64_t)h * w * sizeof(double), 2.0 * h * jw * depth);
+        if (status != 0) {
+            if (next_k < j) ooc_reader_wait(&lu->reader);
+            return -1;
+        }
+        if (lu->progress) {
+            atomic_fetch_add(&lu->progress->done, 1);
+            if (atomic_load(&lu->progress->cancel)) {
+                if (next_k < j) ooc_reader_wait(&lu->reader);
+                return -2;
+            }
+        }
+        if (next_k == j) return 0;
+        k = next_k;
+        I = next_I;
+        cur ^= 1;
+    }
+}
+
+// Determinant of a square tiled matrix through an out-of-core LU that holds
+// at most about memory bytes (0: half the physical memory). progress, if
+// given, counts tile rows of L streamed and panels factored and can cancel.
+// The result is given as a sign and log|det|, since large determinants
+// overflow a double. Returns 0, -2 if cancelled, or -1 with the reason in
+// matrix_last_error().
+int matrix_tiled_det(const MatrixTiled *a, size_t memory, MatrixProgress *progress, MatrixLogDet *out) {
+    out->sign = 0;
+    out->log_abs = -INFINITY;
+    if (a->rows != a->cols) {
+        snprintf(matrix_io_error, sizeof(matrix_io_error), "%s: %ux%u is not square",
+                 a->path, a->rows, a->cols);
+        return -1;
+    }
+    if (memory == 0) memory = (size_t)sysconf(_SC_PHYS_PAGES) * (size_t)sysconf(_SC_PAGESIZE) / 2;
+
+    // A panel of n rows, two tile rows of L and a staging tile
+    OocLu lu = { .a = a, .n = a->rows, .tile = a->tile, .scratch = -1, .progress = progress };
+    unsigned t = lu.tile, n = lu.n, tiles = tiled_count(n, t);
+    size_t words = memory / sizeof(double), per_tile = ((size_t)n + 2 * t) * t;
+    size_t fit = words > (size_t)t * t ? (words - (size_t)t * t) / per_tile : 0;
+    if (fit == 0) {
+        snprintf(matrix_io_error, sizeof(matrix_io_error),
+                 "%s: a memory budget of %.1f MB is below the %.1f MB a panel needs", a->path,
+                 memory / 1e6, (per_tile + (size_t)t * t) * sizeof(double) / 1e6);
+        return -1;
+    }
+    lu.width = (fit < tiles ? (unsigned)fit : tiles) * t;
+    unsigned panels = tiled_count(n, lu.width), w = lu.width;
+    MatrixTraceScope op = op_begin("det_ooc");
+
+    int status = -1;
+    char *scratch_path = malloc(strlen(a->path) + 16);
+    lu.panel = workspace_alloc((size_t)n * w * sizeof(double));
+    lu.chunk[0] = workspace_alloc((size_t)t * w * sizeof(double));
+    lu.chunk[1] = workspace_alloc((size_t)t * w * sizeof(double));
+    lu.stage = workspace_alloc((size_t)t * t * sizeof(double));
+    lu.piv = malloc(n * sizeof(unsigned));
+    int reader_started = 0;
+    if (!scratch_path || !lu.panel || !lu.chunk[0] || !lu.chunk[1] || !lu.stage || !lu.piv) {
+        snprintf(matrix_io_error, sizeof(matrix_io_error), "out of memory");
+        goto out;
+    }
+    // Next to the matrix, which is on storage with room for it
+    sprintf(scratch_path, "%s.lu.XXXXXX", a->path);
+    lu.scratch = mkstemp(scratch_path);
+    if (lu.scratch < 0) {
+        snprintf(matrix_io_error, sizeof(matrix_io_error), "%s: cannot create scratch file", scratch_path);
+        goto out;
+    }
+    unlink(scratch_path);
+
+    pthread_mutex_init(&lu.reader.lock, NULL);
+    pthread_cond_init(&lu.reader.cond, NULL);
+    lu.reader.fd = lu.scratch;
+    if (pthread_create(&lu.reader.thread, NULL, ooc_reader_main, &lu.reader) != 0) {
+        snprintf(matrix_io_error, sizeof(matrix_io_error), "cannot start reader thread");
+        goto out;
+    }
+    reader_started = 1;
+
+    if (progress) {
+        uint64_t total = panels;
+        for (unsigned j = 1; j < panels; j++)
+            for (unsigned k = 0; k < j; k++)
+                total += tiles - k * w / t;
+        atomic_store(&progress->done, 0);
+        atomic_store(&progress->total, total > UINT_MAX ? UINT_MAX : (unsigned)total);
+    }
+
+    int sign = 1;
+    double log_abs = 0.0;
+    for (unsigned j = 0; j < panels; j++) {
+        unsigned j0 = j * w, jw = n - j0 < w ? n - j0 : w;
+        if (ooc_load_panel(&lu, j0, jw) != 0) {
+            snprintf(matrix_io_error, sizeof(matrix_io_error), "%s: cannot read file", a->path);
+            goto out;
+        }
+        int update = ooc_update_panel(&lu, j, jw);
+        if (update != 0) {
+            if (update == -2) status = -2;
+            else snprintf(matrix_io_error, sizeof(matrix_io_error), "%s: cannot read scratch file", a->path);
+            goto out;
+        }
+
+        int factor = ooc_factor_panel(lu.panel + (size_t)j0 * w, w, n - j0, jw, lu.piv + j0);
+        if (factor < 0) {
+            snprintf(matrix_io_error, sizeof(matrix_io_error), "out of memory");
+            goto out;
+        }
+        if (factor > 0) {
+            sign = 0;       // an exactly zero pivot column: singular
+            break;
+        }
+        for (unsigned i = j0; i < j0 + jw; i++) {
+            double u = lu.panel[(size_t)i * w + (i - j0)];
+            lu.piv[i] += j0;
+            if ((lu.piv[i] != i) != (u < 0)) sign = -sign;
+            log_abs += log(fabs(u));
+        }
+
+        if (j + 1 < panels) {
+            MatrixTraceScope scope = matrix_trace_begin("ooc.write");
+            size_t bytes = (size_t)(n - j0) * w * sizeof(double);
+            int written = pwrite_full(lu.scratch, lu.panel + (size_t)j0 * w, bytes, ooc_l_offset(&lu, j));
+            matrix_trace_end(scope, bytes, 0.0);
+            if (written != 0) {
+                snprintf(matrix_io_error, sizeof(matrix_io_error), "%s: cannot write scratch file", a->path);
+                goto out;
+            }
+        }
+        if (progress) atomic_fetch_add(&progress->done, 1);
+    }
+    out->sign = sign;
+    out->log_abs = sign ? log_abs : -INFINITY;
+    status = 0;
+
+out:
+    if (reader_started) {
+        pthread_mutex_lock(&lu.reader.lock);
+        lu.reader.stop = 1;
+        pthread_cond_broadcast(&lu.reader.cond);
+        pthread_mutex_unlock(&lu.reader.lock);
+        pthread_join(lu.reader.thread, NULL);
+    }
+    if (lu.scratch >= 0) {
+        pthread_mutex_destroy(&lu.reader.lock);
+        pthread_cond_destroy(&lu.reader.cond);
+        close(lu.scratch);
+    }
+    free(scratch_path);
+    workspace_free(lu.panel);
+    workspace_free(lu.chunk[0]);
+    workspace_free(lu.chunk[1]);
+    workspace_free(lu.stage);
+    free(lu.piv);
+    op_end(op, (uint64_t)n * n * sizeof(double), 2.0 / 3.0 * n * n * n);
+    return status;
+}
+
+// Heatmap
+//
+// Each pixel shows the elements under it by their minimum and maximum,
+// coloured by whichever has the larger magnitude, so a lone spike survives
+// zooming out. Reading all of those elements would make a zoomed-out frame
+// cost the whole matrix, so a MatrixPyramid keeps the minimum and maximum of
+// aligned blocks instead, built once per matrix version: level 0 covers
+// blocks of base x base elements, each further level blocks twice as wide.
+// A pixel then folds at most 3 x 3 entries of the level just below its
+// footprint, and a frame costs O(pixels) at any zoom.
+//
+// Without a pyramid, or zoomed in past level 0, dense pixels read their
+// elements when there are at most HEATMAP_DIRECT_SCALE per pixel across and
+// their centre element otherwise; sparse rows are swept once per pixel row,
+// nonzeros only.
+#define HEATMAP_BASE 4                  // level 0 block side of a dense matrix
+#define HEATMAP_DIRECT_SCALE 8          // most elements per pixel read without a pyramid
+#define HEATMAP_SPARSE_CELLS (1u << 20) // level 0 cells a sparse matrix may have whatever its nonzeros
+#define HEATMAP_BAND 16                 // level 0 cell rows per build task
+#define HEATMAP_LEVELS 32
+#define HEATMAP_BACKGROUND 0xffd9d7ccu  // outside the matrix
+
+typedef struct {
+    float lo, hi;           // lo > hi when every element is NaN
+} HeatmapCell;
+
+struct MatrixPyramid {
+    unsigned rows, cols;    // of the matrix
+    uint64_t version;       // of the matrix it was built from
+    unsigned base;          // level 0 block side, a power of two
+    unsigned levels;
+    unsigned level_rows[HEATMAP_LEVELS], level_cols[HEATMAP_LEVELS];
+    HeatmapCell *cells[HEATMAP_LEVELS];
+    double lo, hi;          // over the whole matrix
+};
+
+// Selects rather than branches, which random data would mispredict; a NaN
+// value leaves the cell as it was
+static inline void heatmap_fold(HeatmapCell *cell, float value) {
+    cell->lo = value < cell->lo ? value : cell->lo;
+    cell->hi = value > cell->hi ? value : cell->hi;
+}
+
+static inline void heatmap_merge(HeatmapCell *cell, const HeatmapCell *other) {
+    cell->lo = other->lo < cell->lo ? other->lo : cell->lo;
+    cell->hi = other->hi > cell->hi ? other->hi : cell->hi;
+}
+
+typedef struct {
+    const Matrix *matrix;
+    MatrixPyramid *pyramid;
+    MatrixProgress *progress;
+    atomic_uint remaining;
+    atomic_int failed;
+    atomic_int done;
+} PyramidJob;
+
+// Level 0 cell rows [a * HEATMAP_BAND, (a + 1) * HEATMAP_BAND)
+static void pyramid_band_task(PoolTask *task) {
+    PyramidJob *job = task->ctx;
+    const Matrix *matrix = job->matrix;
+    MatrixPyramid *p = job->pyramid;
+    unsigned base = p->base, cols = p->level_cols[0], n = matrix->N;
+    unsigned first = task->a * HEATMAP_BAND;
+    unsigned end = p->level_rows[0] - first < HEATMAP_BAND ? p->level_rows[0] : first + HEATMAP_BAND;
+    MatrixTraceScope scope = matrix_trace_begin("heatmap.band");
+    size_t mark = scratch_mark();
+    double *row = matrix->csr ? NULL : scratch_alloc((size_t)n * sizeof(double));
+    uint64_t *counts = matrix->csr ? scratch_alloc((size_t)cols * sizeof(uint64_t)) : NULL;
+    uint64_t bytes = 0;
+
+    if (!row && !counts) {
+        atomic_store(&job->failed, 1);
+    } else if (!atomic_load(&job->failed) && !(job->progress && atomic_load(&job->progress->cancel))) {
+        const MatrixTypeInfo *info = &matrix_types[matrix->type];
+        const MatrixCsr *csr = matrix->csr;
+        for (unsigned r = first; r < end; r++) {
+            HeatmapCell *cells = p->cells[0] + (size_t)r * cols;
+            unsigned i0 = r * base, i1 = matrix->M - i0 < base ? matrix->M : i0 + base;
+            for (unsigned c = 0; c < cols; c++)
+                cells[c] = (HeatmapCell){ INFINITY, -INFINITY };
+            if (!csr) {
+                for (unsigned i = i0; i < i1; i++) {
+                    info->to_doubles((const char *)matrix->data + (size_t)i * n * info->size, n, row);
+                    for (unsigned c = 0, j = 0; c < cols; c++) {
+                        unsigned j1 = n - j < base ? n : j + base;
+                        for (; j < j1; j++)
+                            heatmap_fold(&cells[c], (float)row[j]);
+                    }
+                }
+                bytes += (uint64_t)(i1 - i0) * n * info->size;
+                continue;
+            }
+            // Sparse: a cell holds a zero unless all of its elements are stored
+            memset(counts, 0, (size_t)cols * sizeof(uint64_t));
+            for (unsigned i = i0; i < i1; i++) {
+                for (uint64_t q = csr->row_ptr[i]; q < csr->row_ptr[i + 1]; q++) {
+                    heatmap_fold(&cells[csr->cols[q] / base], (float)csr->values[q]);
+                    counts[csr->cols[q] / base]++;
+                }
+                bytes += (csr->row_ptr[i + 1] - csr->row_ptr[i]) * (sizeof(unsigned) + sizeof(int));
+            }
+            for (unsigned c = 0; c < cols; c++) {
+                unsigned j0 = c * base, width = n - j0 < base ? n - j0 : base;
+                if (counts[c] < (uint64_t)(i1 - i0) * width) heatmap_fold(&cells[c], 0.0f);
+            }
+        }
+        if (job->progress) {
+            unsigned i0 = first * base;
+            atomic_fetch_add(&job->progress->done,
+                             ((uint64_t)end * base < matrix->M ? end * base : matrix->M) - i0);
+        }
+    }
+    scratch_pop(mark);
+    matrix_trace_end(scope, bytes, 0.0);
+    if (atomic_fetch_sub(&job->remaining, 1) == 1)
+        pool_signal_done(&job->done);
+}
+
+void matrix_pyramid_free(MatrixPyramid *pyramid) {
+    if (!pyramid) return;
+    for (unsigned l = 0; l < pyramid->levels; l++)
+        workspace_free(pyramid->cells[l]);
+    free(pyramid);
+}
+
+// Min/max pyramid of matrix for matrix_heatmap_render(), which uses it only
+// while the matrix keeps the version it was built from. progress counts
+// rows and may be NULL. NULL if cancelled or out of memory, with the reason
+// in matrix_last_error().
+MatrixPyramid *matrix_pyramid_build(const Matrix *matrix, MatrixProgress *progress) {
+    MatrixPyramid *p = calloc(1, sizeof(MatrixPyramid));
+    if (!p) {
+        snprintf(matrix_io_error, sizeof(matrix_io_error), "out of memory");
+        return NULL;
+    }
+    MatrixTraceScope op = op_begin("heatmap.pyramid");
+    p->rows = matrix->M;
+    p->cols = matrix->N;
+    p->version = matrix->version;
+
+    // A sparse matrix gets coarser blocks, so the pyramid does not outgrow
+    // its nonzeros
+    uint64_t limit = UINT64_MAX;
+    if (matrix->csr) {
+        limit = matrix->csr->row_ptr[matrix->M];
+        if (limit < HEATMAP_SPARSE_CELLS) limit = HEATMAP_SPARSE_CELLS;
+    }
+    p->base = HEATMAP_BASE;
+    while (p->base < (1u << 30) &&
+           (uint64_t)((matrix->M + p->base - 1) / p->base) * ((matrix->N + p->base - 1) / p->base) > limit)
+        p->base *= 2;
+
+    int status = 0;
+    unsigned rows = (matrix->M + p->base - 1) / p->base, cols = (matrix->N + p->base - 1) / p->base;
+    for (;;) {
+        p->level_rows[p->levels] = rows;
+        p->level_cols[p->levels] = cols;
+        p->cells[p->levels] = workspace_alloc((size_t)rows * cols * sizeof(HeatmapCell));
+        if (!p->cells[p->levels++]) status = -1;
+        if (status != 0 || (rows == 1 && cols == 1) || p->levels == HEATMAP_LEVELS) break;
+        rows = (rows + 1) / 2;
+        cols = (cols + 1) / 2;
+    }
+
+    if (status == 0) {
+        PyramidJob job = { matrix, p, progress };
+        unsigned bands = (p->level_rows[0] + HEATMAP_BAND - 1) / HEATMAP_BAND;
+        atomic_init(&job.remaining, bands);
+        atomic_init(&job.failed, 0);
+        atomic_init(&job.done, 0);
+        if (progress) {
+            atomic_store(&progress->done, 0);
+            atomic_store(&progress->total, matrix->M);
+        }
+        for (unsigned b = 0; b < bands; b++) {
+            PoolTask task = { pyramid_band_task, &job, 0, b, 0, 0 };
+            pool_push(&task);
+        }
+        pool_wait(&job.done);
+        if (atomic_load(&job.failed)) status = -1;
+        else if (progress && atomic_load(&progress->cancel)) status = -2;
+    }
+
+    for (unsigned l = 1; status == 0 && l < p->levels; l++) {
+        const HeatmapCell *below = p->cells[l - 1];
+        unsigned below_rows = p->level_rows[l - 1], below_cols = p->level_cols[l - 1];
+        for (unsigned r = 0; r < p->level_rows[l]; r++) {
+            for (unsigned c = 0; c < p->level_cols[l]; c++) {
+                HeatmapCell *cell = &p->cells[l][(size_t)r * p->level_cols[l] + c];
+                *cell = below[(size_t)2 * r * below_cols + 2 * c];
+                if (2 * c + 1 < below_cols) heatmap_merge(cell, &below[(size_t)2 * r * below_cols + 2 * c + 1]);
+                if (2 * r + 1 < below_rows) {
+                    heatmap_merge(cell, &below[(size_t)(2 * r + 1) * below_cols + 2 * c]);
+                    if (2 * c + 1 < below_cols)
+                        heatmap_merge(cell, &below[(size_t)(2 * r + 1) * below_cols + 2 * c + 1]);
+                }
+            }
+        }
+    }
+
+    uint64_t bytes = matrix->csr ? matrix->csr->row_ptr[matrix->M] * (sizeof(unsigned) + sizeof(int))
+                                 : (uint64_t)matrix->M * matrix->N * matrix_types[matrix->type].size;
+    op_end(op, bytes, 0.0);
+    if (status != 0) {
+        snprintf(matrix_io_error, sizeof(matrix_io_error), status == -2 ? "cancelled" : "out of memory");
+        matrix_pyramid_free(p);
+        return NULL;
+    }
+    // The top level is one cell, unless HEATMAP_LEVELS ran out first
+    const HeatmapCell *top = p->cells[p->levels - 1];
+    HeatmapCell all = top[0];
+    for (size_t k = 1; k < (size_t)p->level_rows[p->levels - 1] * p->level_cols[p->levels - 1]; k++)
+        heatmap_merge(&all, &top[k]);
+    p->lo = all.lo;
+    p->hi = all.hi;
+    return p;
+}
+
+// Elements [first[k], end[k]) under pixel k of a row or column of pixels,
+// clipped to the limit elements there are; empty outside the matrix. For a
+// scale of 1 or more the footprints partition the elements in view.
+static void heatmap_footprints(double origin, double scale, unsigned count, unsigned limit,
+                               unsigned *first, unsigned *end) {
+    for (unsigned k = 0; k < count; k++) {
+        double a = floor(origin + k * scale), b = floor(origin + (k + 1) * scale);
+        if (b <= a) b = a + 1;
+        first[k] = a <= 0 ? 0 : a >= limit ? limit : (unsigned)a;
+        end[k] = b <= 0 ? 0 : b >= limit ? limit : (unsigned)b;
+    }
+}
+
+// Fold elements [i0, i1) x [j0, j1) of a sparse matrix into cell
+static void heatmap_sparse_block(const MatrixCsr *csr, unsigned i0, unsigned i1, unsigned j0, unsigned j1,
+                                 HeatmapCell *cell) {
+    for (unsigned i = i0; i < i1; i++) {
+        size_t q = csr_find(csr, i, j0), stored = 0;
+        for (; q < csr->row_ptr[i + 1] && csr->cols[q] < j1; q++, stored++)
+            heatmap_fold(cell, (float)csr->values[q]);
+        if (stored < j1 - j0) heatmap_fold(cell, 0.0f);
+    }
+}
+
+// Fold element rows [i0, i1) of a dense matrix into a row of pixels, each
+// row converted once over the columns in view into row
+static void heatmap_dense_row(const Matrix *matrix, unsigned i0, unsigned i1, unsigned width,
+                              const unsigned *first, const unsigned *end, double *row,
+                              HeatmapCell *cells) {
+    const MatrixTypeInfo *info = &matrix_types[matrix->type];
+    unsigned lo = UINT_MAX, hi = 0;
+    for (unsigned x = 0; x < width; x++) {
+        cells[x] = (HeatmapCell){ INFINITY, -INFINITY };
+        if (first[x] < end[x]) {
+            if (first[x] < lo) lo = first[x];
+            if (end[x] > hi) hi = end[x];
+        }
+    }
+    for (unsigned i = i0; i < i1 && lo < hi; i++) {
+        info->to_doubles((const char *)matrix->data + ((size_t)i * matrix->N + lo) * info->size, hi - lo, row);
+        for (unsigned x = 0; x < width; x++)
+            for (unsigned j = first[x]; j < end[x]; j++)
+                heatmap_fold(&cells[x], (float)row[j - lo]);
+    }
+}
+
+// Sweep element rows [i0, i1) of a sparse matrix into a row of pixels whose
+// column footprints partition the columns in view (a scale of 1 or more)
+static void heatmap_sweep(const MatrixCsr *csr, unsigned i0, unsigned i1, const MatrixView *view,
+                          const unsigned *first, const unsigned *end, uint64_t *counts,
+                          HeatmapCell *cells) {
+    unsigned width = view->width, lo = UINT_MAX, hi = 0;
+    for (unsigned x = 0; x < width; x++) {
+        cells[x] = (HeatmapCell){ INFINITY, -INFINITY };
+        counts[x] = 0;
+        if (first[x] < end[x]) {
+            if (first[x] < lo) lo = first[x];
+            if (end[x] > hi) hi = end[x];
+        }
+    }
+    if (lo >= hi) return;
+    for (unsigned i = i0; i < i1; i++) {
+        for (size_t q = csr_find(csr, i, lo); q < csr->row_ptr[i + 1] && csr->cols[q] < hi; q++) {
+            unsigned j = csr->cols[q];
+            double at = (j - view->col) / view->scale;
+            unsigned x = at <= 0 ? 0 : at >= width ? width - 1 : (unsigned)at;
+            while (x + 1 < width && first[x + 1] <= j && first[x + 1] < end[x + 1]) x++;
+            while (x > 0 && first[x] > j) x--;
+            if (j < first[x] || j >= end[x]) continue;
+            heatmap_fold(&cells[x], (float)csr->values[q]);
+            counts[x]++;
+        }
+    }
+    for (unsigned x = 0; x < width; x++)
+        if (first[x] < end[x] && counts[x] < (uint64_t)(i1 - i0) * (end[x] - first[x]))
+            heatmap_fold(&cells[x], 0.0f);
+}
+
+// Diverging colours around zero: white at zero, red for positive values and
+// blue for negative ones. A range on one side of zero spans from white to
+// the full colour of that side.
+static uint32_t heatmap_color(const HeatmapCell *cell, double lo, double hi) {
+    if (cell->lo > cell->hi) return 0xff808080u;
+    double v = -cell->lo > cell->hi ? cell->lo : cell->hi, t;
+    if (lo >= 0 && hi > lo) t = (v - lo) / (hi - lo);
+    else if (hi <= 0 && hi > lo) t = (v - hi) / (hi - lo);
+    else t = fmax(-lo, hi) > 0 ? v / fmax(-lo, hi) : 0;
+    t = t < -1 ? -1 : t > 1 ? 1 : t;
+    double r = t >= 0 ? 178 : 33, g = t >= 0 ? 24 : 102, b = t >= 0 ? 43 : 172, s = fabs(t);
+    return 0xff000000u | (uint32_t)(255 + (r - 255) * s + 0.5) << 16 |
+           (uint32_t)(255 + (g - 255) * s + 0.5) << 8 | (uint32_t)(255 + (b - 255) * s + 0.5);
+}
+
+// Draw view of matrix into pixels: height rows of width 0xffRRGGBB words,
+// stride words apart, the layout of a cairo RGB24 image. pyramid may be
+// NULL, or stale, in which case it is ignored and zoomed-out pixels take
+// their centre element. range receives the values the colours span: the
+// whole matrix with a pyramid, else what is in view. Returns 0, or -1 if
+// out of memory.
+int matrix_heatmap_render(const Matrix *matrix, const MatrixPyramid *pyramid, const MatrixView *view,
+                          uint32_t *pixels, size_t stride, double range[2]) {
+    unsigned width = view->width, height = view->height;
+    if (!(view->scale > 0) || !isfinite(view->row) || !isfinite(view->col)) {
+        snprintf(matrix_io_error, sizeof(matrix_io_error), "invalid heatmap view");
+        return -1;
+    }
+    if (pyramid && (pyramid->version != matrix->version || pyramid->rows != matrix->M ||
+                    pyramid->cols != matrix->N))
+        pyramid = NULL;
+    MatrixTraceScope scope = matrix_trace_begin("heatmap.render");
+    size_t mark = scratch_mark();
+    unsigned *row_first = scratch_alloc((size_t)height * sizeof(unsigned));
+    unsigned *row_end = scratch_alloc((size_t)height * sizeof(unsigned));
+    unsigned *col_first = scratch_alloc((size_t)width * sizeof(unsigned));
+    unsigned *col_end = scratch_alloc((size_t)width * sizeof(unsigned));
+    uint64_t *counts = scratch_alloc((size_t)width * sizeof(uint64_t));
+    double *row = scratch_alloc(((size_t)width * HEATMAP_DIRECT_SCALE + 2) * sizeof(double));
+    HeatmapCell *cells = scratch_alloc((size_t)width * height * sizeof(HeatmapCell));
+    if (!row_first || !row_end || !col_first || !col_end || !counts || !row || !cells) {
+        scratch_pop(mark);
+        matrix_trace_end(scope, 0, 0.0);
+        snprintf(matrix_io_error, sizeof(matrix_io_error), "out of memory");
+        return -1;
+    }
+    heatmap_footprints(view->row, view->scale, height, matrix->M, row_first, row_end);
+    heatmap_footprints(view->col, view->scale, width, matrix->N, col_first, col_end);
+
+    // The pyramid level whose blocks are the largest not wider than a pixel
+    int level = -1;
+    unsigned shift = 0;
+    if (pyramid && view->scale >= pyramid->base) {
+        for (level = 0; level + 1 < (int)pyramid->levels &&
+                        (double)((uint64_t)pyramid->base << (level + 1)) <= view->scale; level++) {}
+        for (unsigned b = pyramid->base << level; b > 1; b >>= 1) shift++;
+    }
+
+    for (unsigned y = 0; y < height; y++) {
+        HeatmapCell *line = cells + (size_t)y * width;
+        unsigned i0 = row_first[y], i1 = row_end[y];
+        if (i0 >= i1) continue;
+        if (y > 0 && row_first[y - 1] == i0 && row_end[y - 1] == i1) {
+            memcpy(line, line - width, width * sizeof(HeatmapCell));
+            continue;
+        }
+        if (level < 0 && matrix->csr && view->scale >= 1) {
+            heatmap_sweep(matrix->csr, i0, i1, view, col_first, col_end, counts, line);
+            continue;
+        }
+        if (level < 0 && !matrix->csr && view->scale <= HEATMAP_DIRECT_SCALE) {
+            heatmap_dense_row(matrix, i0, i1, width, col_first, col_end, row, line);
+            continue;
+        }
+        for (unsigned x = 0; x < width; x++) {
+            unsigned j0 = col_first[x], j1 = col_end[x];
+            if (j0 >= j1) continue;
+            if (x > 0 && col_first[x - 1] == j0 && col_end[x - 1] == j1) {
+                line[x] = line[x - 1];
+                continue;
+            }
+            HeatmapCell *cell = &line[x];
+            *cell = (HeatmapCell){ INFINITY, -INFINITY };
+            if (level >= 0) {
+                const HeatmapCell *block = pyramid->cells[level];
+                unsigned block_cols = pyramid->level_cols[level];
+                for (unsigned r = i0 >> shift; r <= (i1 - 1) >> shift; r++)
+                    for (unsigned c = j0 >> shift; c <= (j1 - 1) >> shift; c++)
+                        heatmap_merge(cell, &block[(size_t)r * block_cols + c]);
+            } else if (matrix->csr) {
+                heatmap_sparse_block(matrix->csr, i0, i1, j0, j1, cell);
+            } else {
+                heatmap_fold(cell, (float)matrix_get(matrix, i0 + (i1 - i0) / 2, j0 + (j1 - j0) / 2));
+            }
+        }
+    }
+
+    double lo = pyramid ? pyramid->lo : INFINITY, hi = pyramid ? pyramid->hi : -INFINITY;
+    for (unsigned y = 0; !pyramid && y < height; y++) {
+        for (unsigned x = 0; row_first[y] < row_end[y] && x < width; x++) {
+            const HeatmapCell *cell = &cells[(size_t)y * width + x];
+            if (col_first[x] >= col_end[x] || cell->lo > cell->hi) continue;
+            if (cell->lo < lo) lo = cell->lo;
+            if (cell->hi > hi) hi = cell->hi;
+        }
+    }
+    if (lo > hi) lo = hi = 0;
+    for (unsigned y = 0; y < height; y++) {
+        uint32_t *out = pixels + (size_t)y * stride;
+        for (unsigned x = 0; x < width; x++)
+            out[x] = row_first[y] < row_end[y] && col_first[x] < col_end[x]
+                     ? heatmap_color(&cells[(size_t)y * width + x], lo, hi) : HEATMAP_BACKGROUND;
+    }
+    range[0] = lo;
+    range[1] = hi;
+    scratch_pop(mark);
+    matrix_trace_end(scope, (uint64_t)width * height * sizeof(uint32_t), 0.0);
+    return 0;
+}
+
+// Matrix expressions
+//
+// Statements like "det(A*B + 2*C^T)" or "D = A + B - C" over saved matrices.
+// The parser builds a DAG in which repeated subexpressions are one node, and
+// evaluation only materializes what has to exist as a whole matrix: GEMM
+// operands and results, determinant operands, shared subexpressions and the
+// result. Everything between those, any chain of +, -, scalar * and
+// transposes, is compiled into a small stack program that runs as one pass
+// over the output, EXPR_TILE x EXPR_TILE tiles at a time, in int64. Buffers
+// go back to a pool after their last read, and a pass may write its result
+// over an input it is the last reader of.
+#define EXPR_TILE 32
+
+enum { EXPR_MATRIX, EXPR_NUMBER, EXPR_ADD, EXPR_SUB, EXPR_NEG, EXPR_SCALE, EXPR_TRANSPOSE,
+       EXPR_MATMUL, EXPR_DET };
+
+typedef struct ExprBuffer {
+    void *data;
+    size_t bytes;
+    struct ExprBuffer *next;
+} ExprBuffer;
+
+typedef struct ExprNode {
+    int op;
+    int is_scalar;
+    unsigned rows, cols;
+    struct ExprNode *lhs, *rhs;     // EXPR_SCALE: lhs is the scalar
+    Matrix *matrix;                 // EXPR_MATRIX
+    double number;                  // EXPR_NUMBER, or a scalar once evaluated
+
+    // Evaluation state
+    unsigned refs;                  // parents in the DAG
+    int materialize;                // gets a buffer of its own
+    unsigned uses;                  // reads of that buffer still to come
+    const void *data;               // materialized elements, row-major
+    int wide;                       // int64 elements rather than int
+    ExprBuffer *buffer;             // storage of data, NULL for a saved matrix
+    int planned, done;
+} ExprNode;
+
+struct Expr {
+    ExprNode **nodes;
+    size_t count, cap;
+    ExprNode *root;
+    char *target;                   // name assigned to, or NULL
+
+    int fuse;
+    ExprBuffer *pool;
+    ExprStats *stats;
+    size_t live_bytes;
+};
+
+typedef struct {
+    Expr *expr;
+    const char *text;
+    size_t pos;
+    int failed;
+} ExprParser;
+
+static void expr_parse_error(ExprParser *p, const char *fmt, ...) {
+    if (p->failed) return;
+    int len = snprintf(matrix_io_error, sizeof(matrix_io_error), "column %zu: ", p->pos + 1);
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(matrix_io_error + len, sizeof(matrix_io_error) - len, fmt, args);
+    va_end(args);
+    p->failed = 1;
+}
+
+static void expr_skip_space(ExprParser *p) {
+    while (p->text[p->pos] == ' ' || p->text[p->pos] == '\t') p->pos++;
+}
+
+static int expr_accept(ExprParser *p, char c) {
+    expr_skip_space(p);
+    if (p->text[p->pos] != c) return 0;
+    p->pos++;
+    return 1;
+}
+
+// The node for op over lhs and rhs, shared with an identical one if it exists
+static ExprNode *expr_node(ExprParser *p, int op, ExprNode *lhs, ExprNode *rhs, double number) {
+    Expr *e = p->expr;
+    for (size_t i = 0; i < e->count; i++) {
+        ExprNode *n = e->nodes[i];
+        if (n->op == op && n->lhs == lhs && n->rhs == rhs && n->op != EXPR_MATRIX &&
+            (op != EXPR_NUMBER || n->number == number))
+            return n;
+    }
+    if (e->count == e->cap) {
+        size_t cap = e->cap ? e->cap * 2 : 16;
+        ExprNode **nodes = realloc(e->nodes, cap * sizeof(ExprNode *));
+        if (!nodes) {
+            expr_parse_error(p, "out of memory");
+            return NULL;
+        }
+        e->nodes = nodes;
+        e->cap = cap;
+    }
+    ExprNode *n = calloc(1, sizeof(ExprNode));
+    if (!n) {
+        expr_parse_error(p, "out of memory");
+        return NULL;
+    }
+    n->op = op;
+    n->lhs = lhs;
+    n->rhs = rhs;
+    n->number = number;
+    e->nodes[e->count++] = n;
+    return n;
+}
+
+// The node for the saved matrix called name, which is looked up only once
+static ExprNode *expr_leaf(ExprParser *p, const char *name) {
+    Expr *e = p->expr;
+    for (size_t i = 0; i < e->count; i++)
+        if (e->nodes[i]->op == EXPR_MATRIX && strcmp(e->nodes[i]->matrix->name, name) == 0)
+            return e->nodes[i];
+
+    Matrix *matrix = load_matrix(name);
+    if (!matrix) {
+        expr_parse_error(p, "no saved matrix called %s", name);
+        return NULL;
+    }
+    if (matrix->type != MATRIX_INT32) {
+        // The passes run in int64 over int32 inputs
+        expr_parse_error(p, "%s has %s elements, expressions take int32 matrices",
+                         name, matrix_type_name(matrix->type));
+        free_matrix(matrix);
+        return NULL;
+    }
+    ExprNode *n = expr_node(p, EXPR_MATRIX, NULL, NULL, 0.0);
+    if (!n) {
+        free_matrix(matrix);
+        return NULL;
+    }
+    n->matrix = matrix;
+    n->rows = matrix->M;
+    n->cols = matrix->N;
+    return n;
+}
+
+static ExprNode *expr_parse_sum(ExprParser *p);
+
+static ExprNode *expr_parse_primary(ExprParser *p) {
+    expr_skip_space(p);
+    const char *s = p->text + p->pos;
+    if (*s == '(') {
+        p->pos++;
+        ExprNode *n = expr_parse_sum(p);
+        if (n && !expr_accept(p, ')')) expr_parse_error(p, "expected ')'");
+        return p->failed ? NULL : n;
+    }
+    if ((*s >= '0' && *s <= '9') || *s == '.') {
+        char *end;
+        double value = strtod(s, &end);
+        p->pos += end - s;
+        ExprNode *n = expr_node(p, EXPR_NUMBER, NULL, NULL, value);
+        if (n) n->is_scalar = 1;
+        return n;
+    }
+    size_t len = 0;
+    while ((s[len] >= 'A' && s[len] <= 'Z') || (s[len] >= 'a' && s[len] <= 'z') || s[len] == '_' ||
+           (len > 0 && s[len] >= '0' && s[len] <= '9'))
+        len++;
+    if (len == 0) {
+        expr_parse_error(p, *s ? "unexpected '%c'" : "unexpected end of expression", *s);
+        return NULL;
+    }
+    char *name = strndup(s, len);
+    if (!name) {
+        expr_parse_error(p, "out of memory");
+        return NULL;
+    }
+    p->pos += len;
+
+    ExprNode *n = NULL;
+    if (strcmp(name, "det") == 0 && expr_accept(p, '(')) {
+        size_t start = p->pos;
+        ExprNode *arg = expr_parse_sum(p);
+        if (arg && !expr_accept(p, ')')) {
+            expr_parse_error(p, "expected ')'");
+        } else if (arg && (arg->is_scalar || arg->rows != arg->cols)) {
+            p->pos = start;
+            expr_parse_error(p, "det needs a square matrix");
+        } else if (arg && (n = expr_node(p, EXPR_DET, arg, NULL, 0.0))) {
+            n->is_scalar = 1;
+        }
+    } else {
+        n = expr_leaf(p, name);
+    }
+    free(name);
+    return p->failed ? NULL : n;
+}
+
+// Postfix transposes, written X^T or X'
+static ExprNode *expr_parse_postfix(ExprParser *p) {
+    ExprNode *n = expr_parse_primary(p);
+    while (n) {
+        expr_skip_space(p);
+        if (p->text[p->pos] == '^' && p->text[p->pos + 1] == 'T') {
+            p->pos += 2;
+        } else if (p->text[p->pos] == '\'') {
+            p->pos++;
+        } else {
+            break;
+        }
+        if (n->is_scalar) continue;
+        // (X^T)^T is X itself
+        if (n->op == EXPR_TRANSPOSE) {
+            n = n->lhs;
+            continue;
+        }
+        ExprNode *t = expr_node(p, EXPR_TRANSPOSE, n, NULL, 0.0);
+        if (!t) return NULL;
+        t->rows = n->cols;
+        t->cols = n->rows;
+        n = t;
+    }
+    return n;
+}
+
+static ExprNode *expr_parse_unary(ExprParser *p) {
+    if (!expr_accept(p, '-')) return expr_parse_postfix(p);
+    ExprNode *operand = expr_parse_unary(p);
+    if (!operand) return NULL;
+    ExprNode *n = expr_node(p, EXPR_NEG, operand, NULL, 0.0);
+    if (n) {
+        n->is_scalar = operand->is_scalar;
+        n->rows = operand->rows;
+        n->cols = operand->cols;
+    }
+    return n;
+}
+
+static ExprNode *expr_parse_product(ExprParser *p) {
+    ExprNode *n = expr_parse_unary(p);
+    while (n && expr_accept(p, '*')) {
+        size_t at = p->pos;
+        ExprNode *rhs = expr_parse_unary(p);
+        if (!rhs) return NULL;
+        ExprNode *product;
+        if (n->is_scalar || rhs->is_scalar) {
+            // A scalar factor always goes on the left
+            ExprNode *k = n->is_scalar ? n : rhs, *other = n->is_scalar ? rhs : n;
+            product = expr_node(p, EXPR_SCALE, k, other, 0.0);
+            if (product) {
+                product->is_scalar = other->is_scalar;
+                product->rows = other->rows;
+                product->cols = other->cols;
+            }
+        } else {
+            if (n->cols != rhs->rows) {
+                p->pos = at;
+                expr_parse_error(p, "cannot multiply %ux%u by %ux%u", n->rows, n->cols,
+                                 rhs->rows, rhs->cols);
+                return NULL;
+            }
+            product = expr_node(p, EXPR_MATMUL, n, rhs, 0.0);
+            if (product) {
+                product->rows = n->rows;
+                product->cols = rhs->cols;
+            }
+        }
+        n = product;
+    }
+    return n;
+}
+
+static ExprNode *expr_parse_sum(ExprParser *p) {
+    ExprNode *n = expr_parse_product(p);
+    for (;;) {
+        int op;
+        if (expr_accept(p, '+')) op = EXPR_ADD;
+        else if (expr_accept(p, '-')) op = EXPR_SUB;
+        else break;
+        size_t at = p->pos;
+        ExprNode *rhs = n ? expr_parse_product(p) : NULL;
+        if (!rhs) return NULL;
+        if (n->is_scalar != rhs->is_scalar || n->rows != rhs->rows || n->cols != rhs->cols) {
+            p->pos = at;
+            if (n->is_scalar != rhs->is_scalar)
+                expr_parse_error(p, "cannot add a scalar and a matrix");
+            else
+                expr_parse_error(p, "cannot add %ux%u and %ux%u", n->rows, n->cols, rhs->rows, rhs->cols);
+            return NULL;
+        }
+        ExprNode *sum = expr_node(p, op, n, rhs, 0.0);
+        if (!sum) return NULL;
+        sum->is_scalar = n->is_scalar;
+        sum->rows = n->rows;
+        sum->cols = n->cols;
+        n = sum;
+    }
+    return n;
+}
+
+void expr_free(Expr *expr) {
+    if (!expr) return;
+    for (size_t i = 0; i < expr->count; i++) {
+        if (expr->nodes[i]->matrix) free_matrix(expr->nodes[i]->matrix);
+        free(expr->nodes[i]);
+    }
+    free(expr->nodes);
+    free(expr->target);
+    free(expr);
+}
+
+// Parse "expression" or "name = expression". Saved matrices are looked up
+// here, so this must run on the thread that owns the registry; the Expr then
+// holds its own handles and can be evaluated anywhere. NULL on error, with
+// the reason in matrix_last_error().
+Expr *expr_parse(const char *text) {
+    Expr *expr = calloc(1, sizeof(Expr));
+    if (!expr) {
+        snprintf(matrix_io_error, sizeof(matrix_io_error), "out of memory");
+        return NULL;
+    }
+    ExprParser p = { expr, text, 0, 0 };
+
+    // An assignment starts with a name followed by a single '='
+    size_t len = 0;
+    expr_skip_space(&p);
+    const char *s = text + p.pos;
+    while ((s[len] >= 'A' && s[len] <= 'Z') || (s[len] >= 'a' && s[len] <= 'z') || s[len] == '_' ||
+           (len > 0 && s[len] >= '0' && s[len] <= '9'))
+        len++;
+    size_t after = p.pos + len;
+    while (text[after] == ' ' || text[after] == '\t') after++;
+    if (len > 0 && text[after] == '=') {
+        expr->target = strndup(s, len);
+        if (!expr->target) expr_parse_error(&p, "out of memory");
+        p.pos = after + 1;
+    }
+
+    if (!p.failed) expr->root = expr_parse_sum(&p);
+    expr_skip_space(&p);
+    if (expr->root && text[p.pos] != '\0') expr_parse_error(&p, "unexpected '%c'", text[p.pos]);
+    if (!p.failed && expr->target && expr->root->is_scalar) {
+        p.pos = 0;
+        expr_parse_error(&p, "only a matrix can be saved, and %s is a scalar", expr->target);
+    }
+    if (p.failed || !expr->root) {
+        if (!p.failed) expr_parse_error(&p, "empty expression");
+        expr_free(expr);
+        return NULL;
+    }
+    return expr;
+}
+
+// Name the result is to be saved as, NULL if the statement is not an assignment
+const char *expr_target(const Expr *expr) {
+    return expr->target;
+}
+
+static void *expr_alloc(Expr *e, size_t bytes, ExprBuffer **out) {
+    // Best fit from the pool
+    ExprBuffer **best = NULL;
+    for (ExprBuffer **b = &e->pool; *b; b = &(*b)->next)
+        if ((*b)->bytes >= bytes && (!best || (*b)->bytes < (*best)->bytes)) best = b;
+    if (best) {
+        *out = *best;
+        *best = (*best)->next;
+        return (*out)->data;
+    }
+
+    ExprBuffer *buffer = malloc(sizeof(ExprBuffer));
+    void *data = workspace_alloc(bytes);
+    if (!buffer || !data) {
+        free(buffer);
+        workspace_free(data);
+        snprintf(matrix_io_error, sizeof(matrix_io_error), "out of memory");
+        return NULL;
+    }
+    buffer->data = data;
+    buffer->bytes = bytes;
+    e->live_bytes += bytes;
+    if (e->live_bytes > e->stats->peak_bytes) e->stats->peak_bytes = e->live_bytes;
+    *out = buffer;
+    return data;
+}
+
+// Done with a buffer: pooled when fusing, freed at once otherwise
+static void expr_recycle(Expr *e, ExprBuffer *buffer) {
+    if (e->fuse) {
+        buffer->next = e->pool;
+        e->pool = buffer;
+        return;
+    }
+    e->live_bytes -= buffer->bytes;
+    workspace_free(buffer->data);
+    free(buffer);
+}
+
+// One read of a materialized node is done
+static void expr_release(Expr *e, ExprNode *n) {
+    if (--n->uses > 0 || !n->buffer) return;
+    expr_recycle(e, n->buffer);
+    n->buffer = NULL;
+    n->data = NULL;
+}
+
+static void expr_count_refs(ExprNode *n) {
+    if (!n || n->refs++ > 0) return;
+    expr_count_refs(n->lhs);
+    expr_count_refs(n->rhs);
+}
+
+// Count the reads of every materialized node below n's elementwise subtree
+static void expr_count_sources(ExprNode *n) {
+    if (n->is_scalar) return;
+    if (n->materialize) {
+        n->uses++;
+        return;
+    }
+    expr_count_sources(n->lhs);
+    if (n->rhs) expr_count_sources(n->rhs);
+}
+
+static void expr_plan(Expr *e, ExprNode *n) {
+    if (!n || n->planned) return;
+    n->planned = 1;
+    if (!n->is_scalar)
+        n->materialize |= n->op == EXPR_MATRIX || n->op == EXPR_MATMUL || n->refs > 1 || !e->fuse;
+    if (n->op == EXPR_MATMUL) n->lhs->materialize = n->rhs->materialize = 1;
+    if (n->op == EXPR_DET) n->lhs->materialize = 1;
+    expr_plan(e, n->lhs);
+    expr_plan(e, n->rhs);
+
+    if (n->op == EXPR_MATMUL) {
+        n->lhs->uses++;
+        n->rhs->uses++;
+    } else if (n->op == EXPR_DET) {
+        n->lhs->uses++;
+    } else if (n->materialize && n->op != EXPR_MATRIX) {
+        expr_count_sources(n->lhs);
+        if (n->rhs) expr_count_sources(n->rhs);
+    }
+}
+
+enum { EXPR_LOAD, EXPR_OP_ADD, EXPR_OP_SUB, EXPR_OP_NEG, EXPR_OP_SCALE };
+
+typedef struct {
+    int op;
+    ExprNode *source;               // EXPR_LOAD
+    const void *data;
+    int wide, transposed;
+    unsigned ld;
+    int64_t factor;                 // EXPR_OP_SCALE
+} ExprInstr;
+
+typedef struct {
+    const ExprInstr *code;
+    size_t count;
+    unsigned depth;
+    unsigned rows, cols;
+    int *out;
+    atomic_size_t remaining;
+    atomic_int failed;              // 1 + index of an element out of int range
+    atomic_int done;
+} ExprPass;
+
+static void expr_load_tile(const ExprInstr *in, unsigned i0, unsigned j0, unsigned h, unsigned w,
+                           int64_t *dst) {
+    // Keep the unused part of an edge tile at zero, so it cannot overflow
+    if (h < EXPR_TILE || w < EXPR_TILE) memset(dst, 0, EXPR_TILE * EXPR_TILE * sizeof(int64_t));
+    if (!in->transposed) {
+        for (unsigned r = 0; r < h; r++) {
+            size_t at = (size_t)(i0 + r) * in->ld + j0;
+            int64_t *d = dst + r * EXPR_TILE;
+            if (in->wide) memcpy(d, (const int64_t *)in->data + at, w * sizeof(int64_t));
+            else for (unsigned c = 0; c < w; c++) d[c] = ((const int *)in->data)[at + c];
+        }
+    } else {
+        // Element (i, j) is source (j, i): walk the source rows instead
+        for (unsigned c = 0; c < w; c++) {
+            size_t at = (size_t)(j0 + c) * in->ld + i0;
+            if (in->wide)
+                for (unsigned r = 0; r < h; r++) dst[r * EXPR_TILE + c] = ((const int64_t *)in->data)[at + r];
+            else
+                for (unsigned r = 0; r < h; r++) dst[r * EXPR_TILE + c] = ((const int *)in->data)[at + r];
+        }
+    }
+}
+
+// One band of EXPR_TILE rows of the output
+static void expr_pass_task(PoolTask *task) {
+    ExprPass *pass = task->ctx;
+    unsigned i0 = task->a * EXPR_TILE;
+    unsigned h = pass->rows - i0 < EXPR_TILE ? pass->rows - i0 : EXPR_TILE;
+    int64_t *stack = malloc((size_t)pass->depth * EXPR_TILE * EXPR_TILE * sizeof(int64_t));
+    if (!stack) {
+        atomic_store(&pass->failed, -1);
+    } else {
+        const size_t tile = EXPR_TILE * EXPR_TILE;
+        for (unsigned j0 = 0; j0 < pass->cols && atomic_load(&pass->failed) == 0; j0 += EXPR_TILE) {
+            unsigned w = pass->cols - j0 < EXPR_TILE ? pass->cols - j0 : EXPR_TILE;
+            int64_t *top = stack - tile;
+            for (size_t k = 0; k < pass->count; k++) {
+                const ExprInstr *in = &pass->code[k];
+                switch (in->op) {
+                case EXPR_LOAD:
+                    top += tile;
+                    expr_load_tile(in, i0, j0, h, w, top);
+                    break;
+                case EXPR_OP_ADD:
+                    for (size_t x = 0; x < tile; x++) top[x - tile] += top[x];
+                    top -= tile;
+                    break;
+                case EXPR_OP_SUB:
+                    for (size_t x = 0; x < tile; x++) top[x - tile] -= top[x];
+                    top -= tile;
+                    break;
+                case EXPR_OP_NEG:
+                    for (size_t x = 0; x < tile; x++) top[x] = -top[x];
+                    break;
+                case EXPR_OP_SCALE:
+                    for (size_t x = 0; x < tile; x++) top[x] *= in->factor;
+                    break;
+                }
+            }
+            for (unsigned r = 0; r < h; r++) {
+                int *dst = pass->out + (size_t)(i0 + r) * pass->cols + j0;
+                const int64_t *src = top + r * EXPR_TILE;
+                for (unsigned c = 0; c < w; c++) {
+                    if (src[c] < INT_MIN || src[c] > INT_MAX) {
+                        atomic_store(&pass->failed, 1 + (int)((i0 + r) * pass->cols + j0 + c));
+                        break;
+                    }
+                    dst[c] = (int)src[c];
+                }
+            }
+        }
+        free(stack);
+    }
+    if (atomic_fetch_sub(&pass->remaining, 1) == 1)
+        pool_signal_done(&pass->done);
+}
+
+// Run code over a rows x cols output of int, the bands in parallel
+static int expr_run_pass(Expr *e, const ExprInstr *code, size_t count, unsigned depth,
+                         unsigned rows, unsigned cols, int *out) {
+    MatrixTraceScope scope = matrix_trace_begin("expr.pass");
+    ExprPass pass = { code, count, depth, rows, cols, out };
+    unsigned bands = (rows + EXPR_TILE - 1) / EXPR_TILE;
+    atomic_init(&pass.remaining, bands);
+    atomic_init(&pass.failed, 0);
+    atomic_init(&pass.done, 0);
+    for (unsigned b = 0; b < bands; b++) {
+        PoolTask task = { expr_pass_task, &pass, 0, b, 0, 0 };
+        pool_push(&task);
+    }
+    if (bands) pool_wait(&pass.done);
+
+    e->stats->passes++;
+    size_t traffic = (size_t)rows * cols * sizeof(int);
+    for (size_t k = 0; k < count; k++)
+        if (code[k].op == EXPR_LOAD)
+            traffic += (size_t)rows * cols * (code[k].wide ? 8 : 4);
+    e->stats->traffic_bytes += traffic;
+    matrix_trace_end(scope, traffic, 0.0);
+
+    int failed = atomic_load(&pass.failed);
+    if (failed < 0) {
+        snprintf(matrix_io_error, sizeof(matrix_io_error), "out of memory");
+        return -1;
+    }
+    if (failed > 0) {
+        snprintf(matrix_io_error, sizeof(matrix_io_error),
+                 "element (%u, %u) of an intermediate %ux%u result is out of int range",
+                 (failed - 1) / cols + 1, (failed - 1) % cols + 1, rows, cols);
+        return -1;
+    }
+    return 0;
+}
+
+static int expr_eval_node(Expr *e, ExprNode *n);
+static int expr_scalar(Expr *e, ExprNode *n);
+
+// Append n's elementwise subtree to code in postfix order, loads for the
+// materialized nodes; returns the stack depth it needs, 0 on error
+static unsigned expr_compile(Expr *e, ExprNode *n, int transposed, ExprInstr *code, size_t *count) {
+    if (n->materialize) {
+        if (expr_eval_node(e, n) != 0) return 0;
+        code[(*count)++] = (ExprInstr){ EXPR_LOAD, n, n->data, n->wide, transposed, n->cols, 0 };
+        return 1;
+    }
+    unsigned a, b;
+    switch (n->op) {
+    case EXPR_TRANSPOSE:
+        return expr_compile(e, n->lhs, !transposed, code, count);
+    case EXPR_NEG:
+        if (!(a = expr_compile(e, n->lhs, transposed, code, count))) return 0;
+        code[(*count)++] = (ExprInstr){ .op = EXPR_OP_NEG };
+        return a;
+    case EXPR_SCALE:
+        if (expr_scalar(e, n->lhs) != 0) return 0;
+        if (n->lhs->number != floor(n->lhs->number) || fabs(n->lhs->number) > INT_MAX) {
+            snprintf(matrix_io_error, sizeof(matrix_io_error),
+                     "a matrix can only be scaled by an int, not %g", n->lhs->number);
+            return 0;
+        }
+        if (!(a = expr_compile(e, n->rhs, transposed, code, count))) return 0;
+        code[(*count)++] = (ExprInstr){ .op = EXPR_OP_SCALE, .factor = (int64_t)n->lhs->number };
+        return a;
+    default:    // EXPR_ADD, EXPR_SUB
+        if (!(a = expr_compile(e, n->lhs, transposed, code, count))) return 0;
+        if (!(b = expr_compile(e, n->rhs, transposed, code, count))) return 0;
+        code[(*count)++] = (ExprInstr){ .op = n->op == EXPR_ADD ? EXPR_OP_ADD : EXPR_OP_SUB };
+        return a > b + 1 ? a : b + 1;
+    }
+}
+
+// Evaluate n's elementwise subtree in one pass into an int buffer
+static int expr_eval_fused(Expr *e, ExprNode *n, int **out, ExprBuffer **buffer) {
+    // At most one load per DAG edge and one operation per node
+    ExprInstr *code = malloc((3 * e->count + 1) * sizeof(ExprInstr));
+    if (!code) {
+        snprintf(matrix_io_error, sizeof(matrix_io_error), "out of memory");
+        return -1;
+    }
+    size_t count = 0;
+    unsigned depth = 0;
+    if (n->op == EXPR_MATRIX || n->op == EXPR_MATMUL) {
+        // Only a copy or narrowing of an existing matrix
+        if (expr_eval_node(e, n) == 0) {
+            code[count++] = (ExprInstr){ EXPR_LOAD, n, n->data, n->wide, 0, n->cols, 0 };
+            depth = 1;
+        }
+    } else {
+        int was = n->materialize;
+        n->materialize = 0;
+        depth = expr_compile(e, n, 0, code, &count);
+        n->materialize = was;
+    }
+    if (depth == 0) {
+        free(code);
+        return -1;
+    }
+
+    // Write over an int source this pass is the last reader of, if it is
+    // read untransposed only, as then each tile is loaded before it is stored
+    size_t bytes = (size_t)n->rows * n->cols * sizeof(int);
+    *buffer = NULL;
+    for (size_t k = 0; e->fuse && !*buffer && k < count; k++) {
+        ExprNode *s = code[k].source;
+        if (code[k].op != EXPR_LOAD || !s->buffer || s->wide || s->buffer->bytes < bytes) continue;
+        unsigned reads = 0, untransposed = 1;
+        for (size_t m = 0; m < count; m++) {
+            if (code[m].op != EXPR_LOAD || code[m].source != s) continue;
+            reads++;
+            untransposed &= !code[m].transposed;
+        }
+        if (reads == s->uses && untransposed) {
+            *buffer = s->buffer;
+            s->buffer = NULL;
+        }
+    }
+    *out = *buffer ? (*buffer)->data : expr_alloc(e, bytes, buffer);
+    int status = *out ? expr_run_pass(e, code, count, depth, n->rows, n->cols, *out) : -1;
+
+    for (size_t k = 0; k < count; k++)
+        if (code[k].op == EXPR_LOAD) expr_release(e, code[k].source);
+    free(code);
+    return status;
+}
+
+// Int elements of a materialized node, narrowing a GEMM result into a new
+// buffer (*temp, to be recycled by the caller) if need be
+static const int *expr_int_data(Expr *e, ExprNode *n, ExprBuffer **temp) {
+    *temp = NULL;
+    if (!n->wide) return n->data;
+    ExprInstr load = { EXPR_LOAD, n, n->data, 1, 0, n->cols, 0 };
+    int *out = expr_alloc(e, (size_t)n->rows * n->cols * sizeof(int), temp);
+    if (!out) return NULL;
+    if (expr_run_pass(e, &load, 1, 1, n->rows, n->cols, out) != 0) {
+        expr_recycle(e, *temp);
+        *temp = NULL;
+        return NULL;
+    }
+    return out;
+}
+
+static int expr_eval_matmul(Expr *e, ExprNode *n) {
+    if (expr_eval_node(e, n->lhs) != 0 || expr_eval_node(e, n->rhs) != 0) return -1;
+    ExprBuffer *ta, *tb = NULL;
+    const int *a = expr_int_data(e, n->lhs, &ta);
+    const int *b = a ? expr_int_data(e, n->rhs, &tb) : NULL;
+    unsigned K = n->lhs->cols;
+    int status = -1;
+    if (a && b) {
+        double max_a = 0.0, max_b = 0.0;
+        for (size_t i = 0; i < (size_t)n->rows * K; i++) max_a = fmax(max_a, fabs((double)a[i]));
+        for (size_t i = 0; i < (size_t)K * n->cols; i++) max_b = fmax(max_b, fabs((double)b[i]));
+        ExprBuffer *buffer;
+        int64_t *c;
+        if ((double)K * max_a * max_b >= 0x1p63) {
+            snprintf(matrix_io_error, sizeof(matrix_io_error), "elements too large to multiply exactly");
+        } else if ((c = expr_alloc(e, (size_t)n->rows * n->cols * sizeof(int64_t), &buffer))) {
+            if (gemm_i32(n->rows, n->cols, K, a, K, b, n->cols, c, n->cols) == 0) {
+                n->data = c;
+                n->wide = 1;
+                n->buffer = buffer;
+                e->stats->passes++;
+                e->stats->traffic_bytes += ((size_t)n->rows * K + (size_t)K * n->cols) * sizeof(int) +
+                                           (size_t)n->rows * n->cols * sizeof(int64_t);
+                status = 0;
+            } else {
+                expr_recycle(e, buffer);
+                snprintf(matrix_io_error, sizeof(matrix_io_error), "out of memory");
+            }
+        }
+    }
+    if (ta) expr_recycle(e, ta);
+    if (tb) expr_recycle(e, tb);
+    expr_release(e, n->lhs);
+    expr_release(e, n->rhs);
+    return status;
+}
+
+// Materialize a matrix node that is read as a whole
+static int expr_eval_node(Expr *e, ExprNode *n) {
+    if (n->done) return 0;
+    int status = 0;
+    if (n->op == EXPR_MATRIX) {
+        // Passes index elements directly, so a sparse operand goes dense
+        if (matrix_densify(n->matrix) != 0) {
+            snprintf(matrix_io_error, sizeof(matrix_io_error), "out of memory");
+            status = -1;
+        }
+        n->data = n->matrix->data;
+    } else if (n->op == EXPR_MATMUL) {
+        status = expr_eval_matmul(e, n);
+    } else {
+        int *out;
+        status = expr_eval_fused(e, n, &out, &n->buffer);
+        n->data = out;
+    }
+    n->done = status == 0;
+    return status;
+}
+
+static int expr_scalar(Expr *e, ExprNode *n) {
+    if (n->done) return 0;
+    int status = 0;
+    switch (n->op) {
+    case EXPR_NUMBER:
+        break;
+    case EXPR_ADD:
+    case EXPR_SUB:
+    case EXPR_SCALE:
+        status = expr_scalar(e, n->lhs) != 0 || expr_scalar(e, n->rhs) != 0 ? -1 : 0;
+        if (status == 0)
+            n->number = n->op == EXPR_ADD ? n->lhs->number + n->rhs->number :
+                        n->op == EXPR_SUB ? n->lhs->number - n->rhs->number :
+                                            n->lhs->number * n->rhs->number;
+        break;
+    case EXPR_NEG:
+        status = expr_scalar(e, n->lhs);
+        n->number = -n->lhs->number;
+        break;
+    case EXPR_DET: {
+        ExprNode *m = n->lhs;
+        if (m->op == EXPR_MATRIX) {
+            // A saved matrix shares its factorization with later solves
+            Factorization *f = matrix_factor(m->matrix);
+            if (!f) {
+                status = -1;
+                break;
+            }
+            n->number = f->det;
+            factorization_unref(f);
+            expr_release(e, m);
+            break;
+        }
+        if ((status = expr_eval_node(e, m)) != 0) break;
+        size_t count = (size_t)m->rows * m->cols;
+        ExprBuffer *buffer;
+        double *a = expr_alloc(e, count * sizeof(double), &buffer);
+        if (a) {
+            for (size_t i = 0; i < count; i++)
+                a[i] = m->wide ? (double)((const int64_t *)m->data)[i] : ((const int *)m->data)[i];
+            n->number = determinant_of_doubles(a, m->rows);
+            expr_recycle(e, buffer);
+            e->stats->passes++;
+            e->stats->traffic_bytes += count * (m->wide ? 8 : 4);
+        } else {
+            status = -1;
+        }
+        expr_release(e, m);
+        break;
+    }
+    }
+    n->done = status == 0;
+    return status;
+}
+
+// Evaluate the statement. With fuse set, elementwise chains run as single
+// passes and buffers are reused; without it every operation is its own pass
+// into a fresh buffer, freed after its last read, which is what evaluating
+// one step at a time costs. A matrix result is a new unnamed matrix in
+// result->matrix, a scalar one is result->scalar with result->matrix NULL.
+// stats (optional) receives what evaluation cost. Returns 0, or -1 with the
+// reason in matrix_last_error().
+int expr_eval(Expr *expr, int fuse, ExprResult *result, ExprStats *stats) {
+    MatrixTraceScope op = op_begin("expr");
+    ExprStats local;
+    memset(&local, 0, sizeof(local));
+    for (size_t i = 0; i < expr->count; i++) {
+        ExprNode *n = expr->nodes[i];
+        n->refs = n->uses = 0;
+        n->materialize = n->planned = n->done = n->wide = 0;
+        n->data = NULL;
+        n->buffer = NULL;
+    }
+    expr->fuse = fuse;
+    expr->pool = NULL;
+    expr->stats = &local;
+    expr->live_bytes = 0;
+    result->matrix = NULL;
+    result->scalar = 0.0;
+
+    ExprNode *root = expr->root;
+    expr_count_refs(root);
+    if (!root->is_scalar) root->materialize = 1;
+    expr_plan(expr, root);
+
+    int status;
+    if (root->is_scalar) {
+        status = expr_scalar(expr, root);
+        result->scalar = root->number;
+    } else if (root->op == EXPR_MATRIX) {
+        status = (result->matrix = copy_matrix(root->matrix)) ? 0 : -1;
+        if (status) snprintf(matrix_io_error, sizeof(matrix_io_error), "out of memory");
+    } else {
+        // The result's buffer, trimmed if it came from the pool, becomes
+        // the Matrix's storage. A GEMM at the root is read once, to narrow it.
+        int *out;
+        ExprBuffer *buffer;
+        root->uses++;
+        status = expr_eval_fused(expr, root, &out, &buffer);
+        if (status == 0) {
+            size_t bytes = (size_t)root->rows * root->cols * sizeof(int);
+            int *trimmed = buffer->bytes > bytes ? workspace_realloc(out, bytes) : out;
+            expr->live_bytes -= buffer->bytes;
+            free(buffer);
+            out = trimmed ? trimmed : out;
+            result->matrix = matrix_wrap(root->rows, root->cols, MATRIX_INT32, out, NULL);
+            if (!result->matrix) {
+                snprintf(matrix_io_error, sizeof(matrix_io_error), "out of memory");
+                status = -1;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < expr->count; i++)
+        if (expr->nodes[i]->buffer) expr_recycle(expr, expr->nodes[i]->buffer);
+    while (expr->pool) {
+        ExprBuffer *next = expr->pool->next;
+        workspace_free(expr->pool->data);
+        free(expr->pool);
+        expr->pool = next;
+    }
+    if (stats) *stats = local;
+    op_end(op, local.traffic_bytes, 0.0);
+    return status;
+}
+
@@ -0,0 +1,265 @@
+// Matrix engine: dense, sparse and typed matrices, factorizations, exact
+// determinants, GEMM, expressions, the saved-matrix registry and file I/O.
+// Everything here is GTK-free; mat and matrix-bench link it as libmatrix.
+#ifndef MATRIX_H
+#define MATRIX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdatomic.h>
+
+// A private file mapping shared by every Matrix that points into it
+typedef struct MatrixMapping {
+    void *base;
+    size_t size;
+    atomic_int refs;
+} MatrixMapping;
+
+// Element types, each with its C type and text format. Kernels that touch
+// elements are generated once per type from this list, so a call branches
+// on the type once instead of once per element.
+// Integer types also carry their range: -limit <= value < limit.
+#define MATRIX_TYPES(X)                                 \
+    X(INT32, int32, int32_t, "%" PRId32, 0x1p31)        \
+    X(INT64, int64, int64_t, "%" PRId64, 0x1p63)        \
+    X(FLOAT32, float32, float, "%.9g", INFINITY)        \
+    X(FLOAT64, float64, double, "%.17g", INFINITY)
+
+#define MATRIX_TYPE_ENUM(ID, name, ctype, format, limit) MATRIX_##ID,
+typedef enum { MATRIX_TYPES(MATRIX_TYPE_ENUM) MATRIX_TYPE_COUNT } MatrixType;
+
+// Element storage, shared by every copy of a matrix until one of them writes.
+// Unless data is mapped or was wrapped, header and elements are one
+// workspace block, with data WORKSPACE_ALIGN bytes past the header.
+typedef struct MatrixBuffer {
+    atomic_int refs;
+    void *data;
+    MatrixMapping *mapping; // Set when data points into a mapped store file
+} MatrixBuffer;
+
+// Compressed sparse row elements: row i holds the nonzeros cols/values
+// [row_ptr[i], row_ptr[i + 1]) by increasing column. Shared by every copy of
+// a matrix until one of them writes, like a MatrixBuffer.
+typedef struct MatrixCsr {
+    atomic_int refs;
+    uint64_t *row_ptr;      // M + 1 offsets
+    unsigned *cols;
+    int *values;
+    size_t cap;             // room in cols and values
+    MatrixMapping *mapping; // Set when the arrays point into a mapped store file
+} MatrixCsr;
+
+typedef struct Matrix {
+    unsigned M;
+    unsigned N;
+    MatrixType type;        // Sparse matrices are always MATRIX_INT32
+    void *data;             // Elements of buffer; write through matrix_data_mut(). NULL if sparse.
+    char *name;             // Never NULL, empty if unnamed
+    MatrixBuffer *buffer;   // NULL if sparse
+    MatrixCsr *csr;         // Set instead of buffer for a sparse matrix
+    uint64_t version;       // Changes with every write; equal versions mean equal elements
+} Matrix;
+
+// Matrix storage - global storage for saved matrices, in the order they were
+// added, with a hash index on the name
+extern Matrix **saved_matrices;
+extern int num_saved_matrices;
+
+// Progress of a long computation, shared with the thread that started it:
+// done counts up to total, and setting cancel makes the computation give up
+// at its next checkpoint
+typedef struct {
+    atomic_uint done;
+    atomic_uint total;
+    atomic_int cancel;
+} MatrixProgress;
+
+// Function prototypes
+Matrix *create_matrix(unsigned M, unsigned N);
+Matrix *create_matrix_typed(unsigned M, unsigned N, MatrixType type);
+Matrix *create_sparse_matrix(unsigned M, unsigned N);
+void free_matrix(Matrix *matrix);
+const char *matrix_type_name(MatrixType type);
+int matrix_type_from_name(const char *name, MatrixType *type);
+int set_element(Matrix *matrix, unsigned i, unsigned j, double value);
+double matrix_get(const Matrix *matrix, unsigned i, unsigned j);
+int matrix_format_element(const Matrix *matrix, unsigned i, unsigned j, char *out, size_t size);
+int matrix_parse_element(MatrixType type, const char *text, double *value);
+// An element of any type: integer types use i, so int64 values never pass
+// through a double, floating point types f
+typedef union {
+    int64_t i;
+    double f;
+} MatrixValue;
+int matrix_parse_value(MatrixType type, const char *text, MatrixValue *value);
+MatrixValue matrix_get_value(const Matrix *matrix, unsigned i, unsigned j);
+int matrix_set_value(Matrix *matrix, unsigned i, unsigned j, MatrixValue value);
+Matrix *matrix_convert(const Matrix *matrix, MatrixType type);
+size_t matrix_nonzeros(const Matrix *matrix);
+int matrix_densify(Matrix *matrix);
+int matrix_sparsify(Matrix *matrix);
+void matrix_choose_storage(Matrix *matrix);
+double determinant(Matrix *matrix);
+typedef struct Factorization Factorization;
+typedef struct {
+    uint64_t hits, misses, evictions;
+    unsigned entries;
+    size_t bytes, limit;
+} FactorCacheStats;
+Factorization *matrix_lu(const Matrix *matrix, MatrixProgress *progress);
+Factorization *matrix_sparse_lu(const Matrix *matrix, MatrixProgress *progress);
+double factorization_determinant(const Factorization *f);
+void factorization_unref(Factorization *f);
+double matrix_determinant(const Matrix *matrix);
+double *matrix_solve(const Matrix *a, const Matrix *b);
+double *matrix_inverse(const Matrix *matrix);
+int matrix_rank(const Matrix *matrix);
+double *matrix_rref(const Matrix *matrix, unsigned *rank);
+void factor_cache_get_stats(FactorCacheStats *stats);
+void factor_cache_set_limit(size_t bytes);
+void factor_cache_clear(void);
+typedef struct LuCache LuCache;
+LuCache *lu_cache_new(void);
+void lu_cache_free(LuCache *cache);
+int lu_cache_is_current(const LuCache *cache, const Matrix *matrix);
+int lu_cache_refresh(LuCache *cache, const Matrix *matrix, MatrixProgress *progress);
+double lu_cache_determinant(LuCache *cache, const Matrix *matrix);
+int lu_cache_update(LuCache *cache, const Matrix *matrix, uint64_t old_version,
+                    const double *u, const double *v);
+int lu_cache_update_rank(LuCache *cache, const Matrix *matrix, uint64_t old_version, unsigned k,
+                         const double *u, const double *v);
+int lu_factor(double *a, unsigned n, unsigned *piv, int *sign);
+int lu_factor_progress(double *a, unsigned n, unsigned *piv, int *sign, MatrixProgress *progress);
+// A batch of n x n matrices in struct-of-arrays layout: element (i, j) of
+// matrix k is elements[(i * n + j) * stride + k]
+typedef struct {
+    unsigned n;
+    size_t count, stride;
+    const double *elements;
+    MatrixMapping *mapping; // Set when elements point into a mapped .matbatch file
+} MatrixBatch;
+int matrix_det_batch(unsigned n, size_t count, const double *elements, size_t stride, double *out);
+int matrix_batch_save(const char *path, unsigned n, size_t count, const double *elements, size_t stride);
+int matrix_batch_open(const char *path, MatrixBatch *batch);
+void matrix_batch_close(MatrixBatch *batch);
+// Out-of-core float64 matrix in a .mattile file of square tiles
+typedef struct {
+    int fd;
+    unsigned rows, cols;
+    unsigned tile;          // tile side in elements
+    char *path;
+} MatrixTiled;
+
+// Determinant as sign * exp(log_abs), which does not overflow
+typedef struct {
+    int sign;               // -1 or 1, 0 if singular
+    double log_abs;         // -INFINITY if singular
+} MatrixLogDet;
+
+int matrix_tiled_create(const char *path, unsigned rows, unsigned cols, unsigned tile,
+                        MatrixTiled *tiled);
+int matrix_tiled_open(const char *path, MatrixTiled *tiled);
+int matrix_tiled_close(MatrixTiled *tiled);
+int matrix_tiled_write_rows(MatrixTiled *tiled, unsigned row0, unsigned count, const double *rows);
+int matrix_tiled_read_rows(const MatrixTiled *tiled, unsigned row0, unsigned count, double *rows);
+int matrix_tiled_det(const MatrixTiled *a, size_t memory, MatrixProgress *progress, MatrixLogDet *out);
+char *determinant_exact(const Matrix *matrix, unsigned *primes_used);
+char *determinant_exact_progress(const Matrix *matrix, unsigned *primes_used,
+                                 MatrixProgress *progress);
+int gemm_f64(unsigned M, unsigned N, unsigned K, const double *a, size_t lda,
+             const double *b, size_t ldb, double *c, size_t ldc);
+int gemm_i32(unsigned M, unsigned N, unsigned K, const int *a, size_t lda,
+             const int *b, size_t ldb, int64_t *c, size_t ldc);
+Matrix *matrix_multiply(const Matrix *a, const Matrix *b);
+// Heatmap rendering, with a min/max pyramid of the matrix for zoomed-out views
+typedef struct MatrixPyramid MatrixPyramid;
+typedef struct {
+    double row, col;        // element coordinates of the top-left pixel corner
+    double scale;           // elements per pixel, below 1 when zoomed in
+    unsigned width, height; // in pixels
+} MatrixView;
+MatrixPyramid *matrix_pyramid_build(const Matrix *matrix, MatrixProgress *progress);
+void matrix_pyramid_free(MatrixPyramid *pyramid);
+int matrix_heatmap_render(const Matrix *matrix, const MatrixPyramid *pyramid, const MatrixView *view,
+                          uint32_t *pixels, size_t stride, double range[2]);
+
+// What evaluating an expression cost
+typedef struct {
+    size_t peak_bytes;      // most memory held in intermediate buffers at once
+    size_t traffic_bytes;   // bytes read and written by passes over whole matrices
+    unsigned passes;        // elementwise passes, GEMMs and factorizations
+} ExprStats;
+
+typedef struct {
+    Matrix *matrix;         // NULL for a scalar result
+    double scalar;
+} ExprResult;
+
+typedef struct Expr Expr;
+Expr *expr_parse(const char *text);
+const char *expr_target(const Expr *expr);
+int expr_eval(Expr *expr, int fuse, ExprResult *result, ExprStats *stats);
+void expr_free(Expr *expr);
+void matrix_set_num_threads(unsigned n);
+unsigned matrix_get_num_threads(void);
+typedef struct {
+    uint64_t allocations, frees;    // workspace blocks
+    uint64_t scratch_grows;         // scratch requests that had to allocate
+    uint64_t huge;                  // blocks advised onto huge pages
+    size_t live_bytes, peak_bytes;
+} MatrixAllocStats;
+void matrix_alloc_stats(MatrixAllocStats *stats);
+
+// Timing scopes around the hot paths. Nothing is recorded until
+// matrix_trace_start() or MAT_TRACE=FILE at startup; until then a scope
+// costs one relaxed load.
+typedef struct {
+    const char *name;       // static string
+    uint64_t start_ns;      // 0 if not recording
+} MatrixTraceScope;
+
+// The last top-level operation (determinant, load, multiply, ...), timed
+// whether or not tracing is on
+typedef struct {
+    const char *name;       // NULL before the first operation
+    double seconds;
+    double flops;           // floating point operations, 0 if not counted
+    uint64_t bytes;         // elements or file bytes moved
+} MatrixOpTiming;
+
+MatrixTraceScope matrix_trace_begin(const char *name);
+void matrix_trace_end(MatrixTraceScope scope, uint64_t bytes, double flops);
+int matrix_trace_start(const char *path);
+int matrix_trace_stop(void);
+void matrix_last_op(MatrixOpTiming *out);
+void *matrix_data_mut(Matrix *matrix);
+int matrix_set_name(Matrix *matrix, const char *name);
+Matrix *copy_matrix(Matrix *source);
+int save_matrix(Matrix *matrix, const char *name);
+Matrix *load_matrix(const char *name);
+int delete_matrix(const char *name);
+void save_matrices_to_file(const char *filename);
+int load_matrices_from_file(const char *filename);
+const char *matrix_last_error(void);
+
+// Write-ahead journal of the registry, replayed on open
+typedef struct {
+    uint64_t bytes;         // size of the journal file
+    uint64_t live_bytes;    // what a compaction would leave of it
+    int compacting;
+} MatrixJournalStats;
+
+int matrix_journal_open(const char *path);
+void matrix_journal_close(void);
+int matrix_journal_compact(void);
+int matrix_journal_stats(MatrixJournalStats *out);
+
+// Streaming file I/O that leaves the registry alone, for worker threads.
+// each takes ownership of a matrix and returns nonzero to stop the read.
+typedef int (*MatrixReadFn)(Matrix *matrix, void *data);
+int matrix_file_read(const char *filename, MatrixReadFn each, void *data, MatrixProgress *progress);
+int matrix_file_write(const char *filename, Matrix *const *matrices, int count, MatrixProgress *progress);
+
+#endif